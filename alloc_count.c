@@ -0,0 +1,112 @@
+#define _GNU_SOURCE
+#include <sys/mman.h> // For mmap
+#include <unistd.h>   // For getpid
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h> // For pthread_atfork
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "alloc_count.h"
+
+/*
+ * alloc_count.so: counts the heap allocations of nqp_shell for nqp_bench -a.
+ *
+ * Preloaded into the shell (LD_PRELOAD), it replaces malloc and friends with
+ * glibc's own functions plus one atomic add to the counter in the file named
+ * by NQP_ALLOC_COUNTER, which nqp_bench reads around every command. Only the
+ * process whose pid nqp_bench put in the file counts: forked children stop at
+ * the fork, and the programs they exec load this again but have another pid.
+ * Allocations made between alloc_count_enter_command and
+ * alloc_count_leave_command on the same thread are also counted apart.
+ */
+
+// glibc's allocator, under the names it keeps for replacements like this one
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *pointer);
+
+static Alloc_Counter *counter = NULL;
+static bool counting = false;
+static atomic_bool paused = false;
+// commands the thread is inside of. initial-exec: the preloaded library's TLS
+// is static, reaching it never calls back into malloc
+static _Thread_local __attribute__((tls_model("initial-exec"))) int
+    command_depth = 0;
+
+static void count_allocation(void) {
+  if (counting && !atomic_load_explicit(&paused, memory_order_relaxed)) {
+    atomic_fetch_add_explicit(&counter->allocations, 1, memory_order_relaxed);
+    if (command_depth > 0) {
+      atomic_fetch_add_explicit(&counter->command_allocations, 1,
+                                memory_order_relaxed);
+    }
+  }
+}
+
+static void stop_counting(void) { counting = false; }
+
+__attribute__((constructor)) static void alloc_count_init(void) {
+  const char *path = getenv(ALLOC_COUNTER_VARIABLE);
+  if (NULL == path)
+    return;
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  void *shared = mmap(NULL, sizeof(Alloc_Counter), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == shared)
+    return;
+
+  counter = shared;
+  counting = counter->pid == getpid();
+  pthread_atfork(NULL, NULL, stop_counting);
+}
+
+void alloc_count_pause(void) { atomic_store(&paused, true); }
+
+void alloc_count_resume(void) { atomic_store(&paused, false); }
+
+void alloc_count_enter_command(void) { command_depth++; }
+
+void alloc_count_leave_command(void) { command_depth--; }
+
+//-----------
+// ALLOCATOR
+//-----------
+void *malloc(size_t size) {
+  count_allocation();
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  count_allocation();
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+  count_allocation();
+  return __libc_realloc(pointer, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  count_allocation();
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **pointer, size_t alignment, size_t size) {
+  if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+  count_allocation();
+  void *memory = __libc_memalign(alignment, size);
+  if (NULL == memory)
+    return ENOMEM;
+  *pointer = memory;
+  return 0;
+}
+
+void free(void *pointer) { __libc_free(pointer); }
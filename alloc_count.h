@@ -0,0 +1,27 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// names the file nqp_bench and alloc_count.so share the counter through
+#define ALLOC_COUNTER_VARIABLE "NQP_ALLOC_COUNTER"
+
+// ALLOCATION COUNTER
+// the contents of that file, mapped by both
+typedef struct {
+  pid_t pid;                    // the only process that counts
+  _Atomic uint64_t allocations; // heap allocations it made so far
+  _Atomic uint64_t command_allocations; // of those, made by a builtin or the
+                                        // file system module while it ran
+} Alloc_Counter;
+
+// nqp_shell stops the counting while it reads a line, so only running the
+// command is counted. Only defined when alloc_count.so is preloaded
+void alloc_count_pause(void) __attribute__((weak));
+void alloc_count_resume(void) __attribute__((weak));
+
+// nqp_shell brackets executing a command with these, on whichever thread runs
+// it, so what the command allocates is told apart from parsing, plans and
+// dispatch. Only defined when alloc_count.so is preloaded
+void alloc_count_enter_command(void) __attribute__((weak));
+void alloc_count_leave_command(void) __attribute__((weak));
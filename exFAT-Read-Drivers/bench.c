@@ -0,0 +1,464 @@
+#define _GNU_SOURCE // For syscall
+#include "exfat_io.h"
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef USE_LIBC_INSTEAD
+#include <sys/syscall.h>
+#include <unistd.h>
+#define BENCH_BACKEND "libc"
+#else
+#define BENCH_BACKEND "exfat"
+// not part of the public interface, but it is what every getdents pays for
+char *unicode2ascii(uint16_t *unicode_string, uint8_t length);
+#endif
+
+// Every benchmark is run BENCH_REPEATS times and the median run is reported,
+// the random offsets come from a fixed seed so two runs do the same work.
+#define BENCH_REPEATS 5
+#define BENCH_SEED 0x3430u
+#define BENCH_READ_SIZE 65536
+#define BENCH_ASYNC_DEPTH 8 // reads kept in flight by the async benchmark
+#define BENCH_RANDOM_READ_SIZE 4096
+#define BENCH_RANDOM_READS 64
+#define BENCH_MAX_PATH 512
+#define BENCH_NAME_LENGTH 255
+
+// Fixture layout, mkimage's "bench" profile writes exactly this tree (and it
+// is what has to be extracted for the libc run).
+#define FIXTURE_DEPTH_1 "/bench/d1/leaf"
+#define FIXTURE_DEPTH_4 "/bench/d1/d2/d3/d4/leaf"
+#define FIXTURE_DEPTH_16                                                       \
+  "/bench/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10/d11/d12/d13/d14/d15/d16/leaf"
+#define FIXTURE_DIR_10 "/bench/dir10"
+#define FIXTURE_DIR_1K "/bench/dir1k"
+#define FIXTURE_DIR_100K "/bench/dir100k"
+#define FIXTURE_CONTIGUOUS "/bench/contiguous.bin"
+#define FIXTURE_FRAGMENTED "/bench/fragmented.bin"
+
+typedef struct {
+  const char *name;
+  uint64_t ops;    // operations done by one run
+  uint64_t bytes;  // bytes moved by one run, 0 if it doesn't move data
+  uint64_t median; // nanoseconds for the median run
+  uint64_t min;    // nanoseconds for the fastest run
+  bool failed;
+} bench_result;
+
+static const char *root = NULL; // image (exfat) or extracted tree (libc)
+static bool first_result = true;
+
+//----------
+// HELPERS
+//----------
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// xorshift32, plenty for picking offsets and reproducible everywhere
+static uint32_t next_random(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// the driver resolves paths inside the image, libc needs them under the
+// extracted tree
+static const char *fixture_path(const char *path, char *buffer) {
+#ifdef USE_LIBC_INSTEAD
+  snprintf(buffer, BENCH_MAX_PATH, "%s%s", root, path);
+  return buffer;
+#else
+  (void)buffer;
+  return path;
+#endif
+}
+
+#ifdef USE_LIBC_INSTEAD
+// exfat_io.h has no libc stand-in for getdents, so read raw linux_dirent64
+// records and hand them back the way the driver does (one heap name each).
+#define LINUX_DT_DIR 4
+#define GETDENTS_BUFFER 32768
+
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+static ssize_t bench_getdents(int fd, exfat_dirent *dirp, size_t count) {
+  static char buffer[GETDENTS_BUFFER];
+  static int buffer_fd = -1;
+  static long offset = 0, length = 0;
+  size_t filled = 0;
+
+  if (fd != buffer_fd) {
+    buffer_fd = fd;
+    offset = length = 0;
+  }
+
+  while (filled < count) {
+    if (offset >= length) {
+      length = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+      offset = 0;
+      if (length <= 0) {
+        buffer_fd = -1;
+        return length < 0 && filled == 0 ? -1 : (ssize_t)filled;
+      }
+    }
+
+    struct linux_dirent64 *d = (struct linux_dirent64 *)(buffer + offset);
+    offset += d->d_reclen;
+    if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+      continue; // exFAT directories don't have these
+    }
+
+    dirp[filled].inode_number = d->d_ino;
+    dirp[filled].name = strdup(d->d_name);
+    dirp[filled].name_len = strlen(d->d_name);
+    dirp[filled].type = d->d_type == LINUX_DT_DIR ? DT_DIR : DT_REG;
+    filled++;
+  }
+  return (ssize_t)filled;
+}
+#else
+#define bench_getdents(fd, dirp, count) exfat_getdents(fd, dirp, count)
+#endif
+
+//------------
+// BENCHMARKS
+//------------
+// Each benchmark does one run and returns the nanoseconds it took, or 0 if
+// the fixture is missing or the driver returned an error.
+
+static uint64_t run_mount(const void *arg, uint64_t *ops, uint64_t *bytes) {
+  (void)arg;
+  (void)bytes;
+  uint64_t start = now_ns();
+  for (int i = 0; i < 50; i++) {
+    if (exfat_mount(root, EXFAT_FS_EXFAT) != EXFAT_OK) {
+      return 0;
+    }
+    (void)exfat_unmount();
+  }
+  *ops = 50;
+  return now_ns() - start;
+}
+
+static uint64_t run_resolve(const void *arg, uint64_t *ops, uint64_t *bytes) {
+  char buffer[BENCH_MAX_PATH];
+  const char *path = fixture_path(arg, buffer);
+  (void)bytes;
+
+  uint64_t start = now_ns();
+  for (int i = 0; i < 1000; i++) {
+    int fd = exfat_open(path);
+    if (fd < 0) {
+      return 0;
+    }
+    exfat_close(fd);
+  }
+  *ops = 1000;
+  return now_ns() - start;
+}
+
+static uint64_t run_getdents(const void *arg, uint64_t *ops, uint64_t *bytes) {
+  char buffer[BENCH_MAX_PATH];
+  exfat_dirent entries[64];
+  ssize_t dirents_read;
+  (void)bytes;
+
+  uint64_t start = now_ns();
+  int fd = exfat_open(fixture_path(arg, buffer));
+  if (fd < 0) {
+    return 0;
+  }
+
+  *ops = 0;
+  while ((dirents_read = bench_getdents(fd, entries, 64)) > 0) {
+    for (ssize_t i = 0; i < dirents_read; i++) {
+      free(entries[i].name);
+    }
+    *ops += (uint64_t)dirents_read;
+  }
+  exfat_close(fd);
+  return dirents_read < 0 ? 0 : now_ns() - start;
+}
+
+static uint64_t run_sequential(const void *arg, uint64_t *ops,
+                               uint64_t *bytes) {
+  static char data[BENCH_READ_SIZE];
+  char buffer[BENCH_MAX_PATH];
+  ssize_t bytes_read;
+
+  uint64_t start = now_ns();
+  int fd = exfat_open(fixture_path(arg, buffer));
+  if (fd < 0) {
+    return 0;
+  }
+
+  *ops = *bytes = 0;
+  while ((bytes_read = exfat_read(fd, data, sizeof(data))) > 0) {
+    *bytes += (uint64_t)bytes_read;
+    (*ops)++;
+  }
+  exfat_close(fd);
+  return bytes_read < 0 ? 0 : now_ns() - start;
+}
+
+// BENCH_RANDOM_READS reads at random offsets of one open file with
+// exfat_pread, which neither uses nor moves the file position
+static uint64_t run_random(const void *arg, uint64_t *ops, uint64_t *bytes) {
+  static char data[BENCH_READ_SIZE];
+  char buffer[BENCH_MAX_PATH];
+  const char *path = fixture_path(arg, buffer);
+  uint32_t state = BENCH_SEED;
+  uint64_t size = 0;
+  ssize_t bytes_read;
+
+  // find the size once, outside of the timed part
+  int fd = exfat_open(path);
+  if (fd < 0) {
+    return 0;
+  }
+  while ((bytes_read = exfat_read(fd, data, sizeof(data))) > 0) {
+    size += (uint64_t)bytes_read;
+  }
+  exfat_close(fd);
+  if (size < BENCH_RANDOM_READ_SIZE) {
+    return 0;
+  }
+
+  uint64_t start = now_ns();
+  fd = exfat_open(path);
+  if (fd < 0) {
+    return 0;
+  }
+  for (int i = 0; i < BENCH_RANDOM_READS; i++) {
+    uint64_t offset = next_random(&state) % (size - BENCH_RANDOM_READ_SIZE);
+    bytes_read = exfat_pread(fd, data, BENCH_RANDOM_READ_SIZE, (off_t)offset);
+    if (bytes_read <= 0) {
+      exfat_close(fd);
+      return 0;
+    }
+  }
+  exfat_close(fd);
+  *ops = BENCH_RANDOM_READS;
+  *bytes = (uint64_t)BENCH_RANDOM_READS * BENCH_RANDOM_READ_SIZE;
+  return now_ns() - start;
+}
+
+// The whole file a byte at a time through a buffered stream
+static uint64_t run_getc(const void *arg, uint64_t *ops, uint64_t *bytes) {
+  char buffer[BENCH_MAX_PATH];
+  uint32_t checksum = 0;
+  int byte;
+
+  uint64_t start = now_ns();
+  exfat_FILE *stream = exfat_fopen(fixture_path(arg, buffer));
+  if (NULL == stream) {
+    return 0;
+  }
+
+  *ops = 0;
+  while ((byte = exfat_getc(stream)) != EOF) {
+    checksum += (uint32_t)byte; // so the loop can't be optimized away
+    (*ops)++;
+  }
+  exfat_fclose(stream);
+  *bytes = *ops;
+  return checksum == UINT32_MAX ? 0 : now_ns() - start;
+}
+
+// The whole file a line at a time through a buffered stream
+static uint64_t run_getline(const void *arg, uint64_t *ops, uint64_t *bytes) {
+  char buffer[BENCH_MAX_PATH];
+  char *line = NULL;
+  size_t capacity = 0;
+  ssize_t length;
+
+  uint64_t start = now_ns();
+  exfat_FILE *stream = exfat_fopen(fixture_path(arg, buffer));
+  if (NULL == stream) {
+    return 0;
+  }
+
+  *ops = *bytes = 0;
+  while ((length = exfat_getline(&line, &capacity, stream)) > 0) {
+    *bytes += (uint64_t)length;
+    (*ops)++;
+  }
+  exfat_fclose(stream);
+  free(line);
+  return now_ns() - start;
+}
+
+#ifndef USE_LIBC_INSTEAD
+// The same reads as run_sequential, with BENCH_ASYNC_DEPTH of them in flight
+static uint64_t run_sequential_async(const void *arg, uint64_t *ops,
+                                     uint64_t *bytes) {
+  static char data[BENCH_ASYNC_DEPTH][BENCH_READ_SIZE];
+  int requests[BENCH_ASYNC_DEPTH];
+  char buffer[BENCH_MAX_PATH];
+  uint64_t offset = 0;
+  ssize_t bytes_read = 0;
+
+  uint64_t start = now_ns();
+  int fd = exfat_open(fixture_path(arg, buffer));
+  if (fd < 0) {
+    return 0;
+  }
+
+  *ops = *bytes = 0;
+  for (int i = 0; i < BENCH_ASYNC_DEPTH; i++, offset += BENCH_READ_SIZE) {
+    requests[i] = exfat_read_async(fd, data[i], BENCH_READ_SIZE, (off_t)offset);
+  }
+  // complete the oldest read and queue the next one in its buffer
+  for (int oldest = 0;; oldest = (oldest + 1) % BENCH_ASYNC_DEPTH) {
+    bytes_read = exfat_read_complete(requests[oldest]);
+    requests[oldest] = -1;
+    if (bytes_read <= 0) {
+      break;
+    }
+    *bytes += (uint64_t)bytes_read;
+    (*ops)++;
+    requests[oldest] = exfat_read_async(fd, data[oldest], BENCH_READ_SIZE,
+                                        (off_t)offset);
+    offset += BENCH_READ_SIZE;
+  }
+  for (int i = 0; i < BENCH_ASYNC_DEPTH; i++) {
+    if (requests[i] >= 0) {
+      exfat_read_complete(requests[i]); // queued past the end of the file
+    }
+  }
+  exfat_close(fd);
+  return bytes_read < 0 ? 0 : now_ns() - start;
+}
+
+static uint64_t run_decode(const void *arg, uint64_t *ops, uint64_t *bytes) {
+  uint16_t name[BENCH_NAME_LENGTH];
+  uint8_t length = (uint8_t)(uintptr_t)arg;
+  (void)bytes;
+
+  for (int i = 0; i < length; i++) {
+    name[i] = (uint16_t)('a' + i % 26);
+  }
+
+  uint64_t start = now_ns();
+  for (int i = 0; i < 100000; i++) {
+    free(unicode2ascii(name, length));
+  }
+  *ops = 100000;
+  return now_ns() - start;
+}
+#endif
+
+//---------
+// RUNNER
+//---------
+typedef uint64_t (*bench_fn)(const void *arg, uint64_t *ops, uint64_t *bytes);
+
+static void report(const bench_result *result) {
+  printf("%s\n    {\"name\": \"%s\"", first_result ? "" : ",", result->name);
+  first_result = false;
+
+  if (result->failed) {
+    printf(", \"error\": \"fixture missing or operation failed\"}");
+    return;
+  }
+
+  printf(", \"ops\": %" PRIu64 ", \"median_ns\": %" PRIu64
+         ", \"min_ns\": %" PRIu64 ", \"ns_per_op\": %.1f",
+         result->ops, result->median, result->min,
+         result->ops ? (double)result->median / (double)result->ops : 0.0);
+  if (result->bytes > 0) {
+    printf(", \"bytes\": %" PRIu64 ", \"mb_per_s\": %.1f", result->bytes,
+           (double)result->bytes / ((double)result->median / 1e9) / 1e6);
+  }
+  printf("}");
+}
+
+static void bench(const char *name, bench_fn fn, const void *arg) {
+  uint64_t runs[BENCH_REPEATS];
+  bench_result result = {.name = name};
+
+  for (int i = 0; i < BENCH_REPEATS; i++) {
+    runs[i] = fn(arg, &result.ops, &result.bytes);
+    if (runs[i] == 0) {
+      result.failed = true;
+      break;
+    }
+  }
+
+  if (!result.failed) {
+    qsort(runs, BENCH_REPEATS, sizeof(uint64_t), compare_u64);
+    result.min = runs[0];
+    result.median = runs[BENCH_REPEATS / 2];
+  }
+  report(&result);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <image | extracted tree>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  root = argv[1];
+
+  printf("{\n  \"backend\": \"%s\",\n  \"source\": \"%s\",\n"
+         "  \"repeats\": %d,\n  \"seed\": %u,\n  \"results\": [",
+         BENCH_BACKEND, root, BENCH_REPEATS, BENCH_SEED);
+
+  bench("mount", run_mount, NULL);
+
+  if (exfat_mount(root, EXFAT_FS_EXFAT) != EXFAT_OK) {
+    fprintf(stderr, "%s could not be mounted\n", root);
+    printf("\n  ]\n}\n");
+    return EXIT_FAILURE;
+  }
+
+  bench("resolve_depth_1", run_resolve, FIXTURE_DEPTH_1);
+  bench("resolve_depth_4", run_resolve, FIXTURE_DEPTH_4);
+  bench("resolve_depth_16", run_resolve, FIXTURE_DEPTH_16);
+  bench("getdents_10", run_getdents, FIXTURE_DIR_10);
+  bench("getdents_1k", run_getdents, FIXTURE_DIR_1K);
+  bench("getdents_100k", run_getdents, FIXTURE_DIR_100K);
+  bench("sequential_read_contiguous", run_sequential, FIXTURE_CONTIGUOUS);
+  bench("sequential_read_fragmented", run_sequential, FIXTURE_FRAGMENTED);
+  bench("random_read_contiguous", run_random, FIXTURE_CONTIGUOUS);
+  bench("random_read_fragmented", run_random, FIXTURE_FRAGMENTED);
+  bench("getc_contiguous", run_getc, FIXTURE_CONTIGUOUS);
+  bench("getc_fragmented", run_getc, FIXTURE_FRAGMENTED);
+  bench("getline_contiguous", run_getline, FIXTURE_CONTIGUOUS);
+  bench("getline_fragmented", run_getline, FIXTURE_FRAGMENTED);
+#ifndef USE_LIBC_INSTEAD
+  bench("sequential_read_contiguous_async", run_sequential_async,
+        FIXTURE_CONTIGUOUS);
+  bench("sequential_read_fragmented_async", run_sequential_async,
+        FIXTURE_FRAGMENTED);
+  bench("name_decode_15", run_decode, (const void *)(uintptr_t)15);
+  bench("name_decode_255", run_decode, (const void *)(uintptr_t)255);
+#endif
+
+  (void)exfat_unmount();
+  printf("\n  ]\n}\n");
+  return EXIT_SUCCESS;
+}
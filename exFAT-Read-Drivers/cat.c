@@ -2,28 +2,30 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#define CAT_BUFFER_SIZE 65536
+
 int main(int argc, char **argv) {
-  int fd = 0;
-  ssize_t bytes_read = 0;
-  char buffer[256] = {0};
+  exfat_FILE *stream = NULL;
+  size_t bytes_read = 0;
+  static char buffer[CAT_BUFFER_SIZE];
   int exit_code = EXIT_SUCCESS;
   exfat_error err = exfat_mount(argv[1], EXFAT_FS_EXFAT);
 
   if (err == EXFAT_OK) {
     for (int i = 2; i < argc; i++) {
-      fd = exfat_open(argv[i]);
+      stream = exfat_fopen(argv[i]);
 
-      if (fd == EXFAT_FILE_NOT_FOUND) {
+      if (stream == NULL) {
         fprintf(stderr, "%s not found\n", argv[i]);
         exit_code = EXIT_FAILURE;
       } else {
-        while ((bytes_read = exfat_read(fd, buffer, 256)) > 0) {
-          for (ssize_t i = 0; i < bytes_read; i++) {
-            putchar(buffer[i]);
-          }
+        // the stream hands out whole buffers, written out in one go
+        while ((bytes_read = exfat_fread(buffer, 1, CAT_BUFFER_SIZE,
+                                         stream)) > 0) {
+          fwrite(buffer, 1, bytes_read, stdout);
         }
 
-        exfat_close(fd);
+        exfat_fclose(stream);
       }
     }
 
@@ -1,11 +1,203 @@
+#define _GNU_SOURCE // For copy_file_range
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h> // For IOV_MAX, NAME_MAX
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h> // For the mmap device
+#include <sys/stat.h> // For mkdir, futimens
+#include <time.h>     // For the simulated device's clock
+#include <unistd.h>
+
+// reads of several cluster runs are batched on an io_uring, made with raw
+// system calls so nothing beyond the kernel headers is needed. Build with
+// -DEXFAT_NO_IO_URING to read everything with pread
+#if defined(__linux__) && !defined(EXFAT_NO_IO_URING)
+#define EXFAT_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+// directory windows are classified with SSE2 everywhere on x86-64, and with
+// AVX2 where the CPU has it
+#if defined(__x86_64__) && !defined(EXFAT_NO_SIMD)
+#define EXFAT_SIMD_X86
+#include <immintrin.h>
+#endif
 
 #include "exfat_io.h"
 #include "exfat_types.h"
 
+#define DENTRY_SIZE 32           // every directory entry is 32 bytes
+#define NAME_CHARS_PER_ENTRY 15  // characters held by one file name entry
+#define MAX_NAME_LENGTH 255      // longest name an entry set can describe
+#define FAT_END_OF_CHAIN 0xFFFFFFF8
+#define FAT_BLOCK_ENTRIES 1024   // FAT entries cached per read of the FAT
+#define ATTR_DIRECTORY 0x10      // file_attributes bit for directories
+#define FIRST_DATA_CLUSTER 2     // cluster numbers start at 2 in the heap
+#define ROOT_INODE 1             // the root has no file entry to number it by
+#define MAX_SET_ENTRIES 256      // a file entry and its secondary entries
+#define ENTRY_CACHE_SLOTS 4096   // entry sets kept from name lookups
+#define ENTRY_CACHE_NAME_WORDS ((MAX_NAME_LENGTH + 1) / 2) // 2 chars a word
+#define ENTRY_CACHE_SET_WORDS ((sizeof(entry_set) + 3) / 4)
+#define CHAIN_CACHE_SLOTS 1024   // FAT chains kept by their first cluster
+#define CHAIN_CACHE_RUNS 32      // most runs of clusters a cached chain has
+#define NAME_INDEX_SLOTS 16      // directories kept with a sorted name index
+#define WALK_PIECE_CLUSTERS 8    // directory clusters scanned per walk task
+#define WALK_MAX_THREADS 64      // most threads exfat_walk starts
+#define EXPORT_BUFFER_SIZE (1024 * 1024) // bytes per read when exporting
+#define EXPORT_ALIGNMENT 4096    // export reads land in page aligned memory
+#define IO_RING_ENTRIES 64       // cluster runs the ring keeps in flight
+#define ASYNC_MAX_REQUESTS 64    // exfat_read_async reads not completed yet
+#define MAX_SEGMENT_LENGTH (1u << 30) // longest single read of a batch
+#define DIR_WINDOW_BYTES 65536   // directory clusters read per batch
+#define STREAM_BUFFER_BYTES 65536 // least an exfat_fopen stream buffers
+#define READAHEAD_BYTES (4 * 1024 * 1024) // kept coming for sequential fds
+#define DEVICE_VARIABLE "EXFAT_DEVICE" // picks the block device at mount
+#define SIM_DEFAULT_LATENCY_US 1000    // simulated per-request latency
+#define SIM_MAX_QUEUE_DEPTH 256
+
+// DIRECTORY WINDOW SCAN
+// the file entries of a buffered directory window, in directory order, as a
+// structure of arrays so a lookup only touches the fields it compares
+typedef struct DIR_SCAN {
+  bool scanned;          // false until the window is scanned, on first use
+  uint32_t count;        // file entries before the end marker
+  uint32_t end;          // window entry of the end marker, UINT32_MAX if none
+  uint32_t next;         // slot after the one last skipped to
+  uint32_t *entry;       // window entry of each file entry
+  uint16_t *attributes;  // its file_attributes
+  uint16_t *name_hash;   // from the stream extension entry that follows it,
+  uint8_t *name_length;  // 0 if that entry is not in the window
+} dir_scan;
+
+// OPEN FILE TABLE ENTRY
+typedef struct OPEN_FILE {
+  entry_set set;              // file and stream extension entries
+  bool is_directory;          // directory (getdents) or file (read)
+  uint32_t *cluster_chain;    // every cluster of the file, in order
+  uint32_t chain_length;      // number of clusters in cluster_chain
+  bool chain_loaded;          // false until cluster_chain has been built
+  atomic_int *chain_users;    // fds sharing cluster_chain, NULL if only one
+  uint64_t current_position;  // byte offset, or entry index for directories
+  exfat_advice advice;        // last exfat_fadvise for the whole file
+  uint64_t readahead_until;   // end of what sequential reads asked ahead for
+  uint8_t *cluster_buffer;    // last directory window read, NULL if unused
+  int64_t buffered_cluster;   // index in cluster_chain of cluster_buffer
+  uint32_t buffered_count;    // clusters in cluster_buffer
+  dir_scan scan;              // file entries of cluster_buffer
+} open_file;
+
+// ENTRY SET CACHE ENTRY
+// other processes write the slot while it is read, so like the chain cache
+// every field is atomic; the name and the set are copied a word at a time
+typedef struct CACHED_ENTRY_SET {
+  atomic_uint sequence;       // odd while the slot is written, see below
+  atomic_uint generation;     // mount the set was cached under
+  atomic_uint parent_cluster; // first cluster of the directory
+  atomic_uint name_length;    // characters in name
+  atomic_uint name[ENTRY_CACHE_NAME_WORDS]; // up-cased name the set was
+                                            // looked up by
+  atomic_uint set[ENTRY_CACHE_SET_WORDS];   // the entry_set
+} cached_entry_set;
+
+// CLUSTER CHAIN CACHE ENTRY
+// a chain followed through the FAT, kept as its runs of contiguous clusters.
+// Walk threads build chains at the same time, so every field is atomic
+typedef struct CACHED_CHAIN {
+  atomic_uint sequence;      // odd while the slot is written, see below
+  atomic_uint generation;    // mount the chain was cached under
+  atomic_uint first_cluster;
+  atomic_uint num_runs;
+  atomic_uint run_start[CHAIN_CACHE_RUNS];
+  atomic_uint run_length[CHAIN_CACHE_RUNS];
+} cached_chain;
+
+// NAME INDEX ENTRY
+typedef struct NAME_INDEX_ENTRY {
+  uint64_t location; // of the entry set, see read_entry_set_at
+  uint32_t name;     // offset of the name in the index's names
+  uint8_t length;    // characters in the name
+  bool wide;         // a character of the name did not fit in 8 bits
+} name_index_entry;
+
+// NAME INDEX
+// the names of one directory, decoded once and sorted without case so that
+// a name or the names starting with a prefix are found with a binary search
+typedef struct NAME_INDEX {
+  uint32_t generation;       // mount it was built under, 0 while unused
+  uint32_t first_cluster;    // of the directory
+  uint64_t last_used;        // index_clock when it was last searched
+  uint32_t count;            // names in the directory
+  name_index_entry *entries; // sorted by name, without case
+  char *names;               // every name, NUL terminated, 8 bits a character
+} name_index;
+
+// MOUNTED VOLUME
+static int volume_fd = -1; // -1 while nothing is mounted
+static main_boot_record mbr;
+static entry_set root_set;           // made up, the root has no entry set
+static uint32_t cluster_size;        // bytes per cluster
+static uint64_t cluster_heap_start;  // byte offset of the cluster heap
+static uint64_t fat_start;           // byte offset of the first FAT
+static uint32_t dir_window;          // directory clusters read in one batch
+
+// every mount bumps the generation, anything cached under an older one is
+// stale without having to be cleared
+static uint32_t mount_generation;
+
+// one block of the FAT, chains are mostly walked front to back. Each thread
+// keeps its own so exfat_walk's workers can follow chains at the same time
+static _Thread_local uint32_t fat_block[FAT_BLOCK_ENTRIES];
+static _Thread_local int64_t fat_block_index = -1;
+static _Thread_local uint32_t fat_block_generation;
+
+// ALLOCATION BITMAP
+// one bit per cluster of the heap, set while the cluster is in use. Mapped at
+// mount, or read into memory if its clusters are not contiguous
+static const uint8_t *allocation_bitmap_bits = NULL;
+static void *bitmap_memory = NULL;  // what to munmap or free
+static size_t bitmap_memory_length; // mapped bytes, 0 if bitmap_memory is
+                                    // heap memory
+static _Atomic uint64_t used_clusters; // UINT64_MAX until first counted
+
+// OPEN FILE TABLE
+static open_file open_file_table[MAX_OPEN_FILES];
+static bool open_file_bitmap[MAX_OPEN_FILES]; // true where an entry is used
+
+// taken while the open file table or the entry set cache change, so files can
+// be opened and closed from several threads. Reading an open file needs no
+// lock, its entry only belongs to whoever opened it
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// ENTRY SET AND CLUSTER CHAIN CACHES
+// direct mapped, a lookup overwrites whatever shared its slot. The volume is
+// read only, so a cached entry stays valid for as long as it is mounted,
+// entries from an older mount_generation are ignored. exfat_share_caches moves
+// both into memory shared with forked processes, no process-private lock
+// protects them there: every slot is a sequence lock. A writer makes the
+// sequence odd while it writes (and skips the slot if someone else is), a
+// reader only trusts its copy if the sequence was even and did not change
+static cached_entry_set private_entry_cache[ENTRY_CACHE_SLOTS];
+static cached_chain private_chain_cache[CHAIN_CACHE_SLOTS];
+static cached_entry_set *entry_cache = private_entry_cache;
+static cached_chain *chain_cache = private_chain_cache;
+static bool caches_shared = false;
+
+// NAME INDEXES
+// built by exfat_glob for the directories it searches, the least recently
+// used one makes room for the next. Private to the process, they are built and
+// searched with index_lock held, which is taken after table_lock when both are
+static name_index name_indexes[NAME_INDEX_SLOTS];
+static uint64_t index_clock;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
  * Convert a Unicode-formatted string containing only ASCII characters
  * into a regular ASCII-formatted string (16 bit chars to 8 bit
@@ -46,92 +238,3894 @@ char *unicode2ascii(uint16_t *unicode_string, uint8_t length) {
   return ascii_string;
 }
 
-/* Return: EXFAT_UNSUPPORTED_FS if the current implementation does not support
- *         the file system specified, EXFAT_FSCK_FAIL if the super block does
- * not pass the basic file system check, EXFAT_INVAL if an invalid argument has
- * been passed (e.g., NULL),or EXFAT_OK on success.
+//--------------
+// BLOCK DEVICES
+//--------------
+// Every read of the mounted volume goes through one of these, picked at mount
+// from EXFAT_DEVICE:
+//  * "pread" (default): pread on the image, batches may go to the io_uring
+//    and exfat_export may copy with copy_file_range.
+//  * "mmap": the image mapped whole, reads are a memcpy.
+//  * "sim[:latency_us=N][,bandwidth_mb=N][,depth=N]": pread, but a read only
+//    completes when a device with that per-request latency, bandwidth (MB/s,
+//    0 for unlimited) and queue depth would have finished it. Reads issued
+//    together (a batch, several threads, exfat_read_async) overlap up to the
+//    queue depth and share the bandwidth.
+
+// BLOCK DEVICE
+typedef struct BLOCK_DEVICE {
+  const char *name;
+  bool fd_reads; // the io_uring and copy_file_range may read volume_fd
+  // set up for volume_fd, <size> bytes long. False if it can not be used
+  bool (*attach)(uint64_t size);
+  void (*detach)(void);
+  // copies up to <count> bytes at <offset> into <buffer> like pread, stores
+  // when (CLOCK_MONOTONIC ns) the read is complete in <ready_at>, 0 if it is
+  // complete on return
+  ssize_t (*read)(void *buffer, size_t count, uint64_t offset,
+                  uint64_t *ready_at);
+  // passes <advice> for <length> bytes at <offset> on to whatever caches
+  // the device's contents
+  void (*advise)(uint64_t offset, uint64_t length, exfat_advice advice);
+} block_device;
+
+// SIMULATED DEVICE
+// a queue slot is busy for the latency plus the transfer, transfers take
+// turns on the bus
+typedef struct SIMULATED_DEVICE {
+  uint64_t latency_ns;
+  uint64_t bytes_per_second; // 0 for unlimited
+  int queue_depth;
+  pthread_mutex_t lock;
+  uint64_t slot_free_at[SIM_MAX_QUEUE_DEPTH];
+  uint64_t bus_free_at;
+} simulated_device;
+
+static uint8_t *volume_map = NULL; // the mmap device's mapping
+static uint64_t volume_size;
+static simulated_device simulated = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t monotonic_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static void sleep_until(uint64_t ready_at) {
+  struct timespec until = {.tv_sec = (time_t)(ready_at / 1000000000ull),
+                           .tv_nsec = (long)(ready_at % 1000000000ull)};
+  while (ready_at > 0 &&
+         clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) ==
+             EINTR) {
+  }
+}
+
+static bool pread_attach(uint64_t size) {
+  (void)size;
+  return true;
+}
+
+static void pread_detach(void) {}
+
+static ssize_t pread_read(void *buffer, size_t count, uint64_t offset,
+                          uint64_t *ready_at) {
+  *ready_at = 0;
+  return pread(volume_fd, buffer, count, (off_t)offset);
+}
+
+// the posix_fadvise and madvise advice for each exfat_advice
+static const int fadvise_advice[] = {
+    [EXFAT_FADV_NORMAL] = POSIX_FADV_NORMAL,
+    [EXFAT_FADV_SEQUENTIAL] = POSIX_FADV_SEQUENTIAL,
+    [EXFAT_FADV_RANDOM] = POSIX_FADV_RANDOM,
+    [EXFAT_FADV_WILLNEED] = POSIX_FADV_WILLNEED,
+    [EXFAT_FADV_DONTNEED] = POSIX_FADV_DONTNEED};
+static const int madvise_advice[] = {
+    [EXFAT_FADV_NORMAL] = MADV_NORMAL,
+    [EXFAT_FADV_SEQUENTIAL] = MADV_SEQUENTIAL,
+    [EXFAT_FADV_RANDOM] = MADV_RANDOM,
+    [EXFAT_FADV_WILLNEED] = MADV_WILLNEED,
+    [EXFAT_FADV_DONTNEED] = MADV_DONTNEED};
+
+// the image's pages in the page cache
+static void pread_advise(uint64_t offset, uint64_t length,
+                         exfat_advice advice) {
+  posix_fadvise(volume_fd, (off_t)offset, (off_t)length,
+                fadvise_advice[advice]);
+}
+
+static bool mmap_attach(uint64_t size) {
+  if (size == 0) {
+    return false;
+  }
+  void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, volume_fd, 0);
+  if (MAP_FAILED == map) {
+    return false;
+  }
+  volume_map = map;
+  volume_size = size;
+  return true;
+}
+
+static void mmap_detach(void) {
+  munmap(volume_map, volume_size);
+  volume_map = NULL;
+}
+
+static ssize_t mmap_read(void *buffer, size_t count, uint64_t offset,
+                         uint64_t *ready_at) {
+  *ready_at = 0;
+  if (offset >= volume_size) {
+    return 0;
+  }
+  if (count > volume_size - offset) {
+    count = volume_size - offset; // like pread at the end of the image
+  }
+  memcpy(buffer, volume_map + offset, count);
+  return (ssize_t)count;
+}
+
+// the mapped pages, which madvise wants page aligned
+static void mmap_advise(uint64_t offset, uint64_t length,
+                        exfat_advice advice) {
+  uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+  uint64_t start = offset / page * page;
+  uint64_t end = offset + length;
+  if (start >= volume_size) {
+    return;
+  }
+  if (end > volume_size) {
+    end = volume_size;
+  }
+  madvise(volume_map + start, end - start, madvise_advice[advice]);
+}
+
+static bool simulated_attach(uint64_t size) {
+  (void)size;
+  pthread_mutex_lock(&simulated.lock);
+  memset(simulated.slot_free_at, 0, sizeof(simulated.slot_free_at));
+  simulated.bus_free_at = 0;
+  pthread_mutex_unlock(&simulated.lock);
+  return true;
+}
+
+static ssize_t simulated_read(void *buffer, size_t count, uint64_t offset,
+                              uint64_t *ready_at) {
+  ssize_t result = pread(volume_fd, buffer, count, (off_t)offset);
+  uint64_t moved = result > 0 ? (uint64_t)result : 0;
+  uint64_t transfer = simulated.bytes_per_second == 0
+                          ? 0
+                          : moved * 1000000000ull / simulated.bytes_per_second;
+
+  pthread_mutex_lock(&simulated.lock);
+  uint64_t now = monotonic_ns();
+  int slot = 0;
+  for (int i = 1; i < simulated.queue_depth; i++) {
+    if (simulated.slot_free_at[i] < simulated.slot_free_at[slot]) {
+      slot = i;
+    }
+  }
+  uint64_t start = simulated.slot_free_at[slot] > now
+                       ? simulated.slot_free_at[slot]
+                       : now;
+  uint64_t transfer_start = start + simulated.latency_ns;
+  if (transfer_start < simulated.bus_free_at) {
+    transfer_start = simulated.bus_free_at;
+  }
+  *ready_at = transfer_start + transfer;
+  simulated.bus_free_at = *ready_at;
+  simulated.slot_free_at[slot] = *ready_at;
+  pthread_mutex_unlock(&simulated.lock);
+  return result;
+}
+
+// a simulated read always costs the same, there is no cache to steer
+static void simulated_advise(uint64_t offset, uint64_t length,
+                             exfat_advice advice) {
+  (void)offset;
+  (void)length;
+  (void)advice;
+}
+
+static const block_device pread_device = {
+    "pread", true, pread_attach, pread_detach, pread_read, pread_advise};
+static const block_device mmap_device = {
+    "mmap", false, mmap_attach, mmap_detach, mmap_read, mmap_advise};
+static const block_device simulated_block_device = {
+    "sim",          false,          simulated_attach, pread_detach,
+    simulated_read, simulated_advise};
+
+static const block_device *device = &pread_device;
+
+/**
+ * Pick the device EXFAT_DEVICE asks for (see above), the pread device if it
+ * is not set or not understood.
  */
-exfat_error exfat_mount(const char *source, exfat_fs_type fs_type) {
-  // boolean isValidSuperBlock = true;
-  (void)source;
-  (void)fs_type;
+static const block_device *block_device_from_environment(void) {
+  const char *spec = getenv(DEVICE_VARIABLE);
+  if (NULL == spec || strcmp(spec, "pread") == 0) {
+    return &pread_device;
+  }
+  if (strcmp(spec, "mmap") == 0) {
+    return &mmap_device;
+  }
+  if (strncmp(spec, "sim", 3) != 0 || (spec[3] != '\0' && spec[3] != ':')) {
+    return &pread_device;
+  }
 
-  if (NULL == source) {
-    return EXFAT_INVAL;
+  simulated.latency_ns = SIM_DEFAULT_LATENCY_US * 1000ull;
+  simulated.bytes_per_second = 0;
+  simulated.queue_depth = 1;
+  for (const char *option = spec[3] ? spec + 4 : NULL; NULL != option;
+       option = strchr(option, ',') ? strchr(option, ',') + 1 : NULL) {
+    unsigned long long value = 0;
+    if (sscanf(option, "latency_us=%llu", &value) == 1) {
+      simulated.latency_ns = value * 1000ull;
+    } else if (sscanf(option, "bandwidth_mb=%llu", &value) == 1) {
+      simulated.bytes_per_second = value * 1000000ull;
+    } else if (sscanf(option, "depth=%llu", &value) == 1) {
+      if (value > SIM_MAX_QUEUE_DEPTH) {
+        value = SIM_MAX_QUEUE_DEPTH;
+      }
+      simulated.queue_depth = value < 1 ? 1 : (int)value;
+    }
   }
-  if (EXFAT_FS_EXFAT != fs_type) {
-    return EXFAT_UNSUPPORTED_FS;
+  return &simulated_block_device;
+}
+
+/**
+ * Read up to <count> bytes of the volume at <offset>, waiting for the device.
+ *
+ * Return: what pread would.
+ */
+static ssize_t block_read(void *buffer, size_t count, uint64_t offset) {
+  uint64_t ready_at;
+  ssize_t result = device->read(buffer, count, offset, &ready_at);
+  sleep_until(ready_at);
+  return result;
+}
+
+//---------------
+// CLUSTER CHAINS
+//---------------
+static bool is_valid_cluster(uint32_t cluster) {
+  return cluster >= FIRST_DATA_CLUSTER &&
+         cluster <= mbr.cluster_count + 1;
+}
+
+static uint64_t cluster_offset(uint32_t cluster) {
+  assert(is_valid_cluster(cluster));
+  return cluster_heap_start +
+         (uint64_t)(cluster - FIRST_DATA_CLUSTER) * cluster_size;
+}
+
+/**
+ * Look up the cluster that follows <cluster> in the FAT.
+ *
+ * Return: the next cluster, or FAT_END_OF_CHAIN at the end of the chain or
+ *         when the FAT can not be read.
+ */
+static uint32_t fat_next_cluster(uint32_t cluster) {
+  int64_t block = cluster / FAT_BLOCK_ENTRIES;
+
+  if (block != fat_block_index || fat_block_generation != mount_generation) {
+    uint64_t offset = fat_start + (uint64_t)block * sizeof(fat_block);
+    if (block_read(fat_block, sizeof(fat_block), offset) <= 0) {
+      fat_block_index = -1;
+      return FAT_END_OF_CHAIN;
+    }
+    fat_block_index = block;
+    fat_block_generation = mount_generation;
   }
 
-  // opening the file for reading in binary for validating
-  FILE *file_system_bin = fopen(source, "rb");
-  if (NULL == file_system_bin) {
-    return EXFAT_INVAL;
+  return fat_block[cluster % FAT_BLOCK_ENTRIES];
+}
+
+// Return: how many clusters starting at chain[index] follow each other on the
+//         volume, at least 1.
+static uint32_t contiguous_run(const uint32_t *chain, uint32_t length,
+                               uint32_t index) {
+  uint32_t run = 1;
+
+  while (index + run < length && chain[index + run] == chain[index] + run) {
+    run++;
   }
+  return run;
+}
 
-  // reading the opened binary file into the main_boot_record
-  main_boot_record mbr; // struct to store the main boot record data from the fs
-  // reading 1 mbr worth of data from the file
-  if (1 != fread(&mbr, sizeof(main_boot_record), 1, file_system_bin)) {
-    // failed to read the main boot record
-    fclose(file_system_bin);
-    return EXFAT_FSCK_FAIL;
+//----------------
+// SEQUENCE LOCKS
+//----------------
+// Return: false if someone else is writing the slot, it is skipped then.
+static bool sequence_write_begin(atomic_uint *sequence) {
+  unsigned expected = atomic_load_explicit(sequence, memory_order_relaxed);
+  if ((expected & 1) != 0 ||
+      !atomic_compare_exchange_strong_explicit(sequence, &expected,
+                                               expected + 1,
+                                               memory_order_relaxed,
+                                               memory_order_relaxed)) {
+    return false;
   }
+  atomic_thread_fence(memory_order_release);
+  return true;
+}
 
-  // checking the FileSystemName Field
-  if (0 != strcmp(mbr.fs_name, "EXFAT   ")) {
-    // invalid file system FileSystemName
-    fclose(file_system_bin);
-    return EXFAT_FSCK_FAIL;
+static void sequence_write_end(atomic_uint *sequence) {
+  atomic_fetch_add_explicit(sequence, 1, memory_order_release);
+}
+
+static unsigned sequence_read_begin(atomic_uint *sequence) {
+  return atomic_load_explicit(sequence, memory_order_acquire);
+}
+
+// Return: whether what was read since sequence_read_begin returned <begun> is
+// a consistent copy of the slot.
+static bool sequence_read_valid(atomic_uint *sequence, unsigned begun) {
+  atomic_thread_fence(memory_order_acquire);
+  return (begun & 1) == 0 &&
+         atomic_load_explicit(sequence, memory_order_relaxed) == begun;
+}
+
+// relaxed word by word copies of <size> bytes out of and into a slot, the
+// sequence lock around them says whether the copy can be trusted
+static void sequence_load_words(void *to, atomic_uint *from, size_t size) {
+  uint8_t *bytes = to;
+  for (size_t i = 0; i < size; i += sizeof(uint32_t)) {
+    uint32_t word = atomic_load_explicit(&from[i / sizeof(uint32_t)],
+                                         memory_order_relaxed);
+    size_t part = size - i < sizeof(word) ? size - i : sizeof(word);
+    memcpy(bytes + i, &word, part);
   }
+}
 
-  // checking the must_be_zero field, there should be 53 bytes of 0 init
-  if (0 != memcmp(mbr.must_be_zero, 0, 53)) {
-    // invalid must_be_zero field in our file system
-    fclose(file_system_bin);
-    return EXFAT_FSCK_FAIL;
+static void sequence_store_words(atomic_uint *to, const void *from,
+                                 size_t size) {
+  const uint8_t *bytes = from;
+  for (size_t i = 0; i < size; i += sizeof(uint32_t)) {
+    uint32_t word = 0;
+    size_t part = size - i < sizeof(word) ? size - i : sizeof(word);
+    memcpy(&word, bytes + i, part);
+    atomic_store_explicit(&to[i / sizeof(uint32_t)], word,
+                          memory_order_relaxed);
   }
+}
 
-  // checking boot signature
-  if (0xAA55 != mbr.boot_signature) {
-    fclose(file_system_bin);
-    return EXFAT_FSCK_FAIL;
+static cached_chain *chain_cache_slot(uint32_t first_cluster) {
+  return &chain_cache[(first_cluster * 0x9E3779B1u >> 8) % CHAIN_CACHE_SLOTS];
+}
+
+/**
+ * Look <first_cluster>'s FAT chain up in the chain cache.
+ *
+ * Return: a heap allocated chain, or NULL if it is not cached. Its length is
+ *         stored in <length>.
+ */
+static uint32_t *chain_cache_lookup(uint32_t first_cluster, uint32_t *length) {
+  cached_chain *cached = chain_cache_slot(first_cluster);
+  uint32_t run_start[CHAIN_CACHE_RUNS], run_length[CHAIN_CACHE_RUNS];
+  uint64_t total = 0;
+
+  unsigned sequence = sequence_read_begin(&cached->sequence);
+  unsigned num_runs =
+      atomic_load_explicit(&cached->num_runs, memory_order_relaxed);
+  if (atomic_load_explicit(&cached->generation, memory_order_relaxed) !=
+          mount_generation ||
+      atomic_load_explicit(&cached->first_cluster, memory_order_relaxed) !=
+          first_cluster ||
+      num_runs == 0 || num_runs > CHAIN_CACHE_RUNS) {
+    return NULL;
+  }
+  for (unsigned i = 0; i < num_runs; i++) {
+    run_start[i] =
+        atomic_load_explicit(&cached->run_start[i], memory_order_relaxed);
+    run_length[i] =
+        atomic_load_explicit(&cached->run_length[i], memory_order_relaxed);
+    total += run_length[i];
+  }
+  if (!sequence_read_valid(&cached->sequence, sequence) ||
+      total > mbr.cluster_count) {
+    return NULL;
   }
 
-  // checking the FirstClusterOfRootDirectory field should be in range
-  // [2,ClusterCount+1];
-  assert(mbr.cluster_count > 0);
-  if (mbr.first_cluster_of_root_directory < 2 ||
-      mbr.first_cluster_of_root_directory > mbr.cluster_count + 1) {
-    assert(mbr.first_cluster_of_root_directory >= 2);
-    assert(mbr.first_cluster_of_root_directory <= mbr.cluster_count + 1);
-    fclose(file_system_bin);
-    return EXFAT_FSCK_FAIL;
+  uint32_t *chain = malloc(total * sizeof(uint32_t));
+  if (NULL == chain) {
+    return NULL;
+  }
+  *length = 0;
+  for (unsigned i = 0; i < num_runs; i++) {
+    for (uint32_t j = 0; j < run_length[i]; j++) {
+      chain[(*length)++] = run_start[i] + j;
+    }
   }
+  return chain;
+}
 
-  // all the checks passed, this is a valid exFAT file system
-  fclose(file_system_bin);
-  return EXFAT_OK;
+// keeps <chain> if it is made of few enough runs of clusters
+static void chain_cache_insert(const uint32_t *chain, uint32_t length) {
+  uint32_t run_start[CHAIN_CACHE_RUNS], run_length[CHAIN_CACHE_RUNS];
+  unsigned num_runs = 0;
+
+  for (uint32_t i = 0, run; i < length; i += run) {
+    if (num_runs == CHAIN_CACHE_RUNS) {
+      return; // too fragmented to be worth a slot
+    }
+    run = contiguous_run(chain, length, i);
+    run_start[num_runs] = chain[i];
+    run_length[num_runs++] = run;
+  }
+
+  cached_chain *cached = chain_cache_slot(chain[0]);
+  if (num_runs == 0 || !sequence_write_begin(&cached->sequence)) {
+    return;
+  }
+  atomic_store_explicit(&cached->generation, mount_generation,
+                        memory_order_relaxed);
+  atomic_store_explicit(&cached->first_cluster, chain[0],
+                        memory_order_relaxed);
+  atomic_store_explicit(&cached->num_runs, num_runs, memory_order_relaxed);
+  for (unsigned i = 0; i < num_runs; i++) {
+    atomic_store_explicit(&cached->run_start[i], run_start[i],
+                          memory_order_relaxed);
+    atomic_store_explicit(&cached->run_length[i], run_length[i],
+                          memory_order_relaxed);
+  }
+  sequence_write_end(&cached->sequence);
 }
 
-exfat_error exfat_unmount(void) { return EXFAT_INVAL; }
+/**
+ * Build the list of clusters that hold a file's data.
+ *
+ * NoFatChain files are contiguous, so their chain is computed from the data
+ * length, everything else follows the FAT until the end of the chain.
+ *
+ * Return: a heap allocated chain (NULL for an empty file), its length is
+ *         stored in <length>.
+ */
+static uint32_t *build_cluster_chain(uint32_t first_cluster,
+                                     uint64_t data_length, bool no_fat_chain,
+                                     uint32_t *length) {
+  assert(NULL != length);
+  *length = 0;
+
+  if (!is_valid_cluster(first_cluster)) {
+    return NULL; // empty files do not own any clusters
+  }
 
-int exfat_open(const char *pathname) {
-  (void)pathname;
+  if (no_fat_chain) {
+    uint64_t count = (data_length + cluster_size - 1) / cluster_size;
+    if (count == 0 || count > mbr.cluster_count) {
+      return NULL;
+    }
+    uint32_t *chain = malloc(count * sizeof(uint32_t));
+    if (NULL == chain) {
+      return NULL;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      chain[i] = first_cluster + i;
+    }
+    *length = (uint32_t)count;
+    return chain;
+  }
+
+  uint32_t *cached = chain_cache_lookup(first_cluster, length);
+  if (NULL != cached) {
+    return cached;
+  }
+
+  uint32_t capacity = 16;
+  uint32_t *chain = malloc(capacity * sizeof(uint32_t));
+  uint32_t cluster = first_cluster;
+
+  // a chain can never be longer than the heap, that also stops FAT loops
+  while (NULL != chain && is_valid_cluster(cluster) &&
+         *length < mbr.cluster_count) {
+    if (*length == capacity) {
+      capacity *= 2;
+      uint32_t *bigger = realloc(chain, capacity * sizeof(uint32_t));
+      if (NULL == bigger) {
+        free(chain);
+        chain = NULL;
+        break;
+      }
+      chain = bigger;
+    }
+    chain[(*length)++] = cluster;
+    cluster = fat_next_cluster(cluster);
+  }
 
-  return EXFAT_INVAL;
+  if (NULL == chain) {
+    *length = 0;
+  } else {
+    chain_cache_insert(chain, *length);
+  }
+  return chain;
 }
 
-int exfat_close(int fd) {
-  (void)fd;
+//-------------------
+// OPEN FILE ROUTINES
+//-------------------
+/**
+ * Fill in <file> for the entry set <set>. The cluster chain is only built
+ * once the file's contents are read (see load_cluster_chain).
+ */
+static void open_file_from_set(open_file *file, const entry_set *set) {
+  assert(NULL != file && NULL != set);
 
-  return EXFAT_INVAL;
+  memset(file, 0, sizeof(open_file));
+  file->set = *set;
+  file->set.filenames = NULL;
+  file->is_directory = (set->file.file_attributes & ATTR_DIRECTORY) != 0;
+  file->buffered_cluster = -1;
 }
 
-ssize_t exfat_read(int fd, void *buffer, size_t count) {
-  (void)fd;
-  (void)buffer;
-  (void)count;
+/**
+ * Build the cluster chain of <file> if that has not happened yet.
+ *
+ * Return: false if the chain could not be built.
+ */
+static bool load_cluster_chain(open_file *file) {
+  if (file->chain_loaded) {
+    return true;
+  }
+
+  const stream_extension *stream = &file->set.stream_extension;
+  file->cluster_chain =
+      build_cluster_chain(stream->first_cluster, stream->data_length,
+                          stream->flags.no_fat_chain, &file->chain_length);
+  file->chain_loaded = file->chain_length > 0 ||
+                       !is_valid_cluster(stream->first_cluster);
+  return file->chain_loaded;
+}
+
+static void release_open_file(open_file *file) {
+  // the chain goes with the last fd exfat_dup shared it with
+  if (NULL == file->chain_users) {
+    free(file->cluster_chain);
+  } else if (atomic_fetch_sub(file->chain_users, 1) == 1) {
+    free(file->cluster_chain);
+    free(file->chain_users);
+  }
+  free(file->cluster_buffer);
+  free(file->scan.entry); // the other scan arrays share its allocation
+  memset(file, 0, sizeof(open_file));
+}
+
+// Return: the open file behind <fd>, or NULL if it is not open.
+static open_file *lookup_open_file(int fd) {
+  if (volume_fd < 0 || fd < 0 || fd >= MAX_OPEN_FILES ||
+      !open_file_bitmap[fd]) {
+    return NULL;
+  }
+  return &open_file_table[fd];
+}
+
+// Return: a free slot of the open file table, or -1 if it is full.
+static int allocate_open_file(void) {
+  for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+    if (!open_file_bitmap[fd]) {
+      open_file_bitmap[fd] = true;
+      return fd;
+    }
+  }
+  return -1;
+}
+
+//--------------
+// BATCHED READS
+//--------------
+// A read of a file or of a directory window is cut into one segment per run of
+// contiguous clusters. A read of a single segment is one pread, anything more
+// goes through the io_uring so every run is in flight at once. Without the
+// ring (not Linux, EXFAT_NO_IO_URING, the kernel turned it down, or another
+// block device) every segment is read from the device as soon as it is added,
+// and the request waits for the device once they all are.
+
+// READ REQUEST
+// one read, complete once none of its segments are pending. May live on the
+// stack of whoever waits for it, or in async_requests
+typedef struct READ_REQUEST {
+  uint64_t length;     // bytes the read covers, zeros past valid data included
+  uint64_t done_until; // first byte a segment fell short at, if one did
+  bool failed;         // the segment at done_until failed outright
+  int pending;         // segments queued on the ring and not reaped yet
+  uint64_t ready_at;   // when the device is done with the segments read
+  bool async;          // queue even a single segment, the caller has work
+  bool queued;         // some segment went to the ring
+  bool holding;        // held is the only segment so far, not yet queued
+  uint8_t *held_destination;
+  uint64_t held_volume_offset;
+  uint64_t held_length;
+  uint64_t held_request_offset;
+} read_request;
+
+// taken while the ring, its segments or async_requests change
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// REQUESTS OF exfat_read_async
+static read_request async_requests[ASYNC_MAX_REQUESTS];
+static bool async_in_use[ASYNC_MAX_REQUESTS];
+
+// the length grows as reads are added to the request
+static void read_request_init(read_request *request, bool async) {
+  memset(request, 0, sizeof(read_request));
+  request->done_until = UINT64_MAX;
+  request->async = async;
+}
+
+// records that the segment at <request_offset> read <result> of its <length>
+// bytes (negative: it failed)
+static void read_request_done(read_request *request, uint64_t request_offset,
+                              uint64_t length, int64_t result) {
+  if (result >= 0 && (uint64_t)result >= length) {
+    return;
+  }
+  uint64_t until = request_offset + (result > 0 ? (uint64_t)result : 0);
+  if (until < request->done_until) {
+    request->done_until = until;
+    request->failed = result < 0;
+  }
+}
+
+// Return: what exfat_pread returns for the finished <request>.
+static ssize_t read_request_result(const read_request *request) {
+  if (request->done_until >= request->length) {
+    return (ssize_t)request->length;
+  }
+  if (request->done_until == 0 && request->failed) {
+    return -1;
+  }
+  return (ssize_t)request->done_until;
+}
+
+static void read_segment_now(read_request *request, uint8_t *destination,
+                             uint64_t volume_offset, uint64_t length,
+                             uint64_t request_offset) {
+  uint64_t ready_at;
+  ssize_t result = device->read(destination, length, volume_offset, &ready_at);
+  read_request_done(request, request_offset, length, result);
+  if (ready_at > request->ready_at) {
+    request->ready_at = ready_at;
+  }
+}
+
+#ifdef EXFAT_IO_URING
+// IO RING
+// the submission and completion queues shared with the kernel, see
+// io_uring_setup(2). Everything but the kernel's side is behind io_lock
+typedef struct IO_RING {
+  int fd; // -1 when reads go through pread
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring; // the same mapping with IORING_FEAT_SINGLE_MMAP
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+  unsigned segments; // ring_segments in use by this ring
+  unsigned queued;   // entries added since the last io_uring_enter
+  bool reaping;      // a thread waits in io_uring_enter for completions
+} io_ring;
+
+// RING SEGMENT
+// a queued read, found again through the completion's user_data
+typedef struct RING_SEGMENT {
+  read_request *request;
+  uint64_t request_offset;
+  uint64_t length;
+} ring_segment;
+
+static io_ring ring = {.fd = -1};
+static ring_segment ring_segments[IO_RING_ENTRIES];
+static unsigned free_segments[IO_RING_ENTRIES]; // stack of unused segments
+static unsigned num_free_segments;
+static pthread_cond_t io_reaped = PTHREAD_COND_INITIALIZER;
+
+static bool ring_available(void) { return ring.fd >= 0; }
+
+static void ring_unmap(void) {
+  if (NULL != ring.sqes && MAP_FAILED != (void *)ring.sqes) {
+    munmap(ring.sqes, ring.sqes_size);
+  }
+  if (NULL != ring.cq_ring && MAP_FAILED != ring.cq_ring &&
+      ring.cq_ring != ring.sq_ring) {
+    munmap(ring.cq_ring, ring.cq_ring_size);
+  }
+  if (NULL != ring.sq_ring && MAP_FAILED != ring.sq_ring) {
+    munmap(ring.sq_ring, ring.sq_ring_size);
+  }
+  memset(&ring, 0, sizeof(io_ring));
+  ring.fd = -1;
+}
+
+/**
+ * Drop the ring inherited by a forked child, run in the child by fork. The
+ * child shares the queues with the kernel but has its own copy of io_lock and
+ * of the segments, so both processes using it would reap each other's
+ * completions into the wrong buffers. The child reads with pread instead, and
+ * io_lock starts over in case a thread of the parent held it.
+ */
+static void ring_forget(void) {
+  if (ring_available()) {
+    int fd = ring.fd;
+    ring_unmap();
+    close(fd);
+  }
+  num_free_segments = 0;
+  io_lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+  io_reaped = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+}
+
+static void ring_watch_forks(void) {
+  pthread_atfork(NULL, NULL, ring_forget);
+}
+
+/**
+ * Set up the ring for the mounted volume. Reads keep going through pread if
+ * that fails (old kernels, io_uring disabled by a sandbox). The ring belongs
+ * to this process only, see ring_forget.
+ */
+static void ring_open(void) {
+  static pthread_once_t fork_handler = PTHREAD_ONCE_INIT;
+  pthread_once(&fork_handler, ring_watch_forks);
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = (int)syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+  if (fd < 0) {
+    return;
+  }
+
+  ring.fd = fd;
+  ring.sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring.cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap && ring.cq_ring_size > ring.sq_ring_size) {
+    ring.sq_ring_size = ring.cq_ring_size;
+  }
+  ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring.cq_ring = single_mmap ? ring.sq_ring
+                             : mmap(NULL, ring.cq_ring_size,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, fd,
+                                    IORING_OFF_CQ_RING);
+  ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (MAP_FAILED == ring.sq_ring || MAP_FAILED == ring.cq_ring ||
+      MAP_FAILED == (void *)ring.sqes) {
+    ring_unmap();
+    close(fd);
+    return;
+  }
+
+  uint8_t *sq = ring.sq_ring;
+  uint8_t *cq = ring.cq_ring;
+  ring.sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  // never more segments in flight than the submission queue holds, the
+  // completion queue is at least twice that so it can not overflow
+  num_free_segments = 0;
+  for (unsigned i = 0; i < IO_RING_ENTRIES && i < params.sq_entries; i++) {
+    free_segments[num_free_segments++] = i;
+  }
+  ring.segments = num_free_segments;
+}
+
+static int ring_enter(unsigned to_submit, unsigned min_complete,
+                      unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete,
+                      flags, NULL, 0);
+}
+
+static void ring_segment_done(unsigned slot, int64_t result) {
+  ring_segment *segment = &ring_segments[slot];
+  read_request_done(segment->request, segment->request_offset,
+                    segment->length, result);
+  segment->request->pending--;
+  free_segments[num_free_segments++] = slot;
+}
+
+// hands the queued entries to the kernel. Whatever it does not take is read
+// with pread instead, so no request waits on an entry that never completes
+static void ring_submit(void) {
+  while (ring.queued > 0) {
+    int submitted = ring_enter(ring.queued, 0, 0);
+    if (submitted > 0) {
+      ring.queued -= (unsigned)submitted;
+    } else if (submitted < 0 && errno == EINTR) {
+      continue;
+    } else {
+      break;
+    }
+  }
+  if (ring.queued == 0) {
+    return;
+  }
+
+  unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *ring.sq_tail;
+  for (unsigned i = head; i != tail; i++) {
+    struct io_uring_sqe *sqe = &ring.sqes[ring.sq_array[i & *ring.sq_mask]];
+    ssize_t result = pread(volume_fd, (void *)(uintptr_t)sqe->addr, sqe->len,
+                           (off_t)sqe->off);
+    ring_segment_done((unsigned)sqe->user_data, result);
+  }
+  __atomic_store_n(ring.sq_tail, head, __ATOMIC_RELEASE);
+  ring.queued = 0;
+}
+
+static void ring_reap(void) {
+  unsigned head = *ring.cq_head;
+  unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+    ring_segment_done((unsigned)cqe->user_data, cqe->res);
+  }
+  __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Wait until at least one more segment has completed, with io_lock held. One
+ * thread at a time waits in the kernel (without the lock) and reaps for
+ * everyone, the others wait for it to be done.
+ */
+static void ring_wait(void) {
+  ring_submit();
+  if (ring.reaping) {
+    pthread_cond_wait(&io_reaped, &io_lock);
+    return;
+  }
+
+  ring.reaping = true;
+  pthread_mutex_unlock(&io_lock);
+  ring_enter(0, 1, IORING_ENTER_GETEVENTS); // EINTR only means reap early
+  pthread_mutex_lock(&io_lock);
+  ring_reap();
+  ring.reaping = false;
+  pthread_cond_broadcast(&io_reaped);
+}
+
+// queues one segment, with io_lock held. Waits for a free segment first if
+// all of them are in flight
+static void ring_queue(read_request *request, uint8_t *destination,
+                       uint64_t volume_offset, uint64_t length,
+                       uint64_t request_offset) {
+  while (num_free_segments == 0) {
+    ring_wait();
+  }
+
+  unsigned slot = free_segments[--num_free_segments];
+  ring_segments[slot] = (ring_segment){request, request_offset, length};
+  request->pending++;
+
+  unsigned tail = *ring.sq_tail;
+  unsigned index = tail & *ring.sq_mask;
+  struct io_uring_sqe *sqe = &ring.sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = volume_fd;
+  sqe->addr = (uint64_t)(uintptr_t)destination;
+  sqe->len = (uint32_t)length;
+  sqe->off = volume_offset;
+  sqe->user_data = slot;
+  ring.sq_array[index] = index;
+  __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring.queued++;
+}
+
+// waits for every segment in flight, then takes the ring down
+static void ring_close(void) {
+  if (!ring_available()) {
+    return;
+  }
+  pthread_mutex_lock(&io_lock);
+  while (num_free_segments < ring.segments) {
+    ring_wait();
+  }
+  int fd = ring.fd;
+  ring_unmap();
+  close(fd);
+  pthread_mutex_unlock(&io_lock);
+}
+#else
+static bool ring_available(void) { return false; }
+static void ring_open(void) {}
+static void ring_close(void) {}
+static void ring_submit(void) {}
+static void ring_wait(void) {}
+static void ring_queue(read_request *request, uint8_t *destination,
+                       uint64_t volume_offset, uint64_t length,
+                       uint64_t request_offset) {
+  read_segment_now(request, destination, volume_offset, length,
+                   request_offset);
+}
+#endif
 
-  return EXFAT_INVAL;
+/**
+ * Add the <length> bytes of the volume at <volume_offset> to <request>, to be
+ * read into <destination>. <request_offset> is where they start in the read.
+ */
+static void read_request_add(read_request *request, uint8_t *destination,
+                             uint64_t volume_offset, uint64_t length,
+                             uint64_t request_offset) {
+  // the ring takes at most a 32 bit length per read
+  while (length > MAX_SEGMENT_LENGTH) {
+    read_request_add(request, destination, volume_offset, MAX_SEGMENT_LENGTH,
+                     request_offset);
+    destination += MAX_SEGMENT_LENGTH;
+    volume_offset += MAX_SEGMENT_LENGTH;
+    length -= MAX_SEGMENT_LENGTH;
+    request_offset += MAX_SEGMENT_LENGTH;
+  }
+
+  if (!ring_available()) {
+    read_segment_now(request, destination, volume_offset, length,
+                     request_offset);
+    return;
+  }
+  if (!request->async && !request->holding && !request->queued) {
+    // a lone segment is cheaper as a pread, hold it until another turns up
+    request->holding = true;
+    request->held_destination = destination;
+    request->held_volume_offset = volume_offset;
+    request->held_length = length;
+    request->held_request_offset = request_offset;
+    return;
+  }
+
+  request->queued = true;
+  pthread_mutex_lock(&io_lock);
+  if (request->holding) {
+    request->holding = false;
+    ring_queue(request, request->held_destination, request->held_volume_offset,
+               request->held_length, request->held_request_offset);
+  }
+  ring_queue(request, destination, volume_offset, length, request_offset);
+  pthread_mutex_unlock(&io_lock);
+}
+
+// Return: what exfat_pread returns once every segment of <request> is read.
+static ssize_t read_request_wait(read_request *request) {
+  if (request->holding) {
+    request->holding = false;
+    read_segment_now(request, request->held_destination,
+                     request->held_volume_offset, request->held_length,
+                     request->held_request_offset);
+  }
+
+  pthread_mutex_lock(&io_lock);
+  while (request->pending > 0) {
+    ring_wait();
+  }
+  pthread_mutex_unlock(&io_lock);
+  sleep_until(request->ready_at); // the segments went to a slower device
+  return read_request_result(request);
+}
+
+//--------------------
+// DIRECTORY SCANNING
+//--------------------
+// A window of directory clusters is classified a block of 64 entries at a
+// time: one bit per entry for file entries and one for end markers, from the
+// type byte of each entry. Only the file entries are looked at one by one.
+
+// Return: bits of the file entries among the <count> (at most 64) entries at
+//         <entries>, the bits of the end markers are stored in <ends>.
+static uint64_t classify_entries_scalar(const uint8_t *entries, uint32_t count,
+                                        uint64_t *ends) {
+  uint64_t files = 0;
+
+  *ends = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    uint8_t type = entries[(size_t)i * DENTRY_SIZE];
+    files |= (uint64_t)(type == DENTRY_TYPE_FILE) << i;
+    *ends |= (uint64_t)(type == DENTRY_TYPE_END) << i;
+  }
+  return files;
+}
+
+#ifdef EXFAT_SIMD_X86
+// the first four bytes of four entries side by side, the type in the low byte
+static __m128i type_words_sse2(const uint8_t *entries) {
+  __m128i e0 = _mm_loadu_si128((const __m128i *)entries);
+  __m128i e1 = _mm_loadu_si128((const __m128i *)(entries + DENTRY_SIZE));
+  __m128i e2 = _mm_loadu_si128((const __m128i *)(entries + 2 * DENTRY_SIZE));
+  __m128i e3 = _mm_loadu_si128((const __m128i *)(entries + 3 * DENTRY_SIZE));
+
+  return _mm_unpacklo_epi64(_mm_unpacklo_epi32(e0, e1),
+                            _mm_unpacklo_epi32(e2, e3));
+}
+
+static uint64_t classify_entries_sse2(const uint8_t *entries, uint32_t count,
+                                      uint64_t *ends) {
+  const __m128i type_mask = _mm_set1_epi32(0xFF);
+  const __m128i file = _mm_set1_epi32(DENTRY_TYPE_FILE);
+  const __m128i end = _mm_set1_epi32(DENTRY_TYPE_END);
+  uint64_t files = 0, found_ends = 0;
+  uint32_t i = 0;
+
+  for (; i + 4 <= count; i += 4) {
+    __m128i types = _mm_and_si128(
+        type_words_sse2(entries + (size_t)i * DENTRY_SIZE), type_mask);
+    files |= (uint64_t)_mm_movemask_ps(
+                 _mm_castsi128_ps(_mm_cmpeq_epi32(types, file)))
+             << i;
+    found_ends |= (uint64_t)_mm_movemask_ps(
+                      _mm_castsi128_ps(_mm_cmpeq_epi32(types, end)))
+                  << i;
+  }
+  if (i < count) {
+    uint64_t tail_ends;
+    files |= classify_entries_scalar(entries + (size_t)i * DENTRY_SIZE,
+                                     count - i, &tail_ends)
+             << i;
+    found_ends |= tail_ends << i;
+  }
+  *ends = found_ends;
+  return files;
+}
+
+// the same as the SSE2 version, eight entries at a time: the low half of
+// every register holds the first four entries, the high half the next four
+__attribute__((target("avx2"))) static uint64_t
+classify_entries_avx2(const uint8_t *entries, uint32_t count, uint64_t *ends) {
+  const __m256i type_mask = _mm256_set1_epi32(0xFF);
+  const __m256i file = _mm256_set1_epi32(DENTRY_TYPE_FILE);
+  const __m256i end = _mm256_set1_epi32(DENTRY_TYPE_END);
+  uint64_t files = 0, found_ends = 0;
+  uint32_t i = 0;
+
+  for (; i + 8 <= count; i += 8) {
+    const uint8_t *block = entries + (size_t)i * DENTRY_SIZE;
+    __m256i e[4];
+    for (int j = 0; j < 4; j++) {
+      e[j] = _mm256_inserti128_si256(
+          _mm256_castsi128_si256(
+              _mm_loadu_si128((const __m128i *)(block + j * DENTRY_SIZE))),
+          _mm_loadu_si128(
+              (const __m128i *)(block + (j + 4) * DENTRY_SIZE)),
+          1);
+    }
+    __m256i types = _mm256_and_si256(
+        _mm256_unpacklo_epi64(_mm256_unpacklo_epi32(e[0], e[1]),
+                              _mm256_unpacklo_epi32(e[2], e[3])),
+        type_mask);
+    files |= (uint64_t)_mm256_movemask_ps(
+                 _mm256_castsi256_ps(_mm256_cmpeq_epi32(types, file)))
+             << i;
+    found_ends |= (uint64_t)_mm256_movemask_ps(
+                      _mm256_castsi256_ps(_mm256_cmpeq_epi32(types, end)))
+                  << i;
+  }
+  if (i < count) {
+    uint64_t tail_ends;
+    files |= classify_entries_scalar(entries + (size_t)i * DENTRY_SIZE,
+                                     count - i, &tail_ends)
+             << i;
+    found_ends |= tail_ends << i;
+  }
+  *ends = found_ends;
+  return files;
+}
+#endif
+
+// picked at mount, see choose_classifier
+static uint64_t (*classify_entries)(const uint8_t *, uint32_t,
+                                    uint64_t *) = classify_entries_scalar;
+
+static void choose_classifier(void) {
+#ifdef EXFAT_SIMD_X86
+  __builtin_cpu_init();
+  classify_entries = __builtin_cpu_supports("avx2") ? classify_entries_avx2
+                                                    : classify_entries_sse2;
+#endif
+}
+
+/**
+ * Fill in dir->scan for the <entries> entries of dir->cluster_buffer, up to
+ * the first end marker.
+ */
+static void scan_dir_window(open_file *dir, uint32_t entries) {
+  dir_scan *scan = &dir->scan;
+  const directory_entry *window = (const directory_entry *)dir->cluster_buffer;
+
+  scan->scanned = true;
+  scan->count = 0;
+  scan->end = UINT32_MAX;
+  scan->next = 0;
+  for (uint32_t base = 0; base < entries && scan->end == UINT32_MAX;
+       base += 64) {
+    uint32_t count = entries - base < 64 ? entries - base : 64;
+    uint64_t ends;
+    uint64_t files = classify_entries(dir->cluster_buffer +
+                                          (size_t)base * DENTRY_SIZE,
+                                      count, &ends);
+    if (ends != 0) {
+      scan->end = base + (uint32_t)__builtin_ctzll(ends);
+      files &= (ends & -ends) - 1; // nothing past the end marker counts
+    }
+
+    for (; files != 0; files &= files - 1) {
+      uint32_t i = base + (uint32_t)__builtin_ctzll(files);
+      uint32_t slot = scan->count++;
+      scan->entry[slot] = i;
+      scan->attributes[slot] = window[i].file.file_attributes;
+      if (i + 1 < entries &&
+          window[i + 1].entry_type == DENTRY_TYPE_STREAM_EXTENSION) {
+        scan->name_hash[slot] = window[i + 1].stream_extension.name_hash;
+        scan->name_length[slot] = window[i + 1].stream_extension.name_length;
+      } else {
+        scan->name_hash[slot] = 0;
+        scan->name_length[slot] = 0;
+      }
+    }
+  }
+}
+
+// Return: the first slot of <scan> whose file entry is at or after the
+//         window entry <entry>, scan->count if there is none.
+static uint32_t scan_slot_from(const dir_scan *scan, uint32_t entry) {
+  uint32_t low = 0, high = scan->count;
+
+  // reading a directory in order asks for the slot after the last one
+  if (scan->next == scan->count || scan->entry[scan->next] >= entry) {
+    if (scan->next == 0 || scan->entry[scan->next - 1] < entry) {
+      return scan->next;
+    }
+  }
+
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    if (scan->entry[middle] < entry) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+//------------------------
+// DIRECTORY ENTRY READING
+//------------------------
+/**
+ * Make sure the window holding cluster <chain_index> of <dir> is buffered. It
+ * is only scanned once skip_to_file_entry needs it.
+ *
+ * Return: false past the end of the directory or on a read error.
+ */
+static bool load_dir_window(open_file *dir, uint64_t chain_index) {
+  if (!load_cluster_chain(dir) || chain_index >= dir->chain_length ||
+      chain_index * cluster_size >= dir->set.stream_extension.data_length) {
+    return false;
+  }
+
+  // directories are read a window of dir_window clusters at a time, every
+  // run of clusters in it at once. Windows line up with exfat_walk's pieces
+  if ((int64_t)chain_index < dir->buffered_cluster ||
+      (int64_t)chain_index >=
+          dir->buffered_cluster + (int64_t)dir->buffered_count) {
+    if (NULL == dir->cluster_buffer) {
+      size_t entries = (size_t)dir_window * cluster_size / DENTRY_SIZE;
+      dir->cluster_buffer = malloc((size_t)dir_window * cluster_size);
+      dir->scan.entry =
+          malloc(entries * (sizeof(uint32_t) + 2 * sizeof(uint16_t) +
+                            sizeof(uint8_t)));
+      if (NULL == dir->cluster_buffer || NULL == dir->scan.entry) {
+        free(dir->cluster_buffer);
+        free(dir->scan.entry);
+        dir->cluster_buffer = NULL;
+        dir->scan.entry = NULL;
+        return false;
+      }
+      dir->scan.attributes = (uint16_t *)(dir->scan.entry + entries);
+      dir->scan.name_hash = dir->scan.attributes + entries;
+      dir->scan.name_length = (uint8_t *)(dir->scan.name_hash + entries);
+    }
+    uint64_t used = (dir->set.stream_extension.data_length + cluster_size - 1) /
+                    cluster_size;
+    uint32_t first = (uint32_t)(chain_index - chain_index % dir_window);
+    uint32_t end = first + dir_window;
+    if (end > dir->chain_length) {
+      end = dir->chain_length;
+    }
+    if (end > used) {
+      end = (uint32_t)used;
+    }
+
+    read_request request;
+    read_request_init(&request, false);
+    for (uint32_t i = first, run; i < end; i += run) {
+      run = contiguous_run(dir->cluster_chain, end, i);
+      uint64_t in_window = (uint64_t)(i - first) * cluster_size;
+      read_request_add(&request, dir->cluster_buffer + in_window,
+                       cluster_offset(dir->cluster_chain[i]),
+                       (uint64_t)run * cluster_size, in_window);
+    }
+    request.length = (uint64_t)(end - first) * cluster_size;
+    ssize_t bytes_read = read_request_wait(&request);
+    dir->buffered_cluster = first;
+    dir->buffered_count =
+        bytes_read > 0 ? (uint32_t)((uint64_t)bytes_read / cluster_size) : 0;
+    if (chain_index >= (uint64_t)first + dir->buffered_count) {
+      dir->buffered_cluster = -1;
+      return false;
+    }
+    dir->scan.scanned = false;
+  }
+  return true;
+}
+
+/**
+ * Move <*index> to the next file entry or end marker of <dir>, at or after
+ * it, without reading the entries in between.
+ *
+ * Parameters:
+ *  * slot: where the file entry's slot in dir->scan is stored, UINT32_MAX at
+ *          an end marker or when <*index> was not moved.
+ * Return: false past the end of the directory or on a read error.
+ */
+static bool skip_to_file_entry(open_file *dir, uint64_t *index,
+                               uint32_t *slot) {
+  uint64_t entries_per_cluster = cluster_size / DENTRY_SIZE;
+
+  *slot = UINT32_MAX;
+  while (load_dir_window(dir, *index / entries_per_cluster)) {
+    uint64_t first = (uint64_t)dir->buffered_cluster * entries_per_cluster;
+    uint32_t entry = (uint32_t)(*index - first);
+    dir_scan *scan = &dir->scan;
+
+    if (!scan->scanned) {
+      scan_dir_window(dir, (uint32_t)((uint64_t)dir->buffered_count *
+                                      entries_per_cluster));
+    }
+    if (scan->end != UINT32_MAX && entry > scan->end) {
+      return true; // past the end marker, the scan knows nothing there
+    }
+    uint32_t found = scan_slot_from(scan, entry);
+    if (found < scan->count) {
+      *index = first + scan->entry[found];
+      *slot = found;
+      scan->next = found + 1;
+      return true;
+    }
+    if (scan->end != UINT32_MAX) {
+      *index = first + scan->end;
+      return true;
+    }
+    *index = first + (uint64_t)dir->buffered_count * entries_per_cluster;
+  }
+  return false;
+}
+
+/**
+ * Read the <index>th directory entry of the directory <dir>.
+ *
+ * Return: false past the end of the directory or on a read error.
+ */
+static bool read_dir_entry(open_file *dir, uint64_t index,
+                           directory_entry *entry) {
+  uint64_t offset = index * DENTRY_SIZE;
+  uint64_t chain_index = offset / cluster_size;
+
+  if (!load_dir_window(dir, chain_index) ||
+      offset >= dir->set.stream_extension.data_length) {
+    return false;
+  }
+
+  memcpy(entry,
+         dir->cluster_buffer +
+             (chain_index - (uint64_t)dir->buffered_cluster) * cluster_size +
+             offset % cluster_size,
+         DENTRY_SIZE);
+  return true;
+}
+
+// Return: where the <index>th entry of <dir>, already read, is on the volume.
+static uint64_t entry_location(const open_file *dir, uint64_t index) {
+  uint64_t offset = index * DENTRY_SIZE;
+  return cluster_offset(dir->cluster_chain[offset / cluster_size]) +
+         offset % cluster_size;
+}
+
+/**
+ * Get the next file entry set of <dir>, starting at entry <*index>.
+ *
+ * Groups the file, stream extension and file name entries of one file, see
+ * the README. Entries that are not in use or are not files (labels, bitmaps,
+ * etc.) are skipped.
+ *
+ * Parameters:
+ *  * index: the entry to start at, moved past the returned set.
+ *  * set: where the file and stream extension entries are stored.
+ *  * name: MAX_NAME_LENGTH characters for the name of the file.
+ *  * set_index: where the index of the set's file entry is stored, may be
+ *               NULL.
+ * Return: false at the end of the directory.
+ */
+static bool exfat_getdent_set(open_file *dir, uint64_t *index, entry_set *set,
+                              uint16_t *name, uint64_t *set_index) {
+  directory_entry entry;
+  uint32_t slot;
+  uint64_t file_index;
+
+  while (read_dir_entry(dir, *index, &entry)) {
+    if (entry.entry_type == DENTRY_TYPE_END) {
+      return false; // nothing is stored past the end marker
+    }
+    if (entry.entry_type != DENTRY_TYPE_FILE) {
+      // jump over unused and deleted entries with the scan of the window
+      uint64_t skipped_from = *index;
+      if (!skip_to_file_entry(dir, index, &slot)) {
+        return false;
+      }
+      if (*index != skipped_from) {
+        continue;
+      }
+    }
+    if (NULL != set_index) {
+      *set_index = *index;
+    }
+    file_index = (*index)++;
+    if (entry.entry_type != DENTRY_TYPE_FILE ||
+        entry.file.secondary_count < 2) {
+      continue;
+    }
+
+    // first secondary entry: the stream extension
+    set->file = entry.file;
+    set->filenames = NULL;
+    if (!read_dir_entry(dir, *index, &entry) ||
+        entry.entry_type != DENTRY_TYPE_STREAM_EXTENSION) {
+      continue;
+    }
+    (*index)++;
+    set->stream_extension = entry.stream_extension;
+
+    // the rest: file names, 15 characters per entry
+    uint8_t name_length = set->stream_extension.name_length;
+    int name_entries =
+        (name_length + NAME_CHARS_PER_ENTRY - 1) / NAME_CHARS_PER_ENTRY;
+    int copied = 0;
+    for (int i = 0; i < name_entries; i++) {
+      if (!read_dir_entry(dir, *index, &entry) ||
+          entry.entry_type != DENTRY_TYPE_FILE_NAME) {
+        break;
+      }
+      (*index)++;
+      int chars = name_length - copied < NAME_CHARS_PER_ENTRY
+                      ? name_length - copied
+                      : NAME_CHARS_PER_ENTRY;
+      memcpy(name + copied, entry.file_name.file_name,
+             chars * sizeof(uint16_t));
+      copied += chars;
+    }
+
+    if (copied != name_length || name_length == 0) {
+      continue; // a broken set, carry on from the entry that broke it
+    }
+
+    // skip whatever secondary entries remain (vendor extensions)
+    *index += set->file.secondary_count - 1 - name_entries;
+    set->location = entry_location(dir, file_index);
+    return true;
+  }
+
+  return false;
+}
+
+// Return: the EntrySetChecksum of the <count> entries at <entries>.
+static uint16_t entry_set_checksum(const directory_entry *entries,
+                                   uint32_t count) {
+  const uint8_t *bytes = (const uint8_t *)entries;
+  uint16_t checksum = 0;
+
+  for (uint32_t i = 0; i < count * DENTRY_SIZE; i++) {
+    if (i == 2 || i == 3) {
+      continue; // the checksum field itself
+    }
+    checksum =
+        (uint16_t)(((checksum & 1) ? 0x8000 : 0) + (checksum >> 1) + bytes[i]);
+  }
+  return checksum;
+}
+
+/**
+ * Read the entry set whose file entry is at volume offset <location>, for
+ * exfat_open_by_inode. A set that runs past the end of its cluster goes on
+ * in the directory's next cluster, which is not known here: the clusters the
+ * FAT links it to are tried first, then the ones that follow on the volume
+ * (NoFatChain directories). Only a set whose checksum matches is taken.
+ *
+ * Return: false if no valid entry set starts at <location>.
+ */
+static bool read_entry_set_at(uint64_t location, entry_set *set) {
+  directory_entry entries[MAX_SET_ENTRIES];
+
+  if (location < cluster_heap_start || location % DENTRY_SIZE != 0 ||
+      (location - cluster_heap_start) / cluster_size >= mbr.cluster_count) {
+    return false;
+  }
+  uint32_t cluster = (uint32_t)((location - cluster_heap_start) /
+                                cluster_size) + FIRST_DATA_CLUSTER;
+  if (block_read(entries, DENTRY_SIZE, location) != DENTRY_SIZE ||
+      entries[0].entry_type != DENTRY_TYPE_FILE ||
+      entries[0].file.secondary_count < 2) {
+    return false;
+  }
+
+  uint64_t bytes = (uint64_t)(1 + entries[0].file.secondary_count) *
+                   DENTRY_SIZE;
+  uint64_t first_piece = cluster_offset(cluster) + cluster_size - location;
+  for (int follow_fat = 1; follow_fat >= 0; follow_fat--) {
+    uint32_t current = cluster;
+    uint64_t offset = location, done = 0;
+    bool ok = true;
+    while (ok && done < bytes) {
+      uint64_t piece = done == 0 ? first_piece : cluster_size;
+      if (piece > bytes - done) {
+        piece = bytes - done;
+      }
+      ok = block_read((uint8_t *)entries + done, piece, offset) ==
+           (ssize_t)piece;
+      done += piece;
+      if (ok && done < bytes) {
+        current = follow_fat ? fat_next_cluster(current) : current + 1;
+        ok = is_valid_cluster(current);
+        offset = ok ? cluster_offset(current) : 0;
+      }
+    }
+
+    uint32_t count = (uint32_t)(bytes / DENTRY_SIZE);
+    if (ok && entries[1].entry_type == DENTRY_TYPE_STREAM_EXTENSION &&
+        entry_set_checksum(entries, count) == entries[0].file.set_checksum) {
+      set->file = entries[0].file;
+      set->stream_extension = entries[1].stream_extension;
+      set->filenames = NULL;
+      set->location = location;
+      return true;
+    }
+    if (bytes <= first_piece) {
+      break; // the set is in one cluster, there is nothing else to try
+    }
+  }
+  return false;
+}
+
+//---------------
+// PATH TRAVERSAL
+//---------------
+// exFAT names compare without case, the up-case table of the images this
+// driver reads only maps ASCII
+static uint16_t upcase(uint16_t character) {
+  if (character >= 'a' && character <= 'z') {
+    return character - 'a' + 'A';
+  }
+  return character;
+}
+
+// NameHash of a stream extension entry, computed over the up-cased name
+static uint16_t name_hash(const uint16_t *name, uint8_t length) {
+  uint16_t hash = 0;
+
+  for (uint8_t i = 0; i < length; i++) {
+    uint16_t character = upcase(name[i]);
+    hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (character & 0xFF);
+    hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (character >> 8);
+  }
+  return hash;
+}
+
+/**
+ * Search the directory <dir> for the entry whose up-cased name is <wanted>
+ * (<length> characters, NameHash <hash>). Other than a directory is only
+ * looked at if <directory_only> is false.
+ *
+ * Return: true if found, with its entries stored in <set>.
+ */
+static bool find_in_directory(open_file *dir, const uint16_t *wanted,
+                              uint8_t length, uint16_t hash,
+                              bool directory_only, entry_set *set) {
+  uint16_t found[MAX_NAME_LENGTH];
+  uint64_t index = 0;
+  uint32_t slot;
+
+  // the hash rules out almost every entry before its set is even read, using
+  // the window's scan. Without a stream extension in the window, read it
+  while (skip_to_file_entry(dir, &index, &slot)) {
+    const dir_scan *scan = &dir->scan;
+    if (slot != UINT32_MAX && scan->name_length[slot] != 0 &&
+        (scan->name_length[slot] != length || scan->name_hash[slot] != hash ||
+         (directory_only && !(scan->attributes[slot] & ATTR_DIRECTORY)))) {
+      index++;
+      continue;
+    }
+    if (!exfat_getdent_set(dir, &index, set, found, NULL)) {
+      return false;
+    }
+    if (set->stream_extension.name_length != length ||
+        set->stream_extension.name_hash != hash) {
+      continue;
+    }
+    uint8_t i = 0;
+    while (i < length && upcase(found[i]) == wanted[i]) {
+      i++;
+    }
+    if (i == length) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// slot of the entry set cache for the name <hash> in the directory starting
+// at <parent_cluster>
+static cached_entry_set *entry_cache_slot(uint32_t parent_cluster,
+                                          uint16_t hash) {
+  uint32_t mixed = (parent_cluster * 0x9E3779B1u) ^ hash;
+  return &entry_cache[(mixed ^ (mixed >> 16)) % ENTRY_CACHE_SLOTS];
+}
+
+// Return: less than, equal to or greater than 0 as the <a_length> characters
+//         at <a> sort before, with or after the <b_length> at <b>, without
+//         case.
+static int compare_names(const char *a, size_t a_length, const char *b,
+                         size_t b_length) {
+  size_t length = a_length < b_length ? a_length : b_length;
+
+  for (size_t i = 0; i < length; i++) {
+    uint16_t x = upcase((uint8_t)a[i]);
+    uint16_t y = upcase((uint8_t)b[i]);
+    if (x != y) {
+      return x < y ? -1 : 1;
+    }
+  }
+  return (a_length > b_length) - (a_length < b_length);
+}
+
+// qsort_r order of name index entries, <names> is the index's names
+static int compare_index_entries(const void *a, const void *b, void *names) {
+  const name_index_entry *x = a;
+  const name_index_entry *y = b;
+  return compare_names((char *)names + x->name, x->length,
+                       (char *)names + y->name, y->length);
+}
+
+static void free_name_index(name_index *index) {
+  free(index->entries);
+  free(index->names);
+  memset(index, 0, sizeof(name_index));
+}
+
+/**
+ * Read every name of the directory described by <set> into <index> and sort
+ * them. Names are kept 8 bits a character, like exfat_getdents returns them.
+ *
+ * Return: false if memory ran out.
+ */
+static bool build_name_index(const entry_set *set, name_index *index) {
+  uint16_t name[MAX_NAME_LENGTH];
+  size_t capacity = 0, names_used = 0, names_capacity = 0;
+  uint64_t position = 0;
+  entry_set found;
+  open_file dir;
+  bool ok = true;
+
+  open_file_from_set(&dir, set);
+  while (ok && exfat_getdent_set(&dir, &position, &found, name, NULL)) {
+    uint8_t length = found.stream_extension.name_length;
+
+    if (index->count == capacity) {
+      capacity = capacity == 0 ? 256 : capacity * 2;
+      void *grown = realloc(index->entries, capacity * sizeof(*index->entries));
+      ok = NULL != grown;
+      index->entries = ok ? grown : index->entries;
+    }
+    // a name is at most 256 bytes with its NUL, doubling always makes room
+    if (ok && names_used + length + 1 > names_capacity) {
+      names_capacity = names_capacity == 0 ? 4096 : names_capacity * 2;
+      void *grown = realloc(index->names, names_capacity);
+      ok = NULL != grown;
+      index->names = ok ? grown : index->names;
+    }
+    if (!ok) {
+      break;
+    }
+
+    name_index_entry *entry = &index->entries[index->count++];
+    entry->location = found.location;
+    entry->name = (uint32_t)names_used;
+    entry->length = length;
+    entry->wide = false;
+    for (uint8_t i = 0; i < length; i++) {
+      index->names[names_used++] = (char)name[i];
+      entry->wide |= name[i] > 0xFF;
+    }
+    index->names[names_used++] = '\0';
+  }
+  release_open_file(&dir);
+
+  if (!ok) {
+    free_name_index(index);
+    return false;
+  }
+  qsort_r(index->entries, index->count, sizeof(*index->entries),
+          compare_index_entries, index->names);
+
+  // searches go through the names in sorted order, store them that way too
+  char *sorted = malloc(names_used > 0 ? names_used : 1);
+  if (NULL == sorted) {
+    free_name_index(index);
+    return false;
+  }
+  for (uint32_t i = 0, offset = 0; i < index->count; i++) {
+    name_index_entry *entry = &index->entries[i];
+    memcpy(sorted + offset, index->names + entry->name, entry->length + 1u);
+    entry->name = offset;
+    offset += entry->length + 1u;
+  }
+  free(index->names);
+  index->names = sorted;
+  return true;
+}
+
+/**
+ * Find the name index of the directory described by <set>, with index_lock
+ * held. Unless <build> is false, a directory without one is indexed in the
+ * slot used the longest time ago.
+ *
+ * Return: the index, NULL if there is none or memory ran out.
+ */
+static name_index *directory_name_index(const entry_set *set, bool build) {
+  uint32_t first_cluster = set->stream_extension.first_cluster;
+  name_index *oldest = &name_indexes[0];
+
+  for (int i = 0; i < NAME_INDEX_SLOTS; i++) {
+    name_index *index = &name_indexes[i];
+    if (index->generation == mount_generation &&
+        index->first_cluster == first_cluster) {
+      index->last_used = ++index_clock;
+      return index;
+    }
+    if (index->last_used < oldest->last_used) {
+      oldest = index; // unused slots are at 0, they go first
+    }
+  }
+  if (!build) {
+    return NULL;
+  }
+
+  free_name_index(oldest);
+  if (!build_name_index(set, oldest)) {
+    return NULL;
+  }
+  oldest->generation = mount_generation;
+  oldest->first_cluster = first_cluster;
+  oldest->last_used = ++index_clock;
+  return oldest;
+}
+
+// Return: the first entry of <index> whose name does not sort before the
+//         <length> characters at <name>, index->count if there is none.
+static uint32_t index_lower_bound(const name_index *index, const char *name,
+                                  size_t length) {
+  uint32_t low = 0, high = index->count;
+
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    const name_index_entry *entry = &index->entries[middle];
+    if (compare_names(index->names + entry->name, entry->length, name,
+                      length) < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+/**
+ * Look the name <wanted> (<length> characters) up in the name index of the
+ * directory described by <dir>, if exfat_glob built one. Names with
+ * characters that do not fit in 8 bits are never found, like by
+ * find_in_directory.
+ *
+ * Return: EXFAT_OK with the file's entries stored in <set>,
+ *         EXFAT_FILE_NOT_FOUND if the directory has no such name, or
+ *         EXFAT_INVAL if it has no index.
+ */
+static exfat_error index_find(const entry_set *dir, const char *wanted,
+                              size_t length, entry_set *set) {
+  exfat_error result = EXFAT_INVAL;
+
+  pthread_mutex_lock(&index_lock);
+  const name_index *index = directory_name_index(dir, false);
+  if (NULL != index) {
+    result = EXFAT_FILE_NOT_FOUND;
+    for (uint32_t i = index_lower_bound(index, wanted, length);
+         i < index->count; i++) {
+      const name_index_entry *entry = &index->entries[i];
+      if (compare_names(index->names + entry->name, entry->length, wanted,
+                        length) != 0) {
+        break;
+      }
+      if (!entry->wide && read_entry_set_at(entry->location, set)) {
+        result = EXFAT_OK;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&index_lock);
+  return result;
+}
+
+// Return: whether the <length> characters at <name> match <pattern>, where
+//         '*' stands for any characters and '?' for any one. Like in sh, a
+//         leading '.' is only matched by a '.'
+static bool glob_match(const char *pattern, const char *name, size_t length) {
+  const char *star = NULL; // just after the last '*' seen
+  size_t star_at = 0;      // first character of name that '*' has not taken
+  size_t i = 0;
+
+  if (length > 0 && name[0] == '.' && pattern[0] != '.') {
+    return false;
+  }
+  // what follows the last '*' has to end the name, checking that first rules
+  // most names out without backtracking
+  const char *last_star = strrchr(pattern, '*');
+  if (NULL != last_star) {
+    size_t tail = strlen(last_star + 1);
+    if (tail > length) {
+      return false;
+    }
+    for (size_t k = 0; k < tail; k++) {
+      char wanted = last_star[1 + k];
+      if (wanted != '?' && wanted != name[length - tail + k]) {
+        return false;
+      }
+    }
+  }
+  while (i < length) {
+    if (*pattern == '*') {
+      star = ++pattern;
+      star_at = i;
+    } else if (*pattern != '\0' && (*pattern == '?' || *pattern == name[i])) {
+      pattern++;
+      i++;
+    } else if (NULL != star) {
+      pattern = star; // let the last '*' take one more character
+      i = ++star_at;
+    } else {
+      return false;
+    }
+  }
+  while (*pattern == '*') {
+    pattern++;
+  }
+  return *pattern == '\0';
+}
+
+/**
+ * Walk <path> down from the directory described by <start>, one component at
+ * a time. Components already looked up come out of the entry set cache, a
+ * directory is only read when one of its names is not in there and it has
+ * no name index.
+ *
+ * Parameters:
+ *  * start: the directory <path> is relative to.
+ *  * path: '/' separated components, empty components are skipped.
+ *  * result: the entry set of the file or directory <path> names.
+ * Return: EXFAT_OK, or EXFAT_FILE_NOT_FOUND if a component does not exist (or
+ *         is a file in the middle of the path).
+ */
+static exfat_error resolve_path(const entry_set *start, const char *path,
+                                entry_set *result) {
+  uint16_t wanted[MAX_NAME_LENGTH], cached_name[MAX_NAME_LENGTH];
+
+  *result = *start;
+  while (*path != '\0') {
+    size_t length = strcspn(path, "/");
+
+    if (length > 0) {
+      uint32_t parent = result->stream_extension.first_cluster;
+      if (length > MAX_NAME_LENGTH ||
+          !(result->file.file_attributes & ATTR_DIRECTORY) ||
+          !is_valid_cluster(parent)) {
+        return EXFAT_FILE_NOT_FOUND; // too long, not a directory, or empty
+      }
+      for (size_t i = 0; i < length; i++) {
+        wanted[i] = upcase((uint8_t)path[i]);
+      }
+      uint16_t hash = name_hash(wanted, (uint8_t)length);
+      // only a directory can have more components after it
+      bool directory_only = path[length + strspn(path + length, "/")] != '\0';
+
+      // table_lock keeps the threads of this process apart, the sequence
+      // lock only matters once the cache is shared with other processes
+      cached_entry_set *cached = entry_cache_slot(parent, hash);
+      entry_set found;
+      unsigned sequence = sequence_read_begin(&cached->sequence);
+      bool hit =
+          atomic_load_explicit(&cached->generation, memory_order_relaxed) ==
+              mount_generation &&
+          atomic_load_explicit(&cached->parent_cluster,
+                               memory_order_relaxed) == parent &&
+          atomic_load_explicit(&cached->name_length, memory_order_relaxed) ==
+              length;
+      if (hit) {
+        sequence_load_words(cached_name, cached->name,
+                            length * sizeof(uint16_t));
+        sequence_load_words(&found, cached->set, sizeof(found));
+        hit = 0 == memcmp(cached_name, wanted, length * sizeof(uint16_t)) &&
+              sequence_read_valid(&cached->sequence, sequence);
+      }
+      if (!hit) {
+        // a directory exfat_glob indexed is searched in its index instead
+        exfat_error indexed = index_find(result, path, length, &found);
+        hit = EXFAT_OK == indexed;
+        if (EXFAT_INVAL == indexed) {
+          open_file dir;
+          open_file_from_set(&dir, result);
+          hit = find_in_directory(&dir, wanted, (uint8_t)length, hash,
+                                  directory_only, &found);
+          release_open_file(&dir);
+        }
+        if (!hit) {
+          return EXFAT_FILE_NOT_FOUND;
+        }
+
+        if (sequence_write_begin(&cached->sequence)) {
+          atomic_store_explicit(&cached->generation, mount_generation,
+                                memory_order_relaxed);
+          atomic_store_explicit(&cached->parent_cluster, parent,
+                                memory_order_relaxed);
+          atomic_store_explicit(&cached->name_length, (unsigned)length,
+                                memory_order_relaxed);
+          sequence_store_words(cached->name, wanted,
+                               length * sizeof(uint16_t));
+          sequence_store_words(cached->set, &found, sizeof(found));
+          sequence_write_end(&cached->sequence);
+        }
+      }
+      *result = found;
+    }
+
+    path += length;
+    if (*path == '/') {
+      path++;
+    }
+  }
+
+  return EXFAT_OK;
+}
+
+// opens the file described by <set> in the open file table, returns its
+// descriptor
+static int install_open_file(const entry_set *set) {
+  int fd = allocate_open_file();
+  if (fd < 0) {
+    return EXFAT_INVAL;
+  }
+  open_file_from_set(&open_file_table[fd], set);
+  return fd;
+}
+
+//-----------
+// TIMESTAMPS
+//-----------
+// days between 1970-01-01 and the given date of the proleptic Gregorian
+// calendar
+static int64_t days_from_civil(int64_t year, unsigned month, unsigned day) {
+  year -= month <= 2;
+  int64_t era = (year >= 0 ? year : year - 399) / 400;
+  unsigned year_of_era = (unsigned)(year - era * 400);
+  unsigned day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 +
+                         day - 1;
+  unsigned day_of_era =
+      year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+  return era * 146097 + (int64_t)day_of_era - 719468;
+}
+
+/**
+ * Convert an exFAT timestamp to UTC seconds (and nanoseconds) since the
+ * epoch.
+ *
+ * Timestamps are stored as local time: DoubleSeconds (bits 0-4), Minute
+ * (5-10), Hour (11-15), Day (16-20), Month (21-24) and years since 1980
+ * (25-31). <increment_10ms> adds up to 1.99 seconds, and <utc_offset> holds
+ * the offset from UTC in 15 minute steps when its top bit is set. Without a
+ * valid offset the local time is taken as UTC.
+ */
+static struct timespec decode_timestamp(uint32_t timestamp,
+                                        uint8_t increment_10ms,
+                                        uint8_t utc_offset) {
+  struct timespec decoded = {0};
+  unsigned day = (timestamp >> 16) & 0x1F;
+  unsigned month = (timestamp >> 21) & 0x0F;
+
+  if (timestamp == 0 || day == 0 || month == 0 || month > 12) {
+    return decoded; // never set
+  }
+
+  int64_t seconds = days_from_civil(1980 + (timestamp >> 25), month, day) *
+                        86400 +
+                    ((timestamp >> 11) & 0x1F) * 3600 +
+                    ((timestamp >> 5) & 0x3F) * 60 + (timestamp & 0x1F) * 2;
+  if (increment_10ms < 200) {
+    seconds += increment_10ms / 100;
+    decoded.tv_nsec = (long)(increment_10ms % 100) * 10000000L;
+  }
+  if (utc_offset & 0x80) {
+    // sign extend the 7 bit offset
+    int offset_steps = (utc_offset & 0x40) ? (int)(utc_offset | ~0x7F)
+                                           : (int)(utc_offset & 0x7F);
+    seconds -= (int64_t)offset_steps * 15 * 60;
+  }
+
+  decoded.tv_sec = (time_t)seconds;
+  return decoded;
+}
+
+// fills in <stat> for the file described by <set>
+// Return: the inode number of the file described by <set>: where its file
+//         entry is on the volume, counted in entries. Stays the same across
+//         mounts, see exfat_open_by_inode
+static uint64_t inode_number(const entry_set *set) {
+  return set->location == 0 ? ROOT_INODE : set->location / DENTRY_SIZE;
+}
+
+static void fill_file_stat(const entry_set *set, exfat_file_stat *stat) {
+  const file_dentry *file = &set->file;
+  const stream_extension *stream = &set->stream_extension;
+
+  memset(stat, 0, sizeof(exfat_file_stat));
+  stat->inode_number = inode_number(set);
+  stat->type = (file->file_attributes & ATTR_DIRECTORY) ? DT_DIR : DT_REG;
+  stat->attributes = file->file_attributes;
+  stat->data_length = stream->data_length;
+  stat->valid_data_length = stream->valid_data_length;
+  stat->cluster_size = cluster_size;
+  stat->no_fat_chain = stream->flags.no_fat_chain;
+
+  // the allocation always covers the data length, no FAT walk needed
+  if (is_valid_cluster(stream->first_cluster)) {
+    stat->cluster_count =
+        (uint32_t)((stream->data_length + cluster_size - 1) / cluster_size);
+  }
+
+  stat->create_time =
+      decode_timestamp(file->create_timestamp, file->create_10ms_increment,
+                       file->create_utc_offset);
+  stat->modify_time = decode_timestamp(file->last_modified_timestamp,
+                                       file->last_modified_10ms_increment,
+                                       file->last_modified_utc_offset);
+  stat->access_time = decode_timestamp(file->last_accessed_timestamp, 0,
+                                       file->last_accessed_utc_offset);
+}
+
+//-------------
+// FILE READING
+//-------------
+/**
+ * Add the reads of up to <count> bytes of <file> starting at byte <position>
+ * to <request>, one per run of contiguous clusters, after the bytes it
+ * already covers. What lies past the valid data length is zeroed right away.
+ *
+ * Return: false if the file's cluster chain could not be built.
+ */
+static bool read_file_request(open_file *file, void *buffer, size_t count,
+                              uint64_t position, read_request *request) {
+  if (!load_cluster_chain(file)) {
+    return false;
+  }
+
+  uint64_t data_length = file->set.stream_extension.data_length;
+  uint64_t valid_length = file->set.stream_extension.valid_data_length;
+  uint8_t *destination = buffer;
+  uint64_t request_offset = request->length;
+  size_t total = 0;
+
+  while (total < count && position < data_length) {
+    uint64_t chain_index = position / cluster_size;
+    uint64_t in_cluster = position % cluster_size;
+    if (chain_index >= file->chain_length) {
+      break; // the chain is shorter than the data length says
+    }
+
+    // read as many physically contiguous clusters as the request spans in
+    // one segment
+    uint64_t wanted = count - total;
+    if (wanted > data_length - position) {
+      wanted = data_length - position;
+    }
+    uint64_t run = cluster_size - in_cluster;
+    uint32_t first = file->cluster_chain[chain_index];
+    for (uint64_t next = chain_index + 1;
+         run < wanted && next < file->chain_length &&
+         file->cluster_chain[next] == first + (next - chain_index);
+         next++) {
+      run += cluster_size;
+    }
+    if (run > wanted) {
+      run = wanted;
+    }
+
+    // past the valid data length the contents are undefined, hand out zeros
+    uint64_t from_disk = 0;
+    if (position < valid_length) {
+      from_disk = valid_length - position < run ? valid_length - position : run;
+      read_request_add(request, destination + total,
+                       cluster_offset(first) + in_cluster, from_disk,
+                       request_offset + total);
+    }
+    memset(destination + total + from_disk, 0, run - from_disk);
+
+    total += run;
+    position += run;
+    if (run == 0) {
+      break;
+    }
+  }
+
+  request->length = request_offset + total;
+  return true;
+}
+
+/**
+ * Read up to <count> bytes of <file> starting at byte <position>.
+ *
+ * Return: the number of bytes read, 0 at the end of the file, or -1 on error.
+ */
+static ssize_t read_file_at(open_file *file, void *buffer, size_t count,
+                            uint64_t position) {
+  read_request request;
+  read_request_init(&request, false);
+  if (!read_file_request(file, buffer, count, position, &request)) {
+    return -1;
+  }
+  return read_request_wait(&request);
+}
+
+/**
+ * Read <file> from byte <position> into the <count> buffers of <vector>, in
+ * order, as one request: the runs of clusters behind all of them are in
+ * flight together.
+ *
+ * Return: the number of bytes read, 0 at the end of the file, or -1 on error.
+ */
+static ssize_t read_file_vector(open_file *file, const struct iovec *vector,
+                                int count, uint64_t position) {
+  read_request request;
+  read_request_init(&request, false);
+  if (!load_cluster_chain(file)) {
+    return -1; // nothing is queued yet, the chain is all that can fail
+  }
+  for (int i = 0; i < count; i++) {
+    uint64_t before = request.length;
+    read_file_request(file, vector[i].iov_base, vector[i].iov_len, position,
+                      &request);
+    position += request.length - before;
+    if (request.length - before < vector[i].iov_len) {
+      break; // the end of the file
+    }
+  }
+  return read_request_wait(&request);
+}
+
+/**
+ * Pass <advice> for <length> bytes of <file> from byte <position> on to the
+ * block device, one call per run of contiguous clusters. Only the data up to
+ * the end of the file counts.
+ */
+static void advise_file_range(open_file *file, uint64_t position,
+                              uint64_t length, exfat_advice advice) {
+  uint64_t data_length = file->set.stream_extension.data_length;
+
+  if (!load_cluster_chain(file) || position >= data_length) {
+    return;
+  }
+  if (length == 0 || length > data_length - position) {
+    length = data_length - position; // 0 means to the end, like fadvise
+  }
+  uint64_t end = position + length;
+  for (uint64_t i = position / cluster_size;
+       position < end && i < file->chain_length;) {
+    uint32_t run = contiguous_run(file->cluster_chain, file->chain_length,
+                                  (uint32_t)i);
+    uint64_t run_end = (i + run) * cluster_size;
+    if (run_end > end) {
+      run_end = end;
+    }
+    device->advise(cluster_offset(file->cluster_chain[i]) +
+                       position % cluster_size,
+                   run_end - position, advice);
+    position = run_end;
+    i += run;
+  }
+}
+
+/**
+ * Keep the READAHEAD_BYTES of <file> after byte <position> on their way in
+ * when it was advised to be read sequentially. The device is only asked
+ * again once less than half of that is left.
+ */
+static void read_ahead(open_file *file, uint64_t position) {
+  if (file->advice != EXFAT_FADV_SEQUENTIAL ||
+      file->readahead_until >= position + READAHEAD_BYTES / 2) {
+    return;
+  }
+  uint64_t from =
+      file->readahead_until > position ? file->readahead_until : position;
+  uint64_t until = position + READAHEAD_BYTES;
+  advise_file_range(file, from, until - from, EXFAT_FADV_WILLNEED);
+  file->readahead_until = until;
+}
+
+/**
+ * Refill the buffer of <stream> with the bytes of <file> that follow it.
+ * Where the mmap device maps the volume, the stream points straight at the
+ * run of clusters in the mapping, otherwise the buffer is read up to the
+ * next cluster boundary, so refills after the first stay cluster aligned.
+ *
+ * Return: the number of bytes now buffered, 0 at the end of the file, or -1
+ *         on error.
+ */
+static ssize_t fill_stream(exfat_FILE *stream, open_file *file) {
+  uint64_t position = stream->position;
+  uint64_t valid_length = file->set.stream_extension.valid_data_length;
+  uint64_t chain_index = position / cluster_size;
+
+  if (!load_cluster_chain(file)) {
+    return -1;
+  }
+  read_ahead(file, position);
+  if (NULL != volume_map && position < valid_length &&
+      chain_index < file->chain_length) {
+    uint32_t run = contiguous_run(file->cluster_chain, file->chain_length,
+                                  (uint32_t)chain_index);
+    uint64_t volume_offset = cluster_offset(file->cluster_chain[chain_index]) +
+                             position % cluster_size;
+    uint64_t length = (chain_index + run) * cluster_size - position;
+    if (length > valid_length - position) {
+      length = valid_length - position;
+    }
+    if (volume_offset + length <= volume_size) {
+      stream->next = volume_map + volume_offset;
+      stream->end = stream->next + length;
+      stream->position += length;
+      return (ssize_t)length;
+    }
+  }
+
+  ssize_t bytes_read =
+      read_file_at(file, stream->buffer,
+                   stream->capacity - position % cluster_size, position);
+  if (bytes_read > 0) {
+    stream->next = stream->buffer;
+    stream->end = stream->buffer + bytes_read;
+    stream->position += (uint64_t)bytes_read;
+  }
+  return bytes_read;
+}
+
+//--------------
+// PARALLEL WALK
+//--------------
+// DIRECTORY BEING WALKED
+// shared by every task scanning a piece of it, the last one to finish frees it
+typedef struct WALK_DIRECTORY {
+  entry_set set;            // the directory's own entries
+  char *path;               // path the directory was reached by
+  int depth;                // 0 for the directory the walk started at
+  uint32_t *cluster_chain;  // read once, by whoever found the directory
+  uint32_t chain_length;
+  atomic_int references;    // tasks still holding the directory
+} walk_directory;
+
+// WALK TASK
+// scans clusters [first, first + count) of a directory's chain
+typedef struct WALK_TASK {
+  walk_directory *dir;
+  uint32_t first;
+  uint32_t count;
+} walk_task;
+
+// WALK QUEUE
+// one per worker. The owner pushes and pops at the tail, so it goes depth
+// first through directories it just found, idle workers steal from the head,
+// where the oldest (and usually biggest) parts of the tree wait
+typedef struct WALK_QUEUE {
+  pthread_mutex_t lock;
+  walk_task *tasks;
+  size_t head; // next task to steal
+  size_t tail; // one past the next task to pop
+  size_t capacity;
+} walk_queue;
+
+// called for every file a walk finds, from any of its threads. exfat_walk
+// hands the status on to its callback, exfat_export uses the set itself.
+// <name> is the set's name as stored (set->stream_extension.name_length
+// characters), NULL for the starting point, whose name is the caller's
+typedef exfat_walk_action (*walk_visit_fn)(const char *path,
+                                           const entry_set *set,
+                                           const uint16_t *name, int depth,
+                                           void *arg);
+
+typedef struct WALK_STATE {
+  walk_queue *queues; // one per worker
+  int workers;
+  atomic_long pending; // tasks queued or being scanned, 0 once the walk is done
+  atomic_bool stop;    // set once the callback asked to stop
+  walk_visit_fn visit;
+  void *arg;
+  bool utf8; // names go into paths as UTF-8, not narrowed to a byte each
+} walk_state;
+
+typedef struct WALK_WORKER {
+  walk_state *state;
+  int id; // index of the worker's own queue
+} walk_worker;
+
+static bool walk_queue_push(walk_queue *queue, const walk_task *task) {
+  bool pushed = true;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->tail == queue->capacity) {
+    if (queue->head > 0) { // slide the tasks down over the stolen ones
+      memmove(queue->tasks, queue->tasks + queue->head,
+              (queue->tail - queue->head) * sizeof(walk_task));
+      queue->tail -= queue->head;
+      queue->head = 0;
+    } else {
+      size_t capacity = queue->capacity ? queue->capacity * 2 : 64;
+      walk_task *bigger = realloc(queue->tasks, capacity * sizeof(walk_task));
+      if (NULL != bigger) {
+        queue->tasks = bigger;
+        queue->capacity = capacity;
+      } else {
+        pushed = false;
+      }
+    }
+  }
+  if (pushed) {
+    queue->tasks[queue->tail++] = *task;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return pushed;
+}
+
+// takes the newest task of the queue, for its owner
+static bool walk_queue_pop(walk_queue *queue, walk_task *task) {
+  bool popped = false;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail) {
+    *task = queue->tasks[--queue->tail];
+    popped = true;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return popped;
+}
+
+// takes the oldest task of the queue, for any other worker
+static bool walk_queue_steal(walk_queue *queue, walk_task *task) {
+  bool stolen = false;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail) {
+    *task = queue->tasks[queue->head++];
+    stolen = true;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return stolen;
+}
+
+static void walk_release_directory(walk_directory *dir) {
+  if (atomic_fetch_sub(&dir->references, 1) == 1) {
+    free(dir->cluster_chain);
+    free(dir->path);
+    free(dir);
+  }
+}
+
+/**
+ * Encode the <length> UTF-16 characters at <name> as UTF-8 into <out>, which
+ * has room for 3 bytes a character. A surrogate without its other half
+ * becomes U+FFFD.
+ *
+ * Return: the number of bytes written, no NUL is added.
+ */
+static size_t utf16_to_utf8(const uint16_t *name, uint8_t length, char *out) {
+  size_t used = 0;
+
+  for (uint8_t i = 0; i < length; i++) {
+    uint32_t code = name[i];
+    if (code >= 0xD800 && code <= 0xDBFF && i + 1 < length &&
+        name[i + 1] >= 0xDC00 && name[i + 1] <= 0xDFFF) {
+      code = 0x10000 + ((code - 0xD800) << 10) + (name[++i] - 0xDC00);
+    } else if (code >= 0xD800 && code <= 0xDFFF) {
+      code = 0xFFFD;
+    }
+
+    if (code < 0x80) {
+      out[used++] = (char)code;
+    } else if (code < 0x800) {
+      out[used++] = (char)(0xC0 | code >> 6);
+      out[used++] = (char)(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+      out[used++] = (char)(0xE0 | code >> 12);
+      out[used++] = (char)(0x80 | ((code >> 6) & 0x3F));
+      out[used++] = (char)(0x80 | (code & 0x3F));
+    } else {
+      out[used++] = (char)(0xF0 | code >> 18);
+      out[used++] = (char)(0x80 | ((code >> 12) & 0x3F));
+      out[used++] = (char)(0x80 | ((code >> 6) & 0x3F));
+      out[used++] = (char)(0x80 | (code & 0x3F));
+    }
+  }
+  return used;
+}
+
+// <parent>/<name>, heap allocated. The name is narrowed to a byte a character
+// like exfat_getdents does, or encoded as UTF-8 if <utf8>
+static char *walk_join_path(const char *parent, const uint16_t *name,
+                            uint8_t length, bool utf8) {
+  size_t parent_length = strlen(parent);
+  bool separator = parent_length == 0 || parent[parent_length - 1] != '/';
+  char *path = malloc(parent_length + separator + (utf8 ? 3 : 1) * length + 1);
+
+  if (NULL != path) {
+    memcpy(path, parent, parent_length);
+    if (separator) {
+      path[parent_length++] = '/';
+    }
+    if (utf8) {
+      parent_length += utf16_to_utf8(name, length, path + parent_length);
+    } else {
+      for (uint8_t i = 0; i < length; i++) {
+        path[parent_length++] = (char)name[i];
+      }
+    }
+    path[parent_length] = '\0';
+  }
+  return path;
+}
+
+// hands one file to the callback
+static exfat_walk_action walk_report(walk_state *state, const char *path,
+                                     const entry_set *set,
+                                     const uint16_t *name, int depth) {
+  if (atomic_load(&state->stop)) {
+    return EXFAT_WALK_STOP;
+  }
+  exfat_walk_action action =
+      state->visit(path, set, name, depth, state->arg);
+  if (EXFAT_WALK_STOP == action) {
+    atomic_store(&state->stop, true);
+  }
+  return action;
+}
+
+/**
+ * Queue the contents of the directory <set> (found at <path>, which is taken
+ * over) on <queue>, cut into pieces of WALK_PIECE_CLUSTERS clusters so a
+ * single huge directory is still scanned by every worker.
+ */
+static void walk_schedule_directory(walk_state *state, walk_queue *queue,
+                                    const entry_set *set, char *path,
+                                    int depth) {
+  const stream_extension *stream = &set->stream_extension;
+  walk_directory *dir = calloc(1, sizeof(walk_directory));
+
+  if (NULL == dir) {
+    free(path);
+    return;
+  }
+  dir->set = *set;
+  dir->path = path;
+  dir->depth = depth;
+  dir->cluster_chain =
+      build_cluster_chain(stream->first_cluster, stream->data_length,
+                          stream->flags.no_fat_chain, &dir->chain_length);
+
+  // clusters past the data length are not part of the directory
+  uint64_t used = (stream->data_length + cluster_size - 1) / cluster_size;
+  uint32_t clusters = used < dir->chain_length ? (uint32_t)used
+                                               : dir->chain_length;
+  uint32_t pieces = (clusters + WALK_PIECE_CLUSTERS - 1) / WALK_PIECE_CLUSTERS;
+
+  // every piece holds a reference, the last one frees the directory
+  atomic_init(&dir->references, (int)pieces + 1);
+  atomic_fetch_add(&state->pending, (long)pieces);
+  for (uint32_t i = 0; i < pieces; i++) {
+    walk_task task = {dir, i * WALK_PIECE_CLUSTERS, WALK_PIECE_CLUSTERS};
+    if (task.first + task.count > clusters) {
+      task.count = clusters - task.first;
+    }
+    if (!walk_queue_push(queue, &task)) {
+      walk_release_directory(dir);
+      atomic_fetch_sub(&state->pending, 1);
+    }
+  }
+  walk_release_directory(dir);
+}
+
+/**
+ * Report every entry set that starts in the task's clusters. A set may run
+ * into the next piece, whoever scans that piece skips the set's secondary
+ * entries until the first file entry.
+ */
+static void walk_scan(walk_state *state, walk_queue *queue,
+                      const walk_task *task) {
+  walk_directory *dir = task->dir;
+  uint64_t entries_per_cluster = cluster_size / DENTRY_SIZE;
+  uint64_t index = task->first * entries_per_cluster;
+  uint64_t end = (uint64_t)(task->first + task->count) * entries_per_cluster;
+  uint64_t set_index = 0;
+  uint16_t name[MAX_NAME_LENGTH];
+  entry_set set;
+  open_file reader;
+
+  // a private reader over the shared chain, only its cluster buffer is its own
+  open_file_from_set(&reader, &dir->set);
+  reader.cluster_chain = dir->cluster_chain;
+  reader.chain_length = dir->chain_length;
+  reader.chain_loaded = true;
+
+  while (!atomic_load(&state->stop) && index < end &&
+         exfat_getdent_set(&reader, &index, &set, name, &set_index) &&
+         set_index < end) {
+    char *path = walk_join_path(dir->path, name,
+                                set.stream_extension.name_length, state->utf8);
+    if (NULL == path) {
+      break;
+    }
+    exfat_walk_action action =
+        walk_report(state, path, &set, name, dir->depth + 1);
+    if (EXFAT_WALK_CONTINUE == action &&
+        (set.file.file_attributes & ATTR_DIRECTORY)) {
+      walk_schedule_directory(state, queue, &set, path, dir->depth + 1);
+    } else {
+      free(path);
+    }
+  }
+
+  reader.cluster_chain = NULL;
+  release_open_file(&reader);
+  walk_release_directory(dir);
+}
+
+static void *walk_worker_main(void *arg) {
+  walk_worker *worker = arg;
+  walk_state *state = worker->state;
+  walk_queue *own = &state->queues[worker->id];
+  walk_task task;
+
+  while (atomic_load(&state->pending) > 0) {
+    bool found = walk_queue_pop(own, &task);
+    for (int i = 1; !found && i < state->workers; i++) {
+      int victim = (worker->id + i) % state->workers;
+      found = walk_queue_steal(&state->queues[victim], &task);
+    }
+    if (!found) {
+      sched_yield(); // everything left is being scanned, more may turn up
+      continue;
+    }
+    walk_scan(state, own, &task);
+    atomic_fetch_sub(&state->pending, 1);
+  }
+  return NULL;
+}
+
+/**
+ * Walk the tree below <pathname> on <threads> threads (0: one per CPU),
+ * calling <visit> for every file, see exfat_walk. The paths below <pathname>
+ * are built from UTF-8 names if <utf8>, otherwise from names narrowed to a
+ * byte a character, like exfat_getdents returns them.
+ */
+static exfat_error walk_tree(const char *pathname, walk_visit_fn visit,
+                             void *arg, int threads, bool utf8) {
+  pthread_t thread_ids[WALK_MAX_THREADS];
+  walk_worker workers[WALK_MAX_THREADS];
+  entry_set start;
+
+  if (NULL == pathname || volume_fd < 0) {
+    return EXFAT_INVAL;
+  }
+  pthread_mutex_lock(&table_lock);
+  exfat_error err = resolve_path(&root_set, pathname, &start);
+  pthread_mutex_unlock(&table_lock);
+  if (EXFAT_OK != err) {
+    return err;
+  }
+
+  if (threads <= 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = online > 0 ? (int)online : 1;
+  }
+  if (threads > WALK_MAX_THREADS) {
+    threads = WALK_MAX_THREADS;
+  }
+
+  walk_state state = {
+      .workers = threads, .visit = visit, .arg = arg, .utf8 = utf8};
+  atomic_init(&state.pending, 0);
+  atomic_init(&state.stop, false);
+  state.queues = calloc(threads, sizeof(walk_queue));
+  char *path = strdup(pathname);
+  if (NULL == state.queues || NULL == path) {
+    free(state.queues);
+    free(path);
+    return EXFAT_INVAL;
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_mutex_init(&state.queues[i].lock, NULL);
+  }
+
+  // the starting point is reported too, then its contents are queued for the
+  // calling thread, which is worker 0
+  bool scheduled =
+      EXFAT_WALK_CONTINUE == walk_report(&state, path, &start, NULL, 0) &&
+      (start.file.file_attributes & ATTR_DIRECTORY);
+  if (scheduled) {
+    walk_schedule_directory(&state, &state.queues[0], &start, path, 0);
+  } else {
+    free(path);
+  }
+
+  // fewer threads than asked for only means less stealing, a walk of a single
+  // file needs none
+  int started = 1;
+  for (int i = 0; i < threads; i++) {
+    workers[i] = (walk_worker){&state, i};
+  }
+  while (scheduled && started < threads &&
+         0 == pthread_create(&thread_ids[started], NULL, walk_worker_main,
+                             &workers[started])) {
+    started++;
+  }
+  walk_worker_main(&workers[0]);
+  for (int i = 1; i < started; i++) {
+    pthread_join(thread_ids[i], NULL);
+  }
+
+  for (int i = 0; i < threads; i++) {
+    pthread_mutex_destroy(&state.queues[i].lock);
+    free(state.queues[i].tasks);
+  }
+  free(state.queues);
+  return EXFAT_OK;
+}
+
+// WALK CALLBACK
+// what exfat_walk was called with
+typedef struct WALK_CALLBACK {
+  exfat_walk_fn fn;
+  void *arg;
+} walk_callback;
+
+static exfat_walk_action walk_visit_public(const char *path,
+                                           const entry_set *set,
+                                           const uint16_t *name, int depth,
+                                           void *arg) {
+  walk_callback *callback = arg;
+  exfat_file_stat stat;
+  (void)name;
+
+  fill_file_stat(set, &stat);
+  return callback->fn(path, &stat, depth, callback->arg);
+}
+
+//-------
+// EXPORT
+//-------
+// DIRECTORY WAITING FOR ITS TIMESTAMPS
+// set once the walk is over, writing its contents changed them
+typedef struct EXPORT_DIRECTORY {
+  char *host_path;
+  struct timespec times[2]; // last accessed, last modified
+} export_directory;
+
+typedef struct EXPORT_STATE {
+  const char *host_dir;
+  size_t prefix_length; // characters of the walk's paths host_dir stands for
+  pthread_mutex_t lock; // guards directories and summary
+  export_directory *directories;
+  size_t num_directories;
+  size_t capacity;
+  exfat_export_summary summary;
+  atomic_bool copy_in_memory; // the host refused copy_file_range once
+} export_state;
+
+/**
+ * The host path a path of the walk is written to, heap allocated. exFAT
+ * allows 255 characters a name, a host NAME_MAX bytes: a longer UTF-8 name
+ * is cut at the last whole character that fits, the same way for the
+ * directory and everything below it. <*shortened> tells whether the last
+ * name was.
+ */
+static char *export_host_path(const export_state *state, const char *path,
+                              bool *shortened) {
+  const char *relative = path + state->prefix_length;
+  size_t host_length = strlen(state->host_dir);
+  char *host_path = malloc(host_length + 1 + strlen(relative) + 1);
+
+  *shortened = false;
+  if (NULL == host_path) {
+    return NULL;
+  }
+  memcpy(host_path, state->host_dir, host_length);
+  while (*relative != '\0') {
+    relative += strspn(relative, "/");
+    size_t length = strcspn(relative, "/");
+    size_t kept = length;
+    if (length == 0) {
+      break;
+    }
+    if (kept > NAME_MAX) { // back off to the start of a character
+      kept = NAME_MAX;
+      while (kept > 0 && (relative[kept] & 0xC0) == 0x80) {
+        kept--;
+      }
+    }
+    *shortened = kept < length;
+    host_path[host_length++] = '/';
+    memcpy(host_path + host_length, relative, kept);
+    host_length += kept;
+    relative += length;
+  }
+  host_path[host_length] = '\0';
+  return host_path;
+}
+
+/**
+ * Names come from the image and end up under host_dir, so one that would
+ * leave it is refused: "." and "..", and one holding a '/' or a NUL.
+ * <name> is the set's name as stored, NULL for the starting point, which is
+ * host_dir itself or a file named by the caller.
+ *
+ * Return: true if the name is safe to create on the host.
+ */
+static bool export_name_is_safe(const entry_set *set, const uint16_t *name) {
+  uint8_t length = set->stream_extension.name_length;
+  bool dots = length <= 2;
+
+  if (NULL == name) {
+    return true;
+  }
+  for (uint8_t i = 0; i < length; i++) {
+    if (name[i] == '/' || name[i] == '\0') {
+      return false;
+    }
+    dots = dots && name[i] == '.';
+  }
+  return length > 0 && !dots;
+}
+
+// true if <host_path> is a directory of its own, not a link to one; only
+// host_dir, which the caller chose, may be reached through a link
+static bool export_is_directory(const export_state *state,
+                                const char *host_path) {
+  struct stat info;
+  int result = 0 == strcmp(host_path, state->host_dir)
+                   ? stat(host_path, &info)
+                   : lstat(host_path, &info);
+  return 0 == result && S_ISDIR(info.st_mode);
+}
+
+// access and modification times for utimensat, unset ones are left alone
+static void export_times(const entry_set *set, struct timespec times[2]) {
+  const file_dentry *file = &set->file;
+
+  times[0] = decode_timestamp(file->last_accessed_timestamp, 0,
+                              file->last_accessed_utc_offset);
+  times[1] = decode_timestamp(file->last_modified_timestamp,
+                              file->last_modified_10ms_increment,
+                              file->last_modified_utc_offset);
+  for (int i = 0; i < 2; i++) {
+    if (times[i].tv_sec == 0 && times[i].tv_nsec == 0) {
+      times[i].tv_nsec = UTIME_OMIT;
+    }
+  }
+}
+
+/**
+ * Copy <length> bytes at <volume_offset> of the volume to <file_offset> of
+ * <out>. The bytes are one extent, contiguous on the volume.
+ *
+ * copy_file_range lets the kernel move them without passing through this
+ * process at all. Where the host refuses (another file system, old kernel)
+ * they go through <*buffer>, an aligned EXPORT_BUFFER_SIZE bytes allocated on
+ * first use, in large reads.
+ *
+ * Return: false if the volume could not be read or <out> written.
+ */
+static bool export_extent(export_state *state, int out, uint64_t volume_offset,
+                          uint64_t file_offset, uint64_t length,
+                          uint8_t **buffer) {
+  while (length > 0 && device->fd_reads &&
+         !atomic_load(&state->copy_in_memory)) {
+    off_t in_position = (off_t)volume_offset;
+    off_t out_position = (off_t)file_offset;
+    ssize_t copied = copy_file_range(volume_fd, &in_position, out,
+                                     &out_position, length, 0);
+    if (copied > 0) {
+      volume_offset += (uint64_t)copied;
+      file_offset += (uint64_t)copied;
+      length -= (uint64_t)copied;
+    } else if (copied < 0 && (errno == EXDEV || errno == EINVAL ||
+                              errno == ENOSYS || errno == EOPNOTSUPP)) {
+      atomic_store(&state->copy_in_memory, true);
+    } else {
+      return false; // the image is truncated, or writing failed
+    }
+  }
+
+  if (length > 0 && NULL == *buffer &&
+      0 != posix_memalign((void **)buffer, EXPORT_ALIGNMENT,
+                          EXPORT_BUFFER_SIZE)) {
+    *buffer = NULL;
+    return false;
+  }
+  while (length > 0) {
+    size_t chunk = length < EXPORT_BUFFER_SIZE ? length : EXPORT_BUFFER_SIZE;
+    ssize_t bytes_read = block_read(*buffer, chunk, volume_offset);
+    if (bytes_read <= 0) {
+      return false;
+    }
+    for (ssize_t written = 0, result; written < bytes_read;
+         written += result) {
+      result = pwrite(out, *buffer + written, bytes_read - written,
+                      (off_t)(file_offset + written));
+      if (result <= 0) {
+        return false;
+      }
+    }
+    volume_offset += (uint64_t)bytes_read;
+    file_offset += (uint64_t)bytes_read;
+    length -= (uint64_t)bytes_read;
+  }
+  return true;
+}
+
+// writes the file described by <set> to <host_path>, false if that failed.
+// An <exclusive> one must not exist yet: its name was cut to fit the host and
+// may be shared with another file of the directory
+static bool export_file(export_state *state, const entry_set *set,
+                        const char *host_path, bool exclusive) {
+  const stream_extension *stream = &set->stream_extension;
+  // never write through a link already sitting at <host_path>
+  int out = open(host_path,
+                 O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW |
+                     (exclusive ? O_EXCL : 0),
+                 0644);
+  if (out < 0) {
+    return false;
+  }
+
+  uint32_t length = 0;
+  uint32_t *chain =
+      build_cluster_chain(stream->first_cluster, stream->data_length,
+                          stream->flags.no_fat_chain, &length);
+  bool ok = NULL != chain || !is_valid_cluster(stream->first_cluster);
+  uint64_t valid = stream->valid_data_length < stream->data_length
+                       ? stream->valid_data_length
+                       : stream->data_length;
+  uint64_t done = 0;
+  uint8_t *buffer = NULL;
+
+  // one copy per extent: a run of clusters that follow each other
+  for (uint32_t i = 0, run; ok && i < length && done < valid; i += run) {
+    run = contiguous_run(chain, length, i);
+    uint64_t bytes = (uint64_t)run * cluster_size;
+    if (bytes > valid - done) {
+      bytes = valid - done;
+    }
+    ok = export_extent(state, out, cluster_offset(chain[i]), done, bytes,
+                       &buffer);
+    done += bytes;
+  }
+
+  // past the valid data length the file reads as zeros, that is a hole
+  struct timespec times[2];
+  export_times(set, times);
+  ok = ok && done >= valid && 0 == ftruncate(out, (off_t)stream->data_length) &&
+       0 == futimens(out, times);
+
+  free(chain);
+  free(buffer);
+  return 0 == close(out) && ok;
+}
+
+static exfat_walk_action export_visit(const char *path, const entry_set *set,
+                                      const uint16_t *name, int depth,
+                                      void *arg) {
+  export_state *state = arg;
+  bool is_directory = (set->file.file_attributes & ATTR_DIRECTORY) != 0;
+  bool shortened = false;
+  bool ok = export_name_is_safe(set, name);
+  char *host_path = ok ? export_host_path(state, path, &shortened) : NULL;
+  ok = NULL != host_path;
+  (void)depth;
+
+  if (ok && is_directory) {
+    ok = 0 == mkdir(host_path, 0755) ||
+         (EEXIST == errno && export_is_directory(state, host_path));
+  } else if (ok) {
+    ok = export_file(state, set, host_path, shortened);
+  }
+
+  pthread_mutex_lock(&state->lock);
+  if (ok && is_directory && state->num_directories == state->capacity) {
+    size_t capacity = state->capacity ? state->capacity * 2 : 64;
+    export_directory *bigger =
+        realloc(state->directories, capacity * sizeof(export_directory));
+    ok = NULL != bigger;
+    if (ok) {
+      state->directories = bigger;
+      state->capacity = capacity;
+    }
+  }
+  if (!ok) {
+    state->summary.failed++;
+  } else if (shortened) {
+    state->summary.shortened++;
+  }
+  if (ok && is_directory) {
+    export_directory *dir = &state->directories[state->num_directories++];
+    dir->host_path = host_path;
+    export_times(set, dir->times);
+    host_path = NULL; // kept until the timestamps are set
+    state->summary.directories++;
+  } else if (ok) {
+    state->summary.files++;
+    state->summary.bytes += set->stream_extension.data_length;
+  }
+  pthread_mutex_unlock(&state->lock);
+
+  free(host_path);
+  // a directory that could not be made has nowhere to put its contents
+  return ok || !is_directory ? EXFAT_WALK_CONTINUE : EXFAT_WALK_SKIP;
+}
+
+//------------------
+// ALLOCATION BITMAP
+//------------------
+// Return: the set bits in the <length> bytes at <bytes>.
+static uint64_t count_bits_scalar(const uint8_t *bytes, size_t length) {
+  uint64_t count = 0;
+  size_t i = 0;
+
+  for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, bytes + i, sizeof(word));
+    count += (uint64_t)__builtin_popcountll(word);
+  }
+  for (; i < length; i++) {
+    count += (uint64_t)__builtin_popcount(bytes[i]);
+  }
+  return count;
+}
+
+#ifdef EXFAT_SIMD_X86
+// with the POPCNT instruction, 32 bytes a step into four sums so the counts
+// of neighbouring words overlap
+__attribute__((target("popcnt"))) static uint64_t
+count_bits_popcnt(const uint8_t *bytes, size_t length) {
+  uint64_t sums[4] = {0, 0, 0, 0};
+  size_t i = 0;
+
+  for (; i + sizeof(sums) <= length; i += sizeof(sums)) {
+    uint64_t words[4];
+    memcpy(words, bytes + i, sizeof(words));
+    for (int j = 0; j < 4; j++) {
+      sums[j] += (uint64_t)__builtin_popcountll(words[j]);
+    }
+  }
+  return sums[0] + sums[1] + sums[2] + sums[3] +
+         count_bits_scalar(bytes + i, length - i);
+}
+
+// the set bits of every byte of <bytes>: each nibble is looked up in a table
+// of 16 bit counts with one byte shuffle
+__attribute__((target("avx2"))) static inline __m256i
+byte_bit_counts(__m256i bytes, __m256i table, __m256i low_nibble) {
+  __m256i low = _mm256_and_si256(bytes, low_nibble);
+  __m256i high = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), low_nibble);
+  return _mm256_add_epi8(_mm256_shuffle_epi8(table, low),
+                         _mm256_shuffle_epi8(table, high));
+}
+
+// AVX2: byte counts of 8 vectors (at most 64 each, no overflow) are added up
+// byte by byte, then summed into four 64-bit lanes with one vpsadbw
+__attribute__((target("avx2"))) static uint64_t
+count_bits_avx2(const uint8_t *bytes, size_t length) {
+  const __m256i table =
+      _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1,
+                       2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_nibble = _mm256_set1_epi8(0x0f);
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i sums = zero;
+  size_t i = 0;
+
+  while (i + 8 * sizeof(__m256i) <= length) {
+    __m256i counts = zero;
+    for (int j = 0; j < 8; j++, i += sizeof(__m256i)) {
+      __m256i block = _mm256_loadu_si256((const __m256i *)(bytes + i));
+      counts = _mm256_add_epi8(counts,
+                               byte_bit_counts(block, table, low_nibble));
+    }
+    sums = _mm256_add_epi64(sums, _mm256_sad_epu8(counts, zero));
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, sums);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+         count_bits_popcnt(bytes + i, length - i);
+}
+#endif
+
+// picked at mount, see choose_bit_counter
+static uint64_t (*count_bits)(const uint8_t *, size_t) = count_bits_scalar;
+
+static void choose_bit_counter(void) {
+#ifdef EXFAT_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    count_bits = count_bits_avx2;
+  } else if (__builtin_cpu_supports("popcnt")) {
+    count_bits = count_bits_popcnt;
+  }
+#endif
+}
+
+// Return: true if the allocation bitmap marks <cluster> as in use.
+static bool is_allocated(uint32_t cluster) {
+  uint32_t index = cluster - FIRST_DATA_CLUSTER;
+  return (allocation_bitmap_bits[index / 8] >> (index % 8)) & 1;
+}
+
+// Return: true if every cluster of the <length> long <chain> is in use.
+static bool chain_allocated(const uint32_t *chain, uint32_t length) {
+  for (uint32_t i = 0; i < length; i++) {
+    if (!is_allocated(chain[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Map the <length> bytes of the bitmap held by the <count> clusters of
+ * <chain>, or read them into memory if the clusters are not contiguous.
+ *
+ * Return: false if the bitmap could not be mapped or read.
+ */
+static bool load_bitmap_bits(const uint32_t *chain, uint32_t count,
+                             uint64_t length) {
+  uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+
+  if (contiguous_run(chain, count, 0) == count) {
+    uint64_t offset = cluster_offset(chain[0]);
+    uint64_t start = offset / page * page;
+    void *map = mmap(NULL, length + (offset - start), PROT_READ, MAP_SHARED,
+                     volume_fd, (off_t)start);
+    if (MAP_FAILED != map) {
+      bitmap_memory = map;
+      bitmap_memory_length = length + (offset - start);
+      allocation_bitmap_bits = (const uint8_t *)map + (offset - start);
+      return true;
+    }
+  }
+
+  // through the block device, one segment per run of clusters
+  uint8_t *bits = malloc(length);
+  read_request request;
+  if (NULL == bits) {
+    return false;
+  }
+  read_request_init(&request, false);
+  for (uint32_t i = 0, run; i < count && request.length < length; i += run) {
+    run = contiguous_run(chain, count, i);
+    uint64_t bytes = (uint64_t)run * cluster_size;
+    if (bytes > length - request.length) {
+      bytes = length - request.length;
+    }
+    read_request_add(&request, bits + request.length, cluster_offset(chain[i]),
+                     bytes, request.length);
+    request.length += bytes;
+  }
+  if (read_request_wait(&request) != (ssize_t)length) {
+    free(bits);
+    return false;
+  }
+  bitmap_memory = bits;
+  bitmap_memory_length = 0;
+  allocation_bitmap_bits = bits;
+  return true;
+}
+
+/**
+ * Find the allocation bitmap in the root directory and load it. As a check
+ * that the FAT and the bitmap agree, every cluster of the root directory's
+ * and of the bitmap's own FAT chain has to be marked as in use.
+ *
+ * Return: false if there is no usable bitmap or it disagrees with the FAT.
+ */
+static bool load_allocation_bitmap(void) {
+  open_file root;
+  directory_entry entry;
+  bool found = false;
+  uint64_t length = ((uint64_t)mbr.cluster_count + 7) / 8;
+
+  open_file_from_set(&root, &root_set);
+  for (uint64_t i = 0; !found && read_dir_entry(&root, i, &entry); i++) {
+    if (entry.entry_type == DENTRY_TYPE_END) {
+      break;
+    }
+    // the first bitmap, TexFAT volumes have a second one for the second FAT
+    found = entry.entry_type == DENTRY_TYPE_ALLOCATION_BITMAP &&
+            (entry.bitmap.bitmap_flags & 1) == 0;
+  }
+
+  uint32_t count = 0;
+  uint32_t *chain = NULL;
+  if (found && is_valid_cluster(entry.bitmap.first_cluster) &&
+      entry.bitmap.data_length >= length) {
+    chain = build_cluster_chain(entry.bitmap.first_cluster, length, false,
+                                &count);
+  }
+  bool ok = (uint64_t)count * cluster_size >= length &&
+            load_bitmap_bits(chain, count, length) &&
+            chain_allocated(chain, count) && load_cluster_chain(&root) &&
+            chain_allocated(root.cluster_chain, root.chain_length);
+
+  free(chain);
+  release_open_file(&root);
+  atomic_store(&used_clusters, UINT64_MAX);
+  return ok;
+}
+
+// Return: the clusters the allocation bitmap marks as in use.
+static uint64_t count_used_clusters(void) {
+  uint64_t used = atomic_load(&used_clusters);
+  if (used != UINT64_MAX) {
+    return used;
+  }
+
+  // whole bytes, then the bits of the last one that stand for clusters
+  uint32_t whole = mbr.cluster_count / 8, rest = mbr.cluster_count % 8;
+  used = count_bits(allocation_bitmap_bits, whole);
+  if (rest > 0) {
+    used += (uint64_t)__builtin_popcount(allocation_bitmap_bits[whole] &
+                                         ((1u << rest) - 1));
+  }
+  atomic_store(&used_clusters, used); // the volume is read-only, it stays
+  return used;
+}
+
+static void unload_allocation_bitmap(void) {
+  if (bitmap_memory_length > 0) {
+    munmap(bitmap_memory, bitmap_memory_length);
+  } else {
+    free(bitmap_memory);
+  }
+  bitmap_memory = NULL;
+  bitmap_memory_length = 0;
+  allocation_bitmap_bits = NULL;
+}
+
+//-----------
+// PUBLIC API
+//-----------
+/* Return: EXFAT_UNSUPPORTED_FS if the current implementation does not support
+ *         the file system specified, EXFAT_FSCK_FAIL if the super block does
+ * not pass the basic file system check, EXFAT_INVAL if an invalid argument has
+ * been passed (e.g., NULL),or EXFAT_OK on success.
+ */
+exfat_error exfat_mount(const char *source, exfat_fs_type fs_type) {
+  if (NULL == source) {
+    return EXFAT_INVAL;
+  }
+  if (EXFAT_FS_EXFAT != fs_type) {
+    return EXFAT_UNSUPPORTED_FS;
+  }
+  if (volume_fd >= 0) {
+    exfat_unmount(); // mounting again replaces the mounted volume
+  }
+
+  // opening the file for reading in binary for validating
+  int file_system_fd = open(source, O_RDONLY);
+  if (file_system_fd < 0) {
+    return EXFAT_INVAL;
+  }
+
+  // reading the main boot record (first sector) from the opened file
+  if ((ssize_t)sizeof(main_boot_record) !=
+      pread(file_system_fd, &mbr, sizeof(main_boot_record), 0)) {
+    // failed to read the main boot record
+    close(file_system_fd);
+    return EXFAT_FSCK_FAIL;
+  }
+
+  // checking the FileSystemName Field
+  if (0 != memcmp(mbr.fs_name, "EXFAT   ", sizeof(mbr.fs_name))) {
+    // invalid file system FileSystemName
+    close(file_system_fd);
+    return EXFAT_FSCK_FAIL;
+  }
+
+  // checking the must_be_zero field, there should be 53 bytes of 0 init
+  static const uint8_t zeros[sizeof(mbr.must_be_zero)] = {0};
+  if (0 != memcmp(mbr.must_be_zero, zeros, sizeof(mbr.must_be_zero))) {
+    // invalid must_be_zero field in our file system
+    close(file_system_fd);
+    return EXFAT_FSCK_FAIL;
+  }
+
+  // checking boot signature
+  if (0xAA55 != mbr.boot_signature) {
+    close(file_system_fd);
+    return EXFAT_FSCK_FAIL;
+  }
+
+  // checking the sector (512 B to 4 KB) and cluster (up to 32 MB) sizes
+  if (mbr.bytes_per_sector_shift < 9 || mbr.bytes_per_sector_shift > 12 ||
+      mbr.sectors_per_cluster_shift > 25 - mbr.bytes_per_sector_shift) {
+    close(file_system_fd);
+    return EXFAT_FSCK_FAIL;
+  }
+
+  // checking the FirstClusterOfRootDirectory field should be in range
+  // [2,ClusterCount+1];
+  if (mbr.cluster_count == 0 || mbr.first_cluster_of_root_directory < 2 ||
+      mbr.first_cluster_of_root_directory > mbr.cluster_count + 1) {
+    close(file_system_fd);
+    return EXFAT_FSCK_FAIL;
+  }
+
+  // all the checks passed, this is a valid exFAT file system
+  volume_fd = file_system_fd;
+  cluster_size = 1u << (mbr.bytes_per_sector_shift +
+                        mbr.sectors_per_cluster_shift);
+  cluster_heap_start = (uint64_t)mbr.cluster_heap_offset
+                       << mbr.bytes_per_sector_shift;
+  fat_start = (uint64_t)mbr.fat_offset << mbr.bytes_per_sector_shift;
+  mount_generation++;
+  choose_classifier();
+
+  // the device every read goes through, pread if the one asked for fails
+  struct stat image;
+  device = block_device_from_environment();
+  if (fstat(volume_fd, &image) != 0 ||
+      !device->attach((uint64_t)image.st_size)) {
+    device = &pread_device;
+  }
+  if (device->fd_reads) {
+    ring_open();
+  }
+
+  // both are powers of two, so a window never straddles a walk piece
+  dir_window = DIR_WINDOW_BYTES / cluster_size;
+  if (dir_window == 0) {
+    dir_window = 1;
+  }
+  if (dir_window > WALK_PIECE_CLUSTERS) {
+    dir_window = WALK_PIECE_CLUSTERS;
+  }
+
+  // the root has no entry set, make one up with the length of its FAT chain
+  uint32_t root_clusters = 0;
+  free(build_cluster_chain(mbr.first_cluster_of_root_directory, 0, false,
+                           &root_clusters));
+  memset(&root_set, 0, sizeof(entry_set));
+  root_set.file.file_attributes = ATTR_DIRECTORY;
+  root_set.stream_extension.first_cluster = mbr.first_cluster_of_root_directory;
+  root_set.stream_extension.data_length =
+      (uint64_t)root_clusters * cluster_size;
+  root_set.stream_extension.valid_data_length =
+      root_set.stream_extension.data_length;
+
+  choose_bit_counter();
+  if (!load_allocation_bitmap()) {
+    exfat_unmount();
+    return EXFAT_FSCK_FAIL;
+  }
+  return EXFAT_OK;
+}
+
+exfat_error exfat_unmount(void) {
+  if (volume_fd < 0) {
+    return EXFAT_INVAL;
+  }
+
+  for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+    if (open_file_bitmap[fd]) {
+      exfat_close(fd);
+    }
+  }
+  ring_close();
+  unload_allocation_bitmap();
+  pthread_mutex_lock(&index_lock);
+  for (int i = 0; i < NAME_INDEX_SLOTS; i++) {
+    free_name_index(&name_indexes[i]);
+  }
+  pthread_mutex_unlock(&index_lock);
+  memset(async_in_use, 0, sizeof(async_in_use));
+  device->detach();
+  device = &pread_device;
+  close(volume_fd);
+  volume_fd = -1;
+  return EXFAT_OK;
+}
+
+exfat_error exfat_share_caches(void) {
+  if (caches_shared) {
+    return EXFAT_OK;
+  }
+  size_t entries_size = sizeof(cached_entry_set) * ENTRY_CACHE_SLOTS;
+  size_t size = entries_size + sizeof(cached_chain) * CHAIN_CACHE_SLOTS;
+  uint8_t *region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == region) {
+    return EXFAT_INVAL;
+  }
+
+  // the region starts out zeroed, i.e. empty
+  pthread_mutex_lock(&table_lock);
+  entry_cache = (cached_entry_set *)region;
+  chain_cache = (cached_chain *)(region + entries_size);
+  caches_shared = true;
+  pthread_mutex_unlock(&table_lock);
+  return EXFAT_OK;
+}
+
+char *exfat_vol_label(void) {
+  open_file root;
+  directory_entry entry;
+  char *label = NULL;
+
+  if (volume_fd < 0) {
+    return NULL;
+  }
+  open_file_from_set(&root, &root_set);
+
+  // the label entry lives in the root directory, usually right at the start
+  for (uint64_t i = 0; NULL == label && read_dir_entry(&root, i, &entry);
+       i++) {
+    if (entry.entry_type == DENTRY_TYPE_END) {
+      break;
+    }
+    if (entry.entry_type == DENTRY_TYPE_VOLUME_LABEL) {
+      uint8_t length = entry.label.character_count;
+      uint16_t characters[11];
+      if (length > 11) {
+        length = 11;
+      }
+      memcpy(characters, entry.label.volume_label, sizeof(characters));
+      label = length > 0 ? unicode2ascii(characters, length) : strdup("");
+    }
+  }
+
+  release_open_file(&root);
+  return NULL != label ? label : strdup("");
+}
+
+exfat_error exfat_statfs(exfat_fs_stat *stat) {
+  if (NULL == stat || volume_fd < 0) {
+    return EXFAT_INVAL;
+  }
+  stat->cluster_size = cluster_size;
+  stat->total_clusters = mbr.cluster_count;
+  stat->used_clusters = count_used_clusters();
+  stat->free_clusters = stat->total_clusters - stat->used_clusters;
+  return EXFAT_OK;
+}
+
+int exfat_open(const char *pathname) {
+  entry_set set;
+
+  if (NULL == pathname || volume_fd < 0) {
+    return EXFAT_INVAL;
+  }
+
+  pthread_mutex_lock(&table_lock);
+  int fd = resolve_path(&root_set, pathname, &set);
+  if (EXFAT_OK == fd) {
+    fd = install_open_file(&set);
+  }
+  pthread_mutex_unlock(&table_lock);
+  return fd;
+}
+
+int exfat_open_by_inode(uint64_t inode) {
+  entry_set set;
+
+  if (volume_fd < 0) {
+    return EXFAT_INVAL;
+  }
+  if (inode == ROOT_INODE) {
+    set = root_set;
+  } else if (inode > UINT64_MAX / DENTRY_SIZE ||
+             !read_entry_set_at(inode * DENTRY_SIZE, &set)) {
+    return EXFAT_FILE_NOT_FOUND;
+  }
+
+  pthread_mutex_lock(&table_lock);
+  int fd = install_open_file(&set);
+  pthread_mutex_unlock(&table_lock);
+  return fd;
+}
+
+int exfat_openat(int dirfd, const char *name) {
+  open_file *dir = lookup_open_file(dirfd);
+  entry_set set;
+
+  if (NULL == name) {
+    return EXFAT_INVAL;
+  }
+  if (name[0] == '/') {
+    return exfat_open(name); // absolute paths ignore dirfd, like openat(2)
+  }
+  if (NULL == dir || !dir->is_directory) {
+    return EXFAT_INVAL;
+  }
+
+  pthread_mutex_lock(&table_lock);
+  int fd = resolve_path(&dir->set, name, &set);
+  if (EXFAT_OK == fd) {
+    fd = install_open_file(&set);
+  }
+  pthread_mutex_unlock(&table_lock);
+  return fd;
+}
+
+exfat_error exfat_stat(const char *pathname, exfat_file_stat *stat) {
+  entry_set set;
+
+  if (NULL == pathname || NULL == stat || volume_fd < 0) {
+    return EXFAT_INVAL;
+  }
+
+  pthread_mutex_lock(&table_lock);
+  exfat_error err = resolve_path(&root_set, pathname, &set);
+  pthread_mutex_unlock(&table_lock);
+  if (EXFAT_OK == err) {
+    fill_file_stat(&set, stat);
+  }
+  return err;
+}
+
+exfat_error exfat_fstat(int fd, exfat_file_stat *stat) {
+  open_file *file = lookup_open_file(fd);
+
+  if (NULL == file || NULL == stat) {
+    return EXFAT_INVAL;
+  }
+  fill_file_stat(&file->set, stat);
+  return EXFAT_OK;
+}
+
+int exfat_close(int fd) {
+  open_file *file = lookup_open_file(fd);
+
+  if (NULL == file) {
+    return -1;
+  }
+  pthread_mutex_lock(&table_lock);
+  release_open_file(file);
+  open_file_bitmap[fd] = false;
+  pthread_mutex_unlock(&table_lock);
+  return 0;
+}
+
+int exfat_dup(int fd) {
+  open_file *file = lookup_open_file(fd);
+
+  if (NULL == file || !load_cluster_chain(file)) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&table_lock);
+  int copy_fd = allocate_open_file();
+  if (copy_fd >= 0 && NULL == file->chain_users) {
+    file->chain_users = malloc(sizeof(atomic_int));
+    if (NULL == file->chain_users) {
+      open_file_bitmap[copy_fd] = false;
+      copy_fd = -1;
+    } else {
+      atomic_init(file->chain_users, 1);
+    }
+  }
+  if (copy_fd >= 0) {
+    open_file *copy = &open_file_table[copy_fd];
+    open_file_from_set(copy, &file->set);
+    copy->cluster_chain = file->cluster_chain;
+    copy->chain_length = file->chain_length;
+    copy->chain_loaded = true;
+    copy->chain_users = file->chain_users;
+    atomic_fetch_add(copy->chain_users, 1);
+  }
+  pthread_mutex_unlock(&table_lock);
+  return copy_fd;
+}
+
+ssize_t exfat_read(int fd, void *buffer, size_t count) {
+  open_file *file = lookup_open_file(fd);
+
+  if (NULL == file || NULL == buffer || file->is_directory) {
+    return -1;
+  }
+
+  read_ahead(file, file->current_position);
+  ssize_t bytes_read =
+      read_file_at(file, buffer, count, file->current_position);
+  if (bytes_read > 0) {
+    file->current_position += (uint64_t)bytes_read;
+  }
+  return bytes_read;
+}
+
+ssize_t exfat_pread(int fd, void *buffer, size_t count, off_t offset) {
+  open_file *file = lookup_open_file(fd);
+
+  if (NULL == file || NULL == buffer || file->is_directory || offset < 0) {
+    return -1;
+  }
+  return read_file_at(file, buffer, count, (uint64_t)offset);
+}
+
+// Return: true if <count> buffers at <vector> can be read into.
+static bool valid_vector(const struct iovec *vector, int count) {
+  size_t total = 0;
+
+  if (count < 0 || count > IOV_MAX || (NULL == vector && count > 0)) {
+    return false;
+  }
+  for (int i = 0; i < count; i++) {
+    if ((NULL == vector[i].iov_base && vector[i].iov_len > 0) ||
+        vector[i].iov_len > SSIZE_MAX - total) {
+      return false; // the total would not fit the result, like readv(2)
+    }
+    total += vector[i].iov_len;
+  }
+  return true;
+}
+
+ssize_t exfat_readv(int fd, const struct iovec *vector, int count) {
+  open_file *file = lookup_open_file(fd);
+
+  if (NULL == file || file->is_directory || !valid_vector(vector, count)) {
+    return -1;
+  }
+
+  read_ahead(file, file->current_position);
+  ssize_t bytes_read =
+      read_file_vector(file, vector, count, file->current_position);
+  if (bytes_read > 0) {
+    file->current_position += (uint64_t)bytes_read;
+  }
+  return bytes_read;
+}
+
+ssize_t exfat_preadv(int fd, const struct iovec *vector, int count,
+                     off_t offset) {
+  open_file *file = lookup_open_file(fd);
+
+  if (NULL == file || file->is_directory || offset < 0 ||
+      !valid_vector(vector, count)) {
+    return -1;
+  }
+  return read_file_vector(file, vector, count, (uint64_t)offset);
+}
+
+int exfat_read_async(int fd, void *buffer, size_t count, off_t offset) {
+  open_file *file = lookup_open_file(fd);
+  int request = -1;
+
+  if (NULL == file || NULL == buffer || file->is_directory || offset < 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&io_lock);
+  for (int i = 0; i < ASYNC_MAX_REQUESTS && request < 0; i++) {
+    if (!async_in_use[i]) {
+      async_in_use[i] = true;
+      request = i;
+    }
+  }
+  pthread_mutex_unlock(&io_lock);
+  if (request < 0) {
+    return -1;
+  }
+
+  read_request *pending = &async_requests[request];
+  read_request_init(pending, true);
+  if (!read_file_request(file, buffer, count, (uint64_t)offset, pending)) {
+    exfat_read_complete(request);
+    return -1;
+  }
+  pthread_mutex_lock(&io_lock);
+  ring_submit(); // get the reads going, nobody may wait for a while
+  pthread_mutex_unlock(&io_lock);
+  return request;
+}
+
+ssize_t exfat_read_complete(int request) {
+  if (request < 0 || request >= ASYNC_MAX_REQUESTS) {
+    return -1;
+  }
+  pthread_mutex_lock(&io_lock);
+  bool in_use = async_in_use[request];
+  pthread_mutex_unlock(&io_lock);
+  if (!in_use) {
+    return -1;
+  }
+
+  ssize_t result = read_request_wait(&async_requests[request]);
+  pthread_mutex_lock(&io_lock);
+  async_in_use[request] = false;
+  pthread_mutex_unlock(&io_lock);
+  return result;
+}
+
+ssize_t exfat_extents(int fd, exfat_extent *extents, size_t count) {
+  open_file *file = lookup_open_file(fd);
+
+  if (NULL == file || file->is_directory || (NULL == extents && count > 0) ||
+      !load_cluster_chain(file)) {
+    return -1;
+  }
+
+  const stream_extension *stream = &file->set.stream_extension;
+  uint64_t valid = stream->valid_data_length < stream->data_length
+                       ? stream->valid_data_length
+                       : stream->data_length;
+  uint64_t position = 0;
+  size_t total = 0;
+
+  for (uint32_t i = 0, run; i < file->chain_length && position < valid;
+       i += run) {
+    run = contiguous_run(file->cluster_chain, file->chain_length, i);
+    uint64_t length = (uint64_t)run * cluster_size;
+    if (length > valid - position) {
+      length = valid - position;
+    }
+    if (total < count) {
+      extents[total].file_offset = position;
+      extents[total].volume_offset = cluster_offset(file->cluster_chain[i]);
+      extents[total].length = length;
+    }
+    total++;
+    position += length;
+  }
+  return (ssize_t)total;
+}
+
+exfat_error exfat_fadvise(int fd, off_t offset, off_t length,
+                          exfat_advice advice) {
+  open_file *file = lookup_open_file(fd);
+
+  if (NULL == file || file->is_directory || offset < 0 || length < 0 ||
+      advice < EXFAT_FADV_NORMAL || advice > EXFAT_FADV_DONTNEED) {
+    return EXFAT_INVAL;
+  }
+
+  // an order of reads given for the whole file is kept for the descriptor
+  if (advice <= EXFAT_FADV_SEQUENTIAL && offset == 0 && length == 0) {
+    file->advice = advice;
+    file->readahead_until = 0;
+  }
+  advise_file_range(file, (uint64_t)offset, (uint64_t)length, advice);
+  return EXFAT_OK;
+}
+
+exfat_FILE *exfat_fopen(const char *pathname) {
+  int fd = exfat_open(pathname);
+  open_file *file = lookup_open_file(fd);
+
+  if (NULL == file || file->is_directory) {
+    exfat_close(fd);
+    return NULL;
+  }
+  exfat_FILE *stream = calloc(1, sizeof(exfat_FILE));
+  if (NULL == stream) {
+    exfat_close(fd);
+    return NULL;
+  }
+  // both are powers of two, so the buffer holds whole clusters
+  stream->fd = fd;
+  stream->capacity =
+      cluster_size > STREAM_BUFFER_BYTES ? cluster_size : STREAM_BUFFER_BYTES;
+  stream->buffer = malloc(stream->capacity);
+  if (NULL == stream->buffer) {
+    exfat_fclose(stream);
+    return NULL;
+  }
+  stream->next = stream->end = stream->buffer;
+  return stream;
+}
+
+int exfat_fclose(exfat_FILE *stream) {
+  if (NULL == stream) {
+    return -1;
+  }
+  int result = exfat_close(stream->fd);
+  free(stream->buffer);
+  free(stream);
+  return result;
+}
+
+int exfat_getc_refill(exfat_FILE *stream) {
+  open_file *file = NULL == stream ? NULL : lookup_open_file(stream->fd);
+
+  if (NULL == file || fill_stream(stream, file) <= 0) {
+    return -1;
+  }
+  return *stream->next++;
+}
+
+ssize_t exfat_getline(char **line, size_t *capacity, exfat_FILE *stream) {
+  open_file *file = NULL == stream ? NULL : lookup_open_file(stream->fd);
+  size_t length = 0;
+
+  if (NULL == file || NULL == line || NULL == capacity) {
+    return -1;
+  }
+
+  for (;;) {
+    if (stream->next == stream->end && fill_stream(stream, file) <= 0) {
+      break;
+    }
+    size_t available = (size_t)(stream->end - stream->next);
+    const unsigned char *newline = memchr(stream->next, '\n', available);
+    size_t taken =
+        NULL == newline ? available : (size_t)(newline - stream->next) + 1;
+
+    if (NULL == *line || length + taken + 1 > *capacity) {
+      size_t bigger = *capacity > 0 ? *capacity : 128;
+      while (length + taken + 1 > bigger) {
+        bigger *= 2;
+      }
+      char *grown = realloc(*line, bigger);
+      if (NULL == grown) {
+        return -1;
+      }
+      *line = grown;
+      *capacity = bigger;
+    }
+    memcpy(*line + length, stream->next, taken);
+    length += taken;
+    stream->next += taken;
+    if (NULL != newline) {
+      break;
+    }
+  }
+
+  if (length == 0) {
+    return -1;
+  }
+  (*line)[length] = '\0';
+  return (ssize_t)length;
+}
+
+size_t exfat_fread(void *buffer, size_t size, size_t count,
+                   exfat_FILE *stream) {
+  open_file *file = NULL == stream ? NULL : lookup_open_file(stream->fd);
+  uint8_t *destination = buffer;
+  size_t total = 0, copied = 0;
+
+  if (NULL == file || NULL == buffer || size == 0 ||
+      count > SIZE_MAX / size) {
+    return 0;
+  }
+  total = size * count;
+
+  while (copied < total) {
+    size_t available = (size_t)(stream->end - stream->next);
+    if (available > 0) {
+      size_t taken = available < total - copied ? available : total - copied;
+      memcpy(destination + copied, stream->next, taken);
+      stream->next += taken;
+      copied += taken;
+      continue;
+    }
+
+    // big reads skip the buffer, unless the stream reads the mapping anyway
+    ssize_t bytes_read;
+    if (NULL == volume_map && total - copied >= stream->capacity) {
+      bytes_read = read_file_at(file, destination + copied, total - copied,
+                                stream->position);
+      if (bytes_read > 0) {
+        stream->position += (uint64_t)bytes_read;
+        copied += (size_t)bytes_read;
+      }
+    } else {
+      bytes_read = fill_stream(stream, file);
+    }
+    if (bytes_read <= 0) {
+      break;
+    }
+  }
+  return copied / size;
+}
+
+ssize_t exfat_getdents(int fd, void *dirp, size_t count) {
+  return exfat_getdents_stat(fd, dirp, NULL, count);
+}
+
+ssize_t exfat_getdents_stat(int fd, void *dirp, exfat_file_stat *stats,
+                            size_t count) {
+  open_file *dir = lookup_open_file(fd);
+  exfat_dirent *entries = dirp;
+  uint16_t name[MAX_NAME_LENGTH];
+  entry_set set;
+  size_t filled = 0;
+
+  if (NULL == dir || NULL == dirp || count == 0 || !dir->is_directory) {
+    return -1;
+  }
+
+  while (filled < count &&
+         exfat_getdent_set(dir, &dir->current_position, &set, name, NULL)) {
+    uint8_t length = set.stream_extension.name_length;
+    entries[filled].inode_number = inode_number(&set);
+    entries[filled].name_len = length;
+    entries[filled].name = unicode2ascii(name, length);
+    entries[filled].type =
+        (set.file.file_attributes & ATTR_DIRECTORY) ? DT_DIR : DT_REG;
+    if (NULL != stats) {
+      fill_file_stat(&set, &stats[filled]); // the set is already at hand
+    }
+    filled++;
+  }
+
+  return (ssize_t)filled;
+}
+
+exfat_error exfat_glob(const char *pathname, const char *pattern,
+                       exfat_glob_list *list) {
+  entry_set dir;
+
+  if (NULL == pathname || NULL == pattern || NULL == list || volume_fd < 0) {
+    return EXFAT_INVAL;
+  }
+  list->count = 0;
+  list->names = NULL;
+
+  pthread_mutex_lock(&table_lock);
+  exfat_error err = resolve_path(&root_set, pathname, &dir);
+  pthread_mutex_unlock(&table_lock);
+  if (EXFAT_OK != err) {
+    return err;
+  }
+  if (!(dir.file.file_attributes & ATTR_DIRECTORY)) {
+    return EXFAT_FILE_NOT_FOUND;
+  }
+
+  // only the names starting with what comes before the first wildcard are
+  // matched against the pattern, the index has them next to each other.
+  // Names that do not fit in 8 bits a character cannot be opened by path,
+  // they are left out
+  size_t prefix = strcspn(pattern, "*?");
+  size_t bytes = 0;
+  uint32_t first = 0, end = 0;
+  pthread_mutex_lock(&index_lock);
+  const name_index *index = NULL;
+  if (is_valid_cluster(dir.stream_extension.first_cluster)) {
+    index = directory_name_index(&dir, true);
+    if (NULL == index) {
+      pthread_mutex_unlock(&index_lock);
+      return EXFAT_INVAL;
+    }
+    first = end = index_lower_bound(index, pattern, prefix);
+    while (end < index->count && index->entries[end].length >= prefix &&
+           0 == compare_names(index->names + index->entries[end].name, prefix,
+                              pattern, prefix)) {
+      const name_index_entry *entry = &index->entries[end++];
+      const char *name = index->names + entry->name;
+      if (!entry->wide && glob_match(pattern, name, entry->length)) {
+        list->count++;
+        bytes += entry->length + 1u;
+      }
+    }
+  }
+
+  // one allocation: the pointers, then the names they point at
+  list->names = malloc((list->count + 1) * sizeof(char *) + bytes);
+  if (NULL == list->names) {
+    pthread_mutex_unlock(&index_lock);
+    list->count = 0;
+    return EXFAT_INVAL;
+  }
+  char *copy = (char *)(list->names + list->count + 1);
+  size_t matched = 0;
+  for (uint32_t i = first; i < end; i++) {
+    const name_index_entry *entry = &index->entries[i];
+    const char *name = index->names + entry->name;
+    if (!entry->wide && glob_match(pattern, name, entry->length)) {
+      list->names[matched++] = copy;
+      memcpy(copy, name, entry->length + 1u);
+      copy += entry->length + 1u;
+    }
+  }
+  list->names[matched] = NULL;
+  pthread_mutex_unlock(&index_lock);
+  return EXFAT_OK;
+}
+
+void exfat_glob_free(exfat_glob_list *list) {
+  if (NULL != list) {
+    free(list->names);
+    list->names = NULL;
+    list->count = 0;
+  }
+}
+
+exfat_error exfat_walk(const char *pathname, exfat_walk_fn fn, void *arg,
+                       int threads) {
+  walk_callback callback = {fn, arg};
+
+  if (NULL == fn) {
+    return EXFAT_INVAL;
+  }
+  return walk_tree(pathname, walk_visit_public, &callback, threads, false);
+}
+
+exfat_error exfat_export(const char *pathname, const char *host_dir,
+                         int threads, exfat_export_summary *summary) {
+  export_state state = {.host_dir = host_dir};
+  entry_set start;
+
+  if (NULL == pathname || NULL == host_dir || volume_fd < 0) {
+    return EXFAT_INVAL;
+  }
+  pthread_mutex_lock(&table_lock);
+  exfat_error err = resolve_path(&root_set, pathname, &start);
+  pthread_mutex_unlock(&table_lock);
+  if (EXFAT_OK != err) {
+    return err;
+  }
+
+  // a directory becomes host_dir itself, a single file goes into host_dir
+  // under its own name
+  state.prefix_length = strlen(pathname);
+  if (!(start.file.file_attributes & ATTR_DIRECTORY)) {
+    const char *name = strrchr(pathname, '/');
+    state.prefix_length = NULL != name ? (size_t)(name - pathname) : 0;
+    if (0 != mkdir(host_dir, 0755) && EEXIST != errno) {
+      return EXFAT_INVAL;
+    }
+  }
+  pthread_mutex_init(&state.lock, NULL);
+  atomic_init(&state.copy_in_memory, false);
+
+  // host names keep every character, as UTF-8
+  err = walk_tree(pathname, export_visit, &state, threads, true);
+
+  // writing the contents changed every directory's times, they are set last
+  for (size_t i = 0; i < state.num_directories; i++) {
+    export_directory *dir = &state.directories[i];
+    if (0 != utimensat(AT_FDCWD, dir->host_path, dir->times,
+                       AT_SYMLINK_NOFOLLOW)) {
+      state.summary.failed++;
+    }
+    free(dir->host_path);
+  }
+  free(state.directories);
+  pthread_mutex_destroy(&state.lock);
+
+  if (NULL != summary) {
+    *summary = state.summary;
+  }
+  return err;
 }
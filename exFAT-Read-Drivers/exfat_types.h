@@ -83,6 +83,16 @@ typedef struct ALLOCATION_BITMAP {
 } allocation_bitmap;
 #pragma pack(pop)
 
+#pragma pack(push, 1)
+typedef struct UP_CASE_TABLE {
+  uint8_t reserved1[3];
+  uint32_t table_checksum;
+  uint8_t reserved2[12];
+  uint32_t first_cluster;
+  uint64_t data_length;
+} up_case_table;
+#pragma pack(pop)
+
 #pragma pack(push, 1)
 typedef struct VOLUME_LABEL {
   uint8_t character_count;
@@ -96,6 +106,7 @@ typedef struct DIRECTORY_ENTRY {
   uint8_t entry_type;
   union {
     allocation_bitmap bitmap;
+    up_case_table up_case;
     volume_label label;
     file_dentry file;
     file_name file_name;
@@ -108,6 +119,7 @@ typedef struct ENTRY_SET {
   file_dentry file;
   stream_extension stream_extension;
   file_name *filenames;
+  uint64_t location; // volume offset of the file entry, 0 for the root
 } entry_set;
 
 #define DENTRY_TYPE_ALLOCATION_BITMAP 0x81
@@ -0,0 +1,41 @@
+#include "exfat_io.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char **argv) {
+  exfat_export_summary summary = {0};
+  exfat_error err;
+  int exit_code = EXIT_FAILURE;
+
+  // This export takes three arguments: The file system image, the file or
+  // directory in it to copy out and the host directory to copy it into.
+  if (argc == 4) {
+    err = exfat_mount(argv[1], EXFAT_FS_EXFAT);
+    if (err == EXFAT_OK) {
+      err = exfat_export(argv[2], argv[3], 0, &summary);
+
+      if (err == EXFAT_FILE_NOT_FOUND) {
+        fprintf(stderr, "%s not found\n", argv[2]);
+      } else if (err != EXFAT_OK) {
+        fprintf(stderr, "%s could not be written\n", argv[3]);
+      } else {
+        printf("%" PRIu64 " files, %" PRIu64 " directories, %" PRIu64
+               " bytes\n",
+               summary.files, summary.directories, summary.bytes);
+        if (summary.failed > 0) {
+          fprintf(stderr, "%" PRIu64 " could not be written\n",
+                  summary.failed);
+        } else {
+          exit_code = EXIT_SUCCESS;
+        }
+      }
+
+      exfat_unmount();
+    }
+  } else {
+    fprintf(stderr, "Usage: %s disk.img /path host_dir\n", argv[0]);
+  }
+
+  return exit_code;
+}
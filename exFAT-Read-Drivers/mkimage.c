@@ -0,0 +1,787 @@
+#define _GNU_SOURCE // For pwrite, getopt
+#include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "exfat_types.h"
+
+// Writes a valid exFAT image shaped for performance fixtures: huge flat
+// directories, deep trees, long Unicode names, shuffled (fragmented) FAT
+// chains and NoFatChain contiguous files. Everything (names, layout, contents,
+// timestamps) comes from one seed, so the same command line always produces
+// the same image. No mkfs.exfat or root privileges needed.
+
+#define SECTOR_SHIFT 9
+#define SECTOR_SIZE (1 << SECTOR_SHIFT)
+#define BOOT_REGION_SECTORS 12
+#define FAT_OFFSET 128 // sectors, leaves room for both boot regions
+#define FIRST_CLUSTER 2
+#define ENTRY_SIZE 32
+#define NAME_CHARS_PER_ENTRY 15
+#define MAX_NAME_LENGTH 255
+#define UP_CASE_ENTRIES 128
+#define FAT_END_OF_CHAIN 0xFFFFFFFFu
+#define FAT_MEDIA 0xFFFFFFF8u
+#define FREE_CLUSTERS 16 // real volumes are never full, keep some headroom
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE 0x20
+#define LINE_LENGTH 64 // generated file contents are lines of this length
+
+#define DEFAULT_SEED 3430
+#define DEFAULT_CLUSTER_SHIFT 3 // 4 KB clusters
+#define DEFAULT_LABEL "NQP"
+#define BENCH_BIG_FILE (64ULL << 20)
+
+typedef enum { LAYOUT_CHAINED, LAYOUT_CONTIGUOUS, LAYOUT_FRAGMENTED } layout;
+
+typedef struct NODE {
+  uint16_t name[MAX_NAME_LENGTH];
+  uint8_t name_length;
+  bool is_dir;
+  layout layout;
+  uint64_t size;        // bytes of data (directories: entry bytes, rounded)
+  uint32_t *clusters;   // clusters in chain order
+  uint32_t cluster_len; // number of clusters
+  uint32_t timestamp;
+  const char *host_path; // contents come from this host file, if set
+  struct NODE **children;
+  size_t child_count, child_capacity;
+} node;
+
+// volume wide state
+static main_boot_record mbr;
+static uint32_t seed_state = DEFAULT_SEED;
+static uint32_t cluster_size;
+static uint32_t *fat = NULL;     // [cluster_count + 2]
+static uint8_t *bitmap = NULL;   // one bit per cluster
+static uint32_t next_free = FIRST_CLUSTER;
+static uint32_t bitmap_cluster, up_case_cluster;
+static uint64_t bitmap_bytes;
+static uint16_t up_case[UP_CASE_ENTRIES];
+static bool sparse = false;
+static uint16_t label[11];
+static uint8_t label_length;
+static node root = {.is_dir = true};
+
+//---------
+// HELPERS
+//---------
+// xorshift32, deterministic for a given seed on every platform
+static uint32_t next_random(void) {
+  uint32_t x = seed_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  seed_state = x;
+  return x;
+}
+
+static void *checked_calloc(size_t count, size_t size) {
+  void *memory = calloc(count, size);
+  if (NULL == memory) {
+    perror("mkimage: calloc");
+    exit(EXIT_FAILURE);
+  }
+  return memory;
+}
+
+static uint64_t parse_size(const char *text) {
+  char *end = NULL;
+  uint64_t size = strtoull(text, &end, 10);
+  switch (*end) {
+  case 'G':
+  case 'g':
+    size <<= 10;
+    // fall through
+  case 'M':
+  case 'm':
+    size <<= 10;
+    // fall through
+  case 'K':
+  case 'k':
+    size <<= 10;
+    break;
+  default:
+    break;
+  }
+  return size;
+}
+
+static uint8_t ascii2unicode(const char *ascii, uint16_t *unicode) {
+  size_t length = strlen(ascii);
+  if (length > MAX_NAME_LENGTH) {
+    length = MAX_NAME_LENGTH;
+  }
+  for (size_t i = 0; i < length; i++) {
+    unicode[i] = (uint16_t)(unsigned char)ascii[i];
+  }
+  return (uint8_t)length;
+}
+
+static uint16_t upper(uint16_t c) {
+  return c < UP_CASE_ENTRIES ? up_case[c] : c;
+}
+
+// exFAT timestamp: year since 1980, month, day, hour, minute, seconds / 2
+static uint32_t random_timestamp(void) {
+  uint32_t year = 45 + next_random() % 2; // 2025 or 2026
+  uint32_t month = 1 + next_random() % 12;
+  uint32_t day = 1 + next_random() % 28;
+  uint32_t hour = next_random() % 24;
+  uint32_t minute = next_random() % 60;
+  uint32_t seconds = next_random() % 30;
+  return year << 25 | month << 21 | day << 16 | hour << 11 | minute << 5 |
+         seconds;
+}
+
+//---------------
+// TREE BUILDING
+//---------------
+static node *add_child(node *parent, const uint16_t *name, uint8_t length,
+                       bool is_dir) {
+  assert(parent->is_dir);
+  node *child = checked_calloc(1, sizeof(node));
+  memcpy(child->name, name, length * sizeof(uint16_t));
+  child->name_length = length;
+  child->is_dir = is_dir;
+  child->timestamp = random_timestamp();
+
+  if (parent->child_count == parent->child_capacity) {
+    parent->child_capacity =
+        parent->child_capacity ? parent->child_capacity * 2 : 8;
+    parent->children = realloc(parent->children,
+                               parent->child_capacity * sizeof(node *));
+    if (NULL == parent->children) {
+      perror("mkimage: realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  parent->children[parent->child_count++] = child;
+  return child;
+}
+
+// finds <name> in <parent>, only used while parsing the command line so a
+// linear scan is fine
+static node *find_child(node *parent, const uint16_t *name, uint8_t length) {
+  for (size_t i = 0; i < parent->child_count; i++) {
+    node *child = parent->children[i];
+    if (child->name_length == length &&
+        memcmp(child->name, name, length * sizeof(uint16_t)) == 0) {
+      return child;
+    }
+  }
+  return NULL;
+}
+
+// walks <path>, creating any missing directories (like mkdir -p)
+static node *make_dirs(const char *path) {
+  char *copy = strdup(path);
+  char *cursor = copy, *token;
+  node *current = &root;
+  uint16_t name[MAX_NAME_LENGTH];
+
+  while ((token = strsep(&cursor, "/")) != NULL) {
+    if (*token == '\0') {
+      continue;
+    }
+    uint8_t length = ascii2unicode(token, name);
+    node *child = find_child(current, name, length);
+    if (NULL == child) {
+      child = add_child(current, name, length, true);
+    } else if (!child->is_dir) {
+      fprintf(stderr, "mkimage: %s is a file, not a directory\n", token);
+      exit(EXIT_FAILURE);
+    }
+    current = child;
+  }
+  free(copy);
+  return current;
+}
+
+static node *make_file(const char *path, uint64_t size, layout layout) {
+  char *copy = strdup(path);
+  char *slash = strrchr(copy, '/');
+  node *parent = &root;
+  uint16_t name[MAX_NAME_LENGTH];
+
+  if (slash != NULL) {
+    *slash = '\0';
+    parent = make_dirs(copy);
+  }
+  node *file = add_child(parent, name,
+                         ascii2unicode(slash ? slash + 1 : copy, name), false);
+  file->size = size;
+  file->layout = layout;
+  free(copy);
+  return file;
+}
+
+// copies a host file (e.g. a command binary) into the image
+static void make_import(const char *path, const char *host_path) {
+  struct stat info;
+  if (stat(host_path, &info) != 0) {
+    perror(host_path);
+    exit(EXIT_FAILURE);
+  }
+  node *file = make_file(path, (uint64_t)info.st_size, LAYOUT_CHAINED);
+  file->host_path = host_path;
+}
+
+static void make_flat(const char *dir, uint64_t count) {
+  node *parent = make_dirs(dir);
+  char ascii[32];
+  uint16_t name[MAX_NAME_LENGTH];
+
+  for (uint64_t i = 0; i < count; i++) {
+    snprintf(ascii, sizeof(ascii), "file%07" PRIu64, i);
+    add_child(parent, name, ascii2unicode(ascii, name), false);
+  }
+}
+
+static void make_deep(const char *dir, uint64_t depth) {
+  node *current = make_dirs(dir);
+  char ascii[32];
+  uint16_t name[MAX_NAME_LENGTH];
+
+  for (uint64_t i = 1; i <= depth; i++) {
+    add_child(current, name, ascii2unicode("leaf", name), false);
+    snprintf(ascii, sizeof(ascii), "d%" PRIu64, i);
+    current = add_child(current, name, ascii2unicode(ascii, name), true);
+  }
+  add_child(current, name, ascii2unicode("leaf", name), false);
+}
+
+// long names mixing Latin-1, Greek, Cyrillic and CJK, prefixed with an index
+// so they stay unique
+static void make_unicode(const char *dir, uint64_t count) {
+  static const uint16_t ranges[][2] = {
+      {0x00C0, 0x00FF}, {0x0391, 0x03C9}, {0x0410, 0x044F}, {0x4E00, 0x9FFF}};
+  node *parent = make_dirs(dir);
+  char ascii[32];
+  uint16_t name[MAX_NAME_LENGTH];
+
+  for (uint64_t i = 0; i < count; i++) {
+    snprintf(ascii, sizeof(ascii), "%06" PRIu64 "-", i);
+    uint8_t length = ascii2unicode(ascii, name);
+    while (length < MAX_NAME_LENGTH) {
+      const uint16_t *range = ranges[next_random() % 4];
+      name[length++] =
+          (uint16_t)(range[0] + next_random() % (range[1] - range[0] + 1));
+    }
+    add_child(parent, name, length, false);
+  }
+}
+
+static void make_bench(void) {
+  make_deep("/bench", 16);
+  make_flat("/bench/dir10", 10);
+  make_flat("/bench/dir1k", 1000);
+  make_flat("/bench/dir100k", 100000);
+  make_file("/bench/contiguous.bin", BENCH_BIG_FILE, LAYOUT_CONTIGUOUS);
+  make_file("/bench/fragmented.bin", BENCH_BIG_FILE, LAYOUT_FRAGMENTED);
+}
+
+//--------
+// LAYOUT
+//--------
+static uint32_t entries_for(const node *n) {
+  return 2 + (n->name_length + NAME_CHARS_PER_ENTRY - 1) / NAME_CHARS_PER_ENTRY;
+}
+
+static uint32_t clusters_for(uint64_t bytes) {
+  return (uint32_t)((bytes + cluster_size - 1) / cluster_size);
+}
+
+// directory sizes are known once the tree is built, every directory gets at
+// least one cluster (and the root also holds label, bitmap and up-case)
+static uint64_t size_tree(node *dir, bool is_root) {
+  uint64_t entries = is_root ? 3 : 0;
+  uint64_t total = 0;
+
+  for (size_t i = 0; i < dir->child_count; i++) {
+    node *child = dir->children[i];
+    entries += entries_for(child);
+    if (child->is_dir) {
+      total += size_tree(child, false);
+    } else {
+      // fragmented files leave a gap after every run, budget for it
+      total += clusters_for(child->size) *
+               (child->layout == LAYOUT_FRAGMENTED ? 3 : 1);
+    }
+  }
+  dir->size = (uint64_t)clusters_for(entries * ENTRY_SIZE) * cluster_size;
+  if (dir->size == 0) {
+    dir->size = cluster_size;
+  }
+  return total + clusters_for(dir->size);
+}
+
+static void mark_used(uint32_t cluster) {
+  uint32_t index = cluster - FIRST_CLUSTER;
+  bitmap[index / 8] |= (uint8_t)(1 << (index % 8));
+}
+
+// consecutive clusters; NoFatChain files don't get FAT entries at all
+static void allocate_contiguous(node *n, uint32_t count, bool chained) {
+  n->clusters = checked_calloc(count, sizeof(uint32_t));
+  n->cluster_len = count;
+  for (uint32_t i = 0; i < count; i++) {
+    n->clusters[i] = next_free + i;
+    mark_used(n->clusters[i]);
+    if (chained) {
+      fat[n->clusters[i]] =
+          i + 1 < count ? next_free + i + 1 : FAT_END_OF_CHAIN;
+    }
+  }
+  next_free += count;
+}
+
+// runs of 1-3 clusters with 1-2 free clusters after each, and then the order
+// of the runs in the chain is shuffled so the chain jumps back and forth
+static void allocate_fragmented(node *n, uint32_t count) {
+  uint32_t run_capacity = count, run_count = 0;
+  uint32_t *run_start = checked_calloc(run_capacity, sizeof(uint32_t));
+  uint32_t *run_length = checked_calloc(run_capacity, sizeof(uint32_t));
+
+  for (uint32_t placed = 0; placed < count; run_count++) {
+    uint32_t length = 1 + next_random() % 3;
+    if (length > count - placed) {
+      length = count - placed;
+    }
+    run_start[run_count] = next_free;
+    run_length[run_count] = length;
+    next_free += length + 1 + next_random() % 2;
+    placed += length;
+  }
+
+  for (uint32_t i = run_count - 1; i > 0; i--) {
+    uint32_t j = next_random() % (i + 1);
+    uint32_t start = run_start[i], length = run_length[i];
+    run_start[i] = run_start[j];
+    run_length[i] = run_length[j];
+    run_start[j] = start;
+    run_length[j] = length;
+  }
+
+  n->clusters = checked_calloc(count, sizeof(uint32_t));
+  n->cluster_len = count;
+  uint32_t index = 0;
+  for (uint32_t r = 0; r < run_count; r++) {
+    for (uint32_t i = 0; i < run_length[r]; i++) {
+      n->clusters[index++] = run_start[r] + i;
+    }
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    mark_used(n->clusters[i]);
+    fat[n->clusters[i]] =
+        i + 1 < count ? n->clusters[i + 1] : FAT_END_OF_CHAIN;
+  }
+  free(run_start);
+  free(run_length);
+}
+
+static void allocate_tree(node *dir) {
+  allocate_contiguous(dir, clusters_for(dir->size), true);
+  for (size_t i = 0; i < dir->child_count; i++) {
+    node *child = dir->children[i];
+    if (child->is_dir) {
+      allocate_tree(child);
+    } else if (child->size > 0) {
+      uint32_t count = clusters_for(child->size);
+      if (child->layout == LAYOUT_FRAGMENTED) {
+        allocate_fragmented(child, count);
+      } else {
+        allocate_contiguous(child, count, child->layout == LAYOUT_CHAINED);
+      }
+    }
+  }
+}
+
+//-----------
+// CHECKSUMS
+//-----------
+static uint16_t name_hash(const uint16_t *name, uint8_t length) {
+  uint16_t hash = 0;
+  for (uint8_t i = 0; i < length; i++) {
+    uint16_t c = upper(name[i]);
+    hash = (uint16_t)(((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c & 0xFF));
+    hash = (uint16_t)(((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c >> 8));
+  }
+  return hash;
+}
+
+static uint16_t entry_set_checksum(const directory_entry *entries,
+                                   uint32_t count) {
+  const uint8_t *bytes = (const uint8_t *)entries;
+  uint16_t checksum = 0;
+  for (uint32_t i = 0; i < count * ENTRY_SIZE; i++) {
+    if (i == 2 || i == 3) {
+      continue; // the checksum field itself
+    }
+    checksum =
+        (uint16_t)(((checksum & 1) ? 0x8000 : 0) + (checksum >> 1) + bytes[i]);
+  }
+  return checksum;
+}
+
+static uint32_t checksum32(uint32_t checksum, const uint8_t *bytes,
+                           size_t length, bool boot_sector) {
+  for (size_t i = 0; i < length; i++) {
+    // volume flags and percent in use can change without a new checksum
+    if (boot_sector && (i == 106 || i == 107 || i == 112)) {
+      continue;
+    }
+    checksum = ((checksum & 1) ? 0x80000000u : 0) + (checksum >> 1) + bytes[i];
+  }
+  return checksum;
+}
+
+//---------
+// WRITING
+//---------
+static void write_at(int fd, const void *data, size_t length, uint64_t offset) {
+  const uint8_t *bytes = data;
+  while (length > 0) {
+    ssize_t written = pwrite(fd, bytes, length, (off_t)offset);
+    if (written <= 0) {
+      perror("mkimage: pwrite");
+      exit(EXIT_FAILURE);
+    }
+    bytes += written;
+    length -= (size_t)written;
+    offset += (uint64_t)written;
+  }
+}
+
+static uint64_t cluster_offset(uint32_t cluster) {
+  return ((uint64_t)mbr.cluster_heap_offset << SECTOR_SHIFT) +
+         (uint64_t)(cluster - FIRST_CLUSTER) * cluster_size;
+}
+
+// file entry + stream extension + name entries for <n>, returns entry count
+static uint32_t fill_entry_set(directory_entry *set, const node *n) {
+  uint32_t count = entries_for(n);
+  memset(set, 0, count * sizeof(directory_entry));
+
+  set[0].entry_type = DENTRY_TYPE_FILE;
+  set[0].file.secondary_count = (uint8_t)(count - 1);
+  set[0].file.file_attributes = n->is_dir ? ATTR_DIRECTORY : ATTR_ARCHIVE;
+  set[0].file.create_timestamp = n->timestamp;
+  set[0].file.last_modified_timestamp = n->timestamp;
+  set[0].file.last_accessed_timestamp = n->timestamp;
+
+  set[1].entry_type = DENTRY_TYPE_STREAM_EXTENSION;
+  set[1].stream_extension.flags.allocation_possible = 1;
+  set[1].stream_extension.flags.no_fat_chain =
+      !n->is_dir && n->layout == LAYOUT_CONTIGUOUS;
+  set[1].stream_extension.name_length = n->name_length;
+  set[1].stream_extension.name_hash = name_hash(n->name, n->name_length);
+  set[1].stream_extension.first_cluster = n->cluster_len ? n->clusters[0] : 0;
+  set[1].stream_extension.data_length = n->size;
+  set[1].stream_extension.valid_data_length = n->size;
+
+  for (uint32_t i = 2; i < count; i++) {
+    set[i].entry_type = DENTRY_TYPE_FILE_NAME;
+    for (uint32_t c = 0; c < NAME_CHARS_PER_ENTRY; c++) {
+      uint32_t index = (i - 2) * NAME_CHARS_PER_ENTRY + c;
+      if (index < n->name_length) {
+        set[i].file_name.file_name[c] = n->name[index];
+      }
+    }
+  }
+
+  set[0].file.set_checksum = entry_set_checksum(set, count);
+  return count;
+}
+
+static void write_directory(int fd, const node *dir, bool is_root) {
+  directory_entry *entries = checked_calloc(dir->size, 1);
+  uint32_t used = 0;
+
+  if (is_root) {
+    entries[used].entry_type = DENTRY_TYPE_VOLUME_LABEL;
+    entries[used].label.character_count = label_length;
+    memcpy(entries[used].label.volume_label, label, sizeof(label));
+    used++;
+
+    entries[used].entry_type = DENTRY_TYPE_ALLOCATION_BITMAP;
+    entries[used].bitmap.first_cluster = bitmap_cluster;
+    entries[used].bitmap.data_length = bitmap_bytes;
+    used++;
+
+    entries[used].entry_type = DENTRY_TYPE_UP_CASE_TABLE;
+    entries[used].up_case.table_checksum =
+        checksum32(0, (const uint8_t *)up_case, sizeof(up_case), false);
+    entries[used].up_case.first_cluster = up_case_cluster;
+    entries[used].up_case.data_length = sizeof(up_case);
+    used++;
+  }
+
+  for (size_t i = 0; i < dir->child_count; i++) {
+    used += fill_entry_set(&entries[used], dir->children[i]);
+  }
+  assert(used * ENTRY_SIZE <= dir->size);
+
+  // directories are always laid out contiguously, one write does it
+  write_at(fd, entries, dir->size, cluster_offset(dir->clusters[0]));
+  free(entries);
+
+  for (size_t i = 0; i < dir->child_count; i++) {
+    if (dir->children[i]->is_dir) {
+      write_directory(fd, dir->children[i], false);
+    }
+  }
+}
+
+// printable lines, so the files are useful to cat/grep in the shell as well
+static void write_file_data(int fd, const node *file, uint8_t *buffer) {
+  uint64_t remaining = file->size;
+  int host_fd = -1;
+
+  if (file->host_path != NULL &&
+      (host_fd = open(file->host_path, O_RDONLY)) < 0) {
+    perror(file->host_path);
+    exit(EXIT_FAILURE);
+  }
+
+  for (uint32_t i = 0; i < file->cluster_len && remaining > 0; i++) {
+    uint32_t length =
+        remaining < cluster_size ? (uint32_t)remaining : cluster_size;
+    if (host_fd >= 0) {
+      if (pread(host_fd, buffer, length, (off_t)(file->size - remaining)) !=
+          (ssize_t)length) {
+        perror(file->host_path);
+        exit(EXIT_FAILURE);
+      }
+    }
+    for (uint32_t b = 0; b < length && host_fd < 0; b++) {
+      buffer[b] = (b % LINE_LENGTH == LINE_LENGTH - 1)
+                      ? '\n'
+                      : (uint8_t)('a' + next_random() % 26);
+    }
+    write_at(fd, buffer, length, cluster_offset(file->clusters[i]));
+    remaining -= length;
+  }
+
+  if (host_fd >= 0) {
+    close(host_fd);
+  }
+}
+
+static void write_tree_data(int fd, const node *dir, uint8_t *buffer) {
+  for (size_t i = 0; i < dir->child_count; i++) {
+    const node *child = dir->children[i];
+    if (child->is_dir) {
+      write_tree_data(fd, child, buffer);
+    } else if (!sparse || child->host_path != NULL) {
+      write_file_data(fd, child, buffer);
+    }
+  }
+}
+
+static void write_boot_region(int fd, uint64_t sector) {
+  uint8_t region[BOOT_REGION_SECTORS * SECTOR_SIZE] = {0};
+  memcpy(region, &mbr, sizeof(mbr));
+
+  // extended boot sectors only need their signature
+  for (int s = 1; s <= 8; s++) {
+    uint32_t signature = 0xAA550000u;
+    memcpy(&region[(s + 1) * SECTOR_SIZE - 4], &signature, 4);
+  }
+
+  uint32_t checksum = checksum32(0, region, SECTOR_SIZE, true);
+  checksum = checksum32(checksum, region + SECTOR_SIZE, 10 * SECTOR_SIZE,
+                        false);
+  for (int i = 0; i < SECTOR_SIZE / 4; i++) {
+    memcpy(&region[11 * SECTOR_SIZE + i * 4], &checksum, 4);
+  }
+  write_at(fd, region, sizeof(region), sector << SECTOR_SHIFT);
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [options] image\n"
+          "  -s seed        seed for names, layout and contents (default %d)\n"
+          "  -c shift       log2 sectors per cluster (default %d)\n"
+          "  -l label       volume label, up to 11 characters\n"
+          "  -b             add the fixture tree bench expects under /bench\n"
+          "  -f dir:count   flat directory of <count> empty files\n"
+          "  -d dir:depth   <depth> nested directories, each with a leaf\n"
+          "  -u dir:count   <count> files with 255 character Unicode names\n"
+          "  -F path:size   file on a shuffled, fragmented FAT chain\n"
+          "  -C path:size   contiguous NoFatChain file (K/M/G suffixes)\n"
+          "  -I path:host   copy the host file <host> into the image\n"
+          "  -z             leave file contents zeroed (fast for huge files)\n",
+          program, DEFAULT_SEED, DEFAULT_CLUSTER_SHIFT);
+}
+
+int main(int argc, char **argv) {
+  int cluster_shift = DEFAULT_CLUSTER_SHIFT;
+  int option;
+  char *argument;
+  uint32_t seed = DEFAULT_SEED;
+
+  label_length = ascii2unicode(DEFAULT_LABEL, label);
+
+  // the seed has to be known before anything random is generated
+  for (int i = 1; i + 1 < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0) {
+      seed = (uint32_t)strtoul(argv[i + 1], NULL, 10);
+    }
+  }
+  seed_state = seed ? seed : DEFAULT_SEED;
+
+  for (int i = 0; i < UP_CASE_ENTRIES; i++) {
+    up_case[i] = (uint16_t)((i >= 'a' && i <= 'z') ? i - 'a' + 'A' : i);
+  }
+
+  while ((option = getopt(argc, argv, "s:c:l:bf:d:u:F:C:I:z")) != -1) {
+    argument = optarg;
+    char *colon = argument ? strrchr(argument, ':') : NULL;
+    if (strchr("fduFCI", option) && NULL == colon) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    if (colon) {
+      *colon = '\0';
+    }
+
+    switch (option) {
+    case 's':
+      break; // already handled
+    case 'c':
+      cluster_shift = atoi(argument);
+      break;
+    case 'l': {
+      uint16_t name[MAX_NAME_LENGTH];
+      uint8_t length = ascii2unicode(argument, name);
+      label_length = length > 11 ? 11 : length;
+      memset(label, 0, sizeof(label));
+      memcpy(label, name, label_length * sizeof(uint16_t));
+      break;
+    }
+    case 'b':
+      make_bench();
+      break;
+    case 'f':
+      make_flat(argument, parse_size(colon + 1));
+      break;
+    case 'd':
+      make_deep(argument, parse_size(colon + 1));
+      break;
+    case 'u':
+      make_unicode(argument, parse_size(colon + 1));
+      break;
+    case 'F':
+      make_file(argument, parse_size(colon + 1), LAYOUT_FRAGMENTED);
+      break;
+    case 'C':
+      make_file(argument, parse_size(colon + 1), LAYOUT_CONTIGUOUS);
+      break;
+    case 'I':
+      make_import(argument, colon + 1);
+      break;
+    case 'z':
+      sparse = true;
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (optind != argc - 1 || cluster_shift < 0 || cluster_shift > 16) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  cluster_size = (uint32_t)SECTOR_SIZE << cluster_shift;
+
+  // size the volume: tree, up-case table, then the bitmap (which depends on
+  // the cluster count, so settle it with a couple of passes)
+  uint64_t needed = size_tree(&root, true) + clusters_for(sizeof(up_case));
+  needed += FREE_CLUSTERS + needed / 64;
+  uint64_t cluster_count = needed;
+  for (int pass = 0; pass < 3; pass++) {
+    cluster_count = needed + clusters_for((cluster_count + 7) / 8);
+  }
+  if (cluster_count > 0xFFFFFFF5u - FIRST_CLUSTER) {
+    fprintf(stderr, "mkimage: too many clusters, use a bigger -c\n");
+    return EXIT_FAILURE;
+  }
+  bitmap_bytes = (cluster_count + 7) / 8;
+
+  uint32_t sectors_per_cluster = 1u << cluster_shift;
+  uint32_t fat_length =
+      (uint32_t)(((cluster_count + FIRST_CLUSTER) * 4 + SECTOR_SIZE - 1) /
+                 SECTOR_SIZE);
+  uint32_t heap_offset = FAT_OFFSET + fat_length;
+  heap_offset =
+      (heap_offset + sectors_per_cluster - 1) & ~(sectors_per_cluster - 1);
+
+  memcpy(mbr.jump_boot, "\xEB\x76\x90", 3);
+  memcpy(mbr.fs_name, "EXFAT   ", 8);
+  mbr.volume_length = heap_offset + cluster_count * sectors_per_cluster;
+  mbr.fat_offset = FAT_OFFSET;
+  mbr.fat_length = fat_length;
+  mbr.cluster_heap_offset = heap_offset;
+  mbr.cluster_count = (uint32_t)cluster_count;
+  mbr.volume_serial_number = seed;
+  mbr.fs_revision = 0x0100;
+  mbr.bytes_per_sector_shift = SECTOR_SHIFT;
+  mbr.sectors_per_cluster_shift = (uint8_t)cluster_shift;
+  mbr.number_of_fats = 1;
+  mbr.drive_select = 0x80;
+  mbr.boot_signature = 0xAA55;
+
+  fat = checked_calloc(cluster_count + FIRST_CLUSTER, sizeof(uint32_t));
+  bitmap = checked_calloc(clusters_for(bitmap_bytes), cluster_size);
+  fat[0] = FAT_MEDIA;
+  fat[1] = FAT_END_OF_CHAIN;
+
+  // system files first, then the root directory right after them
+  node system = {0};
+  allocate_contiguous(&system, clusters_for(bitmap_bytes), true);
+  bitmap_cluster = system.clusters[0];
+  free(system.clusters);
+  allocate_contiguous(&system, clusters_for(sizeof(up_case)), true);
+  up_case_cluster = system.clusters[0];
+  free(system.clusters);
+  allocate_tree(&root);
+  assert(next_free <= cluster_count + FIRST_CLUSTER);
+  mbr.first_cluster_of_root_directory = root.clusters[0];
+  mbr.percent_in_use =
+      (uint8_t)((next_free - FIRST_CLUSTER) * 100 / cluster_count);
+
+  int fd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("mkimage: open");
+    return EXIT_FAILURE;
+  }
+  if (ftruncate(fd, (off_t)(mbr.volume_length << SECTOR_SHIFT)) != 0) {
+    perror("mkimage: ftruncate");
+    return EXIT_FAILURE;
+  }
+
+  write_boot_region(fd, 0);
+  write_boot_region(fd, BOOT_REGION_SECTORS);
+  write_at(fd, fat, (cluster_count + FIRST_CLUSTER) * sizeof(uint32_t),
+           (uint64_t)FAT_OFFSET << SECTOR_SHIFT);
+  write_at(fd, bitmap, bitmap_bytes, cluster_offset(bitmap_cluster));
+  write_at(fd, up_case, sizeof(up_case), cluster_offset(up_case_cluster));
+  write_directory(fd, &root, true);
+
+  uint8_t *buffer = checked_calloc(1, cluster_size);
+  write_tree_data(fd, &root, buffer);
+  free(buffer);
+
+  close(fd);
+  printf("%s: %" PRIu64 " clusters of %u bytes, %u in use\n", argv[optind],
+         cluster_count, cluster_size, next_free - FIRST_CLUSTER);
+  return EXIT_SUCCESS;
+}
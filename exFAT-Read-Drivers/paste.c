@@ -2,36 +2,46 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+// writes <line> without its '\n'
+static void put_line(const char *line, ssize_t length) {
+  if (length > 0 && line[length - 1] == '\n') {
+    length--;
+  }
+  if (length > 0) {
+    fwrite(line, 1, (size_t)length, stdout);
+  }
+}
+
 int main(int argc, char **argv) {
-  char buffer = '\0';
-  ssize_t bytes_read = 0;
-  int fd1, fd2;
+  char *line1 = NULL, *line2 = NULL;
+  size_t capacity1 = 0, capacity2 = 0;
+  ssize_t length1, length2;
+  exfat_FILE *stream1, *stream2;
 
   exfat_error err = exfat_mount(argv[1], EXFAT_FS_EXFAT);
 
   if (err == EXFAT_OK && argc == 4) {
-    fd1 = exfat_open(argv[2]);
-    fd2 = exfat_open(argv[3]);
+    stream1 = exfat_fopen(argv[2]);
+    stream2 = exfat_fopen(argv[3]);
 
-    if (fd1 != EXFAT_FILE_NOT_FOUND && fd2 != EXFAT_FILE_NOT_FOUND) {
+    if (stream1 != NULL && stream2 != NULL) {
       do {
-        bytes_read = 0;
-        while ((bytes_read += exfat_read(fd1, &buffer, 1)) > 0 &&
-               buffer != '\n') {
-          putchar(buffer);
-        }
-
-        while ((bytes_read += exfat_read(fd2, &buffer, 1)) > 0 &&
-               buffer != '\n') {
-          putchar(buffer);
-        }
-
+        length1 = exfat_getline(&line1, &capacity1, stream1);
+        length2 = exfat_getline(&line2, &capacity2, stream2);
+        put_line(line1, length1);
+        put_line(line2, length2);
         putchar('\n');
-      } while (bytes_read > 0);
+      } while (length1 > 0 || length2 > 0);
+    }
 
-      exfat_close(fd1);
-      exfat_close(fd2);
+    if (stream1 != NULL) {
+      exfat_fclose(stream1);
+    }
+    if (stream2 != NULL) {
+      exfat_fclose(stream2);
     }
+    free(line1);
+    free(line2);
 
     exfat_unmount();
   }
@@ -0,0 +1,452 @@
+// Tests of the driver's internal routines. The driver is included whole so
+// its static functions can be called without an image: every SIMD path is
+// checked against the scalar one it replaces.
+#include "exfat_driver.c"
+
+#include <stdio.h>
+
+#define TEST_SEED 0x3430u
+
+// xorshift32, the same runs every time
+static uint32_t test_random(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+//-------------
+// CLASSIFIERS
+//-------------
+#define TEST_WINDOW_ENTRIES 256
+
+// writes an entry of <type> at <entry>, with the bytes after the type set so
+// only a classifier that looks at the type byte alone gets it right
+static void put_entry(uint8_t *window, uint32_t entry, uint8_t type) {
+  uint8_t *bytes = window + (size_t)entry * DENTRY_SIZE;
+  for (size_t i = 0; i < DENTRY_SIZE; i++) {
+    bytes[i] = (uint8_t)(0xA5 ^ i ^ entry);
+  }
+  bytes[0] = type;
+}
+
+// writes a file's entry set at <entry>: the file entry, its stream extension
+// and <names> file name entries, with the in use bit cleared if <deleted>.
+// Returns the entry after the set
+static uint32_t put_set(uint8_t *window, uint32_t entry, uint32_t names,
+                        bool deleted) {
+  uint8_t in_use = deleted ? 0x80 : 0;
+  put_entry(window, entry++, DENTRY_TYPE_FILE & ~in_use);
+  put_entry(window, entry++, DENTRY_TYPE_STREAM_EXTENSION & ~in_use);
+  for (uint32_t i = 0; i < names; i++) {
+    put_entry(window, entry++, DENTRY_TYPE_FILE_NAME & ~in_use);
+  }
+  return entry;
+}
+
+// runs every classifier this CPU has on <count> entries from <entry> of
+// <window> and checks each against classify_entries_scalar
+static void check_classifiers(const uint8_t *window, uint32_t entry,
+                              uint32_t count) {
+  const uint8_t *entries = window + (size_t)entry * DENTRY_SIZE;
+  uint64_t expected_ends, ends;
+  uint64_t expected = classify_entries_scalar(entries, count, &expected_ends);
+
+  // the scalar classifier itself, against the type bytes
+  for (uint32_t i = 0; i < count; i++) {
+    uint8_t type = entries[(size_t)i * DENTRY_SIZE];
+    assert(((expected >> i) & 1) == (type == DENTRY_TYPE_FILE));
+    assert(((expected_ends >> i) & 1) == (type == DENTRY_TYPE_END));
+  }
+  assert(count == 64 || (expected >> count) == 0);
+
+#ifdef EXFAT_SIMD_X86
+  assert(classify_entries_sse2(entries, count, &ends) == expected);
+  assert(ends == expected_ends);
+  if (__builtin_cpu_supports("avx2")) {
+    assert(classify_entries_avx2(entries, count, &ends) == expected);
+    assert(ends == expected_ends);
+  }
+#else
+  (void)ends;
+#endif
+}
+
+// every block size scan_dir_window can ask for, from every entry of <window>
+static void check_every_block(const uint8_t *window) {
+  for (uint32_t entry = 0; entry + 64 <= TEST_WINDOW_ENTRIES; entry++) {
+    for (uint32_t count = 0; count <= 64; count++) {
+      check_classifiers(window, entry, count);
+    }
+  }
+}
+
+void test_classifiers(void) {
+  static uint8_t window[TEST_WINDOW_ENTRIES * DENTRY_SIZE];
+  uint32_t state = TEST_SEED;
+
+  // Test 1: sets of every size, every third one deleted, until the end
+  {
+    uint32_t entry = 0;
+    for (uint32_t i = 0; entry + 2 + i % 18 < TEST_WINDOW_ENTRIES; i++) {
+      entry = put_set(window, entry, i % 18, i % 3 == 2);
+    }
+    while (entry < TEST_WINDOW_ENTRIES) {
+      put_entry(window, entry++, DENTRY_TYPE_END);
+    }
+    check_every_block(window);
+    printf("Classifier test 1 passed.\n");
+  }
+
+  // Test 2: sets that cross every 64 entry block and every 4 and 8 entry
+  // step of the SIMD loops, with a file entry as the last of a block
+  {
+    uint32_t entry = 0;
+    for (uint32_t i = 0; entry + 3 < TEST_WINDOW_ENTRIES; i++) {
+      if ((entry + 1) % 64 == 0) {
+        entry = put_set(window, entry, 1, false); // file entry ends the block
+      } else {
+        entry = put_set(window, entry, 1 + (i % 2), false);
+      }
+    }
+    while (entry < TEST_WINDOW_ENTRIES) {
+      put_entry(window, entry++, DENTRY_TYPE_FILE);
+    }
+    check_every_block(window);
+    printf("Classifier test 2 passed.\n");
+  }
+
+  // Test 3: an end marker in the middle of a block, left over sets and
+  // garbage after it, the way a directory that had names removed looks
+  {
+    for (uint32_t end = 0; end < 64; end += 7) {
+      uint32_t entry = put_set(window, 0, 2, false);
+      while (entry < end) {
+        put_entry(window, entry++, DENTRY_TYPE_FILE & 0x7F);
+      }
+      put_entry(window, end, DENTRY_TYPE_END);
+      for (entry = end + 1; entry < TEST_WINDOW_ENTRIES; entry++) {
+        put_entry(window, entry, entry % 5 == 0 ? DENTRY_TYPE_END
+                                 : entry % 3 == 0 ? DENTRY_TYPE_FILE
+                                                  : (uint8_t)entry);
+      }
+      check_every_block(window);
+    }
+    printf("Classifier test 3 passed.\n");
+  }
+
+  // Test 4: random type bytes, mostly the ones a directory holds
+  {
+    static const uint8_t types[] = {
+        DENTRY_TYPE_FILE, DENTRY_TYPE_STREAM_EXTENSION, DENTRY_TYPE_FILE_NAME,
+        DENTRY_TYPE_END,  DENTRY_TYPE_FILE & 0x7F,      0xFF};
+    for (int round = 0; round < 8; round++) {
+      for (uint32_t entry = 0; entry < TEST_WINDOW_ENTRIES; entry++) {
+        put_entry(window, entry, types[test_random(&state) % sizeof(types)]);
+      }
+      check_every_block(window);
+    }
+    printf("Classifier test 4 passed.\n");
+  }
+}
+
+//--------------
+// BIT COUNTERS
+//--------------
+#define TEST_BITMAP_BYTES 4096
+
+// runs every bit counter this CPU has on the <length> bytes at <bytes> and
+// checks each against count_bits_scalar
+static void check_bit_counters(const uint8_t *bytes, size_t length) {
+  uint64_t expected = count_bits_scalar(bytes, length);
+
+#ifdef EXFAT_SIMD_X86
+  if (__builtin_cpu_supports("popcnt")) {
+    assert(count_bits_popcnt(bytes, length) == expected);
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    assert(count_bits_avx2(bytes, length) == expected);
+  }
+#else
+  (void)expected;
+#endif
+}
+
+// count_used_clusters with <counter> on a bitmap of <cluster_count> clusters
+// at <bits>, whose last byte may hold bits past the last cluster
+static uint64_t used_clusters_with(uint64_t (*counter)(const uint8_t *,
+                                                       size_t),
+                                   const uint8_t *bits,
+                                   uint32_t cluster_count) {
+  allocation_bitmap_bits = bits;
+  mbr.cluster_count = cluster_count;
+  count_bits = counter;
+  atomic_store(&used_clusters, UINT64_MAX);
+  uint64_t used = count_used_clusters();
+  allocation_bitmap_bits = NULL;
+  count_bits = count_bits_scalar;
+  return used;
+}
+
+void test_bit_counters(void) {
+  static uint8_t bytes[TEST_BITMAP_BYTES + 32];
+  uint32_t state = TEST_SEED;
+
+  for (size_t i = 0; i < sizeof(bytes); i++) {
+    bytes[i] = (uint8_t)test_random(&state);
+  }
+
+  // Test 1: the scalar counter, against one bit at a time
+  {
+    for (size_t length = 0; length <= 1000; length += 37) {
+      uint64_t expected = 0;
+      for (size_t i = 0; i < length * 8; i++) {
+        expected += (bytes[i / 8] >> (i % 8)) & 1;
+      }
+      assert(count_bits_scalar(bytes, length) == expected);
+    }
+    printf("Bit counter test 1 passed.\n");
+  }
+
+  // Test 2: every length up to a few AVX2 steps, odd ones included, from
+  // every alignment within a vector
+  {
+    for (size_t offset = 0; offset < 32; offset++) {
+      for (size_t length = 0; length <= 600; length++) {
+        check_bit_counters(bytes + offset, length);
+      }
+    }
+    check_bit_counters(bytes, TEST_BITMAP_BYTES);
+    check_bit_counters(bytes + 1, TEST_BITMAP_BYTES - 1);
+    printf("Bit counter test 2 passed.\n");
+  }
+
+  // Test 3: all ones and all zeros, where a byte count would overflow first
+  {
+    static uint8_t ones[TEST_BITMAP_BYTES];
+    memset(ones, 0xFF, sizeof(ones));
+    for (size_t length = 0; length <= sizeof(ones); length += 255) {
+      assert(count_bits_scalar(ones, length) == length * 8);
+      check_bit_counters(ones, length);
+    }
+    memset(ones, 0, sizeof(ones));
+    check_bit_counters(ones, sizeof(ones));
+    printf("Bit counter test 3 passed.\n");
+  }
+
+  // Test 4: cluster counts that are not a multiple of 8 only count the bits
+  // of the last byte that stand for clusters
+  {
+    static uint8_t bits[TEST_BITMAP_BYTES];
+    memcpy(bits, bytes, sizeof(bits));
+    for (uint32_t cluster_count = 1; cluster_count <= 8 * 700;
+         cluster_count += cluster_count < 64 ? 1 : 61) {
+      bits[cluster_count / 8] |= (uint8_t)(0xFF << (cluster_count % 8));
+      uint64_t expected = 0;
+      for (uint32_t i = 0; i < cluster_count; i++) {
+        expected += (bits[i / 8] >> (i % 8)) & 1;
+      }
+      assert(used_clusters_with(count_bits_scalar, bits, cluster_count) ==
+             expected);
+#ifdef EXFAT_SIMD_X86
+      if (__builtin_cpu_supports("popcnt")) {
+        assert(used_clusters_with(count_bits_popcnt, bits, cluster_count) ==
+               expected);
+      }
+      if (__builtin_cpu_supports("avx2")) {
+        assert(used_clusters_with(count_bits_avx2, bits, cluster_count) ==
+               expected);
+      }
+#endif
+    }
+    printf("Bit counter test 4 passed.\n");
+  }
+}
+
+//--------------------------
+// NAME INDEX AND WILDCARDS
+//--------------------------
+// a name for the index, <wide> if it had a character over 8 bits
+typedef struct {
+  const char *name;
+  bool wide;
+} test_name;
+
+// builds <index> from <names> the way build_name_index sorts them
+static void make_index(name_index *index, const test_name *names,
+                       uint32_t count) {
+  size_t bytes = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    bytes += strlen(names[i].name) + 1;
+  }
+  index->count = count;
+  index->entries = calloc(count, sizeof(name_index_entry));
+  index->names = malloc(bytes);
+  assert(NULL != index->entries && NULL != index->names);
+
+  for (uint32_t i = 0, offset = 0; i < count; i++) {
+    size_t length = strlen(names[i].name);
+    index->entries[i].name = offset;
+    index->entries[i].length = (uint8_t)length;
+    index->entries[i].wide = names[i].wide;
+    memcpy(index->names + offset, names[i].name, length + 1);
+    offset += (uint32_t)length + 1;
+  }
+  qsort_r(index->entries, index->count, sizeof(*index->entries),
+          compare_index_entries, index->names);
+}
+
+// checks that the entries exfat_glob takes for <prefix>, from
+// index_lower_bound on, are exactly the names starting with it (without case)
+static void check_prefix_range(const name_index *index, const char *prefix) {
+  size_t length = strlen(prefix);
+  uint32_t first = index_lower_bound(index, prefix, length), end = first;
+  while (end < index->count && index->entries[end].length >= length &&
+         0 == compare_names(index->names + index->entries[end].name, length,
+                            prefix, length)) {
+    end++;
+  }
+
+  for (uint32_t i = 0; i < index->count; i++) {
+    const name_index_entry *entry = &index->entries[i];
+    bool starts = entry->length >= length &&
+                  0 == compare_names(index->names + entry->name, length,
+                                     prefix, length);
+    assert(starts == (i >= first && i < end));
+    if (i < first) { // everything before the bound sorts before the prefix
+      assert(compare_names(index->names + entry->name, entry->length, prefix,
+                           length) < 0);
+    }
+  }
+}
+
+void test_glob_match(void) {
+  // Test 1: a leading '.' is only matched by a '.'
+  {
+    assert(!glob_match("*", ".hidden", 7));
+    assert(!glob_match("?hidden", ".hidden", 7));
+    assert(!glob_match("*hidden", ".hidden", 7));
+    assert(glob_match(".*", ".hidden", 7));
+    assert(glob_match(".h?dden", ".hidden", 7));
+    assert(glob_match("*.c", "main.c", 6)); // only the leading one counts
+    assert(glob_match("*", "", 0));
+    printf("Wildcard test 1 passed.\n");
+  }
+
+  // Test 2: several '*', which have to backtrack
+  {
+    assert(glob_match("a*b*c", "axxbyyc", 7));
+    assert(glob_match("a*b*c", "abc", 3));
+    assert(!glob_match("a*b*c", "axxbyy", 6));
+    assert(glob_match("*a*a*", "banana", 6));
+    assert(glob_match("*an*an*", "banana", 6));
+    assert(!glob_match("*x*", "banana", 6));
+    assert(glob_match("**", "abc", 3));
+    assert(glob_match("b**a", "banana", 6));
+    assert(!glob_match("*ab*ab", "abab_ab_b", 9));
+    printf("Wildcard test 2 passed.\n");
+  }
+
+  // Test 3: '?' after the last '*', checked against the end of the name
+  {
+    assert(glob_match("*.?", "file.c", 6));
+    assert(!glob_match("*.?", "file.cc", 7));
+    assert(glob_match("*.??", "file.cc", 7));
+    assert(!glob_match("f*?", "f", 1));
+    assert(glob_match("f*?", "fx", 2));
+    assert(!glob_match("*??", "a", 1));
+    assert(glob_match("*?1?", "file0000010", 11));
+    assert(!glob_match("file000001?", "file00000100", 12));
+    printf("Wildcard test 3 passed.\n");
+  }
+
+  // Test 4: only <length> characters of the name count, and 8 bit names
+  {
+    assert(glob_match("ab", "abc", 2));
+    assert(!glob_match("abc", "abc", 2));
+    assert(glob_match("*b", "abc", 2));
+    assert(glob_match("\xE9t\xE9", "\xE9t\xE9", 3));
+    assert(glob_match("?t*", "\xE9t\xE9", 3));
+    assert(!glob_match("E*", "\xE9t\xE9", 3)); // no case folding past ASCII
+    printf("Wildcard test 4 passed.\n");
+  }
+}
+
+void test_name_index(void) {
+  static const test_name names[] = {
+      {"banana", false},
+      {"BAND", false},
+      {"b", false},
+      {"apricot", false},
+      {"Apple", false},
+      {"ab", false},
+      {"AB", false},
+      {"c", false},
+      {"file0000010", false},
+      {"file0000011", false},
+      {"file000001", false},
+      {"file00000100", false},
+      {"\xE9t\xE9", false}, // U+00E9 fits in 8 bits
+      {"\x01\x01", true},   // two U+0101, kept as their low bytes
+      {"\001b", true},      // U+0101 then b
+  };
+  uint32_t count = sizeof(names) / sizeof(names[0]);
+  name_index index = {0};
+  make_index(&index, names, count);
+
+  // Test 1: exact names are found at their first entry, without case
+  {
+    uint32_t found = index_lower_bound(&index, "BANANA", 6);
+    assert(found < index.count);
+    assert(0 == strcmp(index.names + index.entries[found].name, "banana"));
+    found = index_lower_bound(&index, "ab", 2); // "ab" and "AB" are equal
+    assert(found > 0 && found + 1 < index.count);
+    assert(index.entries[found].length == 2);
+    assert(0 != compare_names(index.names + index.entries[found - 1].name,
+                              index.entries[found - 1].length, "ab", 2));
+    assert(0 == compare_names(index.names + index.entries[found + 1].name,
+                              index.entries[found + 1].length, "ab", 2));
+    printf("Name index test 1 passed.\n");
+  }
+
+  // Test 2: the bounds of the prefix ranges exfat_glob matches in
+  {
+    static const char *prefixes[] = {"",     "a",          "A",   "ab",
+                                     "b",    "ba",         "BAN", "c",
+                                     "cz",   "file000001", "0",   "zzz",
+                                     "\xE9", "\x01"};
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+      check_prefix_range(&index, prefixes[i]);
+    }
+    assert(index_lower_bound(&index, "", 0) == 0);
+    // past every ASCII name, only the 8 bit one sorts after it
+    assert(index_lower_bound(&index, "zzz", 3) == index.count - 1);
+    printf("Name index test 2 passed.\n");
+  }
+
+  // Test 3: wide names sort by their low bytes, apart from the 8 bit ones
+  {
+    uint32_t found = index_lower_bound(&index, "\x01", 1);
+    assert(found == 0); // below every printable name
+    assert(index.entries[0].wide && index.entries[1].wide);
+    found = index_lower_bound(&index, "\xE9", 1);
+    assert(found == index.count - 1); // above every ASCII name
+    assert(!index.entries[found].wide);
+    printf("Name index test 3 passed.\n");
+  }
+
+  free(index.entries);
+  free(index.names);
+}
+
+int main(void) {
+  printf("Running tests...\n\n");
+  test_classifiers();
+  test_bit_counters();
+  test_glob_match();
+  test_name_index();
+  printf("\nAll tests passed!\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,433 @@
+#define _GNU_SOURCE // For wait4
+#include <sys/mman.h>     // For mmap
+#include <sys/resource.h> // For struct rusage
+#include <sys/wait.h>     // For wait4
+#include <unistd.h>       // For pipe, fork, read, write
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <assert.h>
+
+#include "alloc_count.h"
+
+/*
+ * nqp_bench: replays a recorded command stream through nqp_shell and reports
+ * commands per second, latency percentiles per command type and peak RSS.
+ *
+ * The stream is either a session log written with `-o` (lines look like
+ * "LABEL:\> command") or a plain script with one command per line, '#' starts
+ * a comment. Every command is sent followed by an empty line: the shell prints
+ * its prompt right after reading a line, so the prompt for that empty line
+ * only shows up once the command itself has finished.
+ *
+ * With `-a alloc_count.so` the shell runs with that preloaded and the heap
+ * allocations of every command are reported as well. The first pass over the
+ * stream fills the shell's caches and pools, so when there are repeats only
+ * the later ones count. The "shell" column is the part the shell made itself
+ * (parsing, plans, redirections, pipes and dispatch), the rest is the
+ * commands' own: the builtins' bodies and the file system reads that load a
+ * program or a "<" file.
+ */
+
+#define MAX_LINE_SIZE 256
+#define READ_BUFFER_SIZE 4096
+#define PIPE_READ_END 0
+#define PIPE_WRITE_END 1
+#define PROMPT_MARKER ":\\> "
+#define NANOS_PER_MICRO 1000.0
+#define NANOS_PER_SECOND 1e9
+
+// COMMAND TYPES
+typedef enum {
+  TYPE_BUILTIN,
+  TYPE_EXTERNAL,
+  TYPE_PIPELINE,
+  TYPE_REDIRECTION,
+
+  // TYPE_COUNT should always be last
+  TYPE_COUNT
+} Command_Type;
+
+static const char *type_names[TYPE_COUNT] = {"builtin", "external", "pipeline",
+                                             "redirection"};
+static const char *builtins[] = {"cd",   "ls",   "pwd",    "du",      "find",
+                                 "tree", "grep", "export", "latency", "hash",
+                                 NULL};
+
+// SAMPLES
+// nanosecond latencies of every replayed command of one type
+typedef struct {
+  uint64_t *samples;
+  size_t count;
+  size_t capacity;
+} Sample_List;
+
+// SHELL CONNECTION
+typedef struct {
+  pid_t pid;
+  int to_shell;      // write end of the shell's stdin
+  int from_shell;    // read end of the shell's stdout
+  size_t marker_pos; // how much of PROMPT_MARKER the last read ended in
+} Shell;
+
+//--------
+// HELPERS
+//--------
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static int compare_samples(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void sample_list_add(Sample_List *list, uint64_t sample) {
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 64;
+    list->samples = realloc(list->samples, list->capacity * sizeof(uint64_t));
+    assert(NULL != list->samples);
+    if (NULL == list->samples) {
+      perror("nqp_bench: realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  list->samples[list->count++] = sample;
+}
+
+// nearest rank percentile of an already sorted list
+static uint64_t sample_list_percentile(const Sample_List *list,
+                                       double percentile) {
+  if (list->count == 0)
+    return 0;
+  size_t rank = (size_t)((percentile / 100.0) * (double)list->count + 0.999);
+  if (rank < 1)
+    rank = 1;
+  if (rank > list->count)
+    rank = list->count;
+  return list->samples[rank - 1];
+}
+
+// classifies a command line the same way the shell's main loop dispatches it
+static Command_Type classify(const char *line) {
+  if (strchr(line, '|') != NULL)
+    return TYPE_PIPELINE;
+  if (strchr(line, '<') != NULL)
+    return TYPE_REDIRECTION;
+
+  char name[MAX_LINE_SIZE] = {0};
+  sscanf(line, "%255s", name);
+  for (int i = 0; builtins[i] != NULL; i++) {
+    if (strcmp(name, builtins[i]) == 0)
+      return TYPE_BUILTIN;
+  }
+  return TYPE_EXTERNAL;
+}
+
+// turns one line of the stream into a command, false if there is none on it.
+// In a session log only the lines with a prompt hold commands, everything
+// else is their output.
+static bool extract_command(char *line, bool is_log) {
+  line[strcspn(line, "\n")] = '\0';
+
+  char *prompt = strstr(line, PROMPT_MARKER);
+  if (is_log) {
+    if (NULL == prompt)
+      return false; // command output
+    memmove(line, prompt + strlen(PROMPT_MARKER),
+            strlen(prompt + strlen(PROMPT_MARKER)) + 1);
+  } else if (line[0] == '#') {
+    return false; // comment in a script
+  }
+
+  // skip anything left empty, the shell would just ignore it
+  for (char *c = line; *c; c++) {
+    if (*c != ' ' && *c != '\t')
+      return true;
+  }
+  return false;
+}
+
+//------------------
+// SHELL CONNECTION
+//------------------
+// waits until <prompts> more prompts have been printed by the shell, false if
+// the shell exited first
+static bool wait_for_prompts(Shell *shell, int prompts) {
+  char buffer[READ_BUFFER_SIZE];
+  const size_t marker_len = strlen(PROMPT_MARKER);
+
+  while (prompts > 0) {
+    ssize_t n = read(shell->from_shell, buffer, sizeof(buffer));
+    if (n <= 0)
+      return false;
+    for (ssize_t i = 0; i < n; i++) {
+      // a small matcher that survives the marker being split across reads
+      if (buffer[i] == PROMPT_MARKER[shell->marker_pos]) {
+        shell->marker_pos++;
+      } else {
+        shell->marker_pos = buffer[i] == PROMPT_MARKER[0] ? 1 : 0;
+      }
+      if (shell->marker_pos == marker_len) {
+        shell->marker_pos = 0;
+        prompts--;
+      }
+    }
+  }
+  return true;
+}
+
+// <counter> is where the preloaded alloc_count.so counts, NULL if not used
+static bool shell_start(Shell *shell, char *argv[], Alloc_Counter *counter) {
+  int to_shell[2], from_shell[2];
+  if (pipe(to_shell) < 0 || pipe(from_shell) < 0) {
+    perror("nqp_bench: pipe");
+    return false;
+  }
+
+  shell->pid = fork();
+  if (shell->pid < 0) {
+    perror("nqp_bench: fork");
+    return false;
+  }
+  if (shell->pid == 0) { // child: becomes the shell
+    dup2(to_shell[PIPE_READ_END], STDIN_FILENO);
+    dup2(from_shell[PIPE_WRITE_END], STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDERR_FILENO); // command errors are not part of the report
+    close(to_shell[PIPE_READ_END]);
+    close(to_shell[PIPE_WRITE_END]);
+    close(from_shell[PIPE_READ_END]);
+    close(from_shell[PIPE_WRITE_END]);
+    if (NULL != counter)
+      counter->pid = getpid(); // execv keeps the pid
+    execv(argv[0], argv);
+    perror("nqp_bench: execv");
+    exit(EXIT_FAILURE);
+  }
+
+  close(to_shell[PIPE_READ_END]);
+  close(from_shell[PIPE_WRITE_END]);
+  shell->to_shell = to_shell[PIPE_WRITE_END];
+  shell->from_shell = from_shell[PIPE_READ_END];
+  shell->marker_pos = 0;
+
+  // the first prompt is printed once the volume is mounted
+  return wait_for_prompts(shell, 1);
+}
+
+// sends <command> and waits for it to finish, returns its latency or 0 if the
+// shell went away
+static uint64_t shell_run(Shell *shell, const char *command) {
+  char message[MAX_LINE_SIZE + 2];
+  int len = snprintf(message, sizeof(message), "%s\n\n", command);
+
+  uint64_t start = now_ns();
+  if (write(shell->to_shell, message, len) != len)
+    return 0;
+  if (!wait_for_prompts(shell, 2))
+    return 0;
+  return now_ns() - start;
+}
+
+//------
+// MAIN
+//------
+int main(int argc, char *argv[]) {
+  int repeats = 1;
+  const char *log_path = NULL;
+  const char *alloc_shim = NULL;
+  int option;
+
+  while ((option = getopt(argc, argv, "n:o:a:")) != -1) {
+    if (option == 'n') {
+      repeats = atoi(optarg);
+    } else if (option == 'o') {
+      log_path = optarg; // run the shell with logging, like `-o`
+    } else if (option == 'a') {
+      alloc_shim = optarg; // count allocations with alloc_count.so
+    } else {
+      break;
+    }
+  }
+  if (argc - optind != 3 || repeats < 1) {
+    fprintf(stderr,
+            "Usage: %s [-n repeats] [-o log.txt] [-a alloc_count.so] "
+            "nqp_shell volume.img script.txt\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+  const char *shell_path = argv[optind];
+  const char *image = argv[optind + 1];
+  const char *script_path = argv[optind + 2];
+
+  // load the whole stream up front so file reads are not in the timings
+  FILE *script = fopen(script_path, "r");
+  if (NULL == script) {
+    perror(script_path);
+    return EXIT_FAILURE;
+  }
+  char **commands = NULL;
+  size_t num_commands = 0;
+  char line[MAX_LINE_SIZE * 2];
+
+  // anything with a prompt in it was written by `-o`
+  bool is_log = false;
+  while (!is_log && fgets(line, sizeof(line), script) != NULL) {
+    is_log = strstr(line, PROMPT_MARKER) != NULL;
+  }
+  rewind(script);
+
+  while (fgets(line, sizeof(line), script) != NULL) {
+    if (!extract_command(line, is_log))
+      continue;
+    commands = realloc(commands, (num_commands + 1) * sizeof(char *));
+    assert(NULL != commands);
+    commands[num_commands++] = strndup(line, MAX_LINE_SIZE - 1);
+  }
+  fclose(script);
+
+  // the counter file alloc_count.so maps in the shell, which only finds it
+  // through the environment
+  Alloc_Counter *counter = NULL;
+  char counter_path[] = "/tmp/nqp_bench_allocXXXXXX";
+  if (NULL != alloc_shim) {
+    int counter_fd = mkstemp(counter_path);
+    if (counter_fd < 0 || ftruncate(counter_fd, sizeof(Alloc_Counter)) < 0) {
+      perror("nqp_bench: counter file");
+      return EXIT_FAILURE;
+    }
+    counter = mmap(NULL, sizeof(Alloc_Counter), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, counter_fd, 0);
+    close(counter_fd);
+    if (MAP_FAILED == counter) {
+      perror("nqp_bench: mmap");
+      return EXIT_FAILURE;
+    }
+    setenv("LD_PRELOAD", alloc_shim, 1);
+    setenv(ALLOC_COUNTER_VARIABLE, counter_path, 1);
+  }
+
+  // start the shell
+  char *shell_argv[] = {(char *)shell_path, (char *)image, "-o",
+                        (char *)log_path, NULL};
+  if (NULL == log_path)
+    shell_argv[2] = NULL;
+  Shell shell;
+  uint64_t start = now_ns();
+  if (!shell_start(&shell, shell_argv, counter)) {
+    fprintf(stderr, "nqp_bench: %s did not start\n", shell_path);
+    return EXIT_FAILURE;
+  }
+  uint64_t startup = now_ns() - start;
+
+  // replay
+  Sample_List lists[TYPE_COUNT] = {0};
+  Sample_List all = {0};
+  Sample_List allocations[TYPE_COUNT] = {0};
+  Sample_List all_allocations = {0};
+  uint64_t shell_allocations[TYPE_COUNT + 1] = {0}; // [TYPE_COUNT]: all
+  start = now_ns();
+  for (int r = 0; r < repeats; r++) {
+    for (size_t i = 0; i < num_commands; i++) {
+      uint64_t before = NULL != counter ? counter->allocations : 0;
+      uint64_t before_commands =
+          NULL != counter ? counter->command_allocations : 0;
+      uint64_t latency = shell_run(&shell, commands[i]);
+      if (latency == 0) {
+        fprintf(stderr, "nqp_bench: shell exited during: %s\n", commands[i]);
+        r = repeats;
+        break;
+      }
+      sample_list_add(&lists[classify(commands[i])], latency);
+      sample_list_add(&all, latency);
+      if (NULL != counter && (r > 0 || repeats == 1)) {
+        uint64_t made = counter->allocations - before;
+        uint64_t by_shell =
+            made - (counter->command_allocations - before_commands);
+        sample_list_add(&allocations[classify(commands[i])], made);
+        sample_list_add(&all_allocations, made);
+        shell_allocations[classify(commands[i])] += by_shell;
+        shell_allocations[TYPE_COUNT] += by_shell;
+      }
+    }
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  // let the shell exit on EOF and collect its peak RSS
+  close(shell.to_shell);
+  char drain[READ_BUFFER_SIZE];
+  while (read(shell.from_shell, drain, sizeof(drain)) > 0) {
+  }
+  close(shell.from_shell);
+  struct rusage shell_usage, children_usage;
+  wait4(shell.pid, NULL, 0, &shell_usage);
+  getrusage(RUSAGE_CHILDREN, &children_usage);
+
+  // report
+  printf("commands: %zu in %.3f s (%.1f commands/s), startup %.1f ms\n",
+         all.count, elapsed / NANOS_PER_SECOND,
+         elapsed ? all.count / (elapsed / NANOS_PER_SECOND) : 0.0,
+         startup / NANOS_PER_MICRO / 1000.0);
+  printf("peak RSS: shell %ld KB, largest process %ld KB\n",
+         shell_usage.ru_maxrss, children_usage.ru_maxrss);
+  printf("%-12s %8s %10s %10s %10s %10s\n", "type", "count", "p50(us)",
+         "p90(us)", "p99(us)", "max(us)");
+  for (int t = 0; t <= TYPE_COUNT; t++) {
+    Sample_List *list = t < TYPE_COUNT ? &lists[t] : &all;
+    if (list->count == 0)
+      continue;
+    qsort(list->samples, list->count, sizeof(uint64_t), compare_samples);
+    printf("%-12s %8zu %10.1f %10.1f %10.1f %10.1f\n",
+           t < TYPE_COUNT ? type_names[t] : "all", list->count,
+           sample_list_percentile(list, 50.0) / NANOS_PER_MICRO,
+           sample_list_percentile(list, 90.0) / NANOS_PER_MICRO,
+           sample_list_percentile(list, 99.0) / NANOS_PER_MICRO,
+           list->samples[list->count - 1] / NANOS_PER_MICRO);
+  }
+
+  if (NULL != counter) {
+    printf("heap allocations per command%s:\n",
+           repeats > 1 ? " (after the first pass)" : "");
+    printf("%-12s %8s %10s %10s %10s %10s\n", "type", "count", "total",
+           "mean", "max", "shell");
+    for (int t = 0; t <= TYPE_COUNT; t++) {
+      Sample_List *list = t < TYPE_COUNT ? &allocations[t] : &all_allocations;
+      if (list->count == 0)
+        continue;
+      uint64_t total = 0, most = 0;
+      for (size_t i = 0; i < list->count; i++) {
+        total += list->samples[i];
+        most = list->samples[i] > most ? list->samples[i] : most;
+      }
+      printf("%-12s %8zu %10" PRIu64 " %10.1f %10" PRIu64 " %10" PRIu64 "\n",
+             t < TYPE_COUNT ? type_names[t] : "all", list->count, total,
+             (double)total / list->count, most, shell_allocations[t]);
+    }
+    munmap(counter, sizeof(Alloc_Counter));
+    unlink(counter_path);
+  }
+
+  // clean up
+  for (int t = 0; t < TYPE_COUNT; t++) {
+    free(lists[t].samples);
+    free(allocations[t].samples);
+  }
+  free(all.samples);
+  free(all_allocations.samples);
+  for (size_t i = 0; i < num_commands; i++) {
+    free(commands[i]);
+  }
+  free(commands);
+  return EXIT_SUCCESS;
+}
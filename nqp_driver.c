@@ -0,0 +1,38 @@
+// The file system module behind nqp_io.h, built from the exFAT driver in
+// exFAT-Read-Drivers. The driver is written against exfat_io.h and the two
+// interfaces only differ in their prefix, so the public names are mapped here
+// and the driver source is compiled as is.
+#define exfat_mount nqp_mount
+#define exfat_unmount nqp_unmount
+#define exfat_share_caches nqp_share_caches
+#define exfat_vol_label nqp_vol_label
+#define exfat_statfs nqp_statfs
+#define exfat_open nqp_open
+#define exfat_openat nqp_openat
+#define exfat_open_by_inode nqp_open_by_inode
+#define exfat_stat nqp_stat
+#define exfat_fstat nqp_fstat
+#define exfat_close nqp_close
+#define exfat_dup nqp_dup
+#define exfat_read nqp_read
+#define exfat_pread nqp_pread
+#define exfat_readv nqp_readv
+#define exfat_preadv nqp_preadv
+#define exfat_read_async nqp_read_async
+#define exfat_read_complete nqp_read_complete
+#define exfat_extents nqp_extents
+#define exfat_fadvise nqp_fadvise
+#define exfat_fopen nqp_fopen
+#define exfat_fclose nqp_fclose
+#define exfat_getc_refill nqp_getc_refill
+#define exfat_getc nqp_getc
+#define exfat_getline nqp_getline
+#define exfat_fread nqp_fread
+#define exfat_getdents nqp_getdents
+#define exfat_getdents_stat nqp_getdents_stat
+#define exfat_glob nqp_glob
+#define exfat_glob_free nqp_glob_free
+#define exfat_walk nqp_walk
+#define exfat_export nqp_export
+
+#include "exFAT-Read-Drivers/exfat_driver.c"
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h> // For struct iovec
+#include <time.h>
 
 #define MAX_OPEN_FILES 1024
 
@@ -18,12 +21,98 @@ typedef enum NQP_DIRECTORY_ENTRY_TYPE {
 } nqp_dtype;
 
 typedef struct NQP_DIRECTORY_ENTRY {
-  uint64_t inode_number; // the unique identifier for this entry
+  uint64_t inode_number; // where the entry set is, see nqp_open_by_inode
   size_t name_len;       // the number of characters in the name
   char *name;            // the actual name
   nqp_dtype type;        // the type of file that this points at
 } nqp_dirent;
 
+// file attributes, as stored in the file's directory entry
+#define NQP_ATTR_READ_ONLY 0x01
+#define NQP_ATTR_HIDDEN 0x02
+#define NQP_ATTR_SYSTEM 0x04
+#define NQP_ATTR_DIRECTORY 0x10
+#define NQP_ATTR_ARCHIVE 0x20
+
+typedef struct NQP_FILE_STATUS {
+  uint64_t inode_number;       // same number getdents reports for the file
+  nqp_dtype type;              // the type of file
+  uint16_t attributes;         // NQP_ATTR_* flags
+  uint64_t data_length;        // size of the file in bytes
+  uint64_t valid_data_length;  // bytes written, the rest reads as 0
+  uint32_t cluster_count;      // clusters allocated to the file
+  uint32_t cluster_size;       // bytes per cluster on the volume
+  bool no_fat_chain;           // NoFatChain: the clusters follow each other
+                               // and the FAT is not used for them
+  struct timespec create_time; // timestamps, converted to UTC
+  struct timespec modify_time;
+  struct timespec access_time;
+} nqp_file_stat;
+
+typedef enum NQP_WALK_ACTION {
+  NQP_WALK_CONTINUE, // carry on, into the contents if this is a directory
+  NQP_WALK_SKIP,     // carry on, but leave this directory's contents out
+  NQP_WALK_STOP,     // end the walk as soon as possible
+} nqp_walk_action;
+
+// called by nqp_walk for every file and directory, see nqp_walk
+typedef nqp_walk_action (*nqp_walk_fn)(const char *path,
+                                       const nqp_file_stat *stat, int depth,
+                                       void *arg);
+
+// where a piece of a file is stored, see nqp_extents
+typedef struct NQP_EXTENT {
+  uint64_t file_offset;   // first byte of the file held by the extent
+  uint64_t volume_offset; // where that byte is in the volume (image) file
+  uint64_t length;        // bytes in the extent
+} nqp_extent;
+
+// how a file is going to be read, see nqp_fadvise, numbered like
+// POSIX_FADV_NORMAL and the others so the libc stand-in can pass them on
+typedef enum NQP_ADVICE {
+  NQP_FADV_NORMAL = 0,  // no particular order
+  NQP_FADV_RANDOM,      // in no order, nothing is read ahead
+  NQP_FADV_SEQUENTIAL,  // front to back, nqp_read keeps reading ahead
+  NQP_FADV_WILLNEED,    // the range is needed soon, start reading it
+  NQP_FADV_DONTNEED,    // the range is not needed again, drop it
+} nqp_advice;
+
+// BUFFERED STREAM
+// a file opened with nqp_fopen. Only the buffer pointers are public, so that
+// nqp_getc can hand out buffered bytes without a call
+typedef struct NQP_STREAM {
+  const unsigned char *next; // next byte to hand out
+  const unsigned char *end;  // one past the last buffered byte
+  int fd;                    // the open file underneath
+  unsigned char *buffer;     // whole clusters of the file
+  size_t capacity;           // bytes buffer holds
+  uint64_t position;         // file offset of the byte at end
+} nqp_FILE;
+
+// what nqp_export did
+typedef struct NQP_EXPORT_SUMMARY {
+  uint64_t files;       // regular files written
+  uint64_t directories; // directories made (or already there)
+  uint64_t bytes;       // file data written
+  uint64_t failed;      // files and directories that could not be written
+  uint64_t shortened;   // of those written, how many had their name cut to
+                        // the host's NAME_MAX bytes
+} nqp_export_summary;
+
+// what nqp_statfs reports about the mounted volume
+typedef struct NQP_FS_STATUS {
+  uint32_t cluster_size;   // bytes per cluster
+  uint64_t total_clusters; // clusters in the cluster heap
+  uint64_t used_clusters;  // marked as in use in the allocation bitmap
+  uint64_t free_clusters;
+} nqp_fs_stat;
+
+// the names nqp_glob matched
+typedef struct NQP_GLOB_LIST {
+  size_t count; // names matched
+  char **names; // sorted without case, NULL terminated
+} nqp_glob_list;
+
 typedef enum NQP_ERROR {
   NQP_OK = 0, // no error.
 
@@ -46,7 +135,12 @@ typedef enum NQP_ERROR {
  * functions (they will all use the "mounted" file system).
  *
  * This function does a basic file system check on the super block of the file
- * system being mounted.
+ * system being mounted, maps its allocation bitmap and checks that the bitmap
+ * marks the clusters of the root directory and of the bitmap itself as used.
+ *
+ * The volume is read through the block device named by the EXFAT_DEVICE
+ * environment variable: "pread" (the default), "mmap", or
+ * "sim:latency_us=N,bandwidth_mb=N,depth=N" for a simulated slow device.
  *
  * Parameters:
  *  * source: The file containing the file system to mount. Must not be NULL.
@@ -69,6 +163,18 @@ nqp_error nqp_mount(const char *source, nqp_fs_type fs_type);
  */
 nqp_error nqp_unmount(void);
 
+/**
+ * Keep the caches of looked up names and of cluster chains in memory shared
+ * with the processes forked from now on. What a child looks up is then also
+ * cached for its parent and siblings, and the other way around. Call it before
+ * forking or starting other threads; it lasts until the process exits, across
+ * unmounts.
+ *
+ * Return: NQP_INVAL if the shared memory cannot be mapped (the caches stay
+ *         private), or NQP_OK on success.
+ */
+nqp_error nqp_share_caches(void);
+
 /**
  * Get the volume label for the mounted file system.
  *
@@ -77,6 +183,18 @@ nqp_error nqp_unmount(void);
  */
 char *nqp_vol_label(void);
 
+/**
+ * Get the size of the mounted volume and how much of it is in use, from the
+ * allocation bitmap mapped at mount. The set bits are counted (with AVX2 or
+ * POPCNT where the CPU has them) on the first call after mounting only.
+ *
+ * Parameters:
+ *  * stat: Where the cluster counts are stored. Must not be NULL.
+ * Return: NQP_INVAL if nothing is mounted or stat is NULL, or NQP_OK on
+ *         success.
+ */
+nqp_error nqp_statfs(nqp_fs_stat *stat);
+
 /**
  * Open the file at pathname in the "mounted" file system.
  *
@@ -88,6 +206,60 @@ char *nqp_vol_label(void);
  */
 int nqp_open(const char *pathname);
 
+/**
+ * Open the file at name, relative to an open directory, like openat(2). Only
+ * the directories between dirfd and the file are searched, instead of every
+ * directory from the root.
+ *
+ * Parameters:
+ *  * dirfd: A file descriptor of an open directory that relative names are
+ *           looked up in. Ignored if name is absolute.
+ *  * name: The relative (or absolute, starting with '/') path of the file or
+ *          directory that should be opened. Must not be NULL.
+ * Return: -1 on error, or a nonnegative integer on success. The nonnegative
+ *         integer is a file descriptor.
+ */
+int nqp_openat(int dirfd, const char *name);
+
+/**
+ * Open the file with the given inode number, as reported by nqp_getdents,
+ * nqp_stat and nqp_walk, without looking up any path. The number is where
+ * the file's entry set is stored in the volume, so it is the same every time
+ * the volume is mounted; the root directory is 1. The set found there has to
+ * be a file's with a valid checksum, anything else is not opened.
+ *
+ * Parameters:
+ *  * inode: The inode number of the file or directory to open.
+ * Return: NQP_FILE_NOT_FOUND if no file has that inode number, NQP_INVAL
+ *         if nothing is mounted or the open file table is full, or the file
+ *         descriptor on success.
+ */
+int nqp_open_by_inode(uint64_t inode);
+
+/**
+ * Get the status of the file at pathname without opening it. Only directory
+ * entries are read (and cached), never the file's contents or its FAT chain.
+ *
+ * Parameters:
+ *  * pathname: The path of the file or directory in the file system. Must not
+ *              be NULL.
+ *  * stat: Where the status is stored. Must not be NULL.
+ * Return: NQP_FILE_NOT_FOUND if there is no such file, NQP_INVAL if an
+ *         invalid argument has been passed (e.g., NULL), or NQP_OK on
+ *         success.
+ */
+nqp_error nqp_stat(const char *pathname, nqp_file_stat *stat);
+
+/**
+ * Get the status of an open file.
+ *
+ * Parameters:
+ *  * fd: The file descriptor of the file. Must be a nonnegative integer.
+ *  * stat: Where the status is stored. Must not be NULL.
+ * Return: NQP_INVAL if fd is not open or stat is NULL, or NQP_OK on success.
+ */
+nqp_error nqp_fstat(int fd, nqp_file_stat *stat);
+
 /**
  * Close the file referred to by the descriptor.
  *
@@ -97,6 +269,20 @@ int nqp_open(const char *pathname);
  */
 int nqp_close(int fd);
 
+/**
+ * Duplicate a file descriptor, like dup(2), except that the new descriptor
+ * has its own file position (starting at 0) and advice. The file is not
+ * looked up again: the new descriptor gets a copy of its entry set and shares
+ * the cluster chain already built for fd, which stays until the last of them
+ * is closed.
+ *
+ * Parameters:
+ *  * fd: The file descriptor to duplicate. Must be a nonnegative integer.
+ * Return: -1 on error (including when the open file table is full), or the
+ *         new file descriptor.
+ */
+int nqp_dup(int fd);
+
 /**
  * Read from a file desriptor.
  *
@@ -109,6 +295,181 @@ int nqp_close(int fd);
  */
 ssize_t nqp_read(int fd, void *buffer, size_t count);
 
+/**
+ * Read from a file descriptor at a given offset, like pread(2): the file
+ * position used by nqp_read is neither used nor changed. Several threads can
+ * read at the same time as long as each one reads its own descriptor.
+ *
+ * Parameters:
+ *  * fd: The file descriptor to read from. Must be a nonnegative integer. The
+ *        file descriptor should refer to a file, not a directory.
+ *  * buffer: The buffer to read data into. Must not be NULL.
+ *  * count: The number of bytes to read into the buffer.
+ *  * offset: The byte of the file to start reading at. Must not be negative.
+ * Return: The number of bytes read, 0 at or past the end of the file, or -1
+ *         on error.
+ */
+ssize_t nqp_pread(int fd, void *buffer, size_t count, off_t offset);
+
+/**
+ * Read from a file descriptor into several buffers, like readv(2): the
+ * buffers are filled in order, as if by one nqp_read of their total size.
+ * The runs of clusters behind all of them are read as one batch.
+ *
+ * Parameters:
+ *  * fd: The file descriptor to read from. Must be a nonnegative integer. The
+ *        file descriptor should refer to a file, not a directory.
+ *  * vector: The buffers to read data into. May be NULL if count is 0.
+ *  * count: The number of buffers, at most IOV_MAX.
+ * Return: The number of bytes read, 0 at the end of the file, or -1 on error.
+ */
+ssize_t nqp_readv(int fd, const struct iovec *vector, int count);
+
+/**
+ * Read from a file descriptor at a given offset into several buffers, like
+ * preadv(2): nqp_readv without using or changing the file position.
+ *
+ * Parameters:
+ *  * fd: The file descriptor to read from, as for nqp_readv.
+ *  * vector: The buffers to read data into. May be NULL if count is 0.
+ *  * count: The number of buffers, at most IOV_MAX.
+ *  * offset: The byte of the file to start reading at. Must not be negative.
+ * Return: The number of bytes read, 0 at or past the end of the file, or -1
+ *         on error.
+ */
+ssize_t nqp_preadv(int fd, const struct iovec *vector, int count,
+                     off_t offset);
+
+/**
+ * Start reading from a file descriptor at a given offset without waiting for
+ * the data, like nqp_pread otherwise. Every run of contiguous clusters the
+ * read spans is queued at once (on an io_uring where the kernel has one), so
+ * a caller can overlap the reads with its own work and keep several going.
+ * The file descriptor may be closed before the read is completed, the buffer
+ * must not be touched until then.
+ *
+ * Parameters:
+ *  * fd: The file descriptor to read from, as for nqp_pread.
+ *  * buffer: The buffer to read data into. Must not be NULL.
+ *  * count: The number of bytes to read into the buffer.
+ *  * offset: The byte of the file to start reading at. Must not be negative.
+ * Return: A request number for nqp_read_complete, or -1 on error (including
+ *         when 64 requests are already waiting to be completed).
+ */
+int nqp_read_async(int fd, void *buffer, size_t count, off_t offset);
+
+/**
+ * Wait for a read started by nqp_read_async to finish. Every request has to
+ * be completed exactly once.
+ *
+ * Parameters:
+ *  * request: The request number nqp_read_async returned.
+ * Return: What nqp_pread would have returned for the read: the number of
+ *         bytes read, 0 at or past the end of the file, or -1 on error.
+ */
+ssize_t nqp_read_complete(int request);
+
+/**
+ * Get where the contents of an open file are stored in the volume, as one
+ * extent per run of clusters that follow each other. Bytes that are not in
+ * an extent (past the valid data length) read as zeros. The volume offsets can
+ * be used to copy the file straight out of the image, e.g., with
+ * copy_file_range(2).
+ *
+ * Parameters:
+ *  * fd: The file descriptor of the file. Must be a nonnegative integer. The
+ *        file descriptor should refer to a file, not a directory.
+ *  * extents: the buffer the extents are written into, in file order. May be
+ *             NULL if count is 0.
+ *  * count: the number of extents the buffer holds.
+ * Return: The total number of extents of the file, which may be more than
+ *         count (only the first count are written), or -1 on error.
+ */
+ssize_t nqp_extents(int fd, nqp_extent *extents, size_t count);
+
+/**
+ * Say how a range of an open file is going to be read, like posix_fadvise(2).
+ * The advice is passed on, extent by extent, to whatever caches the volume:
+ * the page cache of the image for the "pread" device, the mapping for the
+ * "mmap" device. NQP_FADV_NORMAL, NQP_FADV_SEQUENTIAL and
+ * NQP_FADV_RANDOM given for the whole file (offset and length 0) are also
+ * kept for the descriptor: while it is NQP_FADV_SEQUENTIAL, nqp_read and
+ * the streams ask for the next 4 MB of the file ahead of the reads.
+ *
+ * Parameters:
+ *  * fd: The file descriptor of the file. Must be a nonnegative integer. The
+ *        file descriptor should refer to a file, not a directory.
+ *  * offset: The first byte of the range. Must not be negative.
+ *  * length: The bytes in the range, 0 for up to the end of the file. Must not
+ *            be negative.
+ *  * advice: One of the NQP_FADV_ values.
+ * Return: NQP_INVAL if fd is not an open file or an argument is out of
+ *         range, or NQP_OK on success.
+ */
+nqp_error nqp_fadvise(int fd, off_t offset, off_t length,
+                          nqp_advice advice);
+
+/**
+ * Open a file as a buffered stream, for reading a few bytes or a line at a
+ * time. The stream is refilled whole clusters at a time, or pointed straight
+ * at the image where the "mmap" device maps it, so it must be closed before
+ * unmounting.
+ *
+ * Parameters:
+ *  * pathname: The full path to the file to open. Must not be NULL.
+ * Return: The stream, or NULL if the file does not exist, is a directory, or
+ *         the open file table is full.
+ */
+nqp_FILE *nqp_fopen(const char *pathname);
+
+/**
+ * Close a stream and the file underneath it.
+ *
+ * Return: 0 on success, -1 on error (e.g., stream is NULL).
+ */
+int nqp_fclose(nqp_FILE *stream);
+
+/**
+ * Refill the buffer of a stream and take its first byte. Only called by
+ * nqp_getc, once the buffer is empty.
+ */
+int nqp_getc_refill(nqp_FILE *stream);
+
+/**
+ * Read the next byte of a stream, like getc(3).
+ *
+ * Return: The byte as an unsigned char cast to int, or -1 (EOF) at the end of
+ *         the file or on error.
+ */
+static inline int nqp_getc(nqp_FILE *stream) {
+  return stream->next < stream->end ? *stream->next++
+                                    : nqp_getc_refill(stream);
+}
+
+/**
+ * Read a line of a stream, like getline(3): the line is stored in *line
+ * together with its '\n' (unless it is the last line and has none) and a
+ * terminating NUL. *line is (re)allocated with malloc as needed, the caller
+ * is responsible for free()-ing it.
+ *
+ * Parameters:
+ *  * line: The buffer the line is written to, *line may be NULL.
+ *  * capacity: The size of *line, 0 if it is NULL.
+ *  * stream: The stream to read from.
+ * Return: The number of bytes read, including the '\n' but not the NUL, or
+ *         -1 at the end of the file or on error.
+ */
+ssize_t nqp_getline(char **line, size_t *capacity, nqp_FILE *stream);
+
+/**
+ * Read <count> items of <size> bytes each from a stream, like fread(3).
+ * Requests larger than the stream's buffer are read straight into <buffer>.
+ *
+ * Return: The number of whole items read, less than count at the end of the
+ *         file or on error.
+ */
+size_t nqp_fread(void *buffer, size_t size, size_t count, nqp_FILE *stream);
+
 /**
  * Get the directory entries for a directory. Similar to read()ing a file, you
  * may need to call this function repeatedly to get all directory entries.
@@ -129,6 +490,111 @@ ssize_t nqp_read(int fd, void *buffer, size_t count);
  */
 ssize_t nqp_getdents(int fd, void *dirp, size_t count);
 
+/**
+ * Get the directory entries for a directory together with the status of
+ * each entry, like calling nqp_getdents and then nqp_stat on every name but
+ * without looking any of them up again.
+ *
+ * Parameters:
+ *  * fd: The file descriptor to read from, as for nqp_getdents.
+ *  * dirp: the buffer into which the directory entries will be written, as
+ *          for nqp_getdents.
+ *  * stats: the buffer into which the status of each entry will be written,
+ *           stats[i] describes dirp[i]. Must hold count instances.
+ *  * count: the number of entries to read. Must be greater than zero.
+ * Return: The total number of entries read into the buffers, 0 at the end of
+ *         the directory, or -1 on error.
+ */
+ssize_t nqp_getdents_stat(int fd, void *dirp, nqp_file_stat *stats,
+                          size_t count);
+
+/**
+ * Find the names in a directory that match a pattern, like glob(3) for a
+ * single directory: '*' matches any characters and '?' any one character,
+ * the other characters match themselves (case matters). A leading '.' has to
+ * be matched by a '.' in the pattern, like in sh. Names with characters that
+ * do not fit in 8 bits are left out, they cannot be opened by path.
+ *
+ * The first search of a directory decodes all of its names once into an
+ * index sorted without case, which the next searches and nqp_open lookups
+ * in that directory use instead of reading it. The characters before the
+ * first wildcard of the pattern are found in it with a binary search, so only
+ * the names starting with them are matched against the rest. The indexes of
+ * the last 16 directories searched are kept until unmounting.
+ *
+ * Parameters:
+ *  * pathname: The absolute path of the directory to search. Must not be
+ *              NULL.
+ *  * pattern: The pattern the names have to match, without any '/'. Must not
+ *             be NULL.
+ *  * list: Where the matching names are stored, free it with
+ *          nqp_glob_free. Must not be NULL.
+ * Return: NQP_FILE_NOT_FOUND if pathname does not exist or is not a
+ *         directory, NQP_INVAL if an invalid argument has been passed (e.g.,
+ *         NULL) or memory ran out, or NQP_OK on success (list->count may be
+ *         0).
+ */
+nqp_error nqp_glob(const char *pathname, const char *pattern,
+                   nqp_glob_list *list);
+
+/**
+ * Free the names nqp_glob stored in list, leaving it empty.
+ */
+void nqp_glob_free(nqp_glob_list *list);
+
+/**
+ * Walk the tree below pathname, like nftw(3), calling fn once for pathname
+ * itself and once for every file and directory under it.
+ *
+ * Directories are cut into pieces of a few clusters that a pool of threads
+ * scans in parallel, idle threads steal pieces from busy ones. fn is
+ * therefore called from several threads at once and in no particular order
+ * (a directory is always reported before its contents), it has to do its own
+ * locking. The walk does not use any file descriptors.
+ *
+ * Parameters:
+ *  * pathname: The absolute path of the file or directory to start at. Must
+ *              not be NULL.
+ *  * fn: Called with the path (pathname followed by the names below it, only
+ *        valid during the call), the status of the file, its depth (0 for
+ *        pathname) and arg. Its return value decides whether a directory's
+ *        contents are walked and whether the walk goes on at all.
+ *  * arg: Passed to fn as is.
+ *  * threads: The number of threads to walk with, 0 for one per CPU.
+ * Return: NQP_FILE_NOT_FOUND if pathname does not exist, NQP_INVAL if an
+ *         invalid argument has been passed (e.g., NULL), or NQP_OK once the
+ *         walk is over.
+ */
+nqp_error nqp_walk(const char *pathname, nqp_walk_fn fn, void *arg,
+                   int threads);
+
+/**
+ * Copy pathname, and everything below it if it is a directory, out of the
+ * mounted file system onto the host. Names, last modified and last accessed
+ * times are kept.
+ *
+ * The tree is walked in parallel like nqp_walk and files are written as they
+ * are found. Every run of contiguous clusters is copied with one
+ * copy_file_range(2) from the volume, so the data never passes through this
+ * process. If the host does not support that, it is copied with large aligned
+ * reads instead.
+ *
+ * Parameters:
+ *  * pathname: The absolute path of the file or directory to export. Must not
+ *              be NULL.
+ *  * host_dir: The host directory to write to, created if it does not exist.
+ *              A directory's contents are written straight into it, a file
+ *              is written into it under its own name. Must not be NULL.
+ *  * threads: The number of threads to export with, 0 for one per CPU.
+ *  * summary: Where the number of files, directories and bytes written is
+ *             stored, along with how many could not be. May be NULL.
+ * Return: NQP_FILE_NOT_FOUND if pathname does not exist, NQP_INVAL if an
+ *         invalid argument has been passed (e.g., NULL) or host_dir can not be
+ *         created, or NQP_OK once the export is over (check summary->failed).
+ */
+nqp_error nqp_export(const char *pathname, const char *host_dir,
+                     int threads, nqp_export_summary *summary);
+
 #ifdef USE_LIBC_INSTEAD
 
 #include <fcntl.h>
@@ -138,7 +604,15 @@ ssize_t nqp_getdents(int fd, void *dirp, size_t count);
 // open, read, and close, so that we can get a sense of how the tests are
 // supposed to work.
 #define nqp_read(fd, buffer, size) read(fd, buffer, size)
+#define nqp_pread(fd, buffer, size, offset) pread(fd, buffer, size, offset)
+#define nqp_readv(fd, vector, count) readv(fd, vector, count)
+#define nqp_preadv(fd, vector, count, offset)                               \
+  preadv(fd, vector, count, offset)
+#define nqp_fadvise(fd, offset, length, advice)                             \
+  posix_fadvise(fd, offset, length, advice)
+#define nqp_dup(fd) dup(fd)
 #define nqp_open(name) open(name, O_RDONLY)
+#define nqp_openat(dirfd, name) openat(dirfd, name, O_RDONLY)
 #define nqp_close(fd) close(fd)
 
 // mount and unmount are not functions we would be able to call, so straight
@@ -0,0 +1,286 @@
+#define _GNU_SOURCE // For clock_gettime
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h> // For write
+
+#include "nqp_latency.h"
+
+#include <assert.h>
+#include <errno.h>
+
+#define NANOS_PER_SECOND 1000000000ULL
+#define NANOS_PER_MICRO 1000.0
+#define DUMP_LINE_SIZE 256
+
+// printable names, indexed by Latency_Op
+static const char *latency_op_names[LATENCY_OPS] = {
+    "nqp_mount", "nqp_open", "nqp_read(<=4K)", "nqp_read(<=64K)",
+    "nqp_read(>64K)", "nqp_getdents", "nqp_stat",
+};
+
+// HISTOGRAM STORAGE
+// plain relaxed atomic counters, recording never takes a lock so the
+// histograms can stay enabled all the time
+static _Atomic uint64_t latency_buckets[LATENCY_OPS][LATENCY_BUCKETS];
+static _Atomic uint64_t latency_totals[LATENCY_OPS];
+static _Atomic uint64_t latency_max[LATENCY_OPS];
+
+//--------------------
+// BUCKETING ROUTINES
+//--------------------
+// bucket_index(): maps a value to its (magnitude, sub bucket) slot
+static int bucket_index(uint64_t value) {
+  if (value < LATENCY_SUB_BUCKETS)
+    return (int)value; // small values get one bucket each
+
+  // position of the highest set bit, always >= LATENCY_SUB_BUCKET_BITS here
+  int magnitude = 63 - __builtin_clzll(value);
+  int shift = magnitude - LATENCY_SUB_BUCKET_BITS;
+  int sub_bucket = (int)((value >> shift) & (LATENCY_SUB_BUCKETS - 1));
+
+  int index = (magnitude - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS +
+              sub_bucket;
+  assert(index >= 0 && index < LATENCY_BUCKETS);
+  return index;
+}
+
+// bucket_upper_bound(): the largest value that lands in bucket <index>
+static uint64_t bucket_upper_bound(int index) {
+  assert(index >= 0 && index < LATENCY_BUCKETS);
+  if (index < LATENCY_SUB_BUCKETS)
+    return (uint64_t)index;
+
+  int magnitude = index / LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKET_BITS - 1;
+  int shift = magnitude - LATENCY_SUB_BUCKET_BITS;
+  uint64_t sub_bucket = (uint64_t)(index % LATENCY_SUB_BUCKETS);
+  uint64_t lower = (LATENCY_SUB_BUCKETS + sub_bucket) << shift;
+  return lower + ((1ULL << shift) - 1);
+}
+
+//--------------------
+// RECORDING ROUTINES
+//--------------------
+uint64_t latency_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * NANOS_PER_SECOND + (uint64_t)now.tv_nsec;
+}
+
+void latency_record(Latency_Op op, uint64_t nanoseconds) {
+  assert(op >= 0 && op < LATENCY_OPS);
+  if (op < 0 || op >= LATENCY_OPS)
+    return;
+
+  atomic_fetch_add_explicit(&latency_buckets[op][bucket_index(nanoseconds)], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&latency_totals[op], 1, memory_order_relaxed);
+
+  // bump the max, retrying only while another thread beat us with a smaller
+  // value
+  uint64_t seen = atomic_load_explicit(&latency_max[op], memory_order_relaxed);
+  while (nanoseconds > seen &&
+         !atomic_compare_exchange_weak_explicit(&latency_max[op], &seen,
+                                                nanoseconds,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+  }
+}
+
+void latency_reset(void) {
+  for (int op = 0; op < LATENCY_OPS; op++) {
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+      atomic_store_explicit(&latency_buckets[op][i], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&latency_totals[op], 0, memory_order_relaxed);
+    atomic_store_explicit(&latency_max[op], 0, memory_order_relaxed);
+  }
+}
+
+//--------------------
+// REPORTING ROUTINES
+//--------------------
+uint64_t latency_count(Latency_Op op) {
+  if (op < 0 || op >= LATENCY_OPS)
+    return 0;
+  return atomic_load_explicit(&latency_totals[op], memory_order_relaxed);
+}
+
+uint64_t latency_percentile(Latency_Op op, double percentile) {
+  assert(percentile >= 0.0 && percentile <= 100.0);
+  if (op < 0 || op >= LATENCY_OPS)
+    return 0;
+
+  // sum the buckets instead of trusting the total, recorders may be racing us
+  uint64_t total = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    total +=
+        atomic_load_explicit(&latency_buckets[op][i], memory_order_relaxed);
+  }
+  if (total == 0)
+    return 0;
+
+  // rank of the sample we are looking for (1 based, rounded up)
+  uint64_t rank = (uint64_t)((percentile / 100.0) * (double)total);
+  if ((double)rank < (percentile / 100.0) * (double)total)
+    rank++;
+  if (rank < 1)
+    rank = 1;
+
+  uint64_t seen = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += atomic_load_explicit(&latency_buckets[op][i], memory_order_relaxed);
+    if (seen >= rank) {
+      // never report past the largest value actually seen
+      uint64_t max =
+          atomic_load_explicit(&latency_max[op], memory_order_relaxed);
+      uint64_t bound = bucket_upper_bound(i);
+      return bound < max ? bound : max;
+    }
+  }
+  return atomic_load_explicit(&latency_max[op], memory_order_relaxed);
+}
+
+// writes the <len> bytes snprintf reported for <line>, as many as fit in it,
+// in as many writes as <fd> takes. Gives up on the first error
+static void dump_line(int fd, const char *line, int len) {
+  size_t length = len < 0 ? 0 : (size_t)len;
+  if (length >= DUMP_LINE_SIZE)
+    length = DUMP_LINE_SIZE - 1;
+  while (length > 0) {
+    ssize_t written = write(fd, line, length);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return;
+    line += written;
+    length -= (size_t)written;
+  }
+}
+
+void latency_dump(int fd) {
+  char line[DUMP_LINE_SIZE];
+  int len = snprintf(line, sizeof(line), "%-16s %10s %10s %10s %10s %10s\n",
+                     "operation", "count", "p50(us)", "p99(us)", "p999(us)",
+                     "max(us)");
+  dump_line(fd, line, len);
+
+  for (int op = 0; op < LATENCY_OPS; op++) {
+    uint64_t count = latency_count(op);
+    if (count == 0)
+      continue; // nothing to report for this one
+
+    len = snprintf(
+        line, sizeof(line), "%-16s %10lu %10.1f %10.1f %10.1f %10.1f\n",
+        latency_op_names[op], count,
+        latency_percentile(op, 50.0) / NANOS_PER_MICRO,
+        latency_percentile(op, 99.0) / NANOS_PER_MICRO,
+        latency_percentile(op, 99.9) / NANOS_PER_MICRO,
+        atomic_load_explicit(&latency_max[op], memory_order_relaxed) /
+            NANOS_PER_MICRO);
+    dump_line(fd, line, len);
+  }
+
+  // the wrappers below only see the calls the shell makes through them
+  len = snprintf(line, sizeof(line),
+                 "(shell calls only, not the reads inside nqp_walk and "
+                 "nqp_export, the kernel\n copies staging programs or the "
+                 "calls of forked commands)\n");
+  dump_line(fd, line, len);
+}
+
+//----------------
+// TIMED WRAPPERS
+//----------------
+nqp_error nqp_mount_timed(const char *source, nqp_fs_type fs_type) {
+  uint64_t start = latency_now();
+  nqp_error result = nqp_mount(source, fs_type);
+  latency_record(LATENCY_MOUNT, latency_now() - start);
+  return result;
+}
+
+int nqp_open_timed(const char *pathname) {
+  uint64_t start = latency_now();
+  int fd = nqp_open(pathname);
+  latency_record(LATENCY_OPEN, latency_now() - start);
+  return fd;
+}
+
+// relative opens and opens by inode share the nqp_open histogram, they do
+// the same job
+int nqp_openat_timed(int dirfd, const char *name) {
+  uint64_t start = latency_now();
+  int fd = nqp_openat(dirfd, name);
+  latency_record(LATENCY_OPEN, latency_now() - start);
+  return fd;
+}
+
+int nqp_open_by_inode_timed(uint64_t inode) {
+  uint64_t start = latency_now();
+  int fd = nqp_open_by_inode(inode);
+  latency_record(LATENCY_OPEN, latency_now() - start);
+  return fd;
+}
+
+// reads are bucketed by what was asked for, that is what the caller controls
+static void record_read(size_t count, uint64_t elapsed) {
+  if (count <= LATENCY_READ_SMALL_MAX)
+    latency_record(LATENCY_READ_SMALL, elapsed);
+  else if (count <= LATENCY_READ_MEDIUM_MAX)
+    latency_record(LATENCY_READ_MEDIUM, elapsed);
+  else
+    latency_record(LATENCY_READ_LARGE, elapsed);
+}
+
+ssize_t nqp_read_timed(int fd, void *buffer, size_t count) {
+  uint64_t start = latency_now();
+  ssize_t bytes_read = nqp_read(fd, buffer, count);
+  record_read(count, latency_now() - start);
+  return bytes_read;
+}
+
+ssize_t nqp_pread_timed(int fd, void *buffer, size_t count, off_t offset) {
+  uint64_t start = latency_now();
+  ssize_t bytes_read = nqp_pread(fd, buffer, count, offset);
+  record_read(count, latency_now() - start);
+  return bytes_read;
+}
+
+// only the wait is timed, that is all the caller is held up by
+ssize_t nqp_read_complete_timed(int request, size_t count) {
+  uint64_t start = latency_now();
+  ssize_t bytes_read = nqp_read_complete(request);
+  record_read(count, latency_now() - start);
+  return bytes_read;
+}
+
+ssize_t nqp_getdents_timed(int fd, void *dirp, size_t count) {
+  uint64_t start = latency_now();
+  ssize_t dirents_read = nqp_getdents(fd, dirp, count);
+  latency_record(LATENCY_GETDENTS, latency_now() - start);
+  return dirents_read;
+}
+
+// listings with status share the nqp_getdents histogram
+ssize_t nqp_getdents_stat_timed(int fd, void *dirp, nqp_file_stat *stats,
+                                size_t count) {
+  uint64_t start = latency_now();
+  ssize_t dirents_read = nqp_getdents_stat(fd, dirp, stats, count);
+  latency_record(LATENCY_GETDENTS, latency_now() - start);
+  return dirents_read;
+}
+
+nqp_error nqp_stat_timed(const char *pathname, nqp_file_stat *stat) {
+  uint64_t start = latency_now();
+  nqp_error result = nqp_stat(pathname, stat);
+  latency_record(LATENCY_STAT, latency_now() - start);
+  return result;
+}
+
+// status of open files shares the nqp_stat histogram
+nqp_error nqp_fstat_timed(int fd, nqp_file_stat *stat) {
+  uint64_t start = latency_now();
+  nqp_error result = nqp_fstat(fd, stat);
+  latency_record(LATENCY_STAT, latency_now() - start);
+  return result;
+}
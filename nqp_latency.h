@@ -0,0 +1,68 @@
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "nqp_io.h"
+
+// HISTOGRAM SHAPE
+// values are bucketed by their power of two (magnitude) and then split into
+// LATENCY_SUB_BUCKETS linear sub buckets, so every bucket is at most 1/8th
+// (12.5%) wide relative to the values it holds, no matter how big they get
+#define LATENCY_SUB_BUCKET_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAGNITUDES 64
+#define LATENCY_BUCKETS (LATENCY_MAGNITUDES * LATENCY_SUB_BUCKETS)
+
+// size classes used for splitting up nqp_read() latencies
+#define LATENCY_READ_SMALL_MAX 4096   // up to one page
+#define LATENCY_READ_MEDIUM_MAX 65536 // up to 64 KB, anything above is large
+
+// OPERATIONS BEING TIMED
+typedef enum {
+  LATENCY_MOUNT,
+  LATENCY_OPEN,
+  LATENCY_READ_SMALL,
+  LATENCY_READ_MEDIUM,
+  LATENCY_READ_LARGE,
+  LATENCY_GETDENTS,
+  LATENCY_STAT,
+
+  // LATENCY_OPS should always be last
+  LATENCY_OPS
+} Latency_Op;
+
+// RECORDING
+// records one sample (in nanoseconds) for <op>, lock free and safe to call
+// from any thread
+void latency_record(Latency_Op op, uint64_t nanoseconds);
+// monotonic clock reading in nanoseconds, used to take the samples
+uint64_t latency_now(void);
+// clears all the recorded samples
+void latency_reset(void);
+
+// REPORTING
+// total number of samples recorded for <op>
+uint64_t latency_count(Latency_Op op);
+// value (in nanoseconds) at or below which <percentile> (0-100) of the <op>
+// samples fall, 0 if nothing was recorded
+uint64_t latency_percentile(Latency_Op op, double percentile);
+// writes a p50/p99/p999 table of every operation with samples to <fd>
+void latency_dump(int fd);
+
+// TIMED WRAPPERS AROUND THE FILE SYSTEM MODULE
+// same contract as their nqp_* counterparts in nqp_io.h. Only these calls are
+// timed, not the reads the module makes inside nqp_walk, nqp_export or
+// nqp_extents nor the calls of forked commands
+nqp_error nqp_mount_timed(const char *source, nqp_fs_type fs_type);
+int nqp_open_timed(const char *pathname);
+int nqp_openat_timed(int dirfd, const char *name);
+int nqp_open_by_inode_timed(uint64_t inode);
+ssize_t nqp_read_timed(int fd, void *buffer, size_t count);
+ssize_t nqp_pread_timed(int fd, void *buffer, size_t count, off_t offset);
+// times the wait for a nqp_read_async request of <count> bytes
+ssize_t nqp_read_complete_timed(int request, size_t count);
+ssize_t nqp_getdents_timed(int fd, void *dirp, size_t count);
+ssize_t nqp_getdents_stat_timed(int fd, void *dirp, nqp_file_stat *stats,
+                                size_t count);
+nqp_error nqp_stat_timed(const char *pathname, nqp_file_stat *stat);
+nqp_error nqp_fstat_timed(int fd, nqp_file_stat *stat);
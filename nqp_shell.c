@@ -1,5 +1,6 @@
-#define _GNU_SOURCE   // For fexecve
-#include <sys/mman.h> // For memfd_create
+#define _GNU_SOURCE       // For fexecve, copy_file_range
+#include <sys/mman.h>     // For memfd_create
+#include <sys/sendfile.h> // For sendfile
 #include <sys/wait.h> // For waitpid
 #include <unistd.h>   // For read, write, fork, lseek
 
@@ -8,12 +9,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-#include "nqp_io.h" //file system module
+#include "nqp_io.h"      //file system module
+#include "nqp_latency.h" //latency histograms around the file system module
 #include "nqp_shell.h"
+#include "alloc_count.h" // nqp_bench -a: pauses, counts commands apart
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h> // For staging files that copy_file_range turns down
+#include <fnmatch.h> // For find -name
+#include <limits.h>  // For INT_MAX
+#include <pthread.h> // nqp_walk calls back from several threads
+#include <signal.h>  // For keeping SIGPIPE off pipeline threads
+#include <stdatomic.h>
 #include <stdint.h>
+#include <time.h> // For gmtime_r, strftime
 
 // ASSERTION HELPER CONSTANTS
 #define MAX_ARGS 164
@@ -21,6 +31,17 @@
 
 // IO CONSTANTS
 #define READ_BUFFER_SIZE 4096 // 1024 * 4 bytes to read from the nqp_file system
+#define LS_BATCH_SIZE 256     // directory entries read per nqp_getdents call
+#define LS_OUTPUT_SIZE 65536  // bytes of ls output collected before writing
+#define LS_MAX_LINE_SIZE 320  // longest ls line: 255 char name plus details
+#define WALK_OUTPUT_SIZE 65536 // bytes of du/find/tree output collected
+#define WALK_MAX_PATH_SIZE 4096 // longest path du/find/tree print in full
+#define WALK_MAX_LINE_SIZE 4200 // a path plus du's size or tree's branches
+#define GREP_CHUNK_SIZE (4 * 1024 * 1024) // bytes of a file per grep task
+#define GREP_TAIL_SIZE 65536 // read at a time to finish a task's last line
+#define GREP_MAX_THREADS 64
+#define STAGE_BUFFER_SIZE (1024 * 1024) // read at a time to fill a memory file
+#define STAGE_MAX_EXTENTS 64 // copied by the kernel if stored in at most this
 #define PIPE_READ_END 0       // index of pipe's read end
 #define PIPE_WRITE_END 1      // index of pipe's read end
 
@@ -38,6 +59,62 @@
 #define LOG_DISABLED -1    // flag indicating log is disabeled
 #include <fcntl.h>         //for open()
 int log_fd = LOG_DISABLED; // stores the fd for the log file
+int image_fd = -1; // the volume image, read directly to stage files in memory
+
+// where a builtin running as a pipeline stage reads and writes, -1 outside of
+// a stage (see pipeline_stage_main)
+_Thread_local int stage_input_fd = -1;
+_Thread_local int stage_output_fd = -1;
+
+// COMMAND LOOKUP GLOBALS
+#define COMMAND_PATH_VARIABLE "NQP_PATH" // ':' separated image directories
+#define DEFAULT_COMMAND_PATH "/bin"
+#define MAX_SEARCH_DIRS 32
+#define COMMAND_TABLE_SLOTS 256 // chains of the command hash table
+#define COMMAND_MISSING -1      // a name found in none of the search dirs
+
+// SEARCH DIRECTORY
+// one directory of NQP_PATH, kept open so a command is one lookup away
+typedef struct {
+  char path[MAX_LINE_SIZE];
+  int dir_fd;
+} Search_Dir;
+
+// HASHED COMMAND
+// where a command name was found, or that it was not found anywhere
+typedef struct Hashed_Command {
+  char *name;
+  int dir;       // index into search_dirs, or COMMAND_MISSING
+  unsigned hits; // times the name was run through this entry
+  struct Hashed_Command *next;
+} Hashed_Command;
+
+Search_Dir search_dirs[MAX_SEARCH_DIRS];
+int num_search_dirs = 0;
+Hashed_Command *command_table[COMMAND_TABLE_SLOTS];
+
+// PLAN CACHE GLOBALS
+#define PLAN_CACHE_SIZE 64   // plans kept, the least recently used goes first
+#define PLAN_CACHE_SLOTS 128 // chains of the plan hash table
+// bumped whenever a command may resolve differently, plans built before are
+// rebuilt the next time their line runs
+unsigned long plan_generation = 1;
+Plan *plan_slots[PLAN_CACHE_SLOTS];
+Plan *newest_plan = NULL;
+Plan *oldest_plan = NULL;
+int num_plans = 0;
+
+// OBJECT POOL GLOBALS
+// destroyed Commands, Pipe_Commands and Plans are kept here and handed out
+// again, so the main loop stops allocating once it has seen its longest lines
+#define OBJECT_POOL_SIZE 64 // objects of each kind kept for reuse
+#define MAX_PIPE_COMMANDS (MAX_ARGS / 2 + 1) // every other arg can be a pipe
+Command *pooled_commands[OBJECT_POOL_SIZE];
+int num_pooled_commands = 0;
+Pipe_Commands *pooled_pipe_commands[OBJECT_POOL_SIZE];
+int num_pooled_pipe_commands = 0;
+Plan *pooled_plans[OBJECT_POOL_SIZE];
+int num_pooled_plans = 0;
 
 //----------------------------------
 // CURRENT DIRECTORY OBJECT ROUTINES
@@ -53,6 +130,8 @@ Curr_Dir *construct_empty_curr_dir(void) {
   // Set the path to the root directory.
   strncpy(cwd->path, "/", MAX_LINE_SIZE);
   assert(is_valid_path(cwd->path)); // Verify the path is valid.
+  cwd->dir_fd = -1;
+  reopen_curr_dir(cwd); // Open the root directory for relative lookups.
 
   // Validate the directory object.
   assert(is_valid_curr_dir(cwd));
@@ -76,6 +155,8 @@ Curr_Dir *construct_curr_dir(const char *path) {
   if (NULL == cwd)
     return NULL;                           // malloc failure, so return null
   strncpy(cwd->path, path, MAX_LINE_SIZE); // Copy the path into struct.
+  cwd->dir_fd = -1;
+  reopen_curr_dir(cwd); // Open the directory for relative lookups.
 
   // Validate the directory object.
   assert(is_valid_curr_dir(cwd));
@@ -91,6 +172,8 @@ Curr_Dir *construct_curr_dir(const char *path) {
 void destroy_curr_dir(Curr_Dir *cwd) {
   if (NULL == cwd)
     return;
+  if (cwd->dir_fd >= 0)
+    nqp_close(cwd->dir_fd); // release the directory handle
   free(cwd);
 }
 
@@ -106,9 +189,249 @@ void set_path(Curr_Dir *cwd, const char *path) {
   // Update the path
   if (is_valid_curr_dir(cwd)) {
     strncpy(cwd->path, path, MAX_LINE_SIZE);
+    reopen_curr_dir(cwd);
   }
 }
 
+// Opens the directory handle of a <cwd> again after its path changed, the
+// handle is left at -1 if the path can't be opened (e.g. nothing is mounted).
+void reopen_curr_dir(Curr_Dir *cwd) {
+  assert(NULL != cwd);
+  if (NULL == cwd)
+    return;
+
+  if (cwd->dir_fd >= 0)
+    nqp_close(cwd->dir_fd); // release the old directory's handle
+  cwd->dir_fd = nqp_open_timed(cwd->path);
+  if (cwd->dir_fd < 0)
+    cwd->dir_fd = -1;
+}
+
+// Opens <name> in the nqp fs, relative to the <cwd>'s directory handle so only
+// the current directory gets searched instead of the whole path from the root.
+// Returns the nqp fd, or a negative value if not found.
+int open_in_curr_dir(const Curr_Dir *cwd, const char *name) {
+  assert(NULL != cwd);
+  assert(is_valid_string(name));
+  if (NULL == cwd || !is_valid_string(name))
+    return NQP_INVAL;
+  return nqp_openat_timed(cwd->dir_fd, name);
+}
+
+//------------------------
+// COMMAND LOOKUP ROUTINES
+//------------------------
+// Opens every directory of the ':' separated <list> as a search directory.
+// Directories that are not absolute or cannot be opened are skipped.
+void load_search_dirs(const char *list) {
+  assert(NULL != list);
+  if (NULL == list)
+    return;
+
+  char *copy = strdup(list);
+  assert(NULL != copy);
+  if (NULL == copy)
+    return;
+  char *saveptr = NULL;
+  for (char *dir = strtok_r(copy, ":", &saveptr);
+       dir != NULL && num_search_dirs < MAX_SEARCH_DIRS;
+       dir = strtok_r(NULL, ":", &saveptr)) {
+    if (!is_valid_path(dir))
+      continue;
+    int dir_fd = nqp_open_timed(dir);
+    nqp_file_stat status;
+    if (dir_fd < 0 || nqp_fstat(dir_fd, &status) != NQP_OK ||
+        status.type != DT_DIR) {
+      if (dir_fd >= 0)
+        nqp_close(dir_fd);
+      continue;
+    }
+    Search_Dir *search_dir = &search_dirs[num_search_dirs++];
+    snprintf(search_dir->path, sizeof(search_dir->path), "%s", dir);
+    search_dir->dir_fd = dir_fd;
+  }
+  free(copy);
+  plan_generation++;
+}
+
+// Forgets every hashed command, found or not (`hash -r`).
+void forget_commands(void) {
+  for (int slot = 0; slot < COMMAND_TABLE_SLOTS; slot++) {
+    Hashed_Command *entry = command_table[slot];
+    while (NULL != entry) {
+      Hashed_Command *next = entry->next;
+      free(entry->name);
+      free(entry);
+      entry = next;
+    }
+    command_table[slot] = NULL;
+  }
+  plan_generation++; // plans hold where their commands were found
+}
+
+// Closes the search directories and empties the command hash table.
+void free_search_dirs(void) {
+  forget_commands();
+  for (int i = 0; i < num_search_dirs; i++) {
+    nqp_close(search_dirs[i].dir_fd);
+  }
+  num_search_dirs = 0;
+}
+
+// FNV-1a hash of <text>, continuing from <hash> (2166136261 to start)
+static uint32_t fnv1a(const char *text, uint32_t hash) {
+  for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+    hash = (hash ^ *c) * 16777619u;
+  }
+  return hash;
+}
+
+// the command table slot of a command name
+static unsigned command_slot(const char *name) {
+  return fnv1a(name, 2166136261u) % COMMAND_TABLE_SLOTS;
+}
+
+// Writes the image path of <name> in the search directory <dir> into <out>.
+static void search_dir_path(int dir, const char *name, char *out,
+                            size_t size) {
+  const char *path = search_dirs[dir].path;
+  snprintf(out, size, "%s%s%s", path, strcmp(path, "/") == 0 ? "" : "/",
+           name);
+}
+
+// Opens <name> in the first search directory that has it as a file.
+// Returns the nqp fd and sets <dir> to that directory's index, or returns a
+// negative value and sets <dir> to COMMAND_MISSING.
+static int search_command(const char *name, int *dir) {
+  for (int i = 0; i < num_search_dirs; i++) {
+    int fd = nqp_openat_timed(search_dirs[i].dir_fd, name);
+    if (fd < 0)
+      continue;
+    nqp_file_stat status;
+    if (nqp_fstat(fd, &status) == NQP_OK && status.type == DT_REG) {
+      *dir = i;
+      return fd;
+    }
+    nqp_close(fd); // a directory of that name, keep looking
+  }
+  *dir = COMMAND_MISSING;
+  return NQP_FILE_NOT_FOUND;
+}
+
+// Opens the command <name> through the hash table: a hashed name costs one
+// lookup in the directory it was found in, a hashed miss costs nothing. Names
+// not in the table yet are searched for and remembered either way.
+// Returns the nqp fd and sets <dir> to the search directory it is in, or
+// returns a negative value if no search directory has it.
+static int open_hashed(const char *name, int *dir) {
+
+  unsigned slot = command_slot(name);
+  Hashed_Command *entry = command_table[slot];
+  while (NULL != entry && strcmp(entry->name, name) != 0) {
+    entry = entry->next;
+  }
+
+  int fd = NQP_FILE_NOT_FOUND;
+  if (NULL == entry) { // first time: search and remember the answer
+    entry = calloc(1, sizeof(Hashed_Command));
+    assert(NULL != entry);
+    if (NULL == entry)
+      return NQP_FILE_NOT_FOUND;
+    entry->name = strdup(name);
+    fd = search_command(name, &entry->dir);
+    entry->next = command_table[slot];
+    command_table[slot] = entry;
+  } else if (entry->dir != COMMAND_MISSING) {
+    fd = nqp_openat_timed(search_dirs[entry->dir].dir_fd, name);
+  }
+
+  if (fd >= 0)
+    entry->hits++;
+  *dir = entry->dir;
+  return fd;
+}
+
+// Opens the command <name> through the hash table, see open_hashed.
+int open_hashed_command(const char *name) {
+  assert(is_valid_string(name));
+  if (!is_valid_string(name))
+    return NQP_INVAL;
+  int dir;
+  return open_hashed(name, &dir);
+}
+
+// Opens the command <name> to run it: names with a '/' are paths from the
+// cwd (or the root), other names are looked up in the cwd first and then in
+// the search directories through the hash table. The image path it was found
+// at is written into <path> unless that is NULL.
+// Returns the nqp fd, or a negative value if not found.
+int open_command_path(const Curr_Dir *cwd, const char *name, char *path,
+                      size_t size) {
+  assert(NULL != cwd);
+  assert(is_valid_string(name));
+  if (NULL == cwd || !is_valid_string(name))
+    return NQP_INVAL;
+
+  int fd = open_in_curr_dir(cwd, name);
+  if (fd >= 0) {
+    if (NULL != path)
+      make_absolute_path(cwd, name, path, size);
+    return fd;
+  }
+  if (NULL != strchr(name, '/'))
+    return fd;
+
+  int dir;
+  fd = open_hashed(name, &dir);
+  if (fd >= 0 && NULL != path)
+    search_dir_path(dir, name, path, size);
+  return fd;
+}
+
+// Opens the command <name> to run it, see open_command_path.
+int open_command(const Curr_Dir *cwd, const char *name) {
+  return open_command_path(cwd, name, NULL, 0);
+}
+
+// Opens the executable of <cmd>: straight from the inode its plan resolved,
+// then from its path, or looked up like open_command when it has neither (or
+// they are gone).
+int open_resolved_command(const Command *cmd, const Curr_Dir *cwd) {
+  assert(command_is_valid(cmd));
+  if (!command_is_valid(cmd))
+    return NQP_INVAL;
+  if (cmd->executable_inode != 0) {
+    int fd = nqp_open_by_inode_timed(cmd->executable_inode);
+    if (fd >= 0)
+      return fd;
+  }
+  if (cmd->executable[0] != '\0') {
+    int fd = nqp_open_timed(cmd->executable);
+    if (fd >= 0)
+      return fd;
+  }
+  return open_command(cwd, cmd->argv[0]);
+}
+
+// Opens the "<" input <filename> of <cmd>: straight from the inode its plan
+// resolved, then from its path, or relative to the cwd when it has neither
+// (or they are gone).
+int open_resolved_input(const Command *cmd, const Curr_Dir *cwd,
+                        const char *filename) {
+  assert(NULL != cmd);
+  if (NULL != cmd && cmd->input_inode != 0) {
+    int fd = nqp_open_by_inode_timed(cmd->input_inode);
+    if (fd >= 0)
+      return fd;
+  }
+  if (NULL != cmd && cmd->input_path[0] != '\0') {
+    int fd = nqp_open_timed(cmd->input_path);
+    if (fd >= 0)
+      return fd;
+  }
+  return open_in_curr_dir(cwd, filename);
+}
+
 //----------
 // VALIDATORS
 //----------
@@ -207,6 +530,22 @@ void trim_string(char *str) {
   assert(is_valid_string(str));
 }
 
+// Writes the absolute path of <name> into <out>: <name> itself if it starts
+// with '/', the cwd if it is NULL, otherwise <name> inside the cwd
+void make_absolute_path(const Curr_Dir *cwd, const char *name, char *out,
+                        size_t size) {
+  assert(NULL != cwd && NULL != out);
+  if (NULL == name) {
+    snprintf(out, size, "%s", cwd->path);
+  } else if (name[0] == '/') {
+    snprintf(out, size, "%s", name);
+  } else if (cwd->path[strlen(cwd->path) - 1] == '/') {
+    snprintf(out, size, "%s%s", cwd->path, name);
+  } else {
+    snprintf(out, size, "%s/%s", cwd->path, name);
+  }
+}
+
 //---------
 // BUILTINS
 //---------
@@ -220,55 +559,1639 @@ void command_pwd(const Curr_Dir *cwd) {
   custom_print(buffer); // printing
 }
 
-// List: list the content of the files
-void command_ls(const Curr_Dir *cwd) {
+// snprintf's length, clamped to what actually fit in <size>
+static size_t clamp_length(int len, size_t size) {
+  return len < 0 ? 0 : ((size_t)len < size ? (size_t)len : size - 1);
+}
+
+// LS HELPERS
+// one listed entry, kept around when the listing has to be sorted
+typedef struct {
+  nqp_dirent dirent;
+  nqp_file_stat status;
+} Ls_Entry;
+
+// the options of one ls command, shared by all of its directories
+typedef struct {
+  bool long_format;
+  bool show_hidden;
+  char sort_by; // 'S' or 't', 0 keeps the directory's order
+} Ls_Options;
+
+// the buffers of the ls commands the main thread runs, kept between them so
+// listing stops allocating once it has seen its biggest sorted directory. A
+// pipeline stage runs on a thread of its own and allocates its own
+char *ls_output = NULL;     // LS_OUTPUT_SIZE bytes
+Ls_Entry *ls_sorted = NULL; // grown to the biggest sorted listing
+size_t ls_sorted_capacity = 0;
+
+// biggest first, names break ties
+static int ls_compare_size(const void *a, const void *b) {
+  const Ls_Entry *x = a, *y = b;
+  if (x->status.data_length != y->status.data_length)
+    return x->status.data_length < y->status.data_length ? 1 : -1;
+  return strcmp(x->dirent.name, y->dirent.name);
+}
+
+// newest first, names break ties
+static int ls_compare_mtime(const void *a, const void *b) {
+  const Ls_Entry *x = a, *y = b;
+  const struct timespec *tx = &x->status.modify_time;
+  const struct timespec *ty = &y->status.modify_time;
+  if (tx->tv_sec != ty->tv_sec)
+    return tx->tv_sec < ty->tv_sec ? 1 : -1;
+  if (tx->tv_nsec != ty->tv_nsec)
+    return tx->tv_nsec < ty->tv_nsec ? 1 : -1;
+  return strcmp(x->dirent.name, y->dirent.name);
+}
+
+// formats one line of ls output into <out>, returns its length
+static size_t ls_format_entry(char *out, size_t size, const nqp_dirent *entry,
+                              const nqp_file_stat *status, bool long_format) {
+  const char *suffix = entry->type == DT_DIR ? "/" : "";
+  int len;
+
+  if (long_format) { // inode, size, last modified (UTC), name
+    char mtime[32] = "-";
+    struct tm tm;
+    if (status->modify_time.tv_sec != 0 &&
+        NULL != gmtime_r(&status->modify_time.tv_sec, &tm)) {
+      strftime(mtime, sizeof(mtime), "%Y-%m-%d %H:%M", &tm);
+    }
+    len = snprintf(out, size, "%8lu %12lu %s %s%s\n", entry->inode_number,
+                   status->data_length, mtime, entry->name, suffix);
+  } else {
+    len = snprintf(out, size, "%lu %s%s\n", entry->inode_number, entry->name,
+                   suffix);
+  }
+  return clamp_length(len, size);
+}
+
+/**
+ * ls_directory(): lists the directory <target>, open at nqp <fd>, into
+ * <output>, LS_OUTPUT_SIZE bytes, and closes <fd>. <separator> is NULL for a
+ * single directory, otherwise the listing goes under a "<target>:" line with
+ * <separator> in front of it
+ * Return: true if the directory was listed
+ */
+static bool ls_directory(int fd, const char *target, const char *separator,
+                         const Ls_Options *options, char *output) {
+  nqp_dirent batch[LS_BATCH_SIZE];
+  nqp_file_stat statuses[LS_BATCH_SIZE];
+  bool main_thread = stage_output_fd < 0; // not a pipeline stage
+  Ls_Entry *sorted = main_thread ? ls_sorted : NULL; // only when sorting
+  size_t sorted_capacity = main_thread ? ls_sorted_capacity : 0;
+  size_t num_sorted = 0, used = 0;
+  ssize_t dirents_read;
+  bool out_of_memory = false;
+  if (NULL != separator) // one of several, it goes under its name
+    used = clamp_length(snprintf(output, LS_OUTPUT_SIZE, "%s%s:\n", separator,
+                                 target),
+                        LS_OUTPUT_SIZE);
+
+  // read the directory entries a batch at a time
+  while (!out_of_memory &&
+         (dirents_read = nqp_getdents_stat_timed(fd, batch, statuses,
+                                                 LS_BATCH_SIZE)) > 0) {
+    for (ssize_t i = 0; i < dirents_read; i++) {
+      bool hidden = batch[i].name[0] == '.' ||
+                    (statuses[i].attributes & NQP_ATTR_HIDDEN);
+      if (hidden && !options->show_hidden) {
+        free(batch[i].name);
+        continue;
+      }
+
+      if (options->sort_by) { // keep it, printed once everything is read
+        if (num_sorted == sorted_capacity) {
+          size_t capacity = sorted_capacity ? sorted_capacity * 2 : 256;
+          Ls_Entry *bigger = realloc(sorted, capacity * sizeof(Ls_Entry));
+          assert(NULL != bigger);
+          if (NULL == bigger) { // the rest of the batch goes, sorted below
+            for (ssize_t j = i; j < dirents_read; j++)
+              free(batch[j].name);
+            out_of_memory = true;
+            break;
+          }
+          sorted = bigger;
+          sorted_capacity = capacity;
+        }
+        sorted[num_sorted].dirent = batch[i];
+        sorted[num_sorted].status = statuses[i];
+        num_sorted++;
+        continue;
+      }
+
+      if (LS_OUTPUT_SIZE - used < LS_MAX_LINE_SIZE) {
+        custom_write(output, used); // buffer is full
+        used = 0;
+      }
+      used += ls_format_entry(output + used, LS_OUTPUT_SIZE - used, &batch[i],
+                              &statuses[i], options->long_format);
+      free(batch[i].name);
+    }
+    custom_write(output, used); // one write for the whole batch
+    used = 0;
+  }
+
+  // if not a directory then throw error
+  if (dirents_read == -1) {
+    fprintf(stderr, "%s is not a directory\n", target);
+    used = 0; // nor its header
+  }
+
+  // out of memory: the sorted listing is dropped, not printed in part
+  for (size_t i = 0; out_of_memory && i < num_sorted; i++)
+    free(sorted[i].dirent.name);
+
+  // sorted listings are printed in one go at the end
+  if (num_sorted > 0 && !out_of_memory) {
+    qsort(sorted, num_sorted, sizeof(Ls_Entry),
+          options->sort_by == 'S' ? ls_compare_size : ls_compare_mtime);
+    for (size_t i = 0; i < num_sorted; i++) {
+      if (LS_OUTPUT_SIZE - used < LS_MAX_LINE_SIZE) {
+        custom_write(output, used);
+        used = 0;
+      }
+      used += ls_format_entry(output + used, LS_OUTPUT_SIZE - used,
+                              &sorted[i].dirent, &sorted[i].status,
+                              options->long_format);
+      free(sorted[i].dirent.name);
+    }
+  }
+  custom_write(output, used); // the header of an empty directory, if any
+
+  // clean up resources, the main thread keeps the array for the next ls
+  if (main_thread) {
+    ls_sorted = sorted;
+    ls_sorted_capacity = sorted_capacity;
+  } else {
+    free(sorted);
+  }
+  nqp_close(fd);
+  return dirents_read != -1;
+}
+
+// opens the ls operand <target> and reads its status into <status>, returns
+// the nqp fd or a negative value (reported) if it is not found
+static int ls_open_operand(const Curr_Dir *cwd, const char *target,
+                           nqp_file_stat *status) {
+  int fd = open_in_curr_dir(cwd, target);
+  if (fd >= 0 && nqp_fstat_timed(fd, status) != NQP_OK) {
+    nqp_close(fd);
+    fd = NQP_FILE_NOT_FOUND;
+  }
+  if (fd < 0)
+    fprintf(stderr, "%s not found\n", target);
+  return fd;
+}
+
+/**
+ * ls_files(): lists the operands of <cmd> that are files into <output>,
+ * LS_OUTPUT_SIZE bytes, under the names they were given, in the order
+ * <options> sorts in. Operands that are not found are reported here, the
+ * directories are left for ls_directory
+ * Return: the number of files listed
+ */
+static size_t ls_files(const Command *cmd, const Curr_Dir *cwd,
+                       const Ls_Options *options, char *output) {
+  bool main_thread = stage_output_fd < 0; // see ls_output
+  Ls_Entry *files = main_thread ? ls_sorted : NULL;
+  size_t capacity = main_thread ? ls_sorted_capacity : 0;
+  size_t num_files = 0, used = 0;
+
+  for (int i = 1; i < cmd->argc; i++) {
+    const char *arg = command_get_arg(cmd, i);
+    if (arg[0] == '-' && arg[1] != '\0')
+      continue;
+    nqp_file_stat status;
+    int fd = ls_open_operand(cwd, arg, &status);
+    if (fd < 0)
+      continue;
+    nqp_close(fd);
+    if (status.type == DT_DIR)
+      continue;
+
+    if (num_files == capacity) {
+      size_t bigger_capacity = capacity ? capacity * 2 : 256;
+      Ls_Entry *bigger = realloc(files, bigger_capacity * sizeof(Ls_Entry));
+      assert(NULL != bigger);
+      if (NULL == bigger)
+        break; // the files found so far are still listed
+      files = bigger;
+      capacity = bigger_capacity;
+    }
+    // the operand is the name, it lives as long as the command
+    files[num_files].dirent =
+        (nqp_dirent){.inode_number = status.inode_number,
+                     .name_len = strlen(arg),
+                     .name = (char *)arg,
+                     .type = status.type};
+    files[num_files].status = status;
+    num_files++;
+  }
+
+  if (options->sort_by && num_files > 1)
+    qsort(files, num_files, sizeof(Ls_Entry),
+          options->sort_by == 'S' ? ls_compare_size : ls_compare_mtime);
+  for (size_t i = 0; i < num_files; i++) {
+    if (LS_OUTPUT_SIZE - used < LS_MAX_LINE_SIZE) {
+      custom_write(output, used);
+      used = 0;
+    }
+    used += ls_format_entry(output + used, LS_OUTPUT_SIZE - used,
+                            &files[i].dirent, &files[i].status,
+                            options->long_format);
+  }
+  custom_write(output, used);
+
+  // the main thread keeps the array for the next ls
+  if (main_thread) {
+    ls_sorted = files;
+    ls_sorted_capacity = capacity;
+  } else {
+    free(files);
+  }
+  return num_files;
+}
+
+/*
+ * List: lists the content of the cwd, or every file and the content of every
+ * directory given as argument
+ * "ls [-a] [-l] [-S | -t] [file | directory ...]"
+ * -l long format (size and last modified time), -S sort by size, -t sort by
+ * last modified time, -a also show hidden entries
+ * Files are listed first, like ls(1) does; with several arguments each
+ * directory is then listed under a "<directory>:" line
+ * Entries are read LS_BATCH_SIZE at a time along with their status and every
+ * batch goes out with one write
+ */
+void command_ls(const Command *cmd, const Curr_Dir *cwd) {
   // cwd validation
   assert(NULL != cwd);
   assert(is_valid_curr_dir(cwd));
   if (!is_valid_curr_dir(cwd))
     return;
 
-  nqp_dirent entry = {0};
-  int fd = -1;
-  ssize_t dirents_read;
+  // parse the options, anything else is a file or directory to list
+  Ls_Options options = {.long_format = false, .show_hidden = false};
+  int num_targets = 0;
+  for (int i = 1; NULL != cmd && i < cmd->argc; i++) {
+    const char *arg = command_get_arg(cmd, i);
+    if (arg[0] != '-' || arg[1] == '\0') {
+      num_targets++;
+      continue;
+    }
+    for (const char *option = arg + 1; *option; option++) {
+      if (*option == 'l') {
+        options.long_format = true;
+      } else if (*option == 'a') {
+        options.show_hidden = true;
+      } else if (*option == 'S' || *option == 't') {
+        options.sort_by = *option;
+      } else {
+        fprintf(stderr, "ls: invalid option -- '%c'\n", *option);
+        return;
+      }
+    }
+  }
 
-  // copying the function parameters
-  char *curr_path = strdup(cwd->path);
-  assert(is_valid_path(curr_path));
-  if (!is_valid_path(curr_path)) {
-    printf("ls: corrupted working directory path- %s != %s", curr_path,
-           cwd->path);
+  bool main_thread = stage_output_fd < 0; // see ls_output
+  if (main_thread && NULL == ls_output)
+    ls_output = malloc(LS_OUTPUT_SIZE);
+  char *output = main_thread ? ls_output : malloc(LS_OUTPUT_SIZE);
+  assert(NULL != output);
+  if (NULL == output)
     return;
+
+  if (num_targets == 0) {
+    int fd = nqp_open_timed(cwd->path);
+    if (fd >= 0)
+      ls_directory(fd, cwd->path, NULL, &options, output);
+    else
+      fprintf(stderr, "%s not found\n", cwd->path);
   }
 
-  // open the file in the mounted file system
-  fd = nqp_open(curr_path);
-  if (fd == NQP_FILE_NOT_FOUND) {
-    fprintf(stderr, "%s not found\n", curr_path);
-    free(curr_path);
-    return; // file open failed
+  // the files first, then the directories; a blank line goes between them
+  bool listed = num_targets > 0 && ls_files(cmd, cwd, &options, output) > 0;
+  for (int i = 1; num_targets > 0 && i < cmd->argc; i++) {
+    const char *arg = command_get_arg(cmd, i);
+    if (arg[0] == '-' && arg[1] != '\0')
+      continue;
+    nqp_file_stat status;
+    int fd = open_in_curr_dir(cwd, arg); // not found was reported by ls_files
+    if (fd < 0)
+      continue;
+    if (nqp_fstat_timed(fd, &status) != NQP_OK || status.type != DT_DIR) {
+      nqp_close(fd);
+      continue;
+    }
+    const char *separator = num_targets == 1 ? NULL : listed ? "\n" : "";
+    listed |= ls_directory(fd, arg, separator, &options, output);
   }
 
-  // read the files directory entries
-  while ((dirents_read = nqp_getdents(fd, &entry, 1)) > 0) {
-    char buffer[MAX_LINE_SIZE]; // Adjust the size as needed
-    snprintf(buffer, sizeof(buffer), "%lu %s", entry.inode_number, entry.name);
-    custom_print(buffer);       // print its metadata
-    if (entry.type == DT_DIR) { // append "/", if its a directory
-      custom_print("/");
+  if (!main_thread)
+    free(output);
+}
+
+// WALK HELPERS
+// one file found by nqp_walk, for builtins that need the whole tree at once
+typedef struct {
+  char *path;
+  uint64_t inode;     // opens the file without looking the path up again
+  int depth;          // 0 for the directory the walk started at
+  nqp_dtype type;
+  uint64_t size;      // data length in bytes
+  uint64_t allocated; // bytes in the clusters allocated to the file
+} Walk_Entry;
+
+// every file found by a walk. nqp_walk calls in from several threads, so
+// adding to the list takes the lock
+typedef struct {
+  pthread_mutex_t lock;
+  Walk_Entry *entries;
+  size_t count;
+  size_t capacity;
+  int max_depth;    // directories deeper than this are not entered, -1: any
+  bool show_hidden; // false leaves out hidden files and directories
+  bool failed;      // out of memory, the walk was stopped
+} Walk_List;
+
+// nqp_walk callback adding every file to a Walk_List
+static nqp_walk_action walk_collect(const char *path,
+                                    const nqp_file_stat *status, int depth,
+                                    void *arg) {
+  Walk_List *list = arg;
+  const char *name = strrchr(path, '/');
+  name = NULL != name ? name + 1 : path;
+  if (depth > 0 && !list->show_hidden &&
+      (name[0] == '.' || (status->attributes & NQP_ATTR_HIDDEN)))
+    return NQP_WALK_SKIP;
+
+  char *copy = strdup(path);
+  pthread_mutex_lock(&list->lock);
+  if (NULL != copy && list->count == list->capacity) {
+    size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+    Walk_Entry *bigger = realloc(list->entries, capacity * sizeof(Walk_Entry));
+    if (NULL != bigger) {
+      list->entries = bigger;
+      list->capacity = capacity;
     }
-    putchar('\n');
-    free(entry.name);
   }
+  if (NULL == copy || list->count == list->capacity) {
+    list->failed = true;
+    pthread_mutex_unlock(&list->lock);
+    free(copy);
+    return NQP_WALK_STOP;
+  }
+  Walk_Entry *entry = &list->entries[list->count++];
+  entry->path = copy;
+  entry->inode = status->inode_number;
+  entry->depth = depth;
+  entry->type = status->type;
+  entry->size = status->data_length;
+  entry->allocated = (uint64_t)status->cluster_count * status->cluster_size;
+  pthread_mutex_unlock(&list->lock);
+
+  if (list->max_depth >= 0 && depth >= list->max_depth)
+    return NQP_WALK_SKIP;
+  return NQP_WALK_CONTINUE;
+}
 
-  // if not a directory then throw error
-  if (dirents_read == -1) {
-    fprintf(stderr, "%s is not a directory\n", curr_path);
+// orders paths so that every directory comes right before its contents: '/'
+// sorts before any other character
+static int walk_compare_paths(const void *a, const void *b) {
+  const unsigned char *x = (const unsigned char *)((const Walk_Entry *)a)->path;
+  const unsigned char *y = (const unsigned char *)((const Walk_Entry *)b)->path;
+  while (*x != '\0' && *x == *y) {
+    x++;
+    y++;
+  }
+  int cx = *x == '/' ? 1 : *x;
+  int cy = *y == '/' ? 1 : *y;
+  return cx - cy;
+}
+
+// adds the tree below <start> to <list>, in no particular order. Prints the
+// error and returns false if the walk failed
+static bool walk_collect_unsorted(const char *command, const char *start,
+                                  Walk_List *list) {
+  nqp_error err = nqp_walk(start, walk_collect, list, 0);
+  if (err == NQP_FILE_NOT_FOUND) {
+    fprintf(stderr, "%s: %s not found\n", command, start);
+    return false;
+  }
+  if (err != NQP_OK || list->failed) {
+    fprintf(stderr, "%s: could not walk %s\n", command, start);
+    return false;
+  }
+  return true;
+}
+
+// sorts <list> by path, see walk_compare_paths
+static void walk_sort(Walk_List *list) {
+  qsort(list->entries, list->count, sizeof(Walk_Entry), walk_compare_paths);
+}
+
+// walks the tree below <start> into <list>, sorted by path. Prints the error
+// and returns false if the walk failed
+static bool walk_collect_tree(const char *command, const char *start,
+                              Walk_List *list) {
+  if (!walk_collect_unsorted(command, start, list))
+    return false;
+  walk_sort(list);
+  return true;
+}
+
+static void walk_list_destroy(Walk_List *list) {
+  for (size_t i = 0; i < list->count; i++) {
+    free(list->entries[i].path);
+  }
+  free(list->entries);
+  pthread_mutex_destroy(&list->lock);
+}
+
+// appends <length> bytes of <text> to the <used> bytes of <output>, which is
+// written out first if it is full
+static void walk_output(char *output, size_t *used, const char *text,
+                        size_t length) {
+  if (WALK_OUTPUT_SIZE - *used < length) {
+    custom_write(output, *used);
+    *used = 0;
+  }
+  memcpy(output + *used, text, length);
+  *used += length;
+}
+
+// prints the du lines of a sorted Walk_List, every directory after its
+// contents
+static void du_print(const Walk_List *list, bool all_files, bool summarize) {
+  char *output = malloc(WALK_OUTPUT_SIZE);
+  // the directories whose contents are still being added up, innermost last
+  size_t *open_dirs = malloc(list->count * sizeof(size_t));
+  uint64_t *totals = malloc(list->count * sizeof(uint64_t));
+  size_t num_open = 0, used = 0;
+  char line[WALK_MAX_LINE_SIZE];
+  assert(NULL != output && NULL != open_dirs && NULL != totals);
+  if (NULL == output || NULL == open_dirs || NULL == totals) {
+    free(output);
+    free(open_dirs);
+    free(totals);
+    return;
+  }
+
+  // the list is sorted, every directory comes right before its contents and
+  // is done once an entry that is not deeper shows up
+  for (size_t i = 0; i <= list->count; i++) {
+    const Walk_Entry *entry = i < list->count ? &list->entries[i] : NULL;
+    while (num_open > 0 &&
+           (NULL == entry ||
+            list->entries[open_dirs[num_open - 1]].depth >= entry->depth)) {
+      const Walk_Entry *done = &list->entries[open_dirs[--num_open]];
+      if (!summarize || done->depth == 0) {
+        int len = snprintf(line, sizeof(line), "%lu\t%s\n",
+                           (totals[num_open] + 1023) / 1024, done->path);
+        walk_output(output, &used, line, clamp_length(len, sizeof(line)));
+      }
+      if (num_open > 0)
+        totals[num_open - 1] += totals[num_open];
+    }
+    if (NULL == entry)
+      break;
+
+    if (entry->type == DT_DIR) {
+      open_dirs[num_open] = i;
+      totals[num_open++] = entry->allocated;
+    } else {
+      if (num_open > 0)
+        totals[num_open - 1] += entry->allocated;
+      if ((all_files && !summarize) || num_open == 0) { // or du on a file
+        int len = snprintf(line, sizeof(line), "%lu\t%s\n",
+                           (entry->allocated + 1023) / 1024, entry->path);
+        walk_output(output, &used, line, clamp_length(len, sizeof(line)));
+      }
+    }
+  }
+  custom_write(output, used);
+
+  free(open_dirs);
+  free(totals);
+  free(output);
+}
+
+// du of the directory <target>, the cwd if NULL
+static void du_walk(const Curr_Dir *cwd, const char *target, bool all_files,
+                    bool summarize) {
+  char start[WALK_MAX_PATH_SIZE];
+  make_absolute_path(cwd, target, start, sizeof(start));
+  Walk_List list = {.max_depth = -1, .show_hidden = true};
+  pthread_mutex_init(&list.lock, NULL);
+  if (walk_collect_tree("du", start, &list))
+    du_print(&list, all_files, summarize);
+  walk_list_destroy(&list);
+}
+
+/*
+ * Disk Usage: prints the space allocated to every directory below the cwd, or
+ * below every directory given as argument, in KB, each after its contents
+ * "du [-a] [-s] [directory ...]"
+ * -a also prints every file, -s only prints the total of the directory itself
+ * The tree is walked in parallel with nqp_walk
+ */
+void command_du(const Command *cmd, const Curr_Dir *cwd) {
+  // cwd validation
+  assert(NULL != cmd && NULL != cwd);
+  assert(is_valid_curr_dir(cwd));
+  if (NULL == cmd || !is_valid_curr_dir(cwd))
+    return;
+
+  // parse the options, anything else is a directory to walk
+  bool all_files = false, summarize = false;
+  int num_targets = 0;
+  for (int i = 1; i < cmd->argc; i++) {
+    const char *arg = command_get_arg(cmd, i);
+    if (arg[0] != '-' || arg[1] == '\0') {
+      num_targets++;
+      continue;
+    }
+    for (const char *option = arg + 1; *option; option++) {
+      if (*option == 'a') {
+        all_files = true;
+      } else if (*option == 's') {
+        summarize = true;
+      } else {
+        fprintf(stderr, "du: invalid option -- '%c'\n", *option);
+        return;
+      }
+    }
+  }
+
+  if (num_targets == 0)
+    du_walk(cwd, NULL, all_files, summarize);
+  for (int i = 1; num_targets > 0 && i < cmd->argc; i++) {
+    const char *arg = command_get_arg(cmd, i);
+    if (arg[0] != '-' || arg[1] == '\0')
+      du_walk(cwd, arg, all_files, summarize);
+  }
+}
+
+// FIND HELPERS
+// the predicates of one find command and the output of its matches. nqp_walk
+// calls in from several threads, the output is only touched with the lock
+typedef struct {
+  const char *name;   // fnmatch pattern for the last component, NULL: any
+  int type;           // DT_DIR, DT_REG, or -1 for either
+  char size_compare;  // '+' more than, '-' less than, '=' exactly, 0: any
+  uint64_t size;      // in size_unit bytes, sizes are rounded up to it
+  uint64_t size_unit;
+  pthread_mutex_t lock;
+  char *output;
+  size_t used;
+} Find_Query;
+
+// parses a -size argument "[+|-]N[c|k|M|G]", false if it is not one
+static bool find_parse_size(const char *arg, Find_Query *query) {
+  query->size_compare = '=';
+  if (*arg == '+' || *arg == '-')
+    query->size_compare = *arg++;
+  if (!isdigit((unsigned char)*arg))
+    return false;
+
+  char *unit;
+  query->size = strtoull(arg, &unit, 10);
+  query->size_unit = 1;
+  if (*unit == 'k') {
+    query->size_unit = 1024;
+  } else if (*unit == 'M') {
+    query->size_unit = 1024 * 1024;
+  } else if (*unit == 'G') {
+    query->size_unit = 1024 * 1024 * 1024;
+  } else if (*unit != 'c' && *unit != '\0') {
+    return false;
+  }
+  return *unit == '\0' || unit[1] == '\0';
+}
+
+// nqp_walk callback printing the files that match every predicate
+static nqp_walk_action find_match(const char *path,
+                                  const nqp_file_stat *status, int depth,
+                                  void *arg) {
+  Find_Query *query = arg;
+  (void)depth;
+
+  const char *name = strrchr(path, '/');
+  name = NULL != name && name[1] != '\0' ? name + 1 : path;
+  if (NULL != query->name && fnmatch(query->name, name, 0) != 0)
+    return NQP_WALK_CONTINUE;
+  if (query->type >= 0 && status->type != (nqp_dtype)query->type)
+    return NQP_WALK_CONTINUE;
+  if (query->size_compare) {
+    uint64_t units =
+        (status->data_length + query->size_unit - 1) / query->size_unit;
+    if ((query->size_compare == '+' && units <= query->size) ||
+        (query->size_compare == '-' && units >= query->size) ||
+        (query->size_compare == '=' && units != query->size))
+      return NQP_WALK_CONTINUE;
+  }
+
+  size_t length = strlen(path);
+  pthread_mutex_lock(&query->lock);
+  if (length + 1 <= WALK_OUTPUT_SIZE) {
+    walk_output(query->output, &query->used, path, length);
+    walk_output(query->output, &query->used, "\n", 1);
+  }
+  pthread_mutex_unlock(&query->lock);
+  return NQP_WALK_CONTINUE;
+}
+
+// prints the matches of <query> below <target>, the cwd if NULL
+static void find_walk(const Curr_Dir *cwd, const char *target,
+                      Find_Query *query) {
+  char start[WALK_MAX_PATH_SIZE];
+  make_absolute_path(cwd, target, start, sizeof(start));
+  nqp_error err = nqp_walk(start, find_match, query, 0);
+  if (err == NQP_FILE_NOT_FOUND)
+    fprintf(stderr, "find: %s not found\n", start);
+  else if (err != NQP_OK)
+    fprintf(stderr, "find: could not walk %s\n", start);
+  custom_write(query->output, query->used);
+  query->used = 0;
+}
+
+/*
+ * Find: prints every file and directory below the cwd, or below every
+ * directory given as argument, that matches all of the predicates
+ * "find [directory ...] [-name pattern] [-type f|d] [-size [+|-]N[c|k|M|G]]"
+ * -name matches the last component against a shell pattern, -size compares
+ * the size rounded up to the unit (bytes by default), + for more, - for less
+ * The tree is walked in parallel with nqp_walk, matches come out in the order
+ * they are found
+ */
+void command_find(const Command *cmd, const Curr_Dir *cwd) {
+  // cwd validation
+  assert(NULL != cmd && NULL != cwd);
+  assert(is_valid_curr_dir(cwd));
+  if (NULL == cmd || !is_valid_curr_dir(cwd))
+    return;
+
+  // parse the predicates, anything else is a directory to search
+  Find_Query query = {.type = -1};
+  int num_targets = 0;
+  for (int i = 1; i < cmd->argc; i++) {
+    const char *arg = command_get_arg(cmd, i);
+    const char *value = command_get_arg(cmd, i + 1);
+    if (arg[0] != '-') {
+      num_targets++;
+      continue;
+    }
+    if (NULL == value) {
+      fprintf(stderr, "find: missing argument to '%s'\n", arg);
+      return;
+    }
+    i++;
+    if (strcmp(arg, "-name") == 0) {
+      query.name = value;
+    } else if (strcmp(arg, "-type") == 0 && strcmp(value, "f") == 0) {
+      query.type = DT_REG;
+    } else if (strcmp(arg, "-type") == 0 && strcmp(value, "d") == 0) {
+      query.type = DT_DIR;
+    } else if (strcmp(arg, "-size") == 0 && find_parse_size(value, &query)) {
+      continue;
+    } else {
+      fprintf(stderr, "find: invalid predicate '%s %s'\n", arg, value);
+      return;
+    }
+  }
+
+  query.output = malloc(WALK_OUTPUT_SIZE);
+  assert(NULL != query.output);
+  if (NULL == query.output)
+    return;
+  pthread_mutex_init(&query.lock, NULL);
+
+  if (num_targets == 0)
+    find_walk(cwd, NULL, &query);
+  for (int i = 1; num_targets > 0 && i < cmd->argc; i++) {
+    const char *arg = command_get_arg(cmd, i);
+    if (arg[0] == '-')
+      i++; // its value
+    else
+      find_walk(cwd, arg, &query);
+  }
+
+  pthread_mutex_destroy(&query.lock);
+  free(query.output);
+}
+
+// draws a sorted Walk_List, every entry under its parent
+static void tree_print(const Walk_List *list) {
+  int max_depth = 0;
+  for (size_t i = 0; i < list->count; i++) {
+    if (list->entries[i].depth > max_depth)
+      max_depth = list->entries[i].depth;
+  }
+
+  char *output = malloc(WALK_OUTPUT_SIZE);
+  bool *is_last = malloc(list->count * sizeof(bool)); // no sibling after it
+  bool *sibling_after = calloc(max_depth + 1, sizeof(bool)); // going back
+  bool *ancestor_last = calloc(max_depth + 1, sizeof(bool)); // going forward
+  size_t used = 0, num_dirs = 0, num_files = 0;
+  char line[WALK_MAX_LINE_SIZE];
+  assert(NULL != output && NULL != is_last && NULL != sibling_after &&
+         NULL != ancestor_last);
+  if (NULL == output || NULL == is_last || NULL == sibling_after ||
+      NULL == ancestor_last) {
+    free(output);
+    free(is_last);
+    free(sibling_after);
+    free(ancestor_last);
+    return;
+  }
+
+  // an entry is the last of its siblings if nothing at its depth follows it
+  // before the list goes back up past its parent
+  for (size_t i = list->count; i-- > 0;) {
+    int depth = list->entries[i].depth;
+    is_last[i] = !sibling_after[depth];
+    sibling_after[depth] = true;
+    for (int d = depth + 1; d <= max_depth; d++) {
+      sibling_after[d] = false;
+    }
+  }
+
+  for (size_t i = 0; i < list->count; i++) {
+    const Walk_Entry *entry = &list->entries[i];
+    const char *suffix = entry->type == DT_DIR && i > 0 ? "/" : "";
+    const char *name = entry->path;
+    size_t len = 0;
+
+    if (i > 0) { // everything but the start is drawn under its parent
+      name = strrchr(entry->path, '/') + 1;
+      for (int d = 1; d < entry->depth && len < sizeof(line) / 2; d++) {
+        len += clamp_length(snprintf(line + len, sizeof(line) - len, "%s",
+                                     ancestor_last[d] ? "    " : "│   "),
+                            sizeof(line) - len);
+      }
+      len += clamp_length(snprintf(line + len, sizeof(line) - len, "%s",
+                                   is_last[i] ? "└── " : "├── "),
+                          sizeof(line) - len);
+      ancestor_last[entry->depth] = is_last[i];
+      if (entry->type == DT_DIR)
+        num_dirs++;
+      else
+        num_files++;
+    }
+    len += clamp_length(
+        snprintf(line + len, sizeof(line) - len, "%s%s\n", name, suffix),
+        sizeof(line) - len);
+    walk_output(output, &used, line, len);
+  }
+  int len = snprintf(line, sizeof(line), "\n%zu directories, %zu files\n",
+                     num_dirs, num_files);
+  walk_output(output, &used, line, clamp_length(len, sizeof(line)));
+  custom_write(output, used);
+
+  free(output);
+  free(is_last);
+  free(sibling_after);
+  free(ancestor_last);
+}
+
+// draws the tree below <target>, the cwd if NULL
+static void tree_walk(const Curr_Dir *cwd, const char *target, int max_depth,
+                      bool show_hidden) {
+  char start[WALK_MAX_PATH_SIZE];
+  make_absolute_path(cwd, target, start, sizeof(start));
+  Walk_List list = {.max_depth = max_depth, .show_hidden = show_hidden};
+  pthread_mutex_init(&list.lock, NULL);
+  if (walk_collect_tree("tree", start, &list))
+    tree_print(&list);
+  walk_list_destroy(&list);
+}
+
+/*
+ * Tree: draws the directories and files below the cwd, or below every
+ * directory given as argument, sorted by name
+ * "tree [-a] [-L depth] [directory ...]"
+ * -a also shows hidden entries, -L only goes <depth> levels down
+ * The tree is walked in parallel with nqp_walk, then sorted
+ */
+void command_tree(const Command *cmd, const Curr_Dir *cwd) {
+  // cwd validation
+  assert(NULL != cmd && NULL != cwd);
+  assert(is_valid_curr_dir(cwd));
+  if (NULL == cmd || !is_valid_curr_dir(cwd))
+    return;
+
+  // parse the options, anything else is a directory to draw
+  int max_depth = -1, num_targets = 0;
+  bool show_hidden = false;
+  for (int i = 1; i < cmd->argc; i++) {
+    const char *arg = command_get_arg(cmd, i);
+    if (strcmp(arg, "-a") == 0) {
+      show_hidden = true;
+    } else if (strcmp(arg, "-L") == 0 && NULL != command_get_arg(cmd, i + 1) &&
+               atoi(command_get_arg(cmd, i + 1)) > 0) {
+      max_depth = atoi(command_get_arg(cmd, ++i));
+    } else if (arg[0] != '-') {
+      num_targets++;
+    } else {
+      fprintf(stderr, "tree: invalid option '%s'\n", arg);
+      return;
+    }
+  }
+
+  if (num_targets == 0)
+    tree_walk(cwd, NULL, max_depth, show_hidden);
+  for (int i = 1; num_targets > 0 && i < cmd->argc; i++) {
+    const char *arg = command_get_arg(cmd, i);
+    if (strcmp(arg, "-L") == 0)
+      i++; // its depth
+    else if (arg[0] != '-')
+      tree_walk(cwd, arg, max_depth, show_hidden);
+  }
+}
+
+// GREP HELPERS
+// one piece of one file, searched by whichever thread takes it first
+typedef struct {
+  const Walk_Entry *file;
+  uint64_t start; // the task owns the lines that start in [start, end)
+  uint64_t end;
+  char *matches;  // "path:line\n" for every matching line, in file order
+  size_t used;
+  size_t capacity;
+  bool matched;
+  bool binary; // a NUL byte turned up, matching lines are not printed
+  bool failed; // the file could not be read
+} Grep_Task;
+
+// everything the grep threads share, they only take tasks by bumping
+// next_task and never touch each other's
+typedef struct {
+  const char *pattern;
+  size_t pattern_length;
+  Grep_Task *tasks;
+  size_t num_tasks;
+  atomic_size_t next_task;
+} Grep_Job;
+
+// finds <pattern> in <text>: memchr (vectorized in libc) skips ahead to every
+// occurrence of the first byte, memcmp checks the rest from there
+static const char *grep_find(const char *text, size_t length,
+                             const char *pattern, size_t pattern_length) {
+  if (pattern_length == 0)
+    return text;
+  while (length >= pattern_length) {
+    const char *hit = memchr(text, pattern[0], length - pattern_length + 1);
+    if (NULL == hit)
+      return NULL;
+    if (memcmp(hit + 1, pattern + 1, pattern_length - 1) == 0)
+      return hit;
+    length -= hit + 1 - text;
+    text = hit + 1;
+  }
+  return NULL;
+}
+
+// reads <count> bytes at <offset> of <fd> into <buffer>, returns how many were
+// read before the end of the file, -1 on error
+static ssize_t grep_read(int fd, char *buffer, size_t count, uint64_t offset) {
+  size_t total = 0;
+  while (total < count) {
+    ssize_t bytes_read = nqp_pread_timed(fd, buffer + total, count - total,
+                                         (off_t)(offset + total));
+    if (bytes_read < 0)
+      return -1;
+    if (bytes_read == 0)
+      break;
+    total += bytes_read;
+  }
+  return (ssize_t)total;
+}
+
+static void grep_add_match(Grep_Task *task, const char *line, size_t length) {
+  size_t path_length = strlen(task->file->path);
+  size_t needed = path_length + 1 + length + 1;
+  if (task->capacity - task->used < needed) {
+    size_t capacity = task->capacity ? task->capacity * 2 : 4096;
+    while (capacity - task->used < needed)
+      capacity *= 2;
+    char *bigger = realloc(task->matches, capacity);
+    if (NULL == bigger) {
+      task->failed = true;
+      return;
+    }
+    task->matches = bigger;
+    task->capacity = capacity;
+  }
+  char *out = task->matches + task->used;
+  memcpy(out, task->file->path, path_length);
+  out[path_length] = ':';
+  memcpy(out + path_length + 1, line, length);
+  out[path_length + 1 + length] = '\n';
+  task->used += needed;
+}
+
+// prints one matching line of grep_stream, lines too long for <output> are
+// written on their own
+static void grep_stream_output(char *output, size_t *used, const char *line,
+                               size_t length) {
+  if (length + 1 > WALK_OUTPUT_SIZE) {
+    custom_write(output, *used);
+    *used = 0;
+    custom_write(line, length);
+    custom_write("\n", 1);
+    return;
+  }
+  walk_output(output, used, line, length);
+  walk_output(output, used, "\n", 1);
+}
+
+// filters the lines read from <fd> (the input of a pipeline stage, or a copy
+// of the "<" file) the way grep does without a file: prints every matching
+// line, or with <names_only> "(standard input)" once and stops reading
+static void grep_stream(int fd, const char *pattern, bool names_only) {
+  size_t pattern_length = strlen(pattern);
+  size_t capacity = GREP_TAIL_SIZE, used = 0, output_used = 0;
+  char *buffer = malloc(capacity);
+  char *output = malloc(WALK_OUTPUT_SIZE);
+  assert(NULL != buffer && NULL != output);
+  bool found = false, at_end = false;
+
+  while (NULL != buffer && NULL != output && !at_end &&
+         !(names_only && found)) {
+    if (used == capacity) { // one line fills the buffer
+      char *bigger = realloc(buffer, capacity * 2);
+      if (NULL == bigger)
+        break;
+      buffer = bigger;
+      capacity *= 2;
+    }
+    ssize_t bytes_read = read(fd, buffer + used, capacity - used);
+    if (bytes_read < 0 && errno == EINTR)
+      continue;
+    at_end = bytes_read <= 0;
+    if (!at_end)
+      used += (size_t)bytes_read;
+
+    // every complete line, and the unterminated last one at the end
+    size_t start = 0;
+    while (start < used && !(names_only && found)) {
+      char *newline = memchr(buffer + start, '\n', used - start);
+      if (NULL == newline && !at_end)
+        break;
+      size_t length = (NULL != newline ? (size_t)(newline - buffer) : used) -
+                      start;
+      if (NULL != grep_find(buffer + start, length, pattern, pattern_length)) {
+        found = true;
+        if (!names_only)
+          grep_stream_output(output, &output_used, buffer + start, length);
+      }
+      start += length + (NULL != newline ? 1 : 0);
+    }
+    memmove(buffer, buffer + start, used - start);
+    used -= start;
+  }
+
+  if (names_only && found)
+    custom_print("(standard input)\n");
+  if (NULL != output)
+    custom_write(output, output_used);
+  free(buffer);
+  free(output);
+}
+
+/*
+ * Searches the lines of one task. Its chunk is read straight into <*buffer>
+ * (grown as needed) along with the byte before it, which tells whether the
+ * chunk starts on a new line, and whatever follows up to the end of its last
+ * line
+ */
+static void grep_run_task(const Grep_Job *job, Grep_Task *task, char **buffer,
+                          size_t *capacity) {
+  int fd = nqp_open_by_inode_timed(task->file->inode);
+  if (fd < 0) {
+    task->failed = true;
+    return;
+  }
+
+  uint64_t from = task->start > 0 ? task->start - 1 : 0;
+  size_t owned = task->end - from; // bytes read for the task's own lines
+  size_t length = 0, wanted = owned;
+  for (;;) {
+    if (*capacity < length + wanted) {
+      char *bigger = realloc(*buffer, length + wanted);
+      if (NULL == bigger) {
+        task->failed = true;
+        break;
+      }
+      *buffer = bigger;
+      *capacity = length + wanted;
+    }
+    ssize_t bytes_read = grep_read(fd, *buffer + length, wanted, from + length);
+    if (bytes_read < 0) {
+      task->failed = true;
+      break;
+    }
+    size_t scan = length > owned - 1 ? length : owned - 1;
+    length += bytes_read;
+    // done once the last owned line has ended (or the file has)
+    if ((size_t)bytes_read < wanted || from + length >= task->file->size ||
+        NULL != memchr(*buffer + scan, '\n', length - scan))
+      break;
+    wanted = GREP_TAIL_SIZE;
+  }
+  nqp_close(fd);
+  if (task->failed)
+    return;
+
+  // the first owned line starts after the first newline, unless the chunk
+  // starts the file or the byte before it ended a line
+  const char *text = *buffer;
+  size_t pos = 0;
+  if (task->start > 0) {
+    const char *newline = memchr(text, '\n', length);
+    pos = NULL != newline ? (size_t)(newline - text) + 1 : length;
+  }
+  task->binary = NULL != memchr(text, '\0', length);
+
+  const char *hit;
+  while (pos < length &&
+         NULL != (hit = grep_find(text + pos, length - pos, job->pattern,
+                                  job->pattern_length))) {
+    size_t at = hit - text;
+    const char *line_start = memrchr(text + pos, '\n', at - pos);
+    size_t begin = NULL != line_start ? (size_t)(line_start - text) + 1 : pos;
+    if (from + begin >= task->end)
+      break; // the line belongs to the next task
+    const char *line_end = memchr(hit, '\n', length - at);
+    size_t end = NULL != line_end ? (size_t)(line_end - text) : length;
+
+    task->matched = true;
+    if (task->binary)
+      break; // only whether it matched is printed
+    grep_add_match(task, text + begin, end - begin);
+    pos = end + 1;
+  }
+}
+
+static void *grep_worker(void *arg) {
+  Grep_Job *job = arg;
+  char *buffer = NULL;
+  size_t capacity = 0;
+  size_t next;
+  while ((next = atomic_fetch_add(&job->next_task, 1)) < job->num_tasks) {
+    grep_run_task(job, &job->tasks[next], &buffer, &capacity);
+  }
+  free(buffer);
+  return NULL;
+}
+
+// searches every task on one thread per CPU (the calling thread is one)
+static void grep_run(Grep_Job *job) {
+  pthread_t threads[GREP_MAX_THREADS];
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t wanted = online > 0 ? (size_t)online : 1;
+  if (wanted > GREP_MAX_THREADS)
+    wanted = GREP_MAX_THREADS;
+  if (wanted > job->num_tasks)
+    wanted = job->num_tasks;
+
+  size_t started = 1;
+  while (started < wanted &&
+         pthread_create(&threads[started], NULL, grep_worker, job) == 0)
+    started++;
+  grep_worker(job);
+  for (size_t i = 1; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+// prints the results in file order, <names_only> prints each matching file
+// once instead of its lines
+static void grep_print(const Grep_Job *job, bool names_only) {
+  char *output = malloc(WALK_OUTPUT_SIZE);
+  size_t used = 0;
+  char line[WALK_MAX_LINE_SIZE];
+  assert(NULL != output);
+  if (NULL == output)
+    return;
+
+  for (size_t first = 0, last; first < job->num_tasks; first = last) {
+    const Walk_Entry *file = job->tasks[first].file;
+    bool matched = false, binary = false, failed = false;
+    for (last = first; last < job->num_tasks && job->tasks[last].file == file;
+         last++) {
+      matched |= job->tasks[last].matched;
+      binary |= job->tasks[last].binary;
+      failed |= job->tasks[last].failed;
+    }
+
+    if (failed) {
+      fprintf(stderr, "grep: %s: could not be read\n", file->path);
+    } else if (matched && (names_only || binary)) {
+      int len = snprintf(line, sizeof(line),
+                         names_only ? "%s\n" : "Binary file %s matches\n",
+                         file->path);
+      walk_output(output, &used, line, clamp_length(len, sizeof(line)));
+    } else if (matched) {
+      for (size_t i = first; i < last; i++) {
+        const Grep_Task *task = &job->tasks[i];
+        if (task->used > WALK_OUTPUT_SIZE) { // too big to copy around
+          custom_write(output, used);
+          used = 0;
+          custom_write(task->matches, task->used);
+        } else if (task->used > 0) {
+          walk_output(output, &used, task->matches, task->used);
+        }
+      }
+    }
+  }
+  custom_write(output, used);
+  free(output);
+}
+
+/*
+ * Grep: prints every line holding <pattern> (a plain string) in the files
+ * below the cwd, or below the files and directories given as arguments, as
+ * "path:line"
+ * "grep [-l] pattern [file or directory ...] [< file]"
+ * -l only prints the names of the files that match
+ * Files are cut into GREP_CHUNK_SIZE pieces that are read straight from the
+ * file system and searched on one thread per CPU. Without any path, grep
+ * filters the lines of the "<" file, or in a pipeline those of the previous
+ * command, instead
+ */
+void command_grep(const Command *cmd, const Curr_Dir *cwd) {
+  // cwd validation
+  assert(NULL != cmd && NULL != cwd);
+  assert(is_valid_curr_dir(cwd));
+  if (NULL == cmd || !is_valid_curr_dir(cwd))
+    return;
+
+  // parse the options, they come before the pattern ("--" ends them)
+  bool names_only = false;
+  int first_arg = 1;
+  const char *arg;
+  for (; NULL != (arg = command_get_arg(cmd, first_arg)) && arg[0] == '-' &&
+         arg[1] != '\0';
+       first_arg++) {
+    if (strcmp(arg, "--") == 0) {
+      first_arg++;
+      break;
+    }
+    for (const char *option = arg + 1; *option; option++) {
+      if (*option != 'l') {
+        fprintf(stderr, "grep: invalid option -- '%c'\n", *option);
+        fprintf(stderr, "Usage: grep [-l] pattern [file or directory ...]\n");
+        return;
+      }
+      names_only = true;
+    }
+  }
+  const char *pattern = command_get_arg(cmd, first_arg);
+  if (NULL == pattern) {
+    fprintf(stderr, "Usage: grep [-l] pattern [file or directory ...]\n");
+    return;
+  }
+
+  // the paths end at "<", the file after it is input, not a path to walk
+  int end = first_arg + 1;
+  while (end < cmd->argc && strcmp(command_get_arg(cmd, end), "<") != 0)
+    end++;
+  const char *input = command_get_arg(cmd, end + 1);
+
+  // without any path: filter the "<" file, or what the previous stage wrote
+  if (end == first_arg + 1 && NULL != input) {
+    int fd = open_resolved_input(cmd, cwd, input);
+    int memfd = fd >= 0 ? stage_in_memfd(fd, "grep_input") : -1;
+    if (fd >= 0)
+      nqp_close(fd);
+    if (memfd < 0) {
+      fprintf(stderr, "grep: %s not found\n", input);
+      return;
+    }
+    grep_stream(memfd, pattern, names_only);
+    close(memfd);
+    return;
+  }
+  if (end == first_arg + 1 && stage_input_fd >= 0) {
+    grep_stream(stage_input_fd, pattern, names_only);
+    return;
+  }
+
+  // every file to search, from every argument
+  Walk_List list = {.max_depth = -1, .show_hidden = true};
+  pthread_mutex_init(&list.lock, NULL);
+  char start[WALK_MAX_PATH_SIZE];
+  int i = first_arg + 1;
+  do { // no argument searches the cwd. Sorted once, an expanded pattern can
+       // give thousands of arguments
+    make_absolute_path(cwd, i < end ? command_get_arg(cmd, i) : NULL, start,
+                       sizeof(start));
+    walk_collect_unsorted("grep", start, &list);
+  } while (++i < end);
+  walk_sort(&list);
+
+  // cut them into tasks
+  Grep_Job job = {.pattern = pattern, .pattern_length = strlen(pattern)};
+  size_t capacity = 0;
+  bool out_of_memory = false;
+  atomic_init(&job.next_task, 0);
+  for (size_t f = 0; f < list.count && !out_of_memory; f++) {
+    const Walk_Entry *file = &list.entries[f];
+    if (file->type != DT_REG)
+      continue;
+    for (uint64_t offset = 0; offset < file->size && !out_of_memory;
+         offset += GREP_CHUNK_SIZE) {
+      if (job.num_tasks == capacity) {
+        capacity = capacity ? capacity * 2 : 256;
+        Grep_Task *bigger = realloc(job.tasks, capacity * sizeof(Grep_Task));
+        assert(NULL != bigger);
+        if (NULL == bigger) {
+          out_of_memory = true;
+          break;
+        }
+        job.tasks = bigger;
+      }
+      Grep_Task *task = &job.tasks[job.num_tasks++];
+      memset(task, 0, sizeof(Grep_Task));
+      task->file = file;
+      task->start = offset;
+      task->end = file->size - offset > GREP_CHUNK_SIZE
+                      ? offset + GREP_CHUNK_SIZE
+                      : file->size;
+    }
+  }
+
+  if (job.num_tasks > 0) {
+    grep_run(&job);
+    grep_print(&job, names_only);
   }
 
   // clean up resources
+  for (size_t t = 0; t < job.num_tasks; t++) {
+    free(job.tasks[t].matches);
+  }
+  free(job.tasks);
+  walk_list_destroy(&list);
+}
+
+/*
+ * Export: copies a file, or a directory and everything below it, out of the
+ * image into a directory on the host, keeping names and timestamps
+ * "export <image-path> <host-dir>"
+ * <image-path> is relative to the cwd unless it starts with '/', <host-dir>
+ * is a host path and is created if missing. Runs on one thread per CPU
+ */
+void command_export(const Command *cmd, const Curr_Dir *cwd) {
+  // cwd validation
+  assert(NULL != cmd && NULL != cwd);
+  assert(is_valid_curr_dir(cwd));
+  if (NULL == cmd || !is_valid_curr_dir(cwd))
+    return;
+  if (cmd->argc != 3) {
+    fprintf(stderr, "Usage: export <image-path> <host-dir>\n");
+    return;
+  }
+
+  char source[WALK_MAX_PATH_SIZE];
+  make_absolute_path(cwd, command_get_arg(cmd, 1), source, sizeof(source));
+  const char *host_dir = command_get_arg(cmd, 2);
+  nqp_export_summary summary;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  nqp_error err = nqp_export(source, host_dir, 0, &summary);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (err == NQP_FILE_NOT_FOUND) {
+    fprintf(stderr, "export: %s not found\n", source);
+    return;
+  }
+  if (err != NQP_OK) {
+    fprintf(stderr, "export: could not export %s to %s\n", source, host_dir);
+    return;
+  }
+  if (summary.failed > 0)
+    fprintf(stderr, "export: %lu files or directories could not be written\n",
+            summary.failed);
+  if (summary.shortened > 0)
+    fprintf(stderr, "export: %lu names were cut to fit the host\n",
+            summary.shortened);
+
+  double seconds = (double)(end.tv_sec - start.tv_sec) +
+                   (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+  char buffer[MAX_LINE_SIZE];
+  snprintf(buffer, sizeof(buffer),
+           "exported %lu files, %lu directories, %lu bytes in %.3f s "
+           "(%.1f MB/s)\n",
+           summary.files, summary.directories, summary.bytes, seconds,
+           seconds > 0 ? summary.bytes / seconds / (1024 * 1024) : 0.0);
+  custom_print(buffer);
+}
+
+// FRAG HELPERS
+// extent counts 0, 1, 2-3, 4-7, ... 512-1023 and 1024 or more
+#define FRAG_BUCKETS 12
+#define FRAG_EXTENT_BATCH 64 // extents read without allocating
+
+// the layout of one file
+typedef struct {
+  uint64_t extents;  // runs of contiguous clusters
+  uint64_t largest;  // bytes in the longest of them
+  bool no_fat_chain; // allocated in one piece, the FAT is not used
+  uint64_t slack;    // bytes past the valid data length, they read as zeros
+} Frag_Layout;
+
+// reads the layout of the file found by a walk from its extents. Returns
+// false if it could not be opened
+static bool frag_layout(const Walk_Entry *file, Frag_Layout *layout) {
+  int fd = nqp_open_by_inode_timed(file->inode);
+  nqp_file_stat status;
+  if (fd < 0)
+    return false;
+  if (nqp_fstat(fd, &status) != NQP_OK) {
+    nqp_close(fd);
+    return false;
+  }
+
+  nqp_extent batch[FRAG_EXTENT_BATCH];
+  nqp_extent *extents = batch;
+  ssize_t count = nqp_extents(fd, batch, FRAG_EXTENT_BATCH);
+  if (count > FRAG_EXTENT_BATCH) { // read them all again into enough room
+    extents = malloc((size_t)count * sizeof(nqp_extent));
+    if (NULL == extents ||
+        nqp_extents(fd, extents, (size_t)count) != count) {
+      free(extents);
+      nqp_close(fd);
+      return false;
+    }
+  }
   nqp_close(fd);
-  free(curr_path);
+  if (count < 0)
+    return false;
+
+  layout->extents = (uint64_t)count;
+  layout->largest = 0;
+  for (ssize_t i = 0; i < count; i++) {
+    if (extents[i].length > layout->largest)
+      layout->largest = extents[i].length;
+  }
+  layout->no_fat_chain = status.no_fat_chain;
+  layout->slack = status.data_length > status.valid_data_length
+                      ? status.data_length - status.valid_data_length
+                      : 0;
+  if (extents != batch)
+    free(extents);
+  return true;
+}
+
+// the histogram bucket of a file with <extents> extents
+static int frag_bucket(uint64_t extents) {
+  int bucket = 0;
+  while (extents > 0 && bucket < FRAG_BUCKETS - 1) {
+    extents >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+// prints the layout of every file of a sorted Walk_List, or only of those in
+// more than one extent, then the histogram of their extent counts
+static void frag_print(const Walk_List *list, bool all_files) {
+  char *output = malloc(WALK_OUTPUT_SIZE);
+  assert(NULL != output);
+  if (NULL == output)
+    return;
+
+  uint64_t files[FRAG_BUCKETS] = {0};
+  uint64_t num_files = 0, fragmented = 0, total_extents = 0, total_slack = 0;
+  size_t used = 0;
+  char line[WALK_MAX_LINE_SIZE];
+  bool header = false;
+  for (size_t i = 0; i < list->count; i++) {
+    const Walk_Entry *entry = &list->entries[i];
+    Frag_Layout layout;
+    if (entry->type != DT_REG)
+      continue;
+    if (!frag_layout(entry, &layout)) {
+      fprintf(stderr, "frag: could not read the extents of %s\n",
+              entry->path);
+      continue;
+    }
+
+    num_files++;
+    files[frag_bucket(layout.extents)]++;
+    total_extents += layout.extents;
+    total_slack += layout.slack;
+    if (layout.extents > 1)
+      fragmented++;
+    if (!all_files && layout.extents <= 1)
+      continue;
+    if (!header) {
+      const char *titles = "extents\tlargest\tchain\tslack\tpath\n";
+      walk_output(output, &used, titles, strlen(titles));
+      header = true;
+    }
+    int len = snprintf(line, sizeof(line), "%lu\t%luK\t%s\t%lu\t%s\n",
+                       layout.extents, (layout.largest + 1023) / 1024,
+                       layout.no_fat_chain ? "none" : "fat", layout.slack,
+                       entry->path);
+    walk_output(output, &used, line, clamp_length(len, sizeof(line)));
+  }
+
+  // the histogram, empty buckets left out
+  const char *titles = "\nextents\tfiles\n";
+  walk_output(output, &used, titles + (header ? 0 : 1),
+              strlen(titles) - (header ? 0 : 1));
+  for (int b = 0; b < FRAG_BUCKETS; b++) {
+    uint64_t low = b == 0 ? 0 : 1ull << (b - 1);
+    char range[32];
+    if (files[b] == 0)
+      continue;
+    if (b == FRAG_BUCKETS - 1)
+      snprintf(range, sizeof(range), "%lu+", low);
+    else if (low <= 1)
+      snprintf(range, sizeof(range), "%lu", low);
+    else
+      snprintf(range, sizeof(range), "%lu-%lu", low, 2 * low - 1);
+    int len = snprintf(line, sizeof(line), "%s\t%lu\n", range, files[b]);
+    walk_output(output, &used, line, clamp_length(len, sizeof(line)));
+  }
+  int len = snprintf(line, sizeof(line),
+                     "%lu files, %lu fragmented (%.1f%%), %lu extents, "
+                     "%lu bytes of slack\n",
+                     num_files, fragmented,
+                     num_files > 0 ? 100.0 * fragmented / num_files : 0.0,
+                     total_extents, total_slack);
+  walk_output(output, &used, line, clamp_length(len, sizeof(line)));
+  custom_write(output, used);
+  free(output);
+}
+
+/**
+ * frag_walk(): reports the layout of the files below <target>, the cwd if
+ * NULL. <separator> is NULL for a single target, otherwise the report goes
+ * under a "<target>:" line with <separator> in front of it
+ * Return: true if <target> was found and walked
+ */
+static bool frag_walk(const Curr_Dir *cwd, const char *target,
+                      const char *separator, bool all_files) {
+  char start[WALK_MAX_PATH_SIZE];
+  make_absolute_path(cwd, target, start, sizeof(start));
+  Walk_List list = {.max_depth = -1, .show_hidden = true};
+  pthread_mutex_init(&list.lock, NULL);
+  bool walked = walk_collect_tree("frag", start, &list);
+  if (walked && NULL != separator) {
+    char header[WALK_MAX_LINE_SIZE];
+    int len = snprintf(header, sizeof(header), "%s%s:\n", separator, target);
+    custom_write(header, clamp_length(len, sizeof(header)));
+  }
+  if (walked)
+    frag_print(&list, all_files);
+  walk_list_destroy(&list);
+  return walked;
+}
+
+/*
+ * Frag: reports how the files below the cwd, or below every file or
+ * directory given as argument, are laid out in the image
+ * "frag [-a] [file or directory ...]"
+ * Prints the extent count, longest run of clusters, whether the file uses the
+ * FAT ("fat") or is one piece ("none", NoFatChain) and the bytes past its
+ * valid data length of every file in more than one extent, or of every file
+ * with -a. A histogram of the extent counts of all of them follows
+ */
+void command_frag(const Command *cmd, const Curr_Dir *cwd) {
+  // cwd validation
+  assert(NULL != cmd && NULL != cwd);
+  assert(is_valid_curr_dir(cwd));
+  if (NULL == cmd || !is_valid_curr_dir(cwd))
+    return;
+
+  // parse the options, anything else is a file or directory to report on
+  bool all_files = false;
+  int num_targets = 0;
+  for (int i = 1; i < cmd->argc; i++) {
+    const char *arg = command_get_arg(cmd, i);
+    if (strcmp(arg, "-a") == 0) {
+      all_files = true;
+    } else if (arg[0] != '-') {
+      num_targets++;
+    } else {
+      fprintf(stderr, "frag: invalid option '%s'\n", arg);
+      return;
+    }
+  }
+
+  if (num_targets == 0)
+    frag_walk(cwd, NULL, NULL, all_files);
+  bool reported = false; // a blank line goes between reports
+  for (int i = 1; num_targets > 0 && i < cmd->argc; i++) {
+    const char *arg = command_get_arg(cmd, i);
+    if (arg[0] == '-')
+      continue;
+    const char *separator = num_targets == 1 ? NULL : reported ? "\n" : "";
+    reported |= frag_walk(cwd, arg, separator, all_files);
+  }
+}
+
+/*
+ * Disk Free: prints the size of the mounted volume and how much of it is used
+ * and free, in KB and in clusters, as counted in its allocation bitmap
+ * "df"
+ */
+void command_df(void) {
+  nqp_fs_stat status;
+  if (nqp_statfs(&status) != NQP_OK) {
+    fprintf(stderr, "df: no volume is mounted\n");
+    return;
+  }
+
+  char *label = nqp_vol_label();
+  int percent = status.total_clusters > 0
+                    ? (int)((status.used_clusters * 100 +
+                             status.total_clusters - 1) /
+                            status.total_clusters)
+                    : 0;
+  char buffer[MAX_LINE_SIZE];
+  snprintf(buffer, sizeof(buffer),
+           "volume\t1K-blocks\tused\tavailable\tuse%%\n"
+           "%s\t%lu\t%lu\t%lu\t%d%%\n"
+           "clusters\t%lu\t%lu\t%lu\t(%u bytes each)\n",
+           NULL != label && label[0] != '\0' ? label : "-",
+           status.total_clusters * status.cluster_size / 1024,
+           status.used_clusters * status.cluster_size / 1024,
+           status.free_clusters * status.cluster_size / 1024, percent,
+           status.total_clusters, status.used_clusters, status.free_clusters,
+           status.cluster_size);
+  custom_print(buffer);
+  free(label);
+}
+
+// Latency: prints the p50/p99/p999 latency of every timed file system
+// operation, to both stdout and the log file
+void command_latency(void) {
+  if (stage_output_fd >= 0) { // inside a pipeline stage
+    latency_dump(stage_output_fd);
+    return;
+  }
+  fflush(stdout); // keep the table after whatever is already buffered
+  latency_dump(STDOUT_FILENO);
+  if (log_fd != LOG_DISABLED) {
+    latency_dump(log_fd);
+  }
+}
+
+/*
+ * Hash: shows or changes where commands are found in the search directories
+ * "hash" lists every remembered command with its hits and path, and misses
+ * "hash -r" forgets them all, they are searched for again on their next run
+ * "hash <name> ..." looks up each name now and remembers it
+ */
+void command_hash(const Command *cmd) {
+  assert(NULL != cmd);
+  if (NULL == cmd)
+    return;
+
+  char line[2 * MAX_LINE_SIZE];
+  if (cmd->argc == 2 && strcmp(cmd->argv[1], "-r") == 0) {
+    forget_commands();
+    return;
+  }
+  if (cmd->argc > 1) {
+    for (int i = 1; i < cmd->argc; i++) {
+      int fd = open_hashed_command(cmd->argv[i]);
+      if (fd < 0) {
+        snprintf(line, sizeof(line), "hash: %s: not found\n", cmd->argv[i]);
+        custom_print(line);
+        continue;
+      }
+      nqp_close(fd);
+    }
+    return;
+  }
+
+  bool empty = true;
+  for (int slot = 0; slot < COMMAND_TABLE_SLOTS; slot++) {
+    for (Hashed_Command *entry = command_table[slot]; NULL != entry;
+         entry = entry->next) {
+      if (empty)
+        custom_print("hits\tcommand\n");
+      empty = false;
+      if (entry->dir == COMMAND_MISSING) {
+        snprintf(line, sizeof(line), "   -\t%s (not found)\n", entry->name);
+      } else {
+        char path[MAX_LINE_SIZE];
+        search_dir_path(entry->dir, entry->name, path, sizeof(path));
+        snprintf(line, sizeof(line), "%4u\t%s\n", entry->hits, path);
+      }
+      custom_print(line);
+    }
+  }
+  if (empty)
+    custom_print("hash: hash table empty\n");
 }
 
 /*
@@ -289,6 +2212,7 @@ void command_cd(const char *path, Curr_Dir *cwd) {
       path[0] == ' ') { // if path is NOT starting with a non empty character
                         // then change to root dir
     strncpy(cwd->path, "/", MAX_LINE_SIZE);
+    reopen_curr_dir(cwd);
     return;
   }
   if (!is_valid_string(path)) {
@@ -317,9 +2241,11 @@ void command_cd(const char *path, Curr_Dir *cwd) {
       }
       curr_path[i] = '\0';
     }
+    reopen_curr_dir(cwd); // the parent is opened from the root again
   } else if (strcmp(path, "/") == 0) { //"cd /" or "cd /something" request
     assert(strlen(path) == 1);
     strncpy(cwd->path, "/", MAX_LINE_SIZE);
+    reopen_curr_dir(cwd);
   } else { // change to another directory
 
     // create new absolute path fot the <path>
@@ -336,28 +2262,31 @@ void command_cd(const char *path, Curr_Dir *cwd) {
       return;
     }
 
-    // check if the new folder/file exist in mounted file system
-    int fd = NQP_FILE_NOT_FOUND;
-    fd = nqp_open(new_path);
+    // check if the new folder/file exist in mounted file system, only the
+    // current directory has to be searched for it
+    int fd = open_in_curr_dir(cwd, path);
     if (fd < 0) {
       printf("ERROR: Directory not found: %s\n", new_path);
       return;
     }
 
-    // check if the found entry is a directory entry
-    ssize_t dirents_read;
-    nqp_dirent entry = {0};
-    dirents_read = nqp_getdents(fd, &entry, 1);
-    nqp_close(fd); // free the resources in mounted files system
-
-    if (dirents_read < 0) { // dir not found
+    // check if the found entry is a directory entry, its status comes from
+    // the directory entry alone
+    nqp_file_stat status;
+    if (nqp_fstat_timed(fd, &status) != NQP_OK || status.type != DT_DIR) {
+      nqp_close(fd); // free the resources in mounted files system
       printf("ERROR: Is not a directory: %s\n", new_path);
       return;
     }
 
-    // Update current working directory, if its a directory entry
+    // Update current working directory, if its a directory entry. The
+    // directory just opened becomes its handle
     assert(is_valid_path(new_path));
     strcpy(curr_path, new_path);
+    if (cwd->dir_fd >= 0) {
+      nqp_close(cwd->dir_fd);
+    }
+    cwd->dir_fd = fd;
     assert(is_valid_path(curr_path));
     assert(strncmp(cwd->path, new_path, MAX_LINE_SIZE) <= 0);
   }
@@ -375,67 +2304,176 @@ Command *command_create(const char *input) {
   if (!input)
     return NULL;
 
-  // allocate the memory
-  Command *cmd = (Command *)malloc(sizeof(Command));
-  if (!cmd)
-    return NULL;
+  // take a command from the pool, or allocate one with room for MAX_ARGS
+  // args and the line they come from
+  Command *cmd = NULL;
+  if (num_pooled_commands > 0) {
+    cmd = pooled_commands[--num_pooled_commands];
+  } else {
+    cmd = (Command *)malloc(sizeof(Command));
+    if (!cmd)
+      return NULL;
+    cmd->argv = (char **)malloc(sizeof(char *) * (MAX_ARGS + 1));
+    cmd->text = (char *)malloc(MAX_LINE_SIZE);
+    cmd->capacity = MAX_ARGS + 1;
+    cmd->expanded = NULL;
+    if (!cmd->argv || !cmd->text) {
+      free(cmd->argv);
+      free(cmd->text);
+      free(cmd);
+      return NULL;
+    }
+  }
 
   // initialise the instance vars
   cmd->argc = 0;
-  cmd->argv = (char **)malloc(sizeof(char *) * MAX_ARGS);
-  if (!cmd->argv) {
-    free(cmd);
-    return NULL;
+  cmd->executable[0] = '\0'; // resolved by a plan
+  cmd->input_path[0] = '\0';
+  cmd->executable_inode = 0;
+  cmd->input_inode = 0;
+
+  // copy the input into the command's text and tokenise it there by empty
+  // spaces, the args point into it
+  snprintf(cmd->text, MAX_LINE_SIZE, "%s", input);
+  char *saveptr = NULL;
+  char *token = strtok_r(cmd->text, " \t\n", &saveptr);
+  while (token && cmd->argc < MAX_ARGS) {
+    cmd->argv[cmd->argc++] = token; // store the token in the args vector
+    token = strtok_r(NULL, " \t\n", &saveptr);
   }
 
-  // create copy of the input param for working with it
-  char *input_copy = strdup(input);
-  if (!input_copy) {
-    free(cmd->argv);
-    free(cmd);
-    return NULL;
-  }
+  // terminate the args vector by NULL
+  cmd->argv[cmd->argc] = NULL;
+  return cmd;
+}
 
-  // tokenise the input by empty spaces
-  char *token = strtok(input_copy, " \t\n");
-  while (token && cmd->argc < MAX_ARGS) {
-    cmd->argv[cmd->argc] = strdup(token); // store the token in the args vector
-    if (!cmd->argv[cmd->argc]) {          // if any argument fails
-      for (int i = 0; i < cmd->argc; i++)
-        free(cmd->argv[i]);
-      free(cmd->argv);
-      free(cmd);
-      free(input_copy);
-      return NULL;
+// Return: whether <word> has a '*' or '?' for command_expand_patterns
+static bool is_pattern(const char *word) {
+  return NULL != strpbrk(word, "*?");
+}
+
+// Expands every arg after the command name with a '*' or '?' in its last
+// component into the names of <cwd> (or of the directory before the last
+// '/') it matches, sorted, like sh does. The names come from nqp_glob, so a
+// directory is read once and searched in its name index after that. An arg
+// nothing matches is kept as it is, and so are the "<" file and the pattern
+// after find's -name, which find matches itself.
+// Returns false if memory ran out, the args are left alone then
+bool command_expand_patterns(Command *cmd, const Curr_Dir *cwd) {
+  assert(command_is_valid(cmd) && is_valid_curr_dir(cwd));
+  if (!command_is_valid(cmd) || !is_valid_curr_dir(cwd))
+    return false;
+
+  // glob every pattern first, to know how much room the args need
+  nqp_glob_list lists[MAX_ARGS];
+  size_t argc = 0, bytes = 0;
+  bool any = false;
+  bool find = strcmp(cmd->argv[0], "find") == 0;
+  for (int i = 0; i < cmd->argc; i++) {
+    const char *word = cmd->argv[i];
+    const char *slash = strrchr(word, '/');
+    size_t dir_length = NULL == slash ? 0 : (size_t)(slash - word) + 1;
+    char dir[MAX_LINE_SIZE];
+
+    lists[i].count = 0;
+    lists[i].names = NULL;
+    argc++;
+    if (i == 0 || strcmp(cmd->argv[i - 1], "<") == 0 ||
+        (find && strcmp(cmd->argv[i - 1], "-name") == 0) ||
+        !is_pattern(word + dir_length) || word[dir_length] == '\0')
+      continue;
+
+    // only the last component is a pattern, the directory must exist as is
+    snprintf(dir, sizeof(dir), "%.*s", (int)dir_length, word);
+    if (is_pattern(dir))
+      continue;
+    char path[MAX_LINE_SIZE];
+    make_absolute_path(cwd, dir_length > 0 ? dir : NULL, path, sizeof(path));
+    if (nqp_glob(path, word + dir_length, &lists[i]) != NQP_OK ||
+        lists[i].count == 0) {
+      nqp_glob_free(&lists[i]);
+      continue;
+    }
+    any = true;
+    argc += lists[i].count - 1;
+    for (size_t k = 0; k < lists[i].count; k++) {
+      bytes += dir_length + strlen(lists[i].names[k]) + 1;
     }
-    cmd->argc++; // add next argument
-    token = strtok(NULL, " \t\n");
   }
-
-  // terminate the args vector by NULL
-  if (NULL != cmd->argv[cmd->argc]) {
-    printf("%s", input);
-    cmd->argv[cmd->argc] = NULL;
+  if (!any)
+    return true;
+
+  // the expanded names go in one buffer, argv grows if they do not fit
+  bool ok = argc < (size_t)INT_MAX;
+  char *expanded = ok ? malloc(bytes) : NULL;
+  ok = NULL != expanded;
+  if (ok && argc + 1 > (size_t)cmd->capacity) {
+    char **grown = realloc(cmd->argv, (argc + 1) * sizeof(char *));
+    ok = NULL != grown;
+    if (ok) {
+      cmd->argv = grown;
+      cmd->capacity = (int)argc + 1;
+    }
+  }
+  if (!ok) {
+    free(expanded);
+    for (int i = 0; i < cmd->argc; i++) {
+      nqp_glob_free(&lists[i]);
+    }
+    return false;
   }
 
-  free(input_copy); // free the input param copy
-  return cmd;
+  // fill argv in from the back, so no arg is overwritten before it moved
+  char *next = expanded;
+  size_t at = argc;
+  cmd->argv[at] = NULL;
+  for (int i = cmd->argc - 1; i >= 0; i--) {
+    if (lists[i].count == 0) {
+      cmd->argv[--at] = cmd->argv[i];
+      continue;
+    }
+    const char *slash = strrchr(cmd->argv[i], '/');
+    int dir_length = NULL == slash ? 0 : (int)(slash - cmd->argv[i]) + 1;
+    for (size_t k = lists[i].count; k > 0; k--) {
+      int length = sprintf(next, "%.*s%s", dir_length, cmd->argv[i],
+                           lists[i].names[k - 1]);
+      cmd->argv[--at] = next;
+      next += length + 1;
+    }
+    nqp_glob_free(&lists[i]);
+  }
+  assert(at == 0);
+  cmd->argc = (int)argc;
+  cmd->expanded = expanded;
+  return true;
 }
 
-// Destructor for command object
+// Destructor for command object, it goes back to the pool unless that is full
 void command_destroy(Command *cmd) {
   if (!cmd)
     return;
-  for (int i = 0; i < cmd->argc; i++) {
-    free(cmd->argv[i]);
+  free(cmd->expanded);
+  cmd->expanded = NULL;
+  if (num_pooled_commands < OBJECT_POOL_SIZE) {
+    // argv only keeps the room command_create needs
+    if (cmd->capacity > MAX_ARGS + 1) {
+      char **shrunk = realloc(cmd->argv, sizeof(char *) * (MAX_ARGS + 1));
+      if (NULL != shrunk) {
+        cmd->argv = shrunk;
+        cmd->capacity = MAX_ARGS + 1;
+      }
+    }
+    pooled_commands[num_pooled_commands++] = cmd;
+    return;
   }
   free(cmd->argv);
+  free(cmd->text);
   free(cmd);
 }
 
 // Validator for command object
 bool command_is_valid(const Command *cmd) {
-  return (cmd && cmd->argv && cmd->argc > 0 && cmd->argc <= MAX_ARGS);
+  return (cmd && cmd->argv && cmd->argc > 0 && cmd->argc < cmd->capacity);
 }
 
 // Getter: returns the ith argument of the command
@@ -463,8 +2501,37 @@ void command_print(const Command *cmd) {
   printf("]\n");
 }
 
+// Checks whether <name> is one of the builtins execute_command runs itself
+bool is_builtin(const char *name) {
+  static const char *builtins[] = {"cd",     "ls",   "pwd",     "du",
+                                   "find",   "tree", "grep",    "export",
+                                   "frag",   "df",   "latency", "hash",
+                                   NULL};
+  if (NULL == name)
+    return false;
+  for (int i = 0; builtins[i] != NULL; i++) {
+    if (strcmp(name, builtins[i]) == 0)
+      return true;
+  }
+  return false;
+}
+
+// with nqp_bench -a, allocations between these (a builtin, the file system
+// module reading a program) are counted apart from the shell's own parsing,
+// plans, pipes and dispatch
+static void command_work_begin(void) {
+  if (alloc_count_enter_command)
+    alloc_count_enter_command();
+}
+
+static void command_work_end(void) {
+  if (alloc_count_leave_command)
+    alloc_count_leave_command();
+}
+
 // Executor: parses the command object and executes respective commands
-bool execute_command(const Command *cmd, Curr_Dir *cwd, char *envp[]) {
+static bool execute_builtin_or_external(const Command *cmd, Curr_Dir *cwd,
+                                        char *envp[]) {
   // Make sure the command is valid and has a non-negative argument count
   assert(NULL != cmd);
   assert(cmd->argc >= 0);
@@ -478,30 +2545,43 @@ bool execute_command(const Command *cmd, Curr_Dir *cwd, char *envp[]) {
   const char *argv_0 = command_get_arg(cmd, 0);
   if (!argv_0)
     return false;                 // Command name is missing
-  char *command = strdup(argv_0); // Copy the command name into a new string
-  assert(command != NULL);
-  if (!command)
-    return false; // Memory allocation failed
+  const char *command = argv_0; // the args live as long as the command
 
   // Check if the command matches built-in commands
   if (strcmp(command, "cd") == 0) { // Handle "cd" (change directory)
     const char *argv_1 = command_get_arg(cmd, 1); // Get the target directory
     if (argv_1) {
-      char *destination = strdup(argv_1); // Copy the directory name
-      assert(NULL != destination);
-      command_cd(destination, cwd); // Change to the target directory
-      free(destination);            // Free memory for the directory name
+      command_cd(argv_1, cwd); // Change to the target directory
       return true;
     }
   } else if (strcmp(command, "ls") ==
              0) { // Handle "ls" (list directory contents)
-    command_ls(cwd);
+    command_ls(cmd, cwd);
   } else if (strcmp(command, "pwd") ==
              0) { // Handle "pwd" (print current directory)
     command_pwd(cwd);
+  } else if (strcmp(command, "du") == 0) { // Handle "du" (disk usage)
+    command_du(cmd, cwd);
+  } else if (strcmp(command, "find") == 0) { // Handle "find" (search a tree)
+    command_find(cmd, cwd);
+  } else if (strcmp(command, "tree") == 0) { // Handle "tree" (draw a tree)
+    command_tree(cmd, cwd);
+  } else if (strcmp(command, "grep") == 0) { // Handle "grep" (search files)
+    command_grep(cmd, cwd);
+  } else if (strcmp(command, "export") == 0) { // Handle "export" (copy out)
+    command_export(cmd, cwd);
+  } else if (strcmp(command, "frag") == 0) { // Handle "frag" (file layout)
+    command_frag(cmd, cwd);
+  } else if (strcmp(command, "df") == 0) { // Handle "df" (free space)
+    command_df();
+  } else if (strcmp(command, "latency") ==
+             0) { // Handle "latency" (print file system latency histograms)
+    command_latency();
+  } else if (strcmp(command, "hash") == 0) { // Handle "hash" (command table)
+    command_hash(cmd);
   } else { // Not a built-in command, execute it as an external command
     int return_code = -1;
-    if ((return_code = import_command_data(cmd, cwd->path, envp)) < 0) {
+    if ((return_code = import_command_data(cmd, cwd, envp)) < 0) {
       // Print error messages
       if (return_code == COMMAND_EXECUTION_FAILED)
         fprintf(stderr, "Failure executing command: %s\n", argv_0);
@@ -517,8 +2597,20 @@ bool execute_command(const Command *cmd, Curr_Dir *cwd, char *envp[]) {
     }
   }
 
-  free(command); // Free memory for the copied command name
-  return true;   // Command executed successfully or handled appropriately
+  return true; // Command executed successfully or handled appropriately
+}
+
+// execute_builtin_or_external() for <cmd>, a builtin's body counts as
+// command work (see command_work_begin), running an external command counts
+// only its file system reads
+bool execute_command(const Command *cmd, Curr_Dir *cwd, char *envp[]) {
+  bool builtin = command_is_valid(cmd) && is_builtin(command_get_arg(cmd, 0));
+  if (builtin)
+    command_work_begin();
+  bool executed = execute_builtin_or_external(cmd, cwd, envp);
+  if (builtin)
+    command_work_end();
+  return executed;
 }
 
 // Creates a custom NULL-terminated list of arguments for redirection
@@ -587,66 +2679,45 @@ char **create_arguments_for_redirection(const Command *cmd) {
  * any failure in running pipes or fexecve or forking) status (for successful
  * completion of the child process)
  */
-int import_command_data(const Command *cmd, const char *curr_path,
+int import_command_data(const Command *cmd, const Curr_Dir *cwd,
                         char *envp[]) {
   // input params validation and copying
   const char *argv_0 = command_get_arg(cmd, 0);
-  char *command = strdup(argv_0);
-  char *path = strdup(curr_path);
-  assert(is_valid_path(path));
+  const char *command = argv_0;
+  assert(is_valid_curr_dir(cwd));
   assert(is_valid_string(command));
-  if (!is_valid_path(path) || !is_valid_string(command)) {
-    free(command);
+  if (!is_valid_curr_dir(cwd) || !is_valid_string(command)) {
     return COMMAND_NOT_FOUND;
   }
 
-  // search the command data file in current working directory
-  // first change the command path to start from the root directory
-  if (path[strlen(path) - 1] != '/') {
-    strcat(path, "/"); // make sure the working directory path ends with "/"
-  }
-  strcat(path, command); // concatenate the command to that path
-  assert(is_valid_path(path));
-
-  // open the file in nqp file system
-  int nqp_fd = nqp_open(path);
-  if (nqp_fd == NQP_FILE_NOT_FOUND) {
-    free(command);
+  // open the command data file where its plan found it, otherwise search it
+  // in current working directory, through its handle so the path from the
+  // root is not looked up again, then in the search directories through the
+  // command hash table
+  command_work_begin();
+  int nqp_fd = open_resolved_command(cmd, cwd);
+  if (nqp_fd < 0) {
+    command_work_end();
     return COMMAND_NOT_FOUND;
   }
   assert(nqp_fd >= 0);
-  free(path); // path is no longer needed so free it
 
-  // creat a new file in local memory
-  int mem_fd = memfd_create("FileSystemCode", 0);
-  if (mem_fd == NQP_FILE_NOT_FOUND) { // memfd create fails, do cleanup
-    nqp_close(nqp_fd);
-    free(command);
+  // copy the file's data from the nqp file system into a new file in local
+  // memory (i.e. mem_fd file) and close it in the nqp file system
+  int mem_fd = stage_in_memfd(nqp_fd, "FileSystemCode");
+  nqp_close(nqp_fd);
+  command_work_end();
+  if (mem_fd < 0) { // staging fails, do cleanup
     return COMMAND_NOT_FOUND;
   }
   assert(mem_fd >= 0);
 
-  // read the file's data from the nqp file system and write in the local memory
-  // file (i.e. mem_fd file)
-  char buffer[READ_BUFFER_SIZE] = {0};
-  int bytes_read = 0;
-  while ((bytes_read = nqp_read(nqp_fd, &buffer, READ_BUFFER_SIZE)) > 0) {
-    write(mem_fd, buffer, bytes_read);
-    memset(buffer, 0, READ_BUFFER_SIZE);
-  }
-
-  // close the file in nqp file system and reset the offset marker in mem_fd
-  // file
-  nqp_close(nqp_fd);
-  lseek(mem_fd, 0, SEEK_SET);
-
   // handle the output redirection through a pipe if logging is enable
   int pipefd[2] = {-1, -1};
   if (log_fd != LOG_DISABLED) { // Create pipe for printing command output
     if (pipe(pipefd) < 0) {     // populate the pipe's fd
       perror("pipe");           // piping failed, do cleanup
-      free(command);
-      nqp_close(nqp_fd);
+      close(mem_fd);
       return COMMAND_EXECUTION_FAILED;
     }
   }
@@ -659,8 +2730,7 @@ int import_command_data(const Command *cmd, const char *curr_path,
     // handle the input redirection
     int input_fd = -1;
     input_fd = handle_input_redirection(
-        cmd,
-        curr_path); // copys the mounted fs's file into local memory and open it
+        cmd, cwd); // copys the mounted fs's file into local memory and open it
     if (input_fd > 0) { // if input_fd is different than STDIN_FILENO then
                         // redirection is enabled
       // redirection operator is there, change the file descriptor of stdin with
@@ -704,6 +2774,7 @@ int import_command_data(const Command *cmd, const char *curr_path,
     assert(pid != 0 &&
            "fexecve in child failed"); // trigger means fexecve failed.
                                        // Currently in child process
+    close(mem_fd); // only the child needs the program
 
     // If logging is enabled, read child's output from pipe and write to both
     // stdout and log
@@ -715,8 +2786,7 @@ int import_command_data(const Command *cmd, const char *curr_path,
       char buffer[READ_BUFFER_SIZE];
       ssize_t n;
       while ((n = read(pipefd[0], buffer, READ_BUFFER_SIZE)) > 0) {
-        write(STDOUT_FILENO, buffer, n); // Write to stdout
-        write(log_fd, buffer, n);        // Write to log file
+        custom_write(buffer, (size_t)n); // Write to stdout and log file
       }
 
       close(pipefd[PIPE_READ_END]); // close the pipes read end
@@ -726,13 +2796,142 @@ int import_command_data(const Command *cmd, const char *curr_path,
     int status; // status code for whether waitpid was executed or not
     waitpid(pid, &status, 0); // wait for child to finish
 
-    free(command); // clean up resources
     return status;
   }
 
+  close(mem_fd);
   return COMMAND_EXECUTION_FAILED; // fork failed, hence return failure
 }
 
+/*
+ * stage_extent(): copies one extent of a file straight from the volume image
+ * into mem_fd at the same file offset, without it passing through the shell.
+ * RETURN: true if the whole extent was copied
+ */
+static bool stage_extent(int mem_fd, const nqp_extent *extent) {
+  static bool use_copy_file_range = true; // until the kernel turns it down
+  off_t in = (off_t)extent->volume_offset;
+  off_t out = (off_t)extent->file_offset;
+  uint64_t left = extent->length;
+
+  while (left > 0) {
+    ssize_t copied = -1;
+    if (use_copy_file_range) {
+      copied = copy_file_range(image_fd, &in, mem_fd, &out, left, 0);
+      if (copied < 0 && (errno == EXDEV || errno == EINVAL ||
+                         errno == ENOSYS || errno == EOPNOTSUPP)) {
+        use_copy_file_range = false; // e.g., the image is not on tmpfs
+      }
+    }
+    if (!use_copy_file_range) {
+      // sendfile writes at mem_fd's own offset and only moves in
+      if (lseek(mem_fd, out, SEEK_SET) < 0)
+        return false;
+      copied = sendfile(mem_fd, image_fd, &in, left);
+      if (copied > 0)
+        out += copied;
+    }
+    if (copied <= 0)
+      return false;
+    left -= (uint64_t)copied;
+  }
+  return true;
+}
+
+/*
+ * stage_by_reads(): fills mem_fd with the whole nqp file, STAGE_BUFFER_SIZE
+ * bytes at a time. Used when the file is too fragmented (or the image cannot
+ * be read directly) for the extents to be worth copying one by one. The next
+ * chunk is read asynchronously while the last one is written out.
+ * RETURN: true if all of data_length was copied
+ */
+static bool stage_by_reads(int nqp_fd, int mem_fd, uint64_t data_length) {
+  size_t size = data_length < STAGE_BUFFER_SIZE ? (size_t)data_length
+                                                : STAGE_BUFFER_SIZE;
+  char *buffers = malloc(2 * (size > 0 ? size : 1));
+  if (NULL == buffers)
+    return false;
+
+  // all of it is read right away: have the kernel fetch every extent at once
+  // instead of chunk by chunk
+  nqp_fadvise(nqp_fd, 0, 0, NQP_FADV_WILLNEED);
+
+  uint64_t done = 0; // bytes written to mem_fd
+  int current = 0;   // buffer the chunk at done is read into
+  ssize_t bytes_read;
+  int request = data_length > 0 ? nqp_read_async(nqp_fd, buffers, size, 0)
+                                : -1;
+  while (request >= 0 &&
+         (bytes_read = nqp_read_complete_timed(request, size)) > 0) {
+    char *ready = buffers + current * size;
+    uint64_t ahead = done + (uint64_t)bytes_read;
+    current ^= 1;
+    request = ahead < data_length
+                  ? nqp_read_async(nqp_fd, buffers + current * size, size,
+                                   (off_t)ahead)
+                  : -1;
+    if (pwrite(mem_fd, ready, bytes_read, (off_t)done) != bytes_read) {
+      if (request >= 0)
+        nqp_read_complete(request);
+      break;
+    }
+    done = ahead;
+  }
+
+  // the rest if no asynchronous read could be started
+  while (done < data_length &&
+         (bytes_read = nqp_pread_timed(nqp_fd, buffers, size, (off_t)done)) >
+             0) {
+    if (pwrite(mem_fd, buffers, bytes_read, (off_t)done) != bytes_read)
+      break;
+    done += (uint64_t)bytes_read;
+  }
+  free(buffers);
+  return done == data_length;
+}
+
+/*
+ * stage_in_memfd(): copies the nqp file open at nqp_fd into a new memory file
+ * called name, so it can be exec'd or used as stdin. A file stored in at most
+ * STAGE_MAX_EXTENTS extents is copied by the kernel straight from the image,
+ * anything else with a few large reads. The nqp file stays open.
+ * RETURN: the memory file's fd with its offset at 0, or -1 on any failure
+ */
+int stage_in_memfd(int nqp_fd, const char *name) {
+  assert(nqp_fd >= 0);
+  assert(name != NULL);
+  nqp_file_stat status;
+  if (nqp_fd < 0 || NULL == name || nqp_fstat(nqp_fd, &status) != NQP_OK)
+    return -1;
+
+  int mem_fd = memfd_create(name, 0);
+  if (mem_fd < 0)
+    return -1;
+
+  // sized up front: what the extents do not cover reads as zeros
+  bool staged = false;
+  if (ftruncate(mem_fd, (off_t)status.data_length) == 0) {
+    nqp_extent extents[STAGE_MAX_EXTENTS];
+    ssize_t num_extents =
+        image_fd < 0 ? -1 : nqp_extents(nqp_fd, extents, STAGE_MAX_EXTENTS);
+    if (num_extents >= 0 && num_extents <= STAGE_MAX_EXTENTS) {
+      staged = true;
+      for (ssize_t i = 0; staged && i < num_extents; i++) {
+        staged = stage_extent(mem_fd, &extents[i]);
+      }
+    }
+    if (!staged) {
+      staged = stage_by_reads(nqp_fd, mem_fd, status.data_length);
+    }
+  }
+
+  if (!staged || lseek(mem_fd, 0, SEEK_SET) < 0) {
+    close(mem_fd);
+    return -1;
+  }
+  return mem_fd;
+}
+
 /*
  * handle_input_redirection(): find the redirected input file in nqp fs and
  * create and return the local copy's fd of that input file RETURN CODES:
@@ -742,14 +2941,14 @@ int import_command_data(const Command *cmd, const char *curr_path,
  * (fallback, if redirection operator isnt present in the cmd args) (SUCCESS
  * CODE)
  */
-int handle_input_redirection(const Command *cmd, const char *cwd_path) {
+int handle_input_redirection(const Command *cmd, const Curr_Dir *cwd) {
   // params validation
   assert(command_is_valid(cmd));
-  assert(cwd_path != NULL);
-  assert(is_valid_path(cwd_path));
-  if (NULL == cmd || NULL == cwd_path)
+  assert(cwd != NULL);
+  assert(is_valid_curr_dir(cwd));
+  if (NULL == cmd || NULL == cwd)
     return INVALID_ARGUMENTS;
-  if (!command_is_valid(cmd) || !is_valid_path(cwd_path))
+  if (!command_is_valid(cmd) || !is_valid_curr_dir(cwd))
     return INVALID_ARGUMENTS;
 
   // loop through the command arguments
@@ -771,58 +2970,37 @@ int handle_input_redirection(const Command *cmd, const char *cwd_path) {
         return REDIRECTION_FAILED;
       }
 
-      // copy the input params for creating the absolute path
-      const char *arg_i_plus_one = command_get_arg(cmd, i + 1);
-      assert(arg_i_plus_one != NULL);
-      char *filename =
-          strdup(arg_i_plus_one); // stores the filename for creating filepath
-      assert(NULL != filename);
-      char *filepath =
-          strdup(cwd_path); // stores the absolute path in nqp file system
-      assert(NULL != filepath);
-      if (NULL == filename || NULL == filepath) {
+      // the input file's name, looked up in the current working directory
+      const char *filename = command_get_arg(cmd, i + 1);
+      assert(filename != NULL);
+      if (!is_valid_string(filename)) {
         printf(
             "ERROR: error in finding file from the arguments of the command ");
         command_print(cmd);
-        free(filename);
-        free(filepath);
         return REDIRECTION_FAILED;
       }
-      // create the absolute path of the filename for the nqp file system
-      if (filepath[strlen(filepath) - 1] != '/') {
-        strcat(filepath, "/"); // make sure cwd_path ends with "/"
-      }
-      strcat(filepath, filename); // making filepath absolute
-      assert(is_valid_path(filepath));
 
       // open that file in nqp file system
-      int input_fd = nqp_open(filepath);
+      command_work_begin();
+      int input_fd = open_resolved_input(cmd, cwd, filename);
       if (input_fd < 0) { // file creation failed
+        command_work_end();
         printf("Redirection Error: nqp_open input file {%s} not found\n",
-               command_get_arg(cmd, i + 1));
+               filename);
         return REDIRECTION_FAILED;
       }
       assert(input_fd >= 0);
 
-      // create a memory file to store the input file
-      int mem_fd = memfd_create(filepath, 0);
+      // copy the input file into a memory file, its read offset at 0
+      int mem_fd = stage_in_memfd(input_fd, filename);
+      nqp_close(input_fd); // close the input file in the nqp file system
+      command_work_end();
       if (mem_fd < 0) {
-        printf("ERROR: memfd_create failed creating input_redirect");
-        nqp_close(input_fd); // free resources
+        printf("ERROR: failed copying input_redirect into memory");
         return REDIRECTION_FAILED;
       }
       assert(mem_fd >= 0);
 
-      // read the input file and write its content in the memory file
-      char buffer[READ_BUFFER_SIZE] = {0};
-      ssize_t bytes_read = 0;
-      while ((bytes_read = nqp_read(input_fd, buffer, sizeof(buffer))) > 0) {
-        write(mem_fd, &buffer, bytes_read);  // write it in the memory file
-        memset(buffer, 0, READ_BUFFER_SIZE); // reset the buffer
-      }
-      nqp_close(input_fd);        // close the input file in the nqp file system
-      lseek(mem_fd, 0, SEEK_SET); // reset read offset of the memory input file
-
       return mem_fd; // return the fd of local memory input file
     }
   }
@@ -834,6 +3012,20 @@ int handle_input_redirection(const Command *cmd, const char *cwd_path) {
 //-------------------------
 // LOGGING RELATED ROUTINES
 //-------------------------
+// write_all(): writes all <length> bytes of <buffer> to <fd>, a pipe may take
+// them in pieces. Gives up on the first error (e.g. the reader is gone)
+static void write_all(int fd, const char *buffer, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(fd, buffer, length);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return;
+    buffer += written;
+    length -= (size_t)written;
+  }
+}
+
 // custom_print(): a wrapper of printf function to write to both stdout and log
 // file NOTE: only used as a fallback to non redirected outputs. A basic safety
 // measure to avoid redundant loging
@@ -843,13 +3035,38 @@ void custom_print(const char *message) {
   if (!message)
     return;
 
+  // Inside a pipeline stage the message goes down the pipe only
+  if (stage_output_fd >= 0) {
+    write_all(stage_output_fd, message, strlen(message));
+    return;
+  }
+
   // Write to stdout
   printf("%s", message);
   fflush(stdout);
 
   // Write to log file if output redirection is ON
   if (log_fd != LOG_DISABLED) {
-    write(log_fd, message, strlen(message));
+    write_all(log_fd, message, strlen(message));
+  }
+}
+
+// custom_write(): writes <length> bytes of <buffer> to both stdout and the log
+// file with one write each, for builtins that build their output in bulk
+void custom_write(const char *buffer, size_t length) {
+  // input validation
+  assert(buffer != NULL);
+  if (!buffer || length == 0)
+    return;
+
+  if (stage_output_fd >= 0) { // inside a pipeline stage: down the pipe only
+    write_all(stage_output_fd, buffer, length);
+    return;
+  }
+  fflush(stdout); // keep the order with anything printf'd before
+  write_all(STDOUT_FILENO, buffer, length);
+  if (log_fd != LOG_DISABLED) {
+    write_all(log_fd, buffer, length);
   }
 }
 
@@ -906,24 +3123,37 @@ Pipe_Commands *create_Pipe_Commands(const int num_pipes, char *line) {
     return NULL;
   }
 
-  // Allocate memory for the Pipe_Commands object
-  Pipe_Commands *pipe_commands_obj = malloc(sizeof(Pipe_Commands));
-  assert(NULL != pipe_commands_obj);
-  if (!pipe_commands_obj) {
-    perror("create_Pipe_Commands:: malloc fail - pipe_commands_obj");
+  if (num_pipes + 1 > MAX_PIPE_COMMANDS) {
+    printf("create_Pipe_Commands: too many pipes {%d}", num_pipes);
     return NULL;
   }
 
-  // Allocate memory for the array of Command pointers
-  pipe_commands_obj->commands = malloc((num_pipes + 1) * sizeof(Command *));
-  Command **cmd_array = pipe_commands_obj->commands;
-  if (!cmd_array) {
-    perror("create_Pipe_Commands:: malloc fail - commands array");
-    pipe_commands_destroy(pipe_commands_obj);
-    return NULL;
+  // Take a Pipe_Commands object from the pool, or allocate one with an array
+  // of Command pointers for the most commands a line holds
+  Pipe_Commands *pipe_commands_obj = NULL;
+  if (num_pooled_pipe_commands > 0) {
+    pipe_commands_obj = pooled_pipe_commands[--num_pooled_pipe_commands];
+  } else {
+    pipe_commands_obj = malloc(sizeof(Pipe_Commands));
+    assert(NULL != pipe_commands_obj);
+    if (!pipe_commands_obj) {
+      perror("create_Pipe_Commands:: malloc fail - pipe_commands_obj");
+      return NULL;
+    }
+    pipe_commands_obj->num_commands = 0;
+    pipe_commands_obj->commands =
+        malloc(MAX_PIPE_COMMANDS * sizeof(Command *));
+    if (!pipe_commands_obj->commands) {
+      perror("create_Pipe_Commands:: malloc fail - commands array");
+      pipe_commands_destroy(pipe_commands_obj);
+      return NULL;
+    }
   }
-  // update the total num of commands
+  Command **cmd_array = pipe_commands_obj->commands;
+
+  // update the total num of commands, none is created yet
   pipe_commands_obj->num_commands = num_pipes + 1;
+  memset(cmd_array, 0, (num_pipes + 1) * sizeof(Command *));
   assert(pipe_commands_obj->num_commands == num_pipes + 1);
 
   // Split the line by pipe operators and create a command object for each sub
@@ -979,10 +3209,17 @@ void pipe_commands_destroy(Pipe_Commands *pipe) {
         command_destroy(pipe->commands[i]); // ask command to destroy itself
       }
     }
-    // Free the array of Command pointers
-    free(pipe->commands);
   }
-  // Free the Pipe_Commands struct itself
+  pipe->num_commands = 0;
+
+  // Back to the pool, or free the array of Command pointers and the
+  // Pipe_Commands struct itself if it is full
+  if (pipe->commands != NULL &&
+      num_pooled_pipe_commands < OBJECT_POOL_SIZE) {
+    pooled_pipe_commands[num_pooled_pipe_commands++] = pipe;
+    return;
+  }
+  free(pipe->commands);
   free(pipe);
 }
 
@@ -1019,11 +3256,53 @@ Command *pipe_commands_get_command_at(const Pipe_Commands *cmd_list,
   return cmd_list->commands[index];
 }
 
+// PIPELINE STAGE
+// a builtin running as a thread of the shell inside a pipeline
+typedef struct {
+  const Command *cmd;
+  Curr_Dir *cwd;
+  char **envp;
+  int input_fd;      // read end of the previous pipe, -1 for the first command
+  int output_fd;     // the next pipe's write end, or the pipeline's output
+  bool close_output; // output_fd is a pipe of the pipeline, close it when done
+  pthread_t thread;
+  bool started;
+} Pipeline_Stage;
+
+// runs one builtin of a pipeline with its output going down the pipe, then
+// closes its pipe ends so the commands around it see EOF / a gone reader
+static void *pipeline_stage_main(void *arg) {
+  Pipeline_Stage *stage = arg;
+
+  // a reader that has finished makes writes fail with EPIPE instead of
+  // killing the whole shell
+  sigset_t pipe_signal;
+  sigemptyset(&pipe_signal);
+  sigaddset(&pipe_signal, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipe_signal, NULL);
+
+  stage_input_fd = stage->input_fd;
+  stage_output_fd = stage->output_fd;
+  // like in a subshell, cd in a pipeline does not change the shell's cwd
+  if (strcmp(command_get_arg(stage->cmd, 0), "cd") != 0) {
+    execute_command(stage->cmd, stage->cwd, stage->envp);
+  }
+  stage_input_fd = -1;
+  stage_output_fd = -1;
+
+  if (stage->input_fd >= 0)
+    close(stage->input_fd);
+  if (stage->close_output)
+    close(stage->output_fd);
+  return NULL;
+}
+
 /*
  * Generic Executor
  * execute_pipes(): runs all the command in the cmd_list with given <envp> and
- * redirects output to given output file NOTE: Only runs the commands present in
- * the current working directory (cwd) RETURN CODE: INVALID_ARGUMENTS (any
+ * redirects output to given output file. Builtins run as threads of the shell
+ * and only the other commands are forked, all of them before any thread
+ * starts so no child inherits a lock a builtin holds. RETURN CODE: INVALID_ARGUMENTS (any
  * argument is NULL or invalid structs) OPERATION_FAILED (pipes setup failed OR
  * malloc fail OR fexecve fail OR fork fail) OPERATION_SUCCED (all the command
  * in cmd_list worked noice) REDIRECTION_FAILED (when input redirection file not
@@ -1074,19 +3353,37 @@ int execute_pipes(Pipe_Commands *cmd_list, const Curr_Dir *cwd, char *envp[],
     }
   }
 
-  // Store all child process IDs
+  // Store all child process IDs, builtins run in this process instead
   pid_t child_pids[num_commands];
+  Pipeline_Stage stages[num_commands];
+  memset(stages, 0, sizeof(stages));
 
-  // setup the pipe for each command and execute each command in the cmd_list
+  // setup the pipe for each command and fork every command that is not a
+  // builtin
   for (int i = 0; i < num_commands; i++) {
     // get the command obejct
     Command *current_cmd = pipe_commands_get_command_at(cmd_list, i);
     assert(current_cmd != NULL);
+    child_pids[i] = -1;
+    if (is_builtin(current_cmd->argv[0]))
+      continue; // started as a thread once everything is forked
+
+    // Open command file from the nqp fs before forking, so the lookup lands
+    // in this process's command hash table. The child gets a copy of the
+    // open file table, hence of this handle too
+    const char *cmd_name = current_cmd->argv[0];
+    int cmd_fd = open_resolved_command(current_cmd, cwd);
 
     pid_t pid = fork(); // fork to create a dedicated process for ith command
 
+    if (pid > 0 && cmd_fd >= 0) {
+      nqp_close(cmd_fd); // the child has its own copy
+    }
     if (pid == -1) { // fork fail, so clean up resources and terminate
       perror("Fork failed");
+      if (cmd_fd >= 0) {
+        nqp_close(cmd_fd);
+      }
 
       // Close all pipes
       for (int j = 0; j < num_commands - 1; j++) {
@@ -1110,49 +3407,21 @@ int execute_pipes(Pipe_Commands *cmd_list, const Curr_Dir *cwd, char *envp[],
             // Get the input filename
             const char *filename = current_cmd->argv[j + 1];
 
-            // create absolute path of the input file
-            char inputfile_absolute_path[MAX_LINE_SIZE] = {0};
-            if (cwd->path[strlen(cwd->path) - 1] != '/') {
-              snprintf(inputfile_absolute_path, MAX_LINE_SIZE, "%s/%s",
-                       cwd->path, filename);
-            } else {
-              snprintf(inputfile_absolute_path, MAX_LINE_SIZE, "%s%s",
-                       cwd->path, filename);
-            }
-            assert(is_valid_path(inputfile_absolute_path)); // validate it
-
-            // Open that input file from nqp fs
-            int fd = nqp_open(inputfile_absolute_path);
-            if (fd == NQP_FILE_NOT_FOUND) {
+            // Open that input file from nqp fs, relative to the cwd handle
+            int fd = open_resolved_input(current_cmd, cwd, filename);
+            if (fd < 0) {
               fprintf(stderr,
-                      "Failed to open file %s for redirection at path {%s}\n",
-                      filename, inputfile_absolute_path);
-              exit(EXIT_FAILURE);
-            }
-
-            // Create local copy of that input file in our local memory
-            int memfd = memfd_create("input_redirect", 0);
-            if (memfd == -1) {
-              perror("memfd_create failed");
+                      "Failed to open file %s for redirection in {%s}\n",
+                      filename, cwd->path);
               exit(EXIT_FAILURE);
             }
 
-            // Read file content from nqp fs into the local memory file
-            char buffer[READ_BUFFER_SIZE];
-            size_t bytes_read;
-            while ((bytes_read = nqp_read(fd, buffer, READ_BUFFER_SIZE)) > 0) {
-              if (write(memfd, buffer, bytes_read) == -1) {
-                perror("write to memfd failed");
-                exit(EXIT_FAILURE);
-              }
-            }
-
-            // Close the input file in the nqp fs
+            // Create local copy of that input file in our local memory, with
+            // its offset at 0, and close the input file in the nqp fs
+            int memfd = stage_in_memfd(fd, "input_redirect");
             nqp_close(fd);
-
-            // Reset the local copy of the input file's offset to 0
-            if (lseek(memfd, 0, SEEK_SET) == -1) {
-              perror("lseek failed");
+            if (memfd == -1) {
+              perror("copying input file into memory failed");
               exit(EXIT_FAILURE);
             }
 
@@ -1170,12 +3439,8 @@ int execute_pipes(Pipe_Commands *cmd_list, const Curr_Dir *cwd, char *envp[],
                 create_arguments_for_redirection(current_cmd);
 
             // Replace the command arguments, so that we can directly pass it to
-            // fexec from our cmd object first free the oriignal arguments array
-            // manually
-            for (int k = 0; k < current_cmd->argc; k++) {
-              free(current_cmd->argv[k]);
-            }
-            free(current_cmd->argv);
+            // fexec from our cmd object. The original arguments array belongs
+            // to the command pool, this process just stops using it
 
             // now assign the new args
             current_cmd->argv = filtered_args;
@@ -1232,48 +3497,17 @@ int execute_pipes(Pipe_Commands *cmd_list, const Curr_Dir *cwd, char *envp[],
       }
 
       // Copy the command data from NQP file system to local file
-      // first create teh absolute path
-      const char *cmd_name = current_cmd->argv[0];
-      char cmd_absolute_path[MAX_LINE_SIZE] = {0};
-      if (cwd->path[strlen(cwd->path) - 1] != '/') {
-        snprintf(cmd_absolute_path, MAX_LINE_SIZE, "%s/%s", cwd->path,
-                 cmd_name);
-      } else {
-        snprintf(cmd_absolute_path, MAX_LINE_SIZE, "%s%s", cwd->path, cmd_name);
-      }
-      assert(is_valid_path(cmd_absolute_path));
-
-      // Open command file from the nqp fs
-      int cmd_fd = nqp_open(cmd_absolute_path);
-      if (cmd_fd == NQP_FILE_NOT_FOUND) {
+      if (cmd_fd < 0) {
         fprintf(stderr, "Command not found: %s\n", cmd_name);
         exit(EXIT_FAILURE);
       }
 
-      // Create a local memory file to copy npq fs data
-      int exec_memfd = memfd_create("exec", 0);
-      if (exec_memfd == -1) {
-        perror("memfd_create failed");
-        exit(EXIT_FAILURE);
-      }
-
-      // Read the command file from nqp fs and copy it to the local memory file
-      char buffer[READ_BUFFER_SIZE];
-      size_t bytes_read;
-      while ((bytes_read = nqp_read(cmd_fd, buffer, READ_BUFFER_SIZE)) > 0) {
-        if (write(exec_memfd, buffer, bytes_read) == -1) {
-          perror("write to memfd failed");
-          exit(EXIT_FAILURE);
-        }
-      }
-
-      // Close the command file in the nqp fs to free its OFT for other other
-      // processes
+      // Copy the command file from nqp fs into a local memory file, then
+      // close it in the nqp fs to free its OFT for other other processes
+      int exec_memfd = stage_in_memfd(cmd_fd, "exec");
       nqp_close(cmd_fd);
-
-      // Reset the offset of the memory fd file to 0
-      if (lseek(exec_memfd, 0, SEEK_SET) == -1) {
-        perror("lseek failed");
+      if (exec_memfd == -1) {
+        perror("copying command into memory failed");
         exit(EXIT_FAILURE);
       }
 
@@ -1294,21 +3528,82 @@ int execute_pipes(Pipe_Commands *cmd_list, const Curr_Dir *cwd, char *envp[],
     child_pids[i] = pid;
   }
 
-  // INSIDE Parent process - close all the remaining pipe ends so all the
-  // completed processes actually terminates
+  // INSIDE Parent process - start the builtins, each owns the pipe ends
+  // around it from now on
+  for (int i = 0; i < num_commands; i++) {
+    Command *current_cmd = pipe_commands_get_command_at(cmd_list, i);
+    if (!is_builtin(current_cmd->argv[0]))
+      continue;
+    Pipeline_Stage *stage = &stages[i];
+    stage->cmd = current_cmd;
+    stage->cwd = (Curr_Dir *)cwd;
+    stage->envp = envp;
+    stage->input_fd = i > 0 ? pipes[i - 1][PIPE_READ_END] : -1;
+    stage->close_output = i < num_commands - 1;
+    stage->output_fd =
+        stage->close_output ? pipes[i][PIPE_WRITE_END] : output_fd;
+    stage->started = pthread_create(&stage->thread, NULL, pipeline_stage_main,
+                                    stage) == 0;
+    if (!stage->started) { // the builtin is skipped, the pipeline goes on
+      fprintf(stderr, "Failed to start %s in the pipeline\n",
+              current_cmd->argv[0]);
+      if (stage->input_fd >= 0)
+        close(stage->input_fd);
+      if (stage->close_output)
+        close(stage->output_fd);
+    }
+  }
+
+  // close the remaining pipe ends of the forked commands so all the completed
+  // processes actually terminates
   for (int i = 0; i < num_commands - 1; i++) {
-    close(pipes[i][PIPE_READ_END]);
-    close(pipes[i][PIPE_WRITE_END]);
+    if (child_pids[i] > 0)
+      close(pipes[i][PIPE_WRITE_END]);
+    if (child_pids[i + 1] > 0)
+      close(pipes[i][PIPE_READ_END]);
   }
 
-  // Wait for all child processes to complete executing their commands
+  // Wait for all the builtins and child processes to complete executing their
+  // commands
   for (int i = 0; i < num_commands; i++) {
-    waitpid(child_pids[i], NULL, 0);
+    if (stages[i].started)
+      pthread_join(stages[i].thread, NULL);
+    else if (child_pids[i] > 0)
+      waitpid(child_pids[i], NULL, 0);
   }
 
   return OPERATION_SUCCEED; // return success code
 }
 
+// log_tee_main(): reads the log pipe (at <arg>) until every command closed it
+// and writes it to both stdout and the log file. Returns non-NULL if a write
+// failed
+static void *log_tee_main(void *arg) {
+  int read_fd = *(int *)arg;
+  char buffer[READ_BUFFER_SIZE];
+  ssize_t bytes_read;
+  void *failed = NULL;
+
+  while ((bytes_read = read(read_fd, buffer, READ_BUFFER_SIZE)) > 0) {
+    if (NULL != failed)
+      continue; // keep draining so the commands can finish
+
+    // Write to stdout
+    if (write(STDOUT_FILENO, buffer, bytes_read) != bytes_read) {
+      perror("Failed to write to stdout"); // error in writing
+      failed = arg;
+      continue;
+    }
+
+    // Write to log file
+    if (write(log_fd, buffer, bytes_read) != bytes_read) {
+      perror("Failed to write to log file"); // error in writing
+      failed = arg;
+    }
+  }
+  return failed;
+}
+
 /*
  * execute_pipes_with_logging():
  * wrapper for the execute_pipes(), it sets up 1 pipe to redirect output from
@@ -1330,6 +3625,17 @@ int execute_pipes_with_logging(Pipe_Commands *pipe_cmds, const Curr_Dir *cwd,
     return OPERATION_FAILED;
   }
 
+  // copy the output to stdout and the log file while the commands run, the
+  // last command would block on a full pipe otherwise
+  pthread_t tee_thread;
+  if (pthread_create(&tee_thread, NULL, log_tee_main,
+                     &log_pipe[PIPE_READ_END]) != 0) {
+    perror("Failed to start copying the log pipe");
+    close(log_pipe[PIPE_READ_END]);
+    close(log_pipe[PIPE_WRITE_END]);
+    return OPERATION_FAILED;
+  }
+
   // call the execute_pipes() but pass the write end of the log pipe as
   // output_fd
   int result = execute_pipes(pipe_cmds, cwd, envp, log_pipe[PIPE_WRITE_END]);
@@ -1337,30 +3643,13 @@ int execute_pipes_with_logging(Pipe_Commands *pipe_cmds, const Curr_Dir *cwd,
   // Close write end of the pipe once all the commands are done executing
   close(log_pipe[PIPE_WRITE_END]);
 
-  // Read from the pipe's read end and write to both stdout and log file
-  char buffer[READ_BUFFER_SIZE];
-  ssize_t bytes_read;
-  while ((bytes_read =
-              read(log_pipe[PIPE_READ_END], buffer, READ_BUFFER_SIZE)) > 0) {
-    // Write to stdout
-    if (write(STDOUT_FILENO, buffer, bytes_read) != bytes_read) {
-      perror("Failed to write to stdout"); // error in writing, so do cleanup
-      close(log_pipe[PIPE_READ_END]);
-      return OPERATION_FAILED;
-    }
-
-    // Write to log file
-    if (write(log_fd, buffer, bytes_read) != bytes_read) {
-      perror("Failed to write to log file"); // error in writing, so do cleanup
-      close(log_pipe[PIPE_READ_END]);
-      return OPERATION_FAILED;
-    }
-  }
-
-  // Close read end of the pipe to close all the remaining pipes
+  // Wait for the rest of the output, then close read end of the pipe to close
+  // all the remaining pipes
+  void *tee_result = NULL;
+  pthread_join(tee_thread, &tee_result);
   close(log_pipe[PIPE_READ_END]);
 
-  return result;
+  return NULL == tee_result ? result : OPERATION_FAILED;
 }
 
 //-----------------------
@@ -1441,6 +3730,269 @@ bool validate_pipe_positions(const Command *cmd) {
   return true;
 }
 
+//---------------------
+// PLAN CACHE ROUTINES
+//---------------------
+// the inode of the file open at nqp <fd>, 0 if it cannot be found out
+static uint64_t plan_inode(int fd) {
+  nqp_file_stat status;
+  if (nqp_fstat_timed(fd, &status) != NQP_OK)
+    return 0;
+  return status.inode_number;
+}
+
+// expands the patterns in the args of <cmd>, then resolves where its
+// executable is unless it is a builtin, and with <with_input> the file its
+// "<" reads, so running it again needs no lookups: the inodes are opened
+// directly, the image paths are kept in case that fails. Whatever is not
+// found is left empty and looked up again when the command runs
+static void plan_resolve(Command *cmd, const Curr_Dir *cwd, bool with_input) {
+  command_expand_patterns(cmd, cwd);
+  if (!is_builtin(cmd->argv[0])) {
+    int fd = open_command_path(cwd, cmd->argv[0], cmd->executable,
+                               sizeof(cmd->executable));
+    if (fd >= 0) {
+      cmd->executable_inode = plan_inode(fd);
+      nqp_close(fd);
+    } else {
+      cmd->executable[0] = '\0';
+    }
+  }
+  if (!with_input)
+    return;
+
+  // only the first "<" redirects, like in handle_input_redirection
+  for (int i = 0; i + 1 < cmd->argc; i++) {
+    if (strcmp(cmd->argv[i], "<") == 0) {
+      int fd = open_in_curr_dir(cwd, cmd->argv[i + 1]);
+      if (fd >= 0) {
+        cmd->input_inode = plan_inode(fd);
+        nqp_close(fd);
+        make_absolute_path(cwd, cmd->argv[i + 1], cmd->input_path,
+                           sizeof(cmd->input_path));
+      }
+      return;
+    }
+  }
+}
+
+// Constructor: parses <line> typed in <cwd>, splits it at its pipes and
+// resolves the executables and input files of its commands. Returns NULL only
+// if memory runs out, a line that cannot run gives a plan run_plan skips
+Plan *plan_create(const char *line, const Curr_Dir *cwd) {
+  assert(NULL != line && NULL != cwd);
+  if (NULL == line || NULL == cwd)
+    return NULL;
+  Plan *plan = num_pooled_plans > 0 ? pooled_plans[--num_pooled_plans]
+                                    : malloc(sizeof(Plan));
+  assert(NULL != plan);
+  if (NULL == plan)
+    return NULL;
+  memset(plan, 0, sizeof(Plan));
+  snprintf(plan->line, sizeof(plan->line), "%s", line);
+  snprintf(plan->cwd, sizeof(plan->cwd), "%s", cwd->path);
+  plan->generation = plan_generation;
+
+  // create the command object with the input
+  plan->command = command_create(plan->line);
+  if (NULL == plan->command) {
+    plan_destroy(plan);
+    return NULL;
+  }
+  if (!command_is_valid(plan->command))
+    return plan; // something is not correct with the user input
+
+  // check if there is any pipe in it and create the parsed pipe_commands
+  // object, create_Pipe_Commands cuts up the line it gets
+  plan->num_pipes = calc_num_pipes_marker(plan->command);
+  if (plan->num_pipes > 0) {
+    char line_copy[MAX_LINE_SIZE];
+    snprintf(line_copy, sizeof(line_copy), "%s", plan->line);
+    plan->pipe_cmds = create_Pipe_Commands(plan->num_pipes, line_copy);
+    for (int i = 0; NULL != plan->pipe_cmds &&
+                    i < plan->pipe_cmds->num_commands;
+         i++) {
+      plan_resolve(plan->pipe_cmds->commands[i], cwd, i == 0);
+    }
+  } else if (plan->num_pipes == 0) {
+    plan_resolve(plan->command, cwd, true);
+  }
+  return plan;
+}
+
+// Destructor: frees the plan and its commands, the plan goes back to the
+// pool unless that is full
+void plan_destroy(Plan *plan) {
+  if (NULL == plan)
+    return;
+  pipe_commands_destroy(plan->pipe_cmds);
+  command_destroy(plan->command);
+  if (num_pooled_plans < OBJECT_POOL_SIZE) {
+    pooled_plans[num_pooled_plans++] = plan;
+    return;
+  }
+  free(plan);
+}
+
+// the plan cache slot of <line> typed in the directory <cwd_path>
+static unsigned plan_slot(const char *line, const char *cwd_path) {
+  return fnv1a(line, fnv1a(cwd_path, 2166136261u)) % PLAN_CACHE_SLOTS;
+}
+
+// takes <plan> out of the cache (its slot's chain and the LRU list)
+static void plan_cache_remove(Plan *plan) {
+  Plan **link = &plan_slots[plan_slot(plan->line, plan->cwd)];
+  while (*link != plan) {
+    link = &(*link)->next;
+  }
+  *link = plan->next;
+
+  if (NULL != plan->newer)
+    plan->newer->older = plan->older;
+  else
+    newest_plan = plan->older;
+  if (NULL != plan->older)
+    plan->older->newer = plan->newer;
+  else
+    oldest_plan = plan->newer;
+  plan->newer = plan->older = NULL;
+  num_plans--;
+}
+
+// puts <plan> at the front of the LRU list
+static void plan_cache_push(Plan *plan) {
+  plan->older = newest_plan;
+  plan->newer = NULL;
+  if (NULL != newest_plan)
+    newest_plan->newer = plan;
+  newest_plan = plan;
+  if (NULL == oldest_plan)
+    oldest_plan = plan;
+}
+
+// Finds the plan of <line> typed in <cwd>, NULL if there is none or it was
+// built before plan_generation changed (it is dropped then)
+Plan *plan_cache_lookup(const char *line, const Curr_Dir *cwd) {
+  assert(NULL != line && NULL != cwd);
+  if (NULL == line || NULL == cwd)
+    return NULL;
+
+  Plan *plan = plan_slots[plan_slot(line, cwd->path)];
+  while (NULL != plan && (strcmp(plan->line, line) != 0 ||
+                          strcmp(plan->cwd, cwd->path) != 0)) {
+    plan = plan->next;
+  }
+  if (NULL == plan)
+    return NULL;
+
+  plan_cache_remove(plan);
+  if (plan->generation != plan_generation) { // stale: its lookups may differ
+    plan_destroy(plan);
+    return NULL;
+  }
+
+  // most recently used now, back in its slot's chain
+  unsigned slot = plan_slot(plan->line, plan->cwd);
+  plan->next = plan_slots[slot];
+  plan_slots[slot] = plan;
+  plan_cache_push(plan);
+  num_plans++;
+  return plan;
+}
+
+// Keeps <plan> in the cache, making room by dropping the least recently used
+// plan. Plans of lines that cannot run are not kept.
+// Returns whether the cache took the plan (and frees it from now on).
+bool plan_cache_insert(Plan *plan) {
+  assert(NULL != plan);
+  if (NULL == plan || !command_is_valid(plan->command) ||
+      plan->num_pipes < 0 || (plan->num_pipes > 0 && NULL == plan->pipe_cmds))
+    return false;
+
+  if (num_plans == PLAN_CACHE_SIZE) {
+    Plan *oldest = oldest_plan;
+    plan_cache_remove(oldest);
+    plan_destroy(oldest);
+  }
+  unsigned slot = plan_slot(plan->line, plan->cwd);
+  plan->next = plan_slots[slot];
+  plan_slots[slot] = plan;
+  plan_cache_push(plan);
+  num_plans++;
+  return true;
+}
+
+// Frees every cached plan
+void plan_cache_clear(void) {
+  while (NULL != oldest_plan) {
+    Plan *oldest = oldest_plan;
+    plan_cache_remove(oldest);
+    plan_destroy(oldest);
+  }
+}
+
+// Frees every object kept in the pools, and the buffers ls keeps
+void object_pool_clear(void) {
+  free(ls_output);
+  free(ls_sorted);
+  ls_output = NULL;
+  ls_sorted = NULL;
+  ls_sorted_capacity = 0;
+  while (num_pooled_plans > 0) {
+    free(pooled_plans[--num_pooled_plans]);
+  }
+  while (num_pooled_pipe_commands > 0) {
+    Pipe_Commands *pipe = pooled_pipe_commands[--num_pooled_pipe_commands];
+    free(pipe->commands);
+    free(pipe);
+  }
+  while (num_pooled_commands > 0) {
+    Command *cmd = pooled_commands[--num_pooled_commands];
+    free(cmd->argv);
+    free(cmd->text);
+    free(cmd);
+  }
+}
+
+// run_plan(): runs the commands of <plan>, through pipes if it has any
+static void run_plan(Plan *plan, Curr_Dir *cwd, char *envp[]) {
+  if (!command_is_valid(plan->command))
+    return; // something is not correct with the user input
+
+  if (plan->num_pipes > 0) { // found atleast 1 pipe
+    if (NULL == plan->pipe_cmds)
+      return;
+
+    // execute it based on logging condiition
+    int return_code;
+    if (log_fd !=
+        LOG_DISABLED) { // logging is enabled, and command has pipe init
+      return_code = execute_pipes_with_logging(plan->pipe_cmds, cwd, envp);
+    } else { // logging is disabled, and command has pipe init
+      return_code = execute_pipes(plan->pipe_cmds, cwd, envp, STDOUT_FILENO);
+    }
+
+    // print the error code
+    if (return_code != OPERATION_SUCCEED) {
+      fprintf(stderr, "Pipe execution failed with code: %d\n", return_code);
+    }
+    return;
+  }
+
+  // print error message for invalid use of pipe
+  if (plan->num_pipes == INVALID_USECASE) {
+    printf("pipe operator not used properly\n");
+    return;
+  }
+
+  // Execute the command noramally if pipes are not present
+  if (!execute_command(plan->command, cwd, envp)) {
+    // execution failed
+    custom_print("Failure to execute the command:\n");
+    command_print(plan->command);
+  }
+}
+
 // MAIN FUNCTION
 int main(int argc, char *argv[], char *envp[]) {
   char line_buffer[MAX_LINE_SIZE] = {0}; // store the user input
@@ -1453,7 +4005,7 @@ int main(int argc, char *argv[], char *envp[]) {
     exit(EXIT_FAILURE);
   }
 
-  mount_error = nqp_mount(argv[1], NQP_FS_EXFAT);
+  mount_error = nqp_mount_timed(argv[1], NQP_FS_EXFAT);
 
   if (mount_error != NQP_OK) {
     if (mount_error == NQP_FSCK_FAIL) {
@@ -1462,6 +4014,15 @@ int main(int argc, char *argv[], char *envp[]) {
     exit(EXIT_FAILURE);
   }
 
+  // pipeline children look up their executables and < files themselves,
+  // sharing the lookup caches keeps what they find for the next command. The
+  // caches only stay private if this fails, so it is not an error
+  nqp_share_caches();
+
+  // executables are staged with the kernel copying straight from the image,
+  // without it they are read through the driver
+  image_fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+
   volume_label = nqp_vol_label();
 
   printf("%s:\\> ", volume_label);
@@ -1490,84 +4051,59 @@ int main(int argc, char *argv[], char *envp[]) {
   // Initialise curr_dir with root directory
   Curr_Dir *cwd = construct_empty_curr_dir();
 
+  // directories searched for commands not in the cwd
+  const char *command_path = getenv(COMMAND_PATH_VARIABLE);
+  load_search_dirs(NULL != command_path ? command_path : DEFAULT_COMMAND_PATH);
+
   // start the shell
   while (true) {
     char mssg[MAX_LINE_SIZE] = {
         0}; // store the message to print before each command
     snprintf(mssg, MAX_LINE_SIZE, "%s:\\> ", volume_label);
     fflush(stdout);
+    // readline and the history allocate for every line, that is not part of
+    // running the command
+    if (alloc_count_pause)
+      alloc_count_pause();
     char *line = readline(""); // read user input using readline
     custom_print(mssg);        // print that using the custom print
-    strncpy(line_buffer, line,
-            MAX_LINE_SIZE); // copy the input to safe copy of line in
-                            // line_buffer for processing
 
     if (line == NULL) { // EOF (Ctrl+D pressed)
       custom_print("\n");
       break;
     }
+    snprintf(line_buffer, MAX_LINE_SIZE, "%s",
+             line); // copy the input to safe copy of line in line_buffer for
+                    // processing
+
+    // keep the command itself in the log as well, so a session log can be
+    // replayed (e.g. by nqp_bench)
+    if (log_fd != LOG_DISABLED) {
+      write_all(log_fd, line_buffer, strnlen(line_buffer, MAX_LINE_SIZE));
+      write_all(log_fd, "\n", 1);
+    }
 
     // BONUS PART: Adding the current command to history for navigating the
     // commands with arrows
     add_history(line_buffer);
-
-    // create the command object with the input
-    Command *new_command = command_create(line_buffer);
-    assert(NULL != new_command);
-    if (NULL == new_command)
-      return EXIT_FAILURE;
-
-    if (!command_is_valid(
-            new_command)) { // something is not correct with the user input
-      command_destroy(new_command); // free the resource
-      continue;                     // read next command
-    }
-
-    // check if there is any pipe in it
-    const int num_pipes = calc_num_pipes_marker(new_command);
-    if (num_pipes > 0) { // found atleast 1 pipe
-      // create the parsed pipe_commands object
-      Pipe_Commands *pipe_cmds = create_Pipe_Commands(num_pipes, line_buffer);
-      assert(pipe_commands_is_valid(pipe_cmds));
-      if (NULL == pipe_cmds)
-        continue;
-
-      // execute it based on logging condiition
-      int return_code;
-      if (log_fd !=
-          LOG_DISABLED) { // logging is enabled, and command has pipe init
-        return_code = execute_pipes_with_logging(pipe_cmds, cwd, envp);
-      } else { // logging is disabled, and command has pipe init
-        return_code = execute_pipes(pipe_cmds, cwd, envp, STDOUT_FILENO);
-      }
-
-      // print the error code
-      if (return_code != OPERATION_SUCCEED) {
-        fprintf(stderr, "Pipe execution failed with code: %d\n", return_code);
-      }
-
-      // free up the resources
-      pipe_commands_destroy(pipe_cmds);
-      command_destroy(new_command);
-      continue; // continue reading next command
-    }
-
-    // print error message for invalid use of pipe
-    if (num_pipes == INVALID_USECASE) {
-      printf("pipe operator not used properly\n");
-      command_destroy(new_command); // free up the resources
-      continue;                     // read next command
+    if (alloc_count_resume)
+      alloc_count_resume();
+
+    // the parsed plan of the line, the cached one if the line ran in this
+    // directory before
+    Plan *plan = plan_cache_lookup(line_buffer, cwd);
+    bool cached = NULL != plan;
+    if (!cached) {
+      plan = plan_create(line_buffer, cwd);
+      assert(NULL != plan);
+      if (NULL == plan)
+        return EXIT_FAILURE;
+      cached = plan_cache_insert(plan);
     }
 
-    // Execute the command noramally if pipes are not present
-    if (!execute_command(new_command, cwd, envp) && 0 == num_pipes) {
-      // execution failed
-      custom_print("Failure to execute the command:\n");
-      command_print(new_command);
-
-      command_destroy(new_command); // free up the resources
-      continue;                     // read next command
-    }
+    run_plan(plan, cwd, envp);
+    if (!cached) // lines that cannot run are not kept
+      plan_destroy(plan);
 
     // reset the line buffer for next Command
     memset(line_buffer, 0, MAX_LINE_SIZE);
@@ -1578,7 +4114,16 @@ int main(int argc, char *argv[], char *envp[]) {
   if (NULL != cwd) {
     destroy_curr_dir(cwd);
   }
-  free_logs(); // close the log related resources
+  free_logs();        // close the log related resources
+  free_search_dirs(); // close the command search directories
+  plan_cache_clear();  // free the cached plans
+  object_pool_clear(); // and the objects kept for reuse
+
+  // unmount the file system and report how it performed during the session
+  nqp_unmount();
+  if (image_fd >= 0)
+    close(image_fd);
+  latency_dump(STDERR_FILENO);
   return EXIT_SUCCESS;
 }
 
@@ -1636,13 +4181,13 @@ void test_builtins(void) {
   // This will list the contents of the root directory, visually verify the
   // output
   printf("\ncwd: %s\n", cwd->path);
-  command_ls(cwd);
+  command_ls(NULL, cwd);
 
   // Test command_cd()
   command_cd("..", cwd);
   assert(strcmp(cwd->path, "/") == 0);
   printf("\ncd .. : %s\n", cwd->path);
-  command_ls(cwd);
+  command_ls(NULL, cwd);
 
   command_cd("..", cwd);
   printf("\ncd ..: %s\n", cwd->path);
@@ -1651,7 +4196,7 @@ void test_builtins(void) {
   command_cd("dictionary-words", cwd);
   assert(strcmp(cwd->path, "/dictionary-words") == 0);
   printf("\ncd dictionary-words: %s\n", cwd->path);
-  command_ls(cwd);
+  command_ls(NULL, cwd);
 
   destroy_curr_dir(cwd);
 }
@@ -1716,11 +4261,73 @@ void test_command_obj(void) {
 
   printf("All tests passed!\n");
 }
+// PLAN CACHE TEST
+// builtin lines only, their plans resolve nothing in the file system
+void test_plan_cache(void) {
+  Curr_Dir *root = construct_curr_dir("/");
+  Curr_Dir *home = construct_curr_dir("/home");
+  char line[MAX_LINE_SIZE];
+  plan_cache_clear();
+
+  // Test 1: plans are keyed by the line and the directory it was typed in
+  {
+    Plan *plan = plan_create("pwd", root);
+    assert(plan != NULL);
+    assert(plan_cache_insert(plan));
+    assert(plan_cache_lookup("pwd", root) == plan);
+    assert(plan_cache_lookup("pwd", home) == NULL);
+    assert(plan_cache_lookup("pwd -x", root) == NULL);
+
+    Plan *empty = plan_create("", root); // cannot run, not kept
+    assert(empty != NULL);
+    assert(!plan_cache_insert(empty));
+    plan_destroy(empty);
+    printf("Plan test 1 passed.\n");
+  }
+
+  // Test 2: a full cache drops its least recently used plan
+  {
+    for (int i = 0; i < PLAN_CACHE_SIZE - 1; i++) {
+      snprintf(line, sizeof(line), "ls d%d", i);
+      assert(plan_cache_insert(plan_create(line, root)));
+    }
+    // "pwd" is the oldest now, using "ls d0" makes it the newest
+    assert(plan_cache_lookup("ls d0", root) != NULL);
+    assert(plan_cache_insert(plan_create("ls more", root)));
+    assert(plan_cache_lookup("pwd", root) == NULL);
+    assert(plan_cache_lookup("ls d0", root) != NULL);
+    // "ls d1" was the oldest after "pwd"
+    assert(plan_cache_insert(plan_create("ls again", root)));
+    assert(plan_cache_lookup("ls d1", root) == NULL);
+    assert(plan_cache_lookup("ls d2", root) != NULL);
+    assert(plan_cache_lookup("ls more", root) != NULL);
+    printf("Plan test 2 passed.\n");
+  }
+
+  // Test 3: a new plan_generation drops the plans built before it
+  {
+    Plan *plan = plan_create("pwd", home);
+    assert(plan_cache_insert(plan));
+    plan_generation++;
+    assert(plan_cache_lookup("pwd", home) == NULL);
+    assert(plan_cache_lookup("ls d0", root) == NULL);
+
+    plan = plan_create("pwd", home);
+    assert(plan_cache_insert(plan));
+    assert(plan_cache_lookup("pwd", home) == plan);
+    printf("Plan test 3 passed.\n");
+  }
+
+  plan_cache_clear();
+  destroy_curr_dir(root);
+  destroy_curr_dir(home);
+}
 void test_all(void) {
   test_curr_dir();
   test_validators();
   test_builtins();
   test_command_obj();
+  test_plan_cache();
 }
 // TESTING BLOCK ENDS
 //---------------------------------------------------------------------------------------------------------
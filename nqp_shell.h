@@ -1,26 +1,53 @@
 #pragma once
 #define MAX_LINE_SIZE 256
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 
 // CURRENT DIRECTORY STRUCT
 // keeps track of the current working directory
 typedef struct {
   char path[MAX_LINE_SIZE];
+  int dir_fd; // open nqp handle of path, relative names are looked up from it
 } Curr_Dir;
 Curr_Dir *construct_empty_curr_dir(void);
 Curr_Dir *construct_curr_dir(const char *path);
 void destroy_curr_dir(Curr_Dir *cwd);
 void set_path(Curr_Dir *cwd, const char *path);
+void reopen_curr_dir(Curr_Dir *cwd);
+int open_in_curr_dir(const Curr_Dir *cwd, const char *name);
+
+// COMMAND LOOKUP
+// image directories searched for commands (NQP_PATH) and a hash table of
+// where each command name was found
+void load_search_dirs(const char *list);
+void forget_commands(void);
+void free_search_dirs(void);
+int open_hashed_command(const char *name);
+int open_command_path(const Curr_Dir *cwd, const char *name, char *path,
+                      size_t size);
+int open_command(const Curr_Dir *cwd, const char *name);
 
 // COMMAND OBJECT
 // stores info about command and its args
 typedef struct {
-  int argc;    // total number of args
-  char **argv; // NULL termnated arguments array
+  int argc;       // total number of args
+  char **argv;    // NULL termnated arguments array, pointing into text
+  char *text;     // the args, split in place (MAX_LINE_SIZE bytes)
+  int capacity;   // entries argv has room for, MAX_ARGS + 1 unless patterns
+                  // expanded to more
+  char *expanded; // the names patterns expanded to, NULL if none did
+  char executable[MAX_LINE_SIZE]; // image path argv[0] was found at, "" if
+                                  // not resolved
+  char input_path[MAX_LINE_SIZE]; // image path of the "<" file, "" if not
+                                  // resolved
+  uint64_t executable_inode;      // inode of the executable, 0 if not resolved
+  uint64_t input_inode;           // inode of the "<" file, 0 if not resolved
 } Command;
 // constructor
 Command *command_create(const char *input);
+// expands the '*' and '?' patterns of the args
+bool command_expand_patterns(Command *cmd, const Curr_Dir *cwd);
 // destructor
 void command_destroy(Command *cmd);
 // validator
@@ -30,6 +57,7 @@ const char *command_get_arg(const Command *cmd, int index);
 // for debugging command object
 void command_print(const Command *cmd);
 // instance methods
+bool is_builtin(const char *name);
 bool execute_command(const Command *cmd, Curr_Dir *cwd, char *envp[]);
 
 // PIPE COMMANDS OBEJCT
@@ -46,9 +74,35 @@ int execute_pipes(Pipe_Commands *cmd_list, const Curr_Dir *cwd, char *envp[],
 Command *pipe_commands_get_command_at(const Pipe_Commands *cmd_list,
                                       const int idx);
 
+// EXECUTION PLAN
+// a parsed command line with its executables and input files resolved, kept
+// in an LRU cache so running the same line in the same directory again skips
+// parsing and lookups
+typedef struct Plan {
+  char line[MAX_LINE_SIZE];   // the line as typed
+  char cwd[MAX_LINE_SIZE];    // the directory it was planned in
+  unsigned long generation;   // plan_generation when it was built
+  Command *command;           // the whole line
+  int num_pipes;              // calc_num_pipes_marker of the line
+  Pipe_Commands *pipe_cmds;   // the commands between the pipes, if any
+  struct Plan *newer, *older; // LRU order
+  struct Plan *next;          // chain of the plan cache slot
+} Plan;
+Plan *plan_create(const char *line, const Curr_Dir *cwd);
+void plan_destroy(Plan *plan);
+Plan *plan_cache_lookup(const char *line, const Curr_Dir *cwd);
+bool plan_cache_insert(Plan *plan);
+void plan_cache_clear(void);
+void object_pool_clear(void);
+
 // PROCESS RELATED ROUTINES
-int import_command_data(const Command *cmd, const char *path, char *envp[]);
-int handle_input_redirection(const Command *cmd, const char *cwd_path);
+int import_command_data(const Command *cmd, const Curr_Dir *cwd,
+                        char *envp[]);
+int handle_input_redirection(const Command *cmd, const Curr_Dir *cwd);
+int stage_in_memfd(int nqp_fd, const char *name);
+int open_resolved_command(const Command *cmd, const Curr_Dir *cwd);
+int open_resolved_input(const Command *cmd, const Curr_Dir *cwd,
+                        const char *filename);
 
 // PIPES RELATED ROUTINES
 int calc_num_pipes_marker(const Command *cmd);
@@ -56,6 +110,7 @@ bool validate_pipe_positions(const Command *cmd);
 
 // LOGGING RELATED ROUTINES
 void custom_print(const char *message);
+void custom_write(const char *buffer, size_t length);
 
 // validators
 bool is_valid_string(const char *str);
@@ -66,8 +121,19 @@ void print_string_array(const char *arr[]);
 
 // HELPERS
 void trim_string(char *str);
+void make_absolute_path(const Curr_Dir *cwd, const char *name, char *out,
+                        size_t size);
 
 // builtins
 void command_cd(const char *path, Curr_Dir *cwd);
-void command_ls(const Curr_Dir *cwd);
+void command_ls(const Command *cmd, const Curr_Dir *cwd);
 void command_pwd(const Curr_Dir *cwd);
+void command_du(const Command *cmd, const Curr_Dir *cwd);
+void command_find(const Command *cmd, const Curr_Dir *cwd);
+void command_tree(const Command *cmd, const Curr_Dir *cwd);
+void command_grep(const Command *cmd, const Curr_Dir *cwd);
+void command_export(const Command *cmd, const Curr_Dir *cwd);
+void command_frag(const Command *cmd, const Curr_Dir *cwd);
+void command_df(void);
+void command_latency(void);
+void command_hash(const Command *cmd);